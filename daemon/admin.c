@@ -32,6 +32,7 @@
 #include "datatypes.h"
 #include "viralloc.h"
 #include "virerror.h"
+#include "vireventpoll.h"
 #include "virlog.h"
 #include "virnetdaemon.h"
 #include "virnetserver.h"
@@ -435,6 +436,68 @@ adminConnectSetLoggingFilters(virNetDaemonPtr dmn ATTRIBUTE_UNUSED,
     return virLogSetFilters(filters);
 }
 
+/* Returns the number of recorded messages or -1 in case of an error */
+static int
+adminConnectGetLoggingRecords(char **records, unsigned int flags)
+{
+    virCheckFlags(0, -1);
+
+    /* Leave some room for the rest of the reply */
+    return virLogGetRecorded(records, ADMIN_STRING_MAX - 1024);
+}
+
+static int
+adminConnectGetEventLoopStats(virTypedParameterPtr *params,
+                              int *nparams,
+                              unsigned int flags)
+{
+    int ret = -1;
+    int maxparams = 0;
+    virTypedParameterPtr tmpparams = NULL;
+    virEventPollStatsPtr stats = NULL;
+    size_t nstats = 0;
+    char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+    size_t i;
+
+    virCheckFlags(0, -1);
+
+    if (virEventPollGetStats(&stats, &nstats) < 0)
+        goto cleanup;
+
+    if (virTypedParamsAddUInt(&tmpparams, nparams, &maxparams,
+                              VIR_EVENT_LOOP_COUNT, nstats) < 0)
+        goto cleanup;
+
+    for (i = 0; i < nstats; i++) {
+        snprintf(field, sizeof(field),
+                 "loop.%zu" VIR_EVENT_LOOP_SUFFIX_ITERATIONS, i);
+        if (virTypedParamsAddULLong(&tmpparams, nparams, &maxparams,
+                                    field, stats[i].iterations) < 0)
+            goto cleanup;
+
+        snprintf(field, sizeof(field),
+                 "loop.%zu" VIR_EVENT_LOOP_SUFFIX_BUSY, i);
+        if (virTypedParamsAddULLong(&tmpparams, nparams, &maxparams,
+                                    field, stats[i].busy) < 0)
+            goto cleanup;
+
+        snprintf(field, sizeof(field),
+                 "loop.%zu" VIR_EVENT_LOOP_SUFFIX_HANDLES, i);
+        if (virTypedParamsAddUInt(&tmpparams, nparams, &maxparams,
+                                  field, stats[i].handles) < 0)
+            goto cleanup;
+    }
+
+    *params = tmpparams;
+    tmpparams = NULL;
+    ret = 0;
+
+ cleanup:
+    virTypedParamsFree(tmpparams, *nparams);
+    VIR_FREE(stats);
+    return ret;
+}
+
 static int
 adminDispatchConnectGetLoggingOutputs(virNetServerPtr server ATTRIBUTE_UNUSED,
                                       virNetServerClientPtr client ATTRIBUTE_UNUSED,
@@ -487,4 +550,63 @@ adminDispatchConnectGetLoggingFilters(virNetServerPtr server ATTRIBUTE_UNUSED,
 
     return 0;
 }
+
+static int
+adminDispatchConnectGetEventLoopStats(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                      virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                      virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                      virNetMessageErrorPtr rerr,
+                                      admin_connect_get_event_loop_stats_args *args,
+                                      admin_connect_get_event_loop_stats_ret *ret)
+{
+    int rv = -1;
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+
+    if (adminConnectGetEventLoopStats(&params, &nparams, args->flags) < 0)
+        goto cleanup;
+
+    if (nparams > ADMIN_EVENT_LOOP_STATS_MAX) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Number of event loop statistics %d exceeds "
+                         "max allowed limit: %d"), nparams,
+                       ADMIN_EVENT_LOOP_STATS_MAX);
+        goto cleanup;
+    }
+
+    if (virTypedParamsSerialize(params, nparams,
+                                (virTypedParameterRemotePtr *) &ret->params.params_val,
+                                &ret->params.params_len, 0) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+
+    virTypedParamsFree(params, nparams);
+    return rv;
+}
+
+static int
+adminDispatchConnectGetLoggingRecords(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                      virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                      virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                      virNetMessageErrorPtr rerr,
+                                      admin_connect_get_logging_records_args *args,
+                                      admin_connect_get_logging_records_ret *ret)
+{
+    char *records = NULL;
+    int nrecords = 0;
+
+    if ((nrecords = adminConnectGetLoggingRecords(&records, args->flags)) < 0) {
+        virNetMessageSaveError(rerr);
+        return -1;
+    }
+
+    VIR_STEAL_PTR(ret->records, records);
+    ret->nrecords = nrecords;
+
+    return 0;
+}
 #include "admin_dispatch.h"
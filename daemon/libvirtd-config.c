@@ -245,6 +245,8 @@ daemonConfigFree(struct daemonConfig *data)
     VIR_FREE(data->host_uuid_source);
     VIR_FREE(data->log_filters);
     VIR_FREE(data->log_outputs);
+    VIR_FREE(data->log_recorder_filters);
+    VIR_FREE(data->event_loop_backend);
 
     VIR_FREE(data);
 }
@@ -350,6 +352,11 @@ daemonConfigLoadOptions(struct daemonConfig *data,
     if (virConfGetValueUInt(conf, "max_client_requests", &data->max_client_requests) < 0)
         goto error;
 
+    if (virConfGetValueString(conf, "event_loop_backend", &data->event_loop_backend) < 0)
+        goto error;
+    if (virConfGetValueUInt(conf, "event_loop_threads", &data->event_loop_threads) < 0)
+        goto error;
+
     if (virConfGetValueUInt(conf, "admin_min_workers", &data->admin_min_workers) < 0)
         goto error;
     if (virConfGetValueUInt(conf, "admin_max_workers", &data->admin_max_workers) < 0)
@@ -366,6 +373,9 @@ daemonConfigLoadOptions(struct daemonConfig *data,
     if (virConfGetValueBool(conf, "audit_logging", &data->audit_logging) < 0)
         goto error;
 
+    if (virConfGetValueBool(conf, "firewall_batch_rules", &data->firewall_batch_rules) < 0)
+        goto error;
+
     if (virConfGetValueString(conf, "host_uuid", &data->host_uuid) < 0)
         goto error;
     if (virConfGetValueString(conf, "host_uuid_source", &data->host_uuid_source) < 0)
@@ -377,6 +387,12 @@ daemonConfigLoadOptions(struct daemonConfig *data,
         goto error;
     if (virConfGetValueString(conf, "log_outputs", &data->log_outputs) < 0)
         goto error;
+    if (virConfGetValueUInt(conf, "log_async_records", &data->log_async_records) < 0)
+        goto error;
+    if (virConfGetValueString(conf, "log_recorder_filters", &data->log_recorder_filters) < 0)
+        goto error;
+    if (virConfGetValueUInt(conf, "log_recorder_size", &data->log_recorder_size) < 0)
+        goto error;
 
     if (virConfGetValueInt(conf, "keepalive_interval", &data->keepalive_interval) < 0)
         goto error;
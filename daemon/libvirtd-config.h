@@ -74,13 +74,21 @@ struct daemonConfig {
     unsigned int max_requests;
     unsigned int max_client_requests;
 
+    char *event_loop_backend;
+    unsigned int event_loop_threads;
+
     unsigned int log_level;
     char *log_filters;
     char *log_outputs;
+    unsigned int log_async_records;
+    char *log_recorder_filters;
+    unsigned int log_recorder_size;
 
     unsigned int audit_level;
     bool audit_logging;
 
+    bool firewall_batch_rules;
+
     int keepalive_interval;
     unsigned int keepalive_count;
 
@@ -58,6 +58,8 @@
 #include "viraccessmanager.h"
 #include "virutil.h"
 #include "virgettext.h"
+#include "vireventpoll.h"
+#include "virfirewall.h"
 
 #ifdef WITH_DRIVER_MODULES
 # include "driver.h"
@@ -692,6 +694,10 @@ daemonSetupLogging(struct daemonConfig *config,
     ignore_value(virLogSetFilters(config->log_filters));
     ignore_value(virLogSetOutputs(config->log_outputs));
 
+    if (virLogSetRecorder(config->log_recorder_filters,
+                          config->log_recorder_size) < 0)
+        return -1;
+
     /* If there are some environment variables defined, use those instead */
     virLogSetFromEnv();
 
@@ -705,6 +711,45 @@ daemonSetupLogging(struct daemonConfig *config,
 }
 
 
+/* Messages still queued when we crash are the most interesting ones */
+static void
+daemonFatalSignalHandler(int sig)
+{
+    virLogFlushFromSignal();
+
+    /* The default action was restored, so this still dumps core */
+    raise(sig);
+}
+
+
+/*
+ * Start the asynchronous logging thread, if asked to. This must
+ * happen once we forked into background, as threads do not survive
+ * the fork.
+ */
+static int
+daemonSetupAsyncLogging(struct daemonConfig *config)
+{
+    struct sigaction sig_action;
+
+    if (config->log_async_records == 0)
+        return 0;
+
+    if (virLogSetAsync(config->log_async_records) < 0)
+        return -1;
+
+    memset(&sig_action, 0, sizeof(sig_action));
+    sig_action.sa_handler = daemonFatalSignalHandler;
+    sig_action.sa_flags = SA_RESETHAND;
+    sigemptyset(&sig_action.sa_mask);
+    sigaction(SIGABRT, &sig_action, NULL);
+    sigaction(SIGSEGV, &sig_action, NULL);
+    sigaction(SIGBUS, &sig_action, NULL);
+
+    return 0;
+}
+
+
 static int
 daemonSetupAccessManager(struct daemonConfig *config)
 {
@@ -725,6 +770,28 @@ daemonSetupAccessManager(struct daemonConfig *config)
 }
 
 
+static int
+daemonSetupEventLoop(struct daemonConfig *config)
+{
+    int backend;
+
+    if (virEventPollSetShards(config->event_loop_threads) < 0)
+        return -1;
+
+    if (!config->event_loop_backend)
+        return 0;
+
+    if ((backend = virEventPollBackendTypeFromString(config->event_loop_backend)) < 0) {
+        virReportError(VIR_ERR_CONF_SYNTAX,
+                       _("unknown event loop backend '%s'"),
+                       config->event_loop_backend);
+        return -1;
+    }
+
+    return virEventPollSetBackend(backend);
+}
+
+
 /* Display version information. */
 static void
 daemonVersion(const char *argv0)
@@ -1272,6 +1339,12 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (daemonSetupEventLoop(config) < 0) {
+        VIR_ERROR(_("Can't setup event loop: %s"),
+                  virGetLastErrorMessage());
+        exit(EXIT_FAILURE);
+    }
+
     if (!pid_file &&
         virPidFileConstructPath(privileged,
                                 LOCALSTATEDIR,
@@ -1311,6 +1384,12 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (daemonSetupAsyncLogging(config) < 0) {
+        VIR_ERROR(_("Can't setup asynchronous logging: %s"),
+                  virGetLastErrorMessage());
+        goto cleanup;
+    }
+
     /* Ensure the rundir exists (on tmpfs on some systems) */
     if (privileged) {
         if (VIR_STRDUP_QUIET(run_dir, LOCALSTATEDIR "/run/libvirt") < 0) {
@@ -1481,6 +1560,8 @@ int main(int argc, char **argv) {
     }
     virAuditLog(config->audit_logging > 0);
 
+    virFirewallSetBatchRules(config->firewall_batch_rules);
+
     /* setup the hooks if any */
     if (virHookInitialize() < 0) {
         ret = VIR_DAEMON_ERR_HOOKS;
@@ -1591,5 +1672,10 @@ int main(int argc, char **argv) {
      * 'dmn' as a parameter are done, we can finally unref 'dmn' */
     virObjectUnref(dmn);
 
+    virEventPollStopShards();
+
+    /* Write out whatever is still queued */
+    ignore_value(virLogSetAsync(0));
+
     return ret;
 }
@@ -34,6 +34,7 @@
 # include "lxc_protocol.h"
 # include "qemu_protocol.h"
 # include "virthread.h"
+# include "virhash.h"
 
 # if WITH_SASL
 #  include "virnetsaslcontext.h"
@@ -64,6 +65,14 @@ struct daemonClientPrivate {
     size_t nstorageEventCallbacks;
     daemonClientEventCallbackPtr *nodeDeviceEventCallbacks;
     size_t nnodeDeviceEventCallbacks;
+    daemonClientEventCallbackPtr *statsEventCallbacks;
+    size_t nstatsEventCallbacks;
+
+    /* Field names of compact typed parameters sent to the client,
+     * in order, and the index of each of them */
+    char **typedParamFields;
+    size_t ntypedParamFields;
+    virHashTablePtr typedParamFieldIndex;
     bool closeRegistered;
 
 # if WITH_SASL
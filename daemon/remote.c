@@ -1469,6 +1469,62 @@ remoteRelayDomainQemuMonitorEvent(virConnectPtr conn,
     VIR_FREE(details_p);
 }
 
+static void
+remoteRelayDomainStatsEvent(virConnectPtr conn ATTRIBUTE_UNUSED,
+                            virDomainStatsRecordPtr *stats,
+                            int nstats,
+                            void *opaque)
+{
+    daemonClientEventCallbackPtr callback = opaque;
+    remote_domain_stats_event_msg data;
+    size_t i;
+
+    /* The records were already filtered by the access rights of the
+     * client when they were collected */
+    if (callback->callbackID < 0)
+        return;
+
+    if (nstats > REMOTE_DOMAIN_LIST_MAX) {
+        VIR_WARN("Dropping statistics event with %d records, "
+                 "which exceeds max limit: %d",
+                 nstats, REMOTE_DOMAIN_LIST_MAX);
+        return;
+    }
+
+    VIR_DEBUG("Relaying statistics of %d domains, callback %d",
+              nstats, callback->callbackID);
+
+    /* build return data */
+    memset(&data, 0, sizeof(data));
+    data.callbackID = callback->callbackID;
+
+    if (VIR_ALLOC_N(data.records.records_val, nstats) < 0)
+        goto error;
+    data.records.records_len = nstats;
+
+    for (i = 0; i < nstats; i++) {
+        remote_domain_stats_record *dst = data.records.records_val + i;
+
+        make_nonnull_domain(&dst->dom, stats[i]->dom);
+
+        if (virTypedParamsSerialize(stats[i]->params,
+                                    stats[i]->nparams,
+                                    (virTypedParameterRemotePtr *) &dst->params.params_val,
+                                    &dst->params.params_len,
+                                    VIR_TYPED_PARAM_STRING_OKAY) < 0)
+            goto error;
+    }
+
+    remoteDispatchObjectEventSend(callback->client, remoteProgram,
+                                  REMOTE_PROC_DOMAIN_STATS_EVENT,
+                                  (xdrproc_t)xdr_remote_domain_stats_event_msg,
+                                  &data);
+    return;
+
+ error:
+    xdr_free((xdrproc_t)xdr_remote_domain_stats_event_msg, (char *) &data);
+}
+
 static
 void remoteRelayConnectionClosedEvent(virConnectPtr conn ATTRIBUTE_UNUSED, int reason, void *opaque)
 {
@@ -1483,6 +1539,33 @@ void remoteRelayConnectionClosedEvent(virConnectPtr conn ATTRIBUTE_UNUSED, int r
                                   &msg);
 }
 
+/*
+ * Statistics callbacks keep a sampling thread and a reference on the
+ * connection busy, so they are dropped as soon as the client goes
+ * away rather than when its last reference is released.
+ */
+static void
+remoteClientDeregisterStatsEvents(struct daemonClientPrivate *priv)
+{
+    size_t i;
+
+    for (i = 0; i < priv->nstatsEventCallbacks; i++) {
+        int callbackID = priv->statsEventCallbacks[i]->callbackID;
+        if (callbackID < 0) {
+            VIR_WARN("unexpected incomplete statistics callback %zu", i);
+            continue;
+        }
+        VIR_DEBUG("Deregistering remote statistics event relay %d",
+                  callbackID);
+        priv->statsEventCallbacks[i]->callbackID = -1;
+        if (virConnectDomainStatsEventDeregister(priv->conn,
+                                                 callbackID) < 0)
+            VIR_WARN("unexpected statistics event deregister failure");
+    }
+    VIR_FREE(priv->statsEventCallbacks);
+    priv->nstatsEventCallbacks = 0;
+}
+
 /*
  * You must hold lock for at least the client
  * We don't free stuff here, merely disconnect the client's
@@ -1575,6 +1658,8 @@ void remoteClientFreeFunc(void *data)
         }
         VIR_FREE(priv->qemuEventCallbacks);
 
+        remoteClientDeregisterStatsEvents(priv);
+
         if (priv->closeRegistered) {
             if (virConnectUnregisterCloseCallback(priv->conn,
                                                   remoteRelayConnectionClosedEvent) < 0)
@@ -1587,6 +1672,8 @@ void remoteClientFreeFunc(void *data)
         virObjectUnref(sysident);
     }
 
+    virHashFree(priv->typedParamFieldIndex);
+    virStringListFreeCount(priv->typedParamFields, priv->ntypedParamFields);
     VIR_FREE(priv);
 }
 
@@ -1596,6 +1683,17 @@ static void remoteClientCloseFunc(virNetServerClientPtr client)
     struct daemonClientPrivate *priv = virNetServerClientGetPrivateData(client);
 
     daemonRemoveAllClientStreams(priv->streams);
+
+    virMutexLock(&priv->lock);
+    if (priv->conn && priv->nstatsEventCallbacks) {
+        virIdentityPtr sysident = virIdentityGetSystem();
+
+        virIdentitySetCurrent(sysident);
+        remoteClientDeregisterStatsEvents(priv);
+        virIdentitySetCurrent(NULL);
+        virObjectUnref(sysident);
+    }
+    virMutexUnlock(&priv->lock);
 }
 
 
@@ -4516,6 +4614,7 @@ static int remoteDispatchConnectSupportsFeature(virNetServerPtr server ATTRIBUTE
     case VIR_DRV_FEATURE_FD_PASSING:
     case VIR_DRV_FEATURE_REMOTE_EVENT_CALLBACK:
     case VIR_DRV_FEATURE_REMOTE_CLOSE_CALLBACK:
+    case VIR_DRV_FEATURE_REMOTE_COMPACT_TYPED_PARAMS:
         supported = 1;
         break;
 
@@ -5173,7 +5272,7 @@ remoteDispatchDomainMigratePrepareTunnel3Params(virNetServerPtr server ATTRIBUTE
 
     if (!(st = virStreamNew(priv->conn, VIR_STREAM_NONBLOCK)) ||
         !(stream = daemonCreateClientStream(client, st, remoteProgram,
-                                            &msg->header)))
+                                            &msg->header, false)))
         goto cleanup;
 
     if (virDomainMigratePrepareTunnel3Params(priv->conn, st, params, nparams,
@@ -6010,6 +6109,113 @@ qemuDispatchConnectDomainMonitorEventDeregister(virNetServerPtr server ATTRIBUTE
     return rv;
 }
 
+static int
+remoteDispatchConnectDomainStatsEventRegister(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                              virNetServerClientPtr client,
+                                              virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                              virNetMessageErrorPtr rerr ATTRIBUTE_UNUSED,
+                                              remote_connect_domain_stats_event_register_args *args,
+                                              remote_connect_domain_stats_event_register_ret *ret)
+{
+    int callbackID;
+    int rv = -1;
+    daemonClientEventCallbackPtr callback = NULL;
+    daemonClientEventCallbackPtr ref;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    virMutexLock(&priv->lock);
+
+    /* See qemuDispatchConnectDomainMonitorEventRegister for why an
+     * incomplete callback is appended before registering */
+    if (VIR_ALLOC(callback) < 0)
+        goto cleanup;
+    callback->client = client;
+    callback->callbackID = -1;
+    ref = callback;
+    if (VIR_APPEND_ELEMENT(priv->statsEventCallbacks,
+                           priv->nstatsEventCallbacks,
+                           callback) < 0)
+        goto cleanup;
+
+    if ((callbackID = virConnectDomainStatsEventRegister(priv->conn,
+                                                         args->stats,
+                                                         args->interval,
+                                                         remoteRelayDomainStatsEvent,
+                                                         ref,
+                                                         remoteEventCallbackFree,
+                                                         args->flags)) < 0) {
+        VIR_SHRINK_N(priv->statsEventCallbacks,
+                     priv->nstatsEventCallbacks, 1);
+        callback = ref;
+        goto cleanup;
+    }
+
+    ref->callbackID = callbackID;
+    ret->callbackID = callbackID;
+
+    rv = 0;
+
+ cleanup:
+    VIR_FREE(callback);
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    virMutexUnlock(&priv->lock);
+    return rv;
+}
+
+
+static int
+remoteDispatchConnectDomainStatsEventDeregister(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                                virNetServerClientPtr client,
+                                                virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                                virNetMessageErrorPtr rerr ATTRIBUTE_UNUSED,
+                                                remote_connect_domain_stats_event_deregister_args *args)
+{
+    int rv = -1;
+    size_t i;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    virMutexLock(&priv->lock);
+
+    for (i = 0; i < priv->nstatsEventCallbacks; i++) {
+        if (priv->statsEventCallbacks[i]->callbackID == args->callbackID)
+            break;
+    }
+    if (i == priv->nstatsEventCallbacks) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("statistics event callback %d not registered"),
+                       args->callbackID);
+        goto cleanup;
+    }
+
+    if (virConnectDomainStatsEventDeregister(priv->conn,
+                                             args->callbackID) < 0)
+        goto cleanup;
+
+    VIR_DELETE_ELEMENT(priv->statsEventCallbacks, i,
+                       priv->nstatsEventCallbacks);
+
+    rv = 0;
+
+ cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    virMutexUnlock(&priv->lock);
+    return rv;
+}
+
 static int
 remoteDispatchDomainGetTime(virNetServerPtr server ATTRIBUTE_UNUSED,
                             virNetServerClientPtr client,
@@ -6229,45 +6435,35 @@ remoteDispatchNetworkGetDHCPLeases(virNetServerPtr server ATTRIBUTE_UNUSED,
 }
 
 
+/* Collect the statistics of @doms, or of all domains if there are
+ * none, for both encodings of the bulk stats procedure */
 static int
-remoteDispatchConnectGetAllDomainStats(virNetServerPtr server ATTRIBUTE_UNUSED,
-                                       virNetServerClientPtr client,
-                                       virNetMessagePtr msg ATTRIBUTE_UNUSED,
-                                       virNetMessageErrorPtr rerr,
-                                       remote_connect_get_all_domain_stats_args *args,
-                                       remote_connect_get_all_domain_stats_ret *ret)
+remoteConnectGetAllDomainStatsRecords(virConnectPtr conn,
+                                      remote_nonnull_domain *domsval,
+                                      u_int domslen,
+                                      unsigned int stats,
+                                      unsigned int flags,
+                                      virDomainStatsRecordPtr **retStats)
 {
-    int rv = -1;
-    size_t i;
-    struct daemonClientPrivate *priv = virNetServerClientGetPrivateData(client);
-    virDomainStatsRecordPtr *retStats = NULL;
-    int nrecords = 0;
     virDomainPtr *doms = NULL;
+    int nrecords = -1;
+    size_t i;
 
-    if (!priv->conn) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
-        goto cleanup;
-    }
-
-    if (args->doms.doms_len) {
-        if (VIR_ALLOC_N(doms, args->doms.doms_len + 1) < 0)
+    if (domslen) {
+        if (VIR_ALLOC_N(doms, domslen + 1) < 0)
             goto cleanup;
 
-        for (i = 0; i < args->doms.doms_len; i++) {
-            if (!(doms[i] = get_nonnull_domain(priv->conn, args->doms.doms_val[i])))
+        for (i = 0; i < domslen; i++) {
+            if (!(doms[i] = get_nonnull_domain(conn, domsval[i])))
                 goto cleanup;
         }
 
-        if ((nrecords = virDomainListGetStats(doms,
-                                              args->stats,
-                                              &retStats,
-                                              args->flags)) < 0)
+        if ((nrecords = virDomainListGetStats(doms, stats,
+                                              retStats, flags)) < 0)
             goto cleanup;
     } else {
-        if ((nrecords = virConnectGetAllDomainStats(priv->conn,
-                                                    args->stats,
-                                                    &retStats,
-                                                    args->flags)) < 0)
+        if ((nrecords = virConnectGetAllDomainStats(conn, stats,
+                                                    retStats, flags)) < 0)
             goto cleanup;
     }
 
@@ -6276,9 +6472,44 @@ remoteDispatchConnectGetAllDomainStats(virNetServerPtr server ATTRIBUTE_UNUSED,
                        _("Number of domain stats records is %d, "
                          "which exceeds max limit: %d"),
                        nrecords, REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX);
+        virDomainStatsRecordListFree(*retStats);
+        *retStats = NULL;
+        nrecords = -1;
+    }
+
+ cleanup:
+    virObjectListFree(doms);
+    return nrecords;
+}
+
+
+static int
+remoteDispatchConnectGetAllDomainStats(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                       virNetServerClientPtr client,
+                                       virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                       virNetMessageErrorPtr rerr,
+                                       remote_connect_get_all_domain_stats_args *args,
+                                       remote_connect_get_all_domain_stats_ret *ret)
+{
+    int rv = -1;
+    size_t i;
+    struct daemonClientPrivate *priv = virNetServerClientGetPrivateData(client);
+    virDomainStatsRecordPtr *retStats = NULL;
+    int nrecords = 0;
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
         goto cleanup;
     }
 
+    if ((nrecords = remoteConnectGetAllDomainStatsRecords(priv->conn,
+                                                          args->doms.doms_val,
+                                                          args->doms.doms_len,
+                                                          args->stats,
+                                                          args->flags,
+                                                          &retStats)) < 0)
+        goto cleanup;
+
     if (nrecords) {
         if (VIR_ALLOC_N(ret->retStats.retStats_val, nrecords) < 0)
             goto cleanup;
@@ -6309,7 +6540,194 @@ remoteDispatchConnectGetAllDomainStats(virNetServerPtr server ATTRIBUTE_UNUSED,
         virNetMessageSaveError(rerr);
 
     virDomainStatsRecordListFree(retStats);
-    virObjectListFree(doms);
+
+    return rv;
+}
+
+
+/* Encode @params as indexes in the field names known to the client,
+ * adding the names it doesn't know yet. Called with priv->lock held */
+static int
+remoteSerializeTypedParametersCompact(struct daemonClientPrivate *priv,
+                                      virTypedParameterPtr params,
+                                      int nparams,
+                                      remote_typed_param_compact **ret_params_val,
+                                      u_int *ret_params_len)
+{
+    remote_typed_param_compact *val = NULL;
+    size_t i;
+    int rv = -1;
+
+    if (VIR_ALLOC_N(val, nparams) < 0)
+        goto cleanup;
+
+    for (i = 0; i < nparams; i++) {
+        virTypedParameterPtr param = params + i;
+        remote_typed_param_compact *dst = val + i;
+        size_t index;
+        void *entry;
+
+        if ((entry = virHashLookup(priv->typedParamFieldIndex, param->field))) {
+            index = (uintptr_t) entry - 1;
+        } else {
+            char *field = NULL;
+
+            if (priv->ntypedParamFields >= REMOTE_TYPED_PARAM_FIELDS_MAX) {
+                virReportError(VIR_ERR_RPC,
+                               _("too many typed parameter names, limit is %d"),
+                               REMOTE_TYPED_PARAM_FIELDS_MAX);
+                goto cleanup;
+            }
+
+            index = priv->ntypedParamFields;
+            if (VIR_STRDUP(field, param->field) < 0 ||
+                virHashAddEntry(priv->typedParamFieldIndex, field,
+                                (void *) (uintptr_t) (index + 1)) < 0 ||
+                VIR_APPEND_ELEMENT(priv->typedParamFields,
+                                   priv->ntypedParamFields, field) < 0) {
+                virHashRemoveEntry(priv->typedParamFieldIndex, param->field);
+                VIR_FREE(field);
+                goto cleanup;
+            }
+        }
+
+        dst->field = index;
+        dst->value.type = param->type;
+        switch (param->type) {
+        case VIR_TYPED_PARAM_INT:
+            dst->value.remote_typed_param_value_u.i = param->value.i;
+            break;
+        case VIR_TYPED_PARAM_UINT:
+            dst->value.remote_typed_param_value_u.ui = param->value.ui;
+            break;
+        case VIR_TYPED_PARAM_LLONG:
+            dst->value.remote_typed_param_value_u.l = param->value.l;
+            break;
+        case VIR_TYPED_PARAM_ULLONG:
+            dst->value.remote_typed_param_value_u.ul = param->value.ul;
+            break;
+        case VIR_TYPED_PARAM_DOUBLE:
+            dst->value.remote_typed_param_value_u.d = param->value.d;
+            break;
+        case VIR_TYPED_PARAM_BOOLEAN:
+            dst->value.remote_typed_param_value_u.b = param->value.b;
+            break;
+        case VIR_TYPED_PARAM_STRING:
+            if (VIR_STRDUP(dst->value.remote_typed_param_value_u.s,
+                           param->value.s) < 0)
+                goto cleanup;
+            break;
+        default:
+            virReportError(VIR_ERR_RPC, _("unknown parameter type: %d"),
+                           param->type);
+            goto cleanup;
+        }
+    }
+
+    *ret_params_val = val;
+    *ret_params_len = nparams;
+    val = NULL;
+    rv = 0;
+
+ cleanup:
+    if (val) {
+        for (i = 0; i < nparams; i++) {
+            if (val[i].value.type == VIR_TYPED_PARAM_STRING)
+                VIR_FREE(val[i].value.remote_typed_param_value_u.s);
+        }
+        VIR_FREE(val);
+    }
+    return rv;
+}
+
+
+static int
+remoteDispatchConnectGetAllDomainStatsCompact(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                              virNetServerClientPtr client,
+                                              virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                              virNetMessageErrorPtr rerr,
+                                              remote_connect_get_all_domain_stats_compact_args *args,
+                                              remote_connect_get_all_domain_stats_compact_ret *ret)
+{
+    int rv = -1;
+    size_t i;
+    struct daemonClientPrivate *priv = virNetServerClientGetPrivateData(client);
+    virDomainStatsRecordPtr *retStats = NULL;
+    int nrecords = 0;
+    size_t nfields;
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if ((nrecords = remoteConnectGetAllDomainStatsRecords(priv->conn,
+                                                          args->doms.doms_val,
+                                                          args->doms.doms_len,
+                                                          args->stats,
+                                                          args->flags,
+                                                          &retStats)) < 0)
+        goto cleanup;
+
+    virMutexLock(&priv->lock);
+
+    if (args->nfields > priv->ntypedParamFields) {
+        virReportError(VIR_ERR_RPC,
+                       _("client knows %u typed parameter names, "
+                         "but only %zu were sent"),
+                       args->nfields, priv->ntypedParamFields);
+        goto unlock;
+    }
+
+    if (!priv->typedParamFieldIndex &&
+        !(priv->typedParamFieldIndex = virHashCreate(64, NULL)))
+        goto unlock;
+
+    if (nrecords) {
+        if (VIR_ALLOC_N(ret->retStats.retStats_val, nrecords) < 0)
+            goto unlock;
+
+        ret->retStats.retStats_len = nrecords;
+
+        for (i = 0; i < nrecords; i++) {
+            remote_domain_stats_record_compact *dst = ret->retStats.retStats_val + i;
+
+            make_nonnull_domain(&dst->dom, retStats[i]->dom);
+
+            if (remoteSerializeTypedParametersCompact(priv,
+                                                      retStats[i]->params,
+                                                      retStats[i]->nparams,
+                                                      &dst->params.params_val,
+                                                      &dst->params.params_len) < 0)
+                goto unlock;
+        }
+    }
+
+    /* Send the names the client doesn't know about yet */
+    nfields = priv->ntypedParamFields - args->nfields;
+    ret->firstField = args->nfields;
+    if (nfields) {
+        if (VIR_ALLOC_N(ret->fields.fields_val, nfields) < 0)
+            goto unlock;
+        ret->fields.fields_len = nfields;
+
+        for (i = 0; i < nfields; i++) {
+            if (VIR_STRDUP(ret->fields.fields_val[i],
+                           priv->typedParamFields[args->nfields + i]) < 0)
+                goto unlock;
+        }
+    }
+
+    rv = 0;
+
+ unlock:
+    virMutexUnlock(&priv->lock);
+
+ cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+
+    virDomainStatsRecordListFree(retStats);
 
     return rv;
 }
@@ -52,6 +52,8 @@ struct daemonClientStream {
     virNetMessagePtr rx;
     bool tx;
 
+    bool allowSkip;
+
     daemonClientStreamPtr next;
 };
 
@@ -285,7 +287,8 @@ daemonStreamFilter(virNetServerClientPtr client ATTRIBUTE_UNUSED,
 
     virMutexLock(&stream->priv->lock);
 
-    if (msg->header.type != VIR_NET_STREAM)
+    if (msg->header.type != VIR_NET_STREAM &&
+        msg->header.type != VIR_NET_STREAM_HOLE)
         goto cleanup;
 
     if (!virNetServerProgramMatches(stream->prog, msg))
@@ -321,13 +324,14 @@ daemonClientStream *
 daemonCreateClientStream(virNetServerClientPtr client,
                          virStreamPtr st,
                          virNetServerProgramPtr prog,
-                         virNetMessageHeaderPtr header)
+                         virNetMessageHeaderPtr header,
+                         bool allowSkip)
 {
     daemonClientStream *stream;
     daemonClientPrivatePtr priv = virNetServerClientGetPrivateData(client);
 
-    VIR_DEBUG("client=%p, proc=%d, serial=%u, st=%p",
-              client, header->proc, header->serial, st);
+    VIR_DEBUG("client=%p, proc=%d, serial=%u, st=%p, allowSkip=%d",
+              client, header->proc, header->serial, st, allowSkip);
 
     if (VIR_ALLOC(stream) < 0)
         return NULL;
@@ -339,6 +343,7 @@ daemonCreateClientStream(virNetServerClientPtr client,
     stream->serial = header->serial;
     stream->filterID = -1;
     stream->st = st;
+    stream->allowSkip = allowSkip;
 
     return stream;
 }
@@ -557,6 +562,65 @@ daemonStreamHandleWriteData(virNetServerClientPtr client,
 }
 
 
+/*
+ * We've received a hole from the client. Let the stream
+ * create it in the target.
+ *
+ * Returns 1 if the hole could not be created yet and should
+ * be retried later, 0 if it was created or an error RPC was
+ * sent, -1 upon fatal error
+ */
+static int
+daemonStreamHandleHole(virNetServerClientPtr client,
+                       daemonClientStream *stream,
+                       virNetMessagePtr msg)
+{
+    int ret;
+    virNetStreamHole data;
+    size_t offset = msg->bufferOffset;
+
+    VIR_DEBUG("client=%p, stream=%p, proc=%d, serial=%u",
+              client, stream, msg->header.proc, msg->header.serial);
+
+    memset(&data, 0, sizeof(data));
+
+    if (!stream->allowSkip) {
+        virReportError(VIR_ERR_RPC, "%s",
+                       _("Unexpected stream hole"));
+        ret = -1;
+    } else if (virNetMessageDecodePayload(msg,
+                                          (xdrproc_t) xdr_virNetStreamHole,
+                                          &data) < 0) {
+        ret = -1;
+    } else {
+        ret = virStreamSendHole(stream->st, data.length, data.flags);
+    }
+
+    if (ret == -2) {
+        /* Blocking, so decode the hole again next time */
+        msg->bufferOffset = offset;
+        return 1;
+    } else if (ret < 0) {
+        virNetMessageError rerr;
+
+        memset(&rerr, 0, sizeof(rerr));
+
+        VIR_INFO("Stream send hole failed");
+        stream->closed = true;
+        virStreamEventRemoveCallback(stream->st);
+        virStreamAbort(stream->st);
+
+        return virNetServerProgramSendReplyError(stream->prog,
+                                                 client,
+                                                 msg,
+                                                 &rerr,
+                                                 &msg->header);
+    }
+
+    return 0;
+}
+
+
 /*
  * Process a finish handshake from the client.
  *
@@ -672,7 +736,10 @@ daemonStreamHandleWrite(virNetServerClientPtr client,
             break;
 
         case VIR_NET_CONTINUE:
-            ret = daemonStreamHandleWriteData(client, stream, msg);
+            if (msg->header.type == VIR_NET_STREAM_HOLE)
+                ret = daemonStreamHandleHole(client, stream, msg);
+            else
+                ret = daemonStreamHandleWriteData(client, stream, msg);
             break;
 
         case VIR_NET_ERROR:
@@ -757,9 +824,38 @@ daemonStreamHandleRead(virNetServerClientPtr client,
     if (!(msg = virNetMessageNew(false)))
         goto cleanup;
 
-    rv = virStreamRecv(stream->st, buffer, bufferLen);
-    if (rv == -2) {
-        /* Should never get this, since we're only called when we know
+    if (stream->allowSkip)
+        rv = virStreamRecvFlags(stream->st, buffer, bufferLen,
+                                VIR_STREAM_RECV_STOP_AT_HOLE);
+    else
+        rv = virStreamRecv(stream->st, buffer, bufferLen);
+
+    if (rv == -3) {
+        long long length;
+
+        /* Transfer the hole instead of a run of zeroes */
+        if (virStreamRecvHole(stream->st, &length, 0) < 0) {
+            rv = -1;
+        } else if (length > 0) {
+            stream->tx = false;
+
+            msg->cb = daemonStreamMessageFinished;
+            msg->opaque = stream;
+            stream->refs++;
+            if (virNetServerProgramSendStreamHole(remoteProgram,
+                                                  client,
+                                                  msg,
+                                                  stream->procedure,
+                                                  stream->serial,
+                                                  length,
+                                                  0) < 0)
+                goto cleanup;
+            msg = NULL;
+        }
+    }
+
+    if (rv == -2 || rv == -3) {
+        /* Should never get -2, since we're only called when we know
          * we're readable, but hey things change... */
     } else if (rv < 0) {
         if (virNetServerProgramSendStreamError(remoteProgram,
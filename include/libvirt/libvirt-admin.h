@@ -420,6 +420,52 @@ int virAdmConnectSetLoggingFilters(virAdmConnectPtr conn,
                                    const char *filters,
                                    unsigned int flags);
 
+/* Event loop statistics */
+
+/**
+ * VIR_EVENT_LOOP_COUNT:
+ * Macro for the number of event loops run by the daemon, the main one
+ * included, as VIR_TYPED_PARAM_UINT. Each of them is described by the
+ * "loop.<num>." prefixed fields below, <num> being 0 for the main loop.
+ */
+
+# define VIR_EVENT_LOOP_COUNT "loop.count"
+
+/**
+ * VIR_EVENT_LOOP_SUFFIX_ITERATIONS:
+ * Macro for the suffix of the "loop.<num>.iterations" field: the number
+ * of iterations the event loop has run so far, as VIR_TYPED_PARAM_ULLONG.
+ */
+
+# define VIR_EVENT_LOOP_SUFFIX_ITERATIONS ".iterations"
+
+/**
+ * VIR_EVENT_LOOP_SUFFIX_BUSY:
+ * Macro for the suffix of the "loop.<num>.busy" field: the time the event
+ * loop has spent dispatching events rather than waiting for them, in
+ * microseconds, as VIR_TYPED_PARAM_ULLONG.
+ */
+
+# define VIR_EVENT_LOOP_SUFFIX_BUSY ".busy"
+
+/**
+ * VIR_EVENT_LOOP_SUFFIX_HANDLES:
+ * Macro for the suffix of the "loop.<num>.handles" field: the number of
+ * file handles currently watched by the event loop, as
+ * VIR_TYPED_PARAM_UINT.
+ */
+
+# define VIR_EVENT_LOOP_SUFFIX_HANDLES ".handles"
+
+int virAdmConnectGetEventLoopStats(virAdmConnectPtr conn,
+                                   virTypedParameterPtr *params,
+                                   int *nparams,
+                                   unsigned int flags);
+
+int virAdmConnectGetLoggingRecords(virAdmConnectPtr conn,
+                                   char **records,
+                                   unsigned int flags);
+
 # ifdef __cplusplus
 }
 # endif
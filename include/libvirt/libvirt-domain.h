@@ -2050,6 +2050,38 @@ int virDomainListGetStats(virDomainPtr *doms,
 
 void virDomainStatsRecordListFree(virDomainStatsRecordPtr *stats);
 
+/**
+ * virConnectDomainStatsEventCallback:
+ * @conn: connection object
+ * @stats: array of statistics records which changed since the last event
+ * @nstats: number of records in @stats
+ * @opaque: application specified data
+ *
+ * The callback signature to use when registering for periodic domain
+ * statistics with virConnectDomainStatsEventRegister(). Every record
+ * only holds the typed parameters whose value changed since the
+ * previous event delivered to the same callback, and domains without
+ * any change are left out. The first event carries all the statistics.
+ *
+ * The @stats array and the records it points to are only valid for
+ * the duration of execution of the callback.
+ */
+typedef void (*virConnectDomainStatsEventCallback)(virConnectPtr conn,
+                                                   virDomainStatsRecordPtr *stats,
+                                                   int nstats,
+                                                   void *opaque);
+
+int virConnectDomainStatsEventRegister(virConnectPtr conn,
+                                       unsigned int stats,
+                                       unsigned int interval,
+                                       virConnectDomainStatsEventCallback cb,
+                                       void *opaque,
+                                       virFreeCallback freecb,
+                                       unsigned int flags);
+
+int virConnectDomainStatsEventDeregister(virConnectPtr conn,
+                                         int callbackID);
+
 /*
  * Perf Event API
  */
@@ -48,6 +48,9 @@ const ADMIN_CLIENT_INFO_PARAMETERS_MAX = 64;
 /* Upper limit on number of client processing controls */
 const ADMIN_SERVER_CLIENT_LIMITS_MAX = 32;
 
+/* Upper limit on number of event loop statistics */
+const ADMIN_EVENT_LOOP_STATS_MAX = 256;
+
 /* A long string, which may NOT be NULL. */
 typedef string admin_nonnull_string<ADMIN_STRING_MAX>;
 
@@ -211,6 +214,23 @@ struct admin_connect_set_logging_filters_args {
     unsigned int flags;
 };
 
+struct admin_connect_get_event_loop_stats_args {
+    unsigned int flags;
+};
+
+struct admin_connect_get_event_loop_stats_ret {
+    admin_typed_param params<ADMIN_EVENT_LOOP_STATS_MAX>;
+};
+
+struct admin_connect_get_logging_records_args {
+    unsigned int flags;
+};
+
+struct admin_connect_get_logging_records_ret {
+    admin_nonnull_string records;
+    unsigned int nrecords;
+};
+
 /* Define the program number, protocol version and procedure numbers here. */
 const ADMIN_PROGRAM = 0x06900690;
 const ADMIN_PROTOCOL_VERSION = 1;
@@ -316,5 +336,15 @@ enum admin_procedure {
     /**
      * @generate: both
      */
-    ADMIN_PROC_CONNECT_SET_LOGGING_FILTERS = 17
+    ADMIN_PROC_CONNECT_SET_LOGGING_FILTERS = 17,
+
+    /**
+     * @generate: none
+     */
+    ADMIN_PROC_CONNECT_GET_EVENT_LOOP_STATS = 18,
+
+    /**
+     * @generate: none
+     */
+    ADMIN_PROC_CONNECT_GET_LOGGING_RECORDS = 19
 };
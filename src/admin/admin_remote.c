@@ -495,3 +495,79 @@ remoteAdminConnectGetLoggingFilters(virAdmConnectPtr conn,
     virObjectUnlock(priv);
     return rv;
 }
+
+static int
+remoteAdminConnectGetEventLoopStats(virAdmConnectPtr conn,
+                                    virTypedParameterPtr *params,
+                                    int *nparams,
+                                    unsigned int flags)
+{
+    int rv = -1;
+    remoteAdminPrivPtr priv = conn->privateData;
+    admin_connect_get_event_loop_stats_args args;
+    admin_connect_get_event_loop_stats_ret ret;
+
+    args.flags = flags;
+
+    memset(&ret, 0, sizeof(ret));
+    virObjectLock(priv);
+
+    if (call(conn,
+             0,
+             ADMIN_PROC_CONNECT_GET_EVENT_LOOP_STATS,
+             (xdrproc_t) xdr_admin_connect_get_event_loop_stats_args,
+             (char *) &args,
+             (xdrproc_t) xdr_admin_connect_get_event_loop_stats_ret,
+             (char *) &ret) == -1)
+        goto done;
+
+    if (virTypedParamsDeserialize((virTypedParameterRemotePtr) ret.params.params_val,
+                                  ret.params.params_len,
+                                  ADMIN_EVENT_LOOP_STATS_MAX,
+                                  params,
+                                  nparams) < 0)
+        goto cleanup;
+
+    rv = 0;
+
+ cleanup:
+    xdr_free((xdrproc_t) xdr_admin_connect_get_event_loop_stats_ret,
+             (char *) &ret);
+ done:
+    virObjectUnlock(priv);
+    return rv;
+}
+
+static int
+remoteAdminConnectGetLoggingRecords(virAdmConnectPtr conn,
+                                    char **records,
+                                    unsigned int flags)
+{
+    int rv = -1;
+    remoteAdminPrivPtr priv = conn->privateData;
+    admin_connect_get_logging_records_args args;
+    admin_connect_get_logging_records_ret ret;
+
+    args.flags = flags;
+
+    memset(&ret, 0, sizeof(ret));
+    virObjectLock(priv);
+
+    if (call(conn,
+             0,
+             ADMIN_PROC_CONNECT_GET_LOGGING_RECORDS,
+             (xdrproc_t) xdr_admin_connect_get_logging_records_args,
+             (char *) &args,
+             (xdrproc_t) xdr_admin_connect_get_logging_records_ret,
+             (char *) &ret) == -1)
+        goto done;
+
+    VIR_STEAL_PTR(*records, ret.records);
+
+    rv = ret.nrecords;
+    xdr_free((xdrproc_t) xdr_admin_connect_get_logging_records_ret, (char *) &ret);
+
+ done:
+    virObjectUnlock(priv);
+    return rv;
+}
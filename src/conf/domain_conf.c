@@ -24538,6 +24538,8 @@ virDomainSaveStatus(virDomainXMLOptionPtr xmlopt,
     if (virDomainSaveXML(statusDir, obj->def, xml))
         goto cleanup;
 
+    obj->statusDirty = false;
+    obj->statusSize = strlen(xml);
     ret = 0;
  cleanup:
     VIR_FREE(xml);
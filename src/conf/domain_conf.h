@@ -2377,6 +2377,9 @@ struct _virDomainObj {
 
     unsigned long long original_memlock; /* Original RLIMIT_MEMLOCK, zero if no
                                           * restore will be required later */
+
+    bool statusDirty; /* status changed since virDomainSaveStatus */
+    size_t statusSize; /* length of the status XML last saved */
 };
 
 typedef bool (*virDomainObjListACLFilter)(virConnectPtr conn,
@@ -53,6 +53,7 @@ static virClassPtr virDomainEventBalloonChangeClass;
 static virClassPtr virDomainEventDeviceRemovedClass;
 static virClassPtr virDomainEventPMClass;
 static virClassPtr virDomainQemuMonitorEventClass;
+static virClassPtr virDomainStatsEventClass;
 static virClassPtr virDomainEventTunableClass;
 static virClassPtr virDomainEventAgentLifecycleClass;
 static virClassPtr virDomainEventDeviceAddedClass;
@@ -73,6 +74,7 @@ static void virDomainEventBalloonChangeDispose(void *obj);
 static void virDomainEventDeviceRemovedDispose(void *obj);
 static void virDomainEventPMDispose(void *obj);
 static void virDomainQemuMonitorEventDispose(void *obj);
+static void virDomainStatsEventDispose(void *obj);
 static void virDomainEventTunableDispose(void *obj);
 static void virDomainEventAgentLifecycleDispose(void *obj);
 static void virDomainEventDeviceAddedDispose(void *obj);
@@ -92,6 +94,12 @@ virDomainQemuMonitorEventDispatchFunc(virConnectPtr conn,
                                       virConnectObjectEventGenericCallback cb,
                                       void *cbopaque);
 
+static void
+virDomainStatsEventDispatchFunc(virConnectPtr conn,
+                                virObjectEventPtr event,
+                                virConnectObjectEventGenericCallback cb,
+                                void *cbopaque);
+
 struct _virDomainEvent {
     virObjectEvent parent;
 
@@ -223,6 +231,15 @@ struct _virDomainQemuMonitorEvent {
 typedef struct _virDomainQemuMonitorEvent virDomainQemuMonitorEvent;
 typedef virDomainQemuMonitorEvent *virDomainQemuMonitorEventPtr;
 
+struct _virDomainStatsEvent {
+    virObjectEvent parent;
+
+    virDomainStatsRecordPtr *records;
+    int nrecords;
+};
+typedef struct _virDomainStatsEvent virDomainStatsEvent;
+typedef virDomainStatsEvent *virDomainStatsEventPtr;
+
 struct _virDomainEventTunable {
     virDomainEvent parent;
 
@@ -355,6 +372,12 @@ virDomainEventsOnceInit(void)
                       sizeof(virDomainQemuMonitorEvent),
                       virDomainQemuMonitorEventDispose)))
         return -1;
+    if (!(virDomainStatsEventClass =
+          virClassNew(virClassForObjectEvent(),
+                      "virDomainStatsEvent",
+                      sizeof(virDomainStatsEvent),
+                      virDomainStatsEventDispose)))
+        return -1;
     if (!(virDomainEventTunableClass =
           virClassNew(virDomainEventClass,
                       "virDomainEventTunable",
@@ -540,6 +563,15 @@ virDomainQemuMonitorEventDispose(void *obj)
     VIR_FREE(event->details);
 }
 
+static void
+virDomainStatsEventDispose(void *obj)
+{
+    virDomainStatsEventPtr event = obj;
+    VIR_DEBUG("obj=%p", event);
+
+    virDomainStatsRecordListFree(event->records);
+}
+
 static void
 virDomainEventTunableDispose(void *obj)
 {
@@ -2245,3 +2277,103 @@ virDomainQemuMonitorEventStateRegisterID(virConnectPtr conn,
                                          data, freecb,
                                          false, callbackID, false);
 }
+
+
+/**
+ * virDomainStatsEventNew:
+ * @records: NULL terminated list of statistics records
+ * @nrecords: number of records in @records
+ *
+ * Create a new statistics event carrying @records, which it takes
+ * ownership of, even on failure.
+ */
+virObjectEventPtr
+virDomainStatsEventNew(virDomainStatsRecordPtr *records,
+                       int nrecords)
+{
+    virDomainStatsEventPtr ev;
+
+    if (virDomainEventsInitialize() < 0 ||
+        !(ev = virObjectEventNew(virDomainStatsEventClass,
+                                 virDomainStatsEventDispatchFunc,
+                                 0, 0, NULL, NULL, NULL))) {
+        virDomainStatsRecordListFree(records);
+        return NULL;
+    }
+
+    ev->records = records;
+    ev->nrecords = nrecords;
+
+    return (virObjectEventPtr)ev;
+}
+
+
+static void
+virDomainStatsEventDispatchFunc(virConnectPtr conn,
+                                virObjectEventPtr event,
+                                virConnectObjectEventGenericCallback cb,
+                                void *cbopaque)
+{
+    virDomainStatsEventPtr statsEvent = (virDomainStatsEventPtr)event;
+
+    ((virConnectDomainStatsEventCallback)cb)(conn,
+                                             statsEvent->records,
+                                             statsEvent->nrecords,
+                                             cbopaque);
+}
+
+
+/**
+ * virDomainStatsEventFilter:
+ * @conn: the connection pointer
+ * @event: the event about to be dispatched
+ * @opaque: unused
+ *
+ * Every subscription samples statistics on its own schedule and
+ * keeps its own notion of what changed, so an event is only ever
+ * meant for the subscription which produced it, and must have been
+ * queued with virObjectEventStateQueueRemote().
+ */
+static bool
+virDomainStatsEventFilter(virConnectPtr conn ATTRIBUTE_UNUSED,
+                          virObjectEventPtr event,
+                          void *opaque ATTRIBUTE_UNUSED)
+{
+    return event->remoteID >= 0;
+}
+
+
+/**
+ * virDomainStatsEventStateRegisterID:
+ * @conn: connection to associate with callback
+ * @state: object event state
+ * @cb: function to invoke when statistics are sampled
+ * @opaque: data blob to pass to callback
+ * @freecb: callback to free @opaque
+ * @callbackID: filled with callback ID
+ *
+ * Register the function @cb with connection @conn, from @state, for
+ * statistics events. Since every registration is fed separately, the
+ * caller must tie the callback to the ID its events are queued with,
+ * using virObjectEventStateSetRemote().
+ *
+ * Returns: the number of callbacks now registered, or -1 on error
+ */
+int
+virDomainStatsEventStateRegisterID(virConnectPtr conn,
+                                   virObjectEventStatePtr state,
+                                   virConnectDomainStatsEventCallback cb,
+                                   void *opaque,
+                                   virFreeCallback freecb,
+                                   int *callbackID)
+{
+    if (virDomainEventsInitialize() < 0)
+        return -1;
+
+    return virObjectEventStateRegisterID(conn, state, NULL,
+                                         virDomainStatsEventFilter, NULL,
+                                         virDomainStatsEventClass, 0,
+                                         VIR_OBJECT_EVENT_CALLBACK(cb),
+                                         opaque, freecb,
+                                         false, callbackID, false);
+}
@@ -29,9 +29,12 @@
 #include "virdomainobjlist.h"
 #include "snapshot_conf.h"
 #include "viralloc.h"
+#include "viratomic.h"
 #include "virfile.h"
+#include "virhostcpu.h"
 #include "virlog.h"
 #include "virstring.h"
+#include "virthread.h"
 
 #define VIR_FROM_THIS VIR_FROM_DOMAIN
 
@@ -41,8 +44,13 @@ static virClassPtr virDomainObjListClass;
 static void virDomainObjListDispose(void *obj);
 
 
+/* Lookups by UUID or name, which is what nearly every API call
+ * starts with, only take the list lock for reading and so don't
+ * block each other. Anything that iterates the hash tables takes
+ * it for writing, since virHashForEach and virHashSearch record
+ * the iteration in the table itself. */
 struct _virDomainObjList {
-    virObjectLockable parent;
+    virObjectRWLockable parent;
 
     /* uuid string -> virDomainObj  mapping
      * for O(1), lockless lookup-by-uuid */
@@ -56,7 +64,7 @@ struct _virDomainObjList {
 
 static int virDomainObjListOnceInit(void)
 {
-    if (!(virDomainObjListClass = virClassNew(virClassForObjectLockable(),
+    if (!(virDomainObjListClass = virClassNew(virClassForObjectRWLockable(),
                                               "virDomainObjList",
                                               sizeof(virDomainObjList),
                                               virDomainObjListDispose)))
@@ -74,7 +82,7 @@ virDomainObjListPtr virDomainObjListNew(void)
     if (virDomainObjListInitialize() < 0)
         return NULL;
 
-    if (!(doms = virObjectLockableNew(virDomainObjListClass)))
+    if (!(doms = virObjectRWLockableNew(virDomainObjListClass)))
         return NULL;
 
     if (!(doms->objs = virHashCreate(50, virObjectFreeHashData)) ||
@@ -118,7 +126,7 @@ virDomainObjListFindByIDInternal(virDomainObjListPtr doms,
                                  bool ref)
 {
     virDomainObjPtr obj;
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     obj = virHashSearch(doms->objs, virDomainObjListSearchID, &id);
     if (ref) {
         virObjectRef(obj);
@@ -160,7 +168,7 @@ virDomainObjListFindByUUIDInternal(virDomainObjListPtr doms,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
     virDomainObjPtr obj;
 
-    virObjectLock(doms);
+    virObjectRWLockRead(doms);
     virUUIDFormat(uuid, uuidstr);
 
     obj = virHashLookup(doms->objs, uuidstr);
@@ -204,7 +212,7 @@ virDomainObjPtr virDomainObjListFindByName(virDomainObjListPtr doms,
 {
     virDomainObjPtr obj;
 
-    virObjectLock(doms);
+    virObjectRWLockRead(doms);
     obj = virHashLookup(doms->objsName, name);
     virObjectRef(obj);
     virObjectUnlock(doms);
@@ -327,7 +335,7 @@ virDomainObjPtr virDomainObjListAdd(virDomainObjListPtr doms,
 {
     virDomainObjPtr ret;
 
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     ret = virDomainObjListAddLocked(doms, def, xmlopt, flags, oldDef);
     virObjectUnlock(doms);
     return ret;
@@ -349,7 +357,7 @@ void virDomainObjListRemove(virDomainObjListPtr doms,
     virObjectRef(dom);
     virObjectUnlock(dom);
 
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virObjectLock(dom);
     virHashRemoveEntry(doms->objs, uuidstr);
     virHashRemoveEntry(doms->objsName, dom->def->name);
@@ -394,7 +402,7 @@ virDomainObjListRename(virDomainObjListPtr doms,
      * hold a lock on dom but not refcount it. */
     virObjectRef(dom);
     virObjectUnlock(dom);
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virObjectLock(dom);
     virObjectUnref(dom);
 
@@ -444,80 +452,195 @@ void virDomainObjListRemoveLocked(virDomainObjListPtr doms,
 }
 
 
-static virDomainObjPtr
-virDomainObjListLoadConfig(virDomainObjListPtr doms,
-                           virCapsPtr caps,
-                           virDomainXMLOptionPtr xmlopt,
-                           const char *configDir,
-                           const char *autostartDir,
-                           const char *name,
-                           virDomainLoadConfigNotify notify,
-                           void *opaque)
-{
-    char *configFile = NULL, *autostartLink = NULL;
-    virDomainDefPtr def = NULL;
-    virDomainObjPtr dom;
+/* Upper bound on the threads parsing domain XML at startup */
+#define VIR_DOMAIN_OBJ_LIST_LOAD_MAX_WORKERS 16
+
+typedef struct _virDomainObjListLoadJob virDomainObjListLoadJob;
+typedef virDomainObjListLoadJob *virDomainObjListLoadJobPtr;
+struct _virDomainObjListLoadJob {
+    char *name;
+
+    /* Results of parsing @name, only one of them is set */
+    virDomainDefPtr def;
+    virDomainObjPtr obj;
     int autostart;
-    virDomainDefPtr oldDef = NULL;
 
-    if ((configFile = virDomainConfigFile(configDir, name)) == NULL)
-        goto error;
-    if (!(def = virDomainDefParseFile(configFile, caps, xmlopt, NULL,
-                                      VIR_DOMAIN_DEF_PARSE_INACTIVE |
-                                      VIR_DOMAIN_DEF_PARSE_SKIP_OSTYPE_CHECKS |
-                                      VIR_DOMAIN_DEF_PARSE_SKIP_VALIDATE)))
-        goto error;
+    virErrorPtr err;
+};
 
-    if ((autostartLink = virDomainConfigFile(autostartDir, name)) == NULL)
-        goto error;
+typedef struct _virDomainObjListLoadData virDomainObjListLoadData;
+typedef virDomainObjListLoadData *virDomainObjListLoadDataPtr;
+struct _virDomainObjListLoadData {
+    const char *configDir;
+    const char *autostartDir;
+    int liveStatus;
+    virCapsPtr caps;
+    virDomainXMLOptionPtr xmlopt;
+
+    virDomainObjListLoadJobPtr jobs;
+    size_t njobs;
+    int next; /* index of the next job to pick, updated atomically */
+};
 
-    if ((autostart = virFileLinkPointsTo(autostartLink, configFile)) < 0)
-        goto error;
 
-    if (!(dom = virDomainObjListAddLocked(doms, def, xmlopt, 0, &oldDef)))
-        goto error;
+static int
+virDomainObjListParseConfig(virDomainObjListLoadDataPtr data,
+                            virDomainObjListLoadJobPtr job)
+{
+    char *configFile = NULL, *autostartLink = NULL;
+    int ret = -1;
 
-    dom->autostart = autostart;
+    if ((configFile = virDomainConfigFile(data->configDir, job->name)) == NULL)
+        goto cleanup;
+    if (!(job->def = virDomainDefParseFile(configFile, data->caps,
+                                           data->xmlopt, NULL,
+                                           VIR_DOMAIN_DEF_PARSE_INACTIVE |
+                                           VIR_DOMAIN_DEF_PARSE_SKIP_OSTYPE_CHECKS |
+                                           VIR_DOMAIN_DEF_PARSE_SKIP_VALIDATE)))
+        goto cleanup;
 
-    if (notify)
-        (*notify)(dom, oldDef == NULL, opaque);
+    if ((autostartLink = virDomainConfigFile(data->autostartDir,
+                                             job->name)) == NULL)
+        goto cleanup;
 
-    virDomainDefFree(oldDef);
-    VIR_FREE(configFile);
-    VIR_FREE(autostartLink);
-    return dom;
+    if ((job->autostart = virFileLinkPointsTo(autostartLink, configFile)) < 0)
+        goto cleanup;
 
- error:
+    ret = 0;
+
+ cleanup:
     VIR_FREE(configFile);
     VIR_FREE(autostartLink);
-    virDomainDefFree(def);
-    return NULL;
+    return ret;
+}
+
+
+static int
+virDomainObjListParseStatus(virDomainObjListLoadDataPtr data,
+                            virDomainObjListLoadJobPtr job)
+{
+    char *statusFile = NULL;
+    int ret = -1;
+
+    if ((statusFile = virDomainConfigFile(data->configDir, job->name)) == NULL)
+        goto cleanup;
+
+    if (!(job->obj = virDomainObjParseFile(statusFile, data->caps,
+                                           data->xmlopt,
+                                           VIR_DOMAIN_DEF_PARSE_STATUS |
+                                           VIR_DOMAIN_DEF_PARSE_ACTUAL_NET |
+                                           VIR_DOMAIN_DEF_PARSE_PCI_ORIG_STATES |
+                                           VIR_DOMAIN_DEF_PARSE_SKIP_OSTYPE_CHECKS |
+                                           VIR_DOMAIN_DEF_PARSE_SKIP_VALIDATE)))
+        goto cleanup;
+
+    ret = 0;
+
+ cleanup:
+    VIR_FREE(statusFile);
+    return ret;
+}
+
+
+/* Parsing does not touch the list, so any number of threads can
+ * run this on the same @opaque, each picking the next file. Errors
+ * are not logged as they happen, in whatever order the threads get
+ * to them, but saved to be reported in directory order. */
+static void
+virDomainObjListParseWorker(void *opaque)
+{
+    virDomainObjListLoadDataPtr data = opaque;
+    size_t i;
+    int rc;
+
+    virSetErrorLogQuiet(true);
+
+    while ((i = virAtomicIntAdd(&data->next, 1)) < data->njobs) {
+        virDomainObjListLoadJobPtr job = &data->jobs[i];
+
+        VIR_INFO("Loading config file '%s.xml'", job->name);
+        if (data->liveStatus)
+            rc = virDomainObjListParseStatus(data, job);
+        else
+            rc = virDomainObjListParseConfig(data, job);
+
+        if (rc < 0) {
+            job->err = virSaveLastError();
+            virResetLastError();
+        }
+    }
+
+    virSetErrorLogQuiet(false);
+}
+
+
+static void
+virDomainObjListParseAll(virDomainObjListLoadDataPtr data)
+{
+    virThread *threads = NULL;
+    size_t nthreads = 0;
+    size_t nworkers;
+    size_t i;
+    int ncpus;
+
+    if ((ncpus = virHostCPUGetCount()) < 1) {
+        virResetLastError();
+        ncpus = 1;
+    }
+
+    nworkers = MIN(data->njobs, MIN(ncpus, VIR_DOMAIN_OBJ_LIST_LOAD_MAX_WORKERS));
+
+    /* The calling thread is a worker too, so failing to start more
+     * of them only makes loading slower */
+    if (nworkers > 1 && VIR_ALLOC_N_QUIET(threads, nworkers - 1) == 0) {
+        for (nthreads = 0; nthreads < nworkers - 1; nthreads++) {
+            if (virThreadCreate(&threads[nthreads], true,
+                                virDomainObjListParseWorker, data) < 0) {
+                VIR_WARN("Unable to create domain config parsing thread");
+                break;
+            }
+        }
+    }
+
+    VIR_DEBUG("Parsing %zu domain configs in %zu threads",
+              data->njobs, nthreads + 1);
+
+    virDomainObjListParseWorker(data);
+
+    for (i = 0; i < nthreads; i++)
+        virThreadJoin(&threads[i]);
+    VIR_FREE(threads);
 }
 
 
 static virDomainObjPtr
-virDomainObjListLoadStatus(virDomainObjListPtr doms,
-                           const char *statusDir,
-                           const char *name,
-                           virCapsPtr caps,
+virDomainObjListLoadConfig(virDomainObjListPtr doms,
                            virDomainXMLOptionPtr xmlopt,
-                           virDomainLoadConfigNotify notify,
-                           void *opaque)
+                           virDomainObjListLoadJobPtr job,
+                           bool *newDom)
 {
-    char *statusFile = NULL;
-    virDomainObjPtr obj = NULL;
-    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    virDomainObjPtr dom;
+    virDomainDefPtr oldDef = NULL;
 
-    if ((statusFile = virDomainConfigFile(statusDir, name)) == NULL)
-        goto error;
+    if (!(dom = virDomainObjListAddLocked(doms, job->def, xmlopt, 0, &oldDef)))
+        return NULL;
+    job->def = NULL;
+
+    dom->autostart = job->autostart;
+    *newDom = oldDef == NULL;
+
+    virDomainDefFree(oldDef);
+    return dom;
+}
 
-    if (!(obj = virDomainObjParseFile(statusFile, caps, xmlopt,
-                                      VIR_DOMAIN_DEF_PARSE_STATUS |
-                                      VIR_DOMAIN_DEF_PARSE_ACTUAL_NET |
-                                      VIR_DOMAIN_DEF_PARSE_PCI_ORIG_STATES |
-                                      VIR_DOMAIN_DEF_PARSE_SKIP_OSTYPE_CHECKS |
-                                      VIR_DOMAIN_DEF_PARSE_SKIP_VALIDATE)))
-        goto error;
+
+static virDomainObjPtr
+virDomainObjListLoadStatus(virDomainObjListPtr doms,
+                           virDomainObjListLoadJobPtr job,
+                           bool *newDom)
+{
+    virDomainObjPtr obj = job->obj;
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
 
     virUUIDFormat(obj->def->uuid, uuidstr);
 
@@ -525,34 +648,34 @@ virDomainObjListLoadStatus(virDomainObjListPtr doms,
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("unexpected domain %s already exists"),
                        obj->def->name);
-        goto error;
+        return NULL;
     }
 
     if (virHashAddEntry(doms->objs, uuidstr, obj) < 0)
-        goto error;
+        return NULL;
 
     if (virHashAddEntry(doms->objsName, obj->def->name, obj) < 0) {
         virHashRemoveEntry(doms->objs, uuidstr);
-        goto error;
+        return NULL;
     }
 
     /* Since domain is in two hash tables, increment the
      * reference counter */
     virObjectRef(obj);
+    job->obj = NULL;
+    *newDom = true;
 
-    if (notify)
-        (*notify)(obj, 1, opaque);
-
-    VIR_FREE(statusFile);
     return obj;
-
- error:
-    virObjectUnref(obj);
-    VIR_FREE(statusFile);
-    return NULL;
 }
 
 
+/*
+ * Parsing the XML files is what takes the time, so it is spread over
+ * a few threads without holding the list lock. The results are then
+ * added to the list one by one, in the order of the file names, so
+ * which of two clashing domains wins and the order errors are logged
+ * in do not depend on thread scheduling.
+ */
 int
 virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
                                const char *configDir,
@@ -563,8 +686,14 @@ virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
                                virDomainLoadConfigNotify notify,
                                void *opaque)
 {
+    virDomainObjListLoadData data = {
+        configDir, autostartDir, liveStatus, caps, xmlopt, NULL, 0, 0,
+    };
+    char **names = NULL;
+    size_t nnames = 0;
     DIR *dir;
     struct dirent *entry;
+    size_t i;
     int ret = -1;
     int rc;
 
@@ -573,43 +702,83 @@ virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
     if ((rc = virDirOpenIfExists(&dir, configDir)) <= 0)
         return rc;
 
-    virObjectLock(doms);
-
-    while ((ret = virDirRead(dir, &entry, configDir)) > 0) {
-        virDomainObjPtr dom;
+    while ((rc = virDirRead(dir, &entry, configDir)) > 0) {
+        char *name = NULL;
 
         if (!virFileStripSuffix(entry->d_name, ".xml"))
             continue;
 
+        if (VIR_STRDUP(name, entry->d_name) < 0 ||
+            VIR_APPEND_ELEMENT(names, nnames, name) < 0) {
+            VIR_FREE(name);
+            goto cleanup;
+        }
+    }
+    VIR_DIR_CLOSE(dir);
+
+    if (rc < 0)
+        goto cleanup;
+
+    qsort(names, nnames, sizeof(*names), virStringSortCompare);
+
+    if (VIR_ALLOC_N(data.jobs, nnames) < 0)
+        goto cleanup;
+    data.njobs = nnames;
+    for (i = 0; i < nnames; i++)
+        data.jobs[i].name = names[i];
+
+    virDomainObjListParseAll(&data);
+
+    virObjectRWLockWrite(doms);
+
+    for (i = 0; i < data.njobs; i++) {
+        virDomainObjListLoadJobPtr job = &data.jobs[i];
+        virDomainObjPtr dom = NULL;
+        bool newDom = false;
+
         /* NB: ignoring errors, so one malformed config doesn't
-           kill the whole process */
-        VIR_INFO("Loading config file '%s.xml'", entry->d_name);
-        if (liveStatus)
-            dom = virDomainObjListLoadStatus(doms,
-                                             configDir,
-                                             entry->d_name,
-                                             caps,
-                                             xmlopt,
-                                             notify,
-                                             opaque);
-        else
-            dom = virDomainObjListLoadConfig(doms,
-                                             caps,
-                                             xmlopt,
-                                             configDir,
-                                             autostartDir,
-                                             entry->d_name,
-                                             notify,
-                                             opaque);
+           kill the whole process. The warning below is the only
+           report of each failure. */
+        if (!job->err) {
+            virSetErrorLogQuiet(true);
+            if (liveStatus)
+                dom = virDomainObjListLoadStatus(doms, job, &newDom);
+            else
+                dom = virDomainObjListLoadConfig(doms, xmlopt, job, &newDom);
+            virSetErrorLogQuiet(false);
+            if (!dom)
+                job->err = virSaveLastError();
+        }
+
         if (dom) {
+            if (notify)
+                (*notify)(dom, newDom, opaque);
             if (!liveStatus)
                 dom->persistent = 1;
             virObjectUnlock(dom);
+        } else {
+            if (job->err)
+                virSetError(job->err);
+            VIR_WARN("Failed to load config file '%s.xml': %s",
+                     job->name, virGetLastErrorMessage());
         }
     }
 
-    VIR_DIR_CLOSE(dir);
     virObjectUnlock(doms);
+    virResetLastError();
+    ret = 0;
+
+ cleanup:
+    VIR_DIR_CLOSE(dir);
+    if (data.jobs) {
+        for (i = 0; i < data.njobs; i++) {
+            virDomainDefFree(data.jobs[i].def);
+            virObjectUnref(data.jobs[i].obj);
+            virFreeError(data.jobs[i].err);
+        }
+        VIR_FREE(data.jobs);
+    }
+    virStringListFreeCount(names, nnames);
     return ret;
 }
 
@@ -653,7 +822,7 @@ virDomainObjListNumOfDomains(virDomainObjListPtr doms,
                              virConnectPtr conn)
 {
     struct virDomainObjListData data = { filter, conn, active, 0 };
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virHashForEach(doms->objs, virDomainObjListCount, &data);
     virObjectUnlock(doms);
     return data.count;
@@ -697,7 +866,7 @@ virDomainObjListGetActiveIDs(virDomainObjListPtr doms,
 {
     struct virDomainIDData data = { filter, conn,
                                     0, maxids, ids };
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virHashForEach(doms->objs, virDomainObjListCopyActiveIDs, &data);
     virObjectUnlock(doms);
     return data.numids;
@@ -751,7 +920,7 @@ virDomainObjListGetInactiveNames(virDomainObjListPtr doms,
     struct virDomainNameData data = { filter, conn,
                                       0, 0, maxnames, names };
     size_t i;
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virHashForEach(doms->objs, virDomainObjListCopyInactiveNames, &data);
     virObjectUnlock(doms);
     if (data.oom) {
@@ -792,7 +961,7 @@ virDomainObjListForEach(virDomainObjListPtr doms,
     struct virDomainListIterData data = {
         callback, opaque, 0,
     };
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virHashForEach(doms->objs, virDomainObjListHelper, &data);
     virObjectUnlock(doms);
     return data.ret;
@@ -925,7 +1094,7 @@ virDomainObjListCollect(virDomainObjListPtr domlist,
 {
     struct virDomainListData data = { NULL, 0 };
 
-    virObjectLock(domlist);
+    virObjectRWLockWrite(domlist);
     sa_assert(domlist->objs);
     if (VIR_ALLOC_N(data.vms, virHashSize(domlist->objs)) < 0) {
         virObjectUnlock(domlist);
@@ -962,7 +1131,7 @@ virDomainObjListConvert(virDomainObjListPtr domlist,
     *nvms = 0;
     *vms = NULL;
 
-    virObjectLock(domlist);
+    virObjectRWLockRead(domlist);
     for (i = 0; i < ndoms; i++) {
         virDomainPtr dom = doms[i];
 
@@ -0,0 +1,618 @@
+/*
+ * virdomainstatssampler.c: periodic sampling of domain statistics
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include "virdomainstatssampler.h"
+#include "domain_event.h"
+#include "datatypes.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virhash.h"
+#include "viridentity.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "virtime.h"
+#include "virtypedparam.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+VIR_LOG_INIT("conf.virdomainstatssampler");
+
+/*
+ * A thread per sampler collects the statistics every @interval
+ * seconds and queues an event carrying only the typed parameters
+ * which changed since its previous sample. Collecting may talk to
+ * the monitors of the domains, which is why it can't be done from a
+ * timer of the event loop.
+ *
+ * Removing a sampler only tells its thread to finish, as it may be
+ * done from the event loop while the thread waits for a monitor
+ * reply. The threads are instead accounted in the list, which
+ * virDomainStatsSamplerListStop waits to see drop to zero before the
+ * driver goes away.
+ */
+typedef struct _virDomainStatsSnapshot virDomainStatsSnapshot;
+typedef virDomainStatsSnapshot *virDomainStatsSnapshotPtr;
+struct _virDomainStatsSnapshot {
+    virTypedParameterPtr params;
+    int nparams;
+};
+
+typedef struct _virDomainStatsSampler virDomainStatsSampler;
+typedef virDomainStatsSampler *virDomainStatsSamplerPtr;
+struct _virDomainStatsSampler {
+    virObjectLockable parent;
+
+    virCond cond;
+    bool quit;
+
+    /* Immutable once the thread is started */
+    virDomainStatsSamplerListPtr list;
+    virConnectPtr conn;
+    virIdentityPtr identity;
+    unsigned int stats;
+    unsigned int interval;
+    unsigned int flags;
+    int callbackID;
+
+    /* Only accessed by the sampling thread. Maps the UUID of every
+     * domain to the statistics last reported for it */
+    virHashTablePtr last;
+};
+
+struct _virDomainStatsSamplerList {
+    virObjectLockable parent;
+
+    /* Immutable */
+    virObjectEventStatePtr state;
+    virDomainStatsSamplerCollectFunc collect;
+
+    /* Samplers indexed by their callback ID */
+    virHashTablePtr samplers;
+
+    /* Number of sampling threads still running, signalled on
+     * @threadCond whenever one finishes */
+    size_t nthreads;
+    virCond threadCond;
+    bool stopped;
+};
+
+static virClassPtr virDomainStatsSamplerClass;
+static virClassPtr virDomainStatsSamplerListClass;
+static void virDomainStatsSamplerDispose(void *obj);
+static void virDomainStatsSamplerListDispose(void *obj);
+
+static int
+virDomainStatsSamplerOnceInit(void)
+{
+    if (!(virDomainStatsSamplerClass =
+          virClassNew(virClassForObjectLockable(),
+                      "virDomainStatsSampler",
+                      sizeof(virDomainStatsSampler),
+                      virDomainStatsSamplerDispose)))
+        return -1;
+
+    if (!(virDomainStatsSamplerListClass =
+          virClassNew(virClassForObjectLockable(),
+                      "virDomainStatsSamplerList",
+                      sizeof(virDomainStatsSamplerList),
+                      virDomainStatsSamplerListDispose)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virDomainStatsSampler)
+
+
+static void
+virDomainStatsSnapshotFree(void *payload,
+                           const void *name ATTRIBUTE_UNUSED)
+{
+    virDomainStatsSnapshotPtr snapshot = payload;
+
+    if (!snapshot)
+        return;
+
+    virTypedParamsFree(snapshot->params, snapshot->nparams);
+    VIR_FREE(snapshot);
+}
+
+
+static void
+virDomainStatsSamplerDispose(void *obj)
+{
+    virDomainStatsSamplerPtr sampler = obj;
+
+    virHashFree(sampler->last);
+    virObjectUnref(sampler->identity);
+    virObjectUnref(sampler->conn);
+    virCondDestroy(&sampler->cond);
+}
+
+
+/* Data free callback of the samplers table: tells the sampling
+ * thread to finish, which drops the last reference */
+static void
+virDomainStatsSamplerStop(void *payload,
+                          const void *name ATTRIBUTE_UNUSED)
+{
+    virDomainStatsSamplerPtr sampler = payload;
+
+    if (!sampler)
+        return;
+
+    virObjectLock(sampler);
+    sampler->quit = true;
+    virCondSignal(&sampler->cond);
+    virObjectUnlock(sampler);
+    virObjectUnref(sampler);
+}
+
+
+static void
+virDomainStatsSamplerListDispose(void *obj)
+{
+    virDomainStatsSamplerListPtr list = obj;
+
+    virHashFree(list->samplers);
+    virObjectUnref(list->state);
+    virCondDestroy(&list->threadCond);
+}
+
+
+static bool
+virDomainStatsParamEqual(virTypedParameterPtr a,
+                         virTypedParameterPtr b)
+{
+    if (a->type != b->type || STRNEQ(a->field, b->field))
+        return false;
+
+    switch ((virTypedParameterType) a->type) {
+    case VIR_TYPED_PARAM_INT:
+        return a->value.i == b->value.i;
+    case VIR_TYPED_PARAM_UINT:
+        return a->value.ui == b->value.ui;
+    case VIR_TYPED_PARAM_LLONG:
+        return a->value.l == b->value.l;
+    case VIR_TYPED_PARAM_ULLONG:
+        return a->value.ul == b->value.ul;
+    case VIR_TYPED_PARAM_DOUBLE:
+        return a->value.d == b->value.d;
+    case VIR_TYPED_PARAM_BOOLEAN:
+        return a->value.b == b->value.b;
+    case VIR_TYPED_PARAM_STRING:
+        return STREQ_NULLABLE(a->value.s, b->value.s);
+    case VIR_TYPED_PARAM_LAST:
+        break;
+    }
+
+    return false;
+}
+
+
+/* Build in @delta a record of the parameters of @record which are
+ * missing from or different in @prev. Parameters are generated in
+ * the same order from one sample to the next, so the one at the same
+ * index is tried before searching @prev. */
+static int
+virDomainStatsRecordDiff(virDomainStatsRecordPtr record,
+                         virDomainStatsSnapshotPtr prev,
+                         virDomainStatsRecordPtr *delta)
+{
+    virDomainStatsRecordPtr tmp = NULL;
+    size_t i;
+    int ret = -1;
+
+    *delta = NULL;
+
+    if (VIR_ALLOC(tmp) < 0 ||
+        VIR_ALLOC_N(tmp->params, record->nparams) < 0)
+        goto cleanup;
+
+    for (i = 0; i < record->nparams; i++) {
+        virTypedParameterPtr param = &record->params[i];
+        virTypedParameterPtr old = NULL;
+        virTypedParameterPtr dst;
+
+        if (prev) {
+            if (i < prev->nparams &&
+                STREQ(prev->params[i].field, param->field))
+                old = &prev->params[i];
+            else
+                old = virTypedParamsGet(prev->params, prev->nparams,
+                                        param->field);
+        }
+
+        if (old && virDomainStatsParamEqual(old, param))
+            continue;
+
+        dst = &tmp->params[tmp->nparams++];
+        *dst = *param;
+        if (param->type == VIR_TYPED_PARAM_STRING) {
+            dst->value.s = NULL;
+            if (VIR_STRDUP(dst->value.s, param->value.s) < 0)
+                goto cleanup;
+        }
+    }
+
+    if (tmp->nparams) {
+        tmp->dom = virObjectRef(record->dom);
+        *delta = tmp;
+        tmp = NULL;
+    }
+
+    ret = 0;
+
+ cleanup:
+    if (tmp) {
+        virTypedParamsFree(tmp->params, tmp->nparams);
+        VIR_FREE(tmp);
+    }
+    return ret;
+}
+
+
+/* Take a sample and queue an event for whatever changed */
+static void
+virDomainStatsSamplerSample(virDomainStatsSamplerPtr sampler)
+{
+    virDomainStatsRecordPtr *records = NULL;
+    virDomainStatsRecordPtr *deltas = NULL;
+    virHashTablePtr next = NULL;
+    virObjectEventPtr event;
+    size_t ndeltas = 0;
+    int nrecords;
+    size_t i;
+
+    if ((nrecords = sampler->list->collect(sampler->conn, sampler->stats,
+                                           &records, sampler->flags)) < 0)
+        goto error;
+
+    if (VIR_ALLOC_N(deltas, nrecords + 1) < 0 ||
+        !(next = virHashCreate(nrecords, virDomainStatsSnapshotFree)))
+        goto error;
+
+    for (i = 0; i < nrecords; i++) {
+        virDomainStatsRecordPtr record = records[i];
+        virDomainStatsSnapshotPtr snapshot = NULL;
+        char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+        virUUIDFormat(record->dom->uuid, uuidstr);
+
+        if (virDomainStatsRecordDiff(record,
+                                     virHashLookup(sampler->last, uuidstr),
+                                     &deltas[ndeltas]) < 0)
+            goto error;
+        if (deltas[ndeltas])
+            ndeltas++;
+
+        /* The whole sample is what the next one gets compared to */
+        if (VIR_ALLOC(snapshot) < 0)
+            goto error;
+        snapshot->params = record->params;
+        snapshot->nparams = record->nparams;
+        record->params = NULL;
+        record->nparams = 0;
+
+        if (virHashAddEntry(next, uuidstr, snapshot) < 0) {
+            virDomainStatsSnapshotFree(snapshot, NULL);
+            goto error;
+        }
+    }
+
+    /* Domains which disappeared are forgotten along with the
+     * previous sample */
+    virHashFree(sampler->last);
+    sampler->last = next;
+    next = NULL;
+
+    if (ndeltas) {
+        if (!(event = virDomainStatsEventNew(deltas, ndeltas))) {
+            deltas = NULL;
+            goto error;
+        }
+        deltas = NULL;
+
+        virObjectEventStateQueueRemote(sampler->list->state, event,
+                                       sampler->callbackID);
+    }
+
+ cleanup:
+    virHashFree(next);
+    virDomainStatsRecordListFree(deltas);
+    virDomainStatsRecordListFree(records);
+    return;
+
+ error:
+    VIR_WARN("Failed to sample statistics for callback %d: %s",
+             sampler->callbackID, virGetLastErrorMessage());
+    virResetLastError();
+    goto cleanup;
+}
+
+
+static void
+virDomainStatsSamplerThread(void *opaque)
+{
+    virDomainStatsSamplerPtr sampler = opaque;
+    virDomainStatsSamplerListPtr list = sampler->list;
+    unsigned long long deadline;
+
+    /* Statistics are filtered by what the subscriber may read */
+    if (virIdentitySetCurrent(sampler->identity) < 0)
+        goto cleanup;
+
+    virObjectLock(sampler);
+    while (!sampler->quit) {
+        virObjectUnlock(sampler);
+        virDomainStatsSamplerSample(sampler);
+        virObjectLock(sampler);
+
+        if (virTimeMillisNowRaw(&deadline) < 0)
+            break;
+        deadline += sampler->interval * 1000ull;
+
+        while (!sampler->quit) {
+            if (virCondWaitUntil(&sampler->cond, &sampler->parent.lock,
+                                 deadline) < 0) {
+                if (errno == ETIMEDOUT)
+                    break;
+                VIR_WARN("Failed to wait for statistics callback %d",
+                         sampler->callbackID);
+                sampler->quit = true;
+            }
+        }
+    }
+    virObjectUnlock(sampler);
+
+    ignore_value(virIdentitySetCurrent(NULL));
+
+ cleanup:
+    /* Dropping the sampler may close the connection, which must
+     * happen before the driver is allowed to go away */
+    virObjectUnref(sampler);
+
+    virObjectLock(list);
+    list->nthreads--;
+    virCondBroadcast(&list->threadCond);
+    virObjectUnlock(list);
+    virObjectUnref(list);
+}
+
+
+/**
+ * virDomainStatsSamplerListNew:
+ * @state: event state the statistics events are queued to
+ * @collect: callback collecting the statistics of the domains
+ *
+ * Returns a new, empty, list of samplers or NULL on error.
+ */
+virDomainStatsSamplerListPtr
+virDomainStatsSamplerListNew(virObjectEventStatePtr state,
+                             virDomainStatsSamplerCollectFunc collect)
+{
+    virDomainStatsSamplerListPtr list;
+
+    if (virDomainStatsSamplerInitialize() < 0)
+        return NULL;
+
+    if (!(list = virObjectLockableNew(virDomainStatsSamplerListClass)))
+        return NULL;
+
+    if (virCondInit(&list->threadCond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize condition"));
+        virObjectUnref(list);
+        return NULL;
+    }
+
+    if (!(list->samplers = virHashCreate(16, virDomainStatsSamplerStop))) {
+        virObjectUnref(list);
+        return NULL;
+    }
+
+    list->state = virObjectRef(state);
+    list->collect = collect;
+
+    return list;
+}
+
+
+/**
+ * virDomainStatsSamplerListAdd:
+ * @samplers: list of samplers
+ * @conn: connection the statistics are collected for
+ * @stats: statistics groups, as understood by @collect
+ * @interval: seconds between two samples
+ * @cb: callback invoked with the changed statistics
+ * @opaque: data for @cb
+ * @freecb: callback freeing @opaque
+ * @flags: filtering flags, as understood by @collect
+ *
+ * Register @cb as a statistics event callback and start sampling on
+ * behalf of the identity of the calling thread.
+ *
+ * Returns the callback ID or -1 on error.
+ */
+int
+virDomainStatsSamplerListAdd(virDomainStatsSamplerListPtr samplers,
+                             virConnectPtr conn,
+                             unsigned int stats,
+                             unsigned int interval,
+                             virConnectDomainStatsEventCallback cb,
+                             void *opaque,
+                             virFreeCallback freecb,
+                             unsigned int flags)
+{
+    virDomainStatsSamplerPtr sampler = NULL;
+    char *key = NULL;
+    virThread thread;
+    int callbackID = -1;
+    int ret = -1;
+
+    if (!(sampler = virObjectLockableNew(virDomainStatsSamplerClass)))
+        return -1;
+
+    if (virCondInit(&sampler->cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize condition"));
+        goto cleanup;
+    }
+
+    if (!(sampler->last = virHashCreate(0, virDomainStatsSnapshotFree)))
+        goto cleanup;
+
+    sampler->list = samplers;
+    sampler->identity = virIdentityGetCurrent();
+    sampler->conn = virObjectRef(conn);
+    sampler->stats = stats;
+    sampler->interval = interval;
+    sampler->flags = flags;
+
+    virObjectLock(samplers);
+
+    if (samplers->stopped) {
+        virReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                       _("statistics sampling is shutting down"));
+        goto unlock;
+    }
+
+    if (virDomainStatsEventStateRegisterID(conn, samplers->state,
+                                           cb, opaque, freecb,
+                                           &callbackID) < 0)
+        goto unlock;
+
+    virObjectEventStateSetRemote(conn, samplers->state,
+                                 callbackID, callbackID);
+    sampler->callbackID = callbackID;
+
+    if (virAsprintf(&key, "%d", callbackID) < 0)
+        goto error;
+
+    if (virHashAddEntry(samplers->samplers, key, sampler) < 0)
+        goto error;
+
+    /* From now on the sampler is stopped by removing it. The thread
+     * owns another reference to both the sampler and the list */
+    virObjectRef(sampler);
+    virObjectRef(samplers);
+    if (virThreadCreate(&thread, false,
+                        virDomainStatsSamplerThread, sampler) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create statistics thread"));
+        virObjectUnref(samplers);
+        virObjectUnref(sampler);
+        virHashRemoveEntry(samplers->samplers, key);
+        sampler = NULL;
+        goto error;
+    }
+    samplers->nthreads++;
+    sampler = NULL;
+
+    ret = callbackID;
+
+ unlock:
+    virObjectUnlock(samplers);
+ cleanup:
+    VIR_FREE(key);
+    virObjectUnref(sampler);
+    return ret;
+
+ error:
+    virObjectEventStateDeregisterID(conn, samplers->state, callbackID);
+    goto unlock;
+}
+
+
+/**
+ * virDomainStatsSamplerListRemove:
+ * @samplers: list of samplers
+ * @conn: connection the sampler was added for
+ * @callbackID: ID returned by virDomainStatsSamplerListAdd
+ *
+ * Deregister the callback and tell its sampling thread to finish,
+ * without waiting for it.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virDomainStatsSamplerListRemove(virDomainStatsSamplerListPtr samplers,
+                                virConnectPtr conn,
+                                int callbackID)
+{
+    char *key = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&key, "%d", callbackID) < 0)
+        return -1;
+
+    virObjectLock(samplers);
+
+    if (!virHashLookup(samplers->samplers, key)) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("no statistics callback %d"), callbackID);
+        goto cleanup;
+    }
+
+    /* Fails if the callback belongs to another connection */
+    if (virObjectEventStateDeregisterID(conn, samplers->state,
+                                        callbackID) < 0)
+        goto cleanup;
+
+    virHashRemoveEntry(samplers->samplers, key);
+    ret = 0;
+
+ cleanup:
+    virObjectUnlock(samplers);
+    VIR_FREE(key);
+    return ret;
+}
+
+
+/**
+ * virDomainStatsSamplerListStop:
+ * @samplers: list of samplers
+ *
+ * Tell every sampling thread to finish and wait until they all
+ * have, so that nothing collects statistics anymore once the driver
+ * is freed. No sampler can be added afterwards. Must not be called
+ * from the event loop, which a collecting thread may be waiting on.
+ */
+void
+virDomainStatsSamplerListStop(virDomainStatsSamplerListPtr samplers)
+{
+    if (!samplers)
+        return;
+
+    virObjectLock(samplers);
+    samplers->stopped = true;
+    virHashRemoveAll(samplers->samplers);
+
+    while (samplers->nthreads) {
+        if (virCondWait(&samplers->threadCond, &samplers->parent.lock) < 0) {
+            VIR_WARN("Failed to wait for %zu statistics threads",
+                     samplers->nthreads);
+            break;
+        }
+    }
+    virObjectUnlock(samplers);
+}
@@ -0,0 +1,56 @@
+/*
+ * virdomainstatssampler.h: periodic sampling of domain statistics
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VIR_DOMAIN_STATS_SAMPLER_H__
+# define __VIR_DOMAIN_STATS_SAMPLER_H__
+
+# include "internal.h"
+# include "object_event.h"
+
+typedef struct _virDomainStatsSamplerList virDomainStatsSamplerList;
+typedef virDomainStatsSamplerList *virDomainStatsSamplerListPtr;
+
+/* Collect the statistics of all the domains @conn may see, as
+ * virConnectGetAllDomainStats would */
+typedef int (*virDomainStatsSamplerCollectFunc)(virConnectPtr conn,
+                                                unsigned int stats,
+                                                virDomainStatsRecordPtr **records,
+                                                unsigned int flags);
+
+virDomainStatsSamplerListPtr
+virDomainStatsSamplerListNew(virObjectEventStatePtr state,
+                             virDomainStatsSamplerCollectFunc collect);
+
+int virDomainStatsSamplerListAdd(virDomainStatsSamplerListPtr samplers,
+                                 virConnectPtr conn,
+                                 unsigned int stats,
+                                 unsigned int interval,
+                                 virConnectDomainStatsEventCallback cb,
+                                 void *opaque,
+                                 virFreeCallback freecb,
+                                 unsigned int flags)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(5);
+
+int virDomainStatsSamplerListRemove(virDomainStatsSamplerListPtr samplers,
+                                    virConnectPtr conn,
+                                    int callbackID)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+void virDomainStatsSamplerListStop(virDomainStatsSamplerListPtr samplers);
+
+#endif /* __VIR_DOMAIN_STATS_SAMPLER_H__ */
@@ -1208,6 +1208,19 @@ typedef int
                                   virDomainStatsRecordPtr **retStats,
                                   unsigned int flags);
 
+typedef int
+(*virDrvConnectDomainStatsEventRegister)(virConnectPtr conn,
+                                         unsigned int stats,
+                                         unsigned int interval,
+                                         virConnectDomainStatsEventCallback cb,
+                                         void *opaque,
+                                         virFreeCallback freecb,
+                                         unsigned int flags);
+
+typedef int
+(*virDrvConnectDomainStatsEventDeregister)(virConnectPtr conn,
+                                           int callbackID);
+
 typedef int
 (*virDrvNodeAllocPages)(virConnectPtr conn,
                         unsigned int npages,
@@ -1489,6 +1502,8 @@ struct _virHypervisorDriver {
     virDrvDomainMigrateStartPostCopy domainMigrateStartPostCopy;
     virDrvDomainGetGuestVcpus domainGetGuestVcpus;
     virDrvDomainSetGuestVcpus domainSetGuestVcpus;
+    virDrvConnectDomainStatsEventRegister connectDomainStatsEventRegister;
+    virDrvConnectDomainStatsEventDeregister connectDomainStatsEventDeregister;
 };
 
 
@@ -57,6 +57,14 @@ struct virFDStreamData {
     unsigned long long offset;
     unsigned long long length;
 
+    /* The iohelper frames the file as data and hole segments,
+     * see virFileSegmentHeader */
+    bool sparse;
+    virFileSegmentHeader hdr;   /* segment header being read */
+    size_t hdrGot;              /* how much of @hdr was read so far */
+    int segType;                /* virFileSegmentType of current segment */
+    unsigned long long segLeft; /* bytes left in current segment */
+
     int watch;
     int events;         /* events the stream callback is subscribed for */
     bool cbRemoved;
@@ -376,6 +384,46 @@ virFDStreamAbort(virStreamPtr st)
     return virFDStreamCloseInt(st, true);
 }
 
+/* Write a segment header to the iohelper. The header is smaller than
+ * PIPE_BUF so it is either written whole or not at all. */
+static int
+virFDStreamWriteSegmentHeader(struct virFDStreamData *fdst,
+                              int type,
+                              unsigned long long length)
+{
+    virFileSegmentHeader hdr = { 0 };
+    int ret;
+
+    hdr.type = type;
+    hdr.length = length;
+
+ retry:
+    ret = write(fdst->fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        VIR_WARNINGS_NO_WLOGICALOP_EQUAL_EXPR
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        VIR_WARNINGS_RESET
+            return -2;
+        } else if (errno == EINTR) {
+            goto retry;
+        }
+        virReportSystemError(errno, "%s",
+                             _("cannot write to stream"));
+        return -1;
+    }
+
+    if (ret != sizeof(hdr)) {
+        virReportSystemError(EIO, "%s",
+                             _("short write of segment header to stream"));
+        return -1;
+    }
+
+    fdst->segType = type;
+    fdst->segLeft = length;
+    return 0;
+}
+
+
 static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
 {
     struct virFDStreamData *fdst = st->privateData;
@@ -407,6 +455,20 @@ static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
             nbytes = fdst->length - fdst->offset;
     }
 
+    if (fdst->sparse) {
+        /* Announce a new data segment unless a previous write
+         * was interrupted in the middle of one */
+        if (fdst->segLeft == 0 &&
+            (ret = virFDStreamWriteSegmentHeader(fdst, VIR_FILE_SEGMENT_DATA,
+                                                 nbytes)) < 0) {
+            virMutexUnlock(&fdst->lock);
+            return ret;
+        }
+
+        if (fdst->segLeft < nbytes)
+            nbytes = fdst->segLeft;
+    }
+
  retry:
     ret = write(fdst->fd, bytes, nbytes);
     if (ret < 0) {
@@ -421,8 +483,11 @@ static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
             virReportSystemError(errno, "%s",
                                  _("cannot write to stream"));
         }
-    } else if (fdst->length) {
-        fdst->offset += ret;
+    } else {
+        if (fdst->length)
+            fdst->offset += ret;
+        if (fdst->sparse)
+            fdst->segLeft -= ret;
     }
 
     virMutexUnlock(&fdst->lock);
@@ -430,11 +495,123 @@ static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
 }
 
 
-static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
+static int
+virFDStreamSendHole(virStreamPtr st,
+                    long long length,
+                    unsigned int flags)
+{
+    struct virFDStreamData *fdst = st->privateData;
+    int ret = -1;
+
+    virCheckFlags(0, -1);
+
+    if (!fdst) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "%s", _("stream is not open"));
+        return -1;
+    }
+
+    virMutexLock(&fdst->lock);
+
+    if (!fdst->sparse) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("stream does not support holes"));
+        goto cleanup;
+    }
+
+    if (fdst->segLeft) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("cannot send hole in the middle of data"));
+        goto cleanup;
+    }
+
+    if (fdst->length) {
+        if (length > fdst->length - fdst->offset) {
+            virReportSystemError(ENOSPC, "%s",
+                                 _("cannot write to stream"));
+            goto cleanup;
+        }
+    }
+
+    if ((ret = virFDStreamWriteSegmentHeader(fdst, VIR_FILE_SEGMENT_HOLE,
+                                             length)) < 0)
+        goto cleanup;
+
+    /* Holes carry no payload */
+    fdst->segLeft = 0;
+    if (fdst->length)
+        fdst->offset += length;
+
+ cleanup:
+    virMutexUnlock(&fdst->lock);
+    return ret;
+}
+
+
+/* Make sure a segment header was read from the iohelper.
+ * Returns 1 if a segment is available, 0 on EOF, -2 if the
+ * header is not complete yet and -1 on error. */
+static int
+virFDStreamReadSegmentHeader(struct virFDStreamData *fdst)
+{
+    char *hdr = (char *) &fdst->hdr;
+    ssize_t got;
+
+    while (fdst->segLeft == 0) {
+        got = read(fdst->fd, hdr + fdst->hdrGot,
+                   sizeof(fdst->hdr) - fdst->hdrGot);
+        if (got < 0) {
+            VIR_WARNINGS_NO_WLOGICALOP_EQUAL_EXPR
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            VIR_WARNINGS_RESET
+                return -2;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            virReportSystemError(errno, "%s",
+                                 _("cannot read from stream"));
+            return -1;
+        }
+
+        if (got == 0) {
+            if (fdst->hdrGot == 0)
+                return 0;
+            virReportSystemError(EIO, "%s",
+                                 _("truncated segment header in stream"));
+            return -1;
+        }
+
+        fdst->hdrGot += got;
+        if (fdst->hdrGot < sizeof(fdst->hdr))
+            continue;
+
+        fdst->hdrGot = 0;
+        if (fdst->hdr.type != VIR_FILE_SEGMENT_DATA &&
+            fdst->hdr.type != VIR_FILE_SEGMENT_HOLE) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unknown segment type %u in stream"),
+                           fdst->hdr.type);
+            return -1;
+        }
+        fdst->segType = fdst->hdr.type;
+        fdst->segLeft = fdst->hdr.length;
+    }
+
+    return 1;
+}
+
+
+static int
+virFDStreamReadFlags(virStreamPtr st,
+                     char *bytes,
+                     size_t nbytes,
+                     unsigned int flags)
 {
     struct virFDStreamData *fdst = st->privateData;
     int ret;
 
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
     if (nbytes > INT_MAX) {
         virReportSystemError(ERANGE, "%s",
                              _("Too many bytes to read from stream"));
@@ -459,6 +636,28 @@ static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
             nbytes = fdst->length - fdst->offset;
     }
 
+    if (fdst->sparse) {
+        if ((ret = virFDStreamReadSegmentHeader(fdst)) <= 0) {
+            virMutexUnlock(&fdst->lock);
+            return ret;
+        }
+
+        if (fdst->segLeft < nbytes)
+            nbytes = fdst->segLeft;
+
+        if (fdst->segType == VIR_FILE_SEGMENT_HOLE) {
+            if (flags & VIR_STREAM_RECV_STOP_AT_HOLE) {
+                virMutexUnlock(&fdst->lock);
+                return -3;
+            }
+
+            /* Caller is not interested in holes, hand out zeroes */
+            memset(bytes, 0, nbytes);
+            ret = nbytes;
+            goto done;
+        }
+    }
+
  retry:
     ret = read(fdst->fd, bytes, nbytes);
     if (ret < 0) {
@@ -473,10 +672,65 @@ static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
             virReportSystemError(errno, "%s",
                                  _("cannot read from stream"));
         }
-    } else if (fdst->length) {
+        virMutexUnlock(&fdst->lock);
+        return ret;
+    }
+
+ done:
+    if (fdst->length)
         fdst->offset += ret;
+    if (fdst->sparse)
+        fdst->segLeft -= ret;
+
+    virMutexUnlock(&fdst->lock);
+    return ret;
+}
+
+
+static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
+{
+    return virFDStreamReadFlags(st, bytes, nbytes, 0);
+}
+
+
+static int
+virFDStreamRecvHole(virStreamPtr st,
+                    long long *length,
+                    unsigned int flags)
+{
+    struct virFDStreamData *fdst = st->privateData;
+    int ret = -1;
+
+    virCheckFlags(0, -1);
+
+    if (!fdst) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "%s", _("stream is not open"));
+        return -1;
+    }
+
+    virMutexLock(&fdst->lock);
+
+    *length = 0;
+    if (fdst->sparse &&
+        (!fdst->length || fdst->offset < fdst->length)) {
+        if ((ret = virFDStreamReadSegmentHeader(fdst)) < 0)
+            goto cleanup;
+
+        if (ret > 0 && fdst->segType == VIR_FILE_SEGMENT_HOLE) {
+            *length = fdst->segLeft;
+            /* Like data, holes end where the stream is told to */
+            if (fdst->length) {
+                if (*length > fdst->length - fdst->offset)
+                    *length = fdst->length - fdst->offset;
+                fdst->offset += *length;
+            }
+            fdst->segLeft -= *length;
+        }
     }
+    ret = 0;
 
+ cleanup:
     virMutexUnlock(&fdst->lock);
     return ret;
 }
@@ -485,6 +739,9 @@ static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
 static virStreamDriver virFDStreamDrv = {
     .streamSend = virFDStreamWrite,
     .streamRecv = virFDStreamRead,
+    .streamRecvFlags = virFDStreamReadFlags,
+    .streamSendHole = virFDStreamSendHole,
+    .streamRecvHole = virFDStreamRecvHole,
     .streamFinish = virFDStreamClose,
     .streamAbort = virFDStreamAbort,
     .streamEventAddCallback = virFDStreamAddCallback,
@@ -496,12 +753,13 @@ static int virFDStreamOpenInternal(virStreamPtr st,
                                    int fd,
                                    virCommandPtr cmd,
                                    int errfd,
-                                   unsigned long long length)
+                                   unsigned long long length,
+                                   bool sparse)
 {
     struct virFDStreamData *fdst;
 
-    VIR_DEBUG("st=%p fd=%d cmd=%p errfd=%d length=%llu",
-              st, fd, cmd, errfd, length);
+    VIR_DEBUG("st=%p fd=%d cmd=%p errfd=%d length=%llu sparse=%d",
+              st, fd, cmd, errfd, length, sparse);
 
     if ((st->flags & VIR_STREAM_NONBLOCK) &&
         virSetNonBlock(fd) < 0) {
@@ -516,6 +774,7 @@ static int virFDStreamOpenInternal(virStreamPtr st,
     fdst->cmd = cmd;
     fdst->errfd = errfd;
     fdst->length = length;
+    fdst->sparse = sparse;
     if (virMutexInit(&fdst->lock) < 0) {
         VIR_FREE(fdst);
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
@@ -533,7 +792,7 @@ static int virFDStreamOpenInternal(virStreamPtr st,
 int virFDStreamOpen(virStreamPtr st,
                     int fd)
 {
-    return virFDStreamOpenInternal(st, fd, NULL, -1, 0);
+    return virFDStreamOpenInternal(st, fd, NULL, -1, 0, false);
 }
 
 
@@ -579,7 +838,7 @@ int virFDStreamConnectUNIX(virStreamPtr st,
         goto error;
     }
 
-    if (virFDStreamOpenInternal(st, fd, NULL, -1, 0) < 0)
+    if (virFDStreamOpenInternal(st, fd, NULL, -1, 0, false) < 0)
         goto error;
     return 0;
 
@@ -605,7 +864,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
                             unsigned long long length,
                             int oflags,
                             int mode,
-                            bool forceIOHelper)
+                            bool forceIOHelper,
+                            bool sparse)
 {
     int fd = -1;
     int childfd = -1;
@@ -614,8 +874,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
     int errfd = -1;
     char *iohelper_path = NULL;
 
-    VIR_DEBUG("st=%p path=%s oflags=%x offset=%llu length=%llu mode=%o",
-              st, path, oflags, offset, length, mode);
+    VIR_DEBUG("st=%p path=%s oflags=%x offset=%llu length=%llu mode=%o "
+              "sparse=%d", st, path, oflags, offset, length, mode, sparse);
 
     oflags |= O_NOCTTY | O_BINARY;
 
@@ -649,10 +909,13 @@ virFDStreamOpenFileInternal(virStreamPtr st,
      * non-blocking I/O on block devs/regular files. To
      * support those we need to fork a helper process to do
      * the I/O so we just have a fifo. Or use AIO :-(
+     * Sparse streams always need the helper as it is the one
+     * looking for holes in the file.
      */
-    if ((st->flags & VIR_STREAM_NONBLOCK) &&
-        ((!S_ISCHR(sb.st_mode) &&
-          !S_ISFIFO(sb.st_mode)) || forceIOHelper)) {
+    if (sparse ||
+        ((st->flags & VIR_STREAM_NONBLOCK) &&
+         ((!S_ISCHR(sb.st_mode) &&
+           !S_ISFIFO(sb.st_mode)) || forceIOHelper))) {
         int fds[2] = { -1, -1 };
 
         if ((oflags & O_ACCMODE) == O_RDWR) {
@@ -683,6 +946,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
         virCommandPassFD(cmd, fd,
                          VIR_COMMAND_PASS_FD_CLOSE_PARENT);
         virCommandAddArgFormat(cmd, "%d", fd);
+        if (sparse)
+            virCommandAddArg(cmd, "1");
 
         if ((oflags & O_ACCMODE) == O_RDONLY) {
             childfd = fds[1];
@@ -701,7 +966,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
         VIR_FORCE_CLOSE(childfd);
     }
 
-    if (virFDStreamOpenInternal(st, fd, cmd, errfd, length) < 0)
+    if (virFDStreamOpenInternal(st, fd, cmd, errfd, length,
+                                cmd && sparse) < 0)
         goto error;
 
     return 0;
@@ -731,7 +997,7 @@ int virFDStreamOpenFile(virStreamPtr st,
     }
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
-                                       oflags, 0, false);
+                                       oflags, 0, false, false);
 }
 
 int virFDStreamCreateFile(virStreamPtr st,
@@ -744,7 +1010,7 @@ int virFDStreamCreateFile(virStreamPtr st,
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
                                        oflags | O_CREAT, mode,
-                                       false);
+                                       false, false);
 }
 
 #ifdef HAVE_CFMAKERAW
@@ -760,7 +1026,7 @@ int virFDStreamOpenPTY(virStreamPtr st,
     if (virFDStreamOpenFileInternal(st, path,
                                     offset, length,
                                     oflags | O_CREAT, 0,
-                                    false) < 0)
+                                    false, false) < 0)
         return -1;
 
     fdst = st->privateData;
@@ -797,7 +1063,7 @@ int virFDStreamOpenPTY(virStreamPtr st,
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
                                        oflags | O_CREAT, 0,
-                                       false);
+                                       false, false);
 }
 #endif /* !HAVE_CFMAKERAW */
 
@@ -805,11 +1071,12 @@ int virFDStreamOpenBlockDevice(virStreamPtr st,
                                const char *path,
                                unsigned long long offset,
                                unsigned long long length,
-                               int oflags)
+                               int oflags,
+                               bool sparse)
 {
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
-                                       oflags, 0, true);
+                                       oflags, 0, true, sparse);
 }
 
 int virFDStreamSetInternalCloseCb(virStreamPtr st,
@@ -1241,3 +1241,91 @@ virAdmConnectSetLoggingFilters(virAdmConnectPtr conn,
     virDispatchError(NULL);
     return -1;
 }
+
+/**
+ * virAdmConnectGetEventLoopStats:
+ * @conn: pointer to an active admin connection
+ * @params: pointer to event loop statistics object
+ *          (return value, allocated automatically)
+ * @nparams: pointer to number of parameters returned in @params
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * Retrieve statistics of the event loops run by the daemon, i.e. the main
+ * loop and the additional threads configured by the event_loop_threads
+ * option, if any. For each of them these include:
+ *  - the number of iterations run so far,
+ *  - the time spent dispatching events,
+ *  - the number of file handles currently watched.
+ *
+ * See VIR_EVENT_LOOP_COUNT and the VIR_EVENT_LOOP_SUFFIX_* macros for the
+ * names of the returned fields.
+ *
+ * Returns 0 on success, allocating @params to size returned in @nparams, or
+ * -1 in case of an error. Caller is responsible for deallocating @params.
+ */
+int
+virAdmConnectGetEventLoopStats(virAdmConnectPtr conn,
+                               virTypedParameterPtr *params,
+                               int *nparams,
+                               unsigned int flags)
+{
+    int ret = -1;
+
+    VIR_DEBUG("conn=%p, params=%p, nparams=%p, flags=%x",
+              conn, params, nparams, flags);
+
+    virResetLastError();
+    virCheckAdmConnectReturn(conn, -1);
+    virCheckNonNullArgGoto(params, error);
+    virCheckNonNullArgGoto(nparams, error);
+
+    if ((ret = remoteAdminConnectGetEventLoopStats(conn, params, nparams,
+                                                   flags)) < 0)
+        goto error;
+
+    return ret;
+ error:
+    virDispatchError(NULL);
+    return -1;
+}
+
+/**
+ * virAdmConnectGetLoggingRecords:
+ * @conn: pointer to an active admin connection
+ * @records: pointer to a variable to store a string containing the recorded
+ *           messages (allocated automatically)
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * Retrieves the messages kept by the daemon's flight recorder, i.e. the
+ * latest messages of any priority logged by the sources listed in the
+ * log_recorder_filters setting of the daemon's configuration file, whatever
+ * the logging filters currently installed. Messages are formatted one per
+ * line, oldest first. Should they not all fit in a single reply, the oldest
+ * ones are left out.
+ *
+ * Caller is responsible for freeing @records.
+ *
+ * Returns the count of messages in @records, or -1 in case of an error.
+ */
+int
+virAdmConnectGetLoggingRecords(virAdmConnectPtr conn,
+                               char **records,
+                               unsigned int flags)
+{
+    int ret = -1;
+
+    VIR_DEBUG("conn=%p, records=%p, flags=%x", conn, records, flags);
+
+    virResetLastError();
+    virCheckAdmConnectReturn(conn, -1);
+    virCheckNonNullArgGoto(records, error);
+
+    if ((ret = remoteAdminConnectGetLoggingRecords(conn, records,
+                                                   flags)) < 0)
+        goto error;
+
+    return ret;
+ error:
+    virDispatchError(NULL);
+    return -1;
+}
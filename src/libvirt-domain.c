@@ -11445,6 +11445,115 @@ virDomainStatsRecordListFree(virDomainStatsRecordPtr *stats)
 }
 
 
+/**
+ * virConnectDomainStatsEventRegister:
+ * @conn: pointer to the hypervisor connection
+ * @stats: stats to report, binary-OR of virDomainStatsTypes
+ * @interval: period between two samples, in seconds
+ * @cb: callback to the function handling the statistics
+ * @opaque: opaque data to pass on to the callback
+ * @freecb: optional function to deallocate opaque when not used anymore
+ * @flags: extra flags; binary-OR of virConnectGetAllDomainStatsFlags
+ *
+ * Subscribes to the statistics of all the domains of @conn, as reported
+ * by virConnectGetAllDomainStats() for the same @stats and @flags. The
+ * hypervisor samples them every @interval seconds and calls @cb with the
+ * statistics that changed since its previous call, which saves the
+ * client from polling and from transferring values it already knows.
+ *
+ * The first call reports every statistic of every domain. Later calls
+ * only include the domains with at least one changed value, and for
+ * each of them only the typed parameters that were added or changed;
+ * the values are absolute, not differences. No call is made at all if
+ * nothing changed. A client can therefore keep the latest value of
+ * each statistic by merging the records it receives.
+ *
+ * The virDomainPtr objects passed into the callback upon delivery
+ * are only valid for the duration of execution of the callback. If the
+ * callback wishes to keep a domain object after the callback returns,
+ * it shall take a reference to it, by calling virDomainRef().
+ *
+ * The return value from this method is a positive integer identifier
+ * for the callback. To unregister a callback, this callback ID should
+ * be passed to the virConnectDomainStatsEventDeregister() method.
+ *
+ * Returns a callback identifier on success, -1 on failure
+ */
+int
+virConnectDomainStatsEventRegister(virConnectPtr conn,
+                                   unsigned int stats,
+                                   unsigned int interval,
+                                   virConnectDomainStatsEventCallback cb,
+                                   void *opaque,
+                                   virFreeCallback freecb,
+                                   unsigned int flags)
+{
+    VIR_DEBUG("conn=%p, stats=0x%x, interval=%u, cb=%p, opaque=%p, "
+              "freecb=%p, flags=0x%x",
+              conn, stats, interval, cb, opaque, freecb, flags);
+
+    virResetLastError();
+
+    virCheckConnectReturn(conn, -1);
+    virCheckNonNullArgGoto(cb, error);
+    virCheckPositiveArgGoto(interval, error);
+
+    if (conn->driver && conn->driver->connectDomainStatsEventRegister) {
+        int ret;
+        ret = conn->driver->connectDomainStatsEventRegister(conn, stats,
+                                                            interval, cb,
+                                                            opaque, freecb,
+                                                            flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virReportUnsupportedError();
+ error:
+    virDispatchError(conn);
+    return -1;
+}
+
+
+/**
+ * virConnectDomainStatsEventDeregister:
+ * @conn: pointer to the connection
+ * @callbackID: the callback identifier
+ *
+ * Removes a statistics subscription previously registered with
+ * virConnectDomainStatsEventRegister(). The hypervisor stops
+ * sampling on behalf of the subscription.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+virConnectDomainStatsEventDeregister(virConnectPtr conn,
+                                     int callbackID)
+{
+    VIR_DEBUG("conn=%p, callbackID=%d", conn, callbackID);
+
+    virResetLastError();
+
+    virCheckConnectReturn(conn, -1);
+    virCheckNonNegativeArgGoto(callbackID, error);
+
+    if (conn->driver && conn->driver->connectDomainStatsEventDeregister) {
+        int ret;
+        ret = conn->driver->connectDomainStatsEventDeregister(conn,
+                                                              callbackID);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virReportUnsupportedError();
+ error:
+    virDispatchError(conn);
+    return -1;
+}
+
+
 /**
  * virDomainGetFSInfo:
  * @dom: a domain object
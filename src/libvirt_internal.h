@@ -123,6 +123,12 @@ enum {
      * Support for driver close callback rpc
      */
     VIR_DRV_FEATURE_REMOTE_CLOSE_CALLBACK = 15,
+
+    /*
+     * Support for typed parameters named by a per-connection
+     * dictionary of field names in rpc
+     */
+    VIR_DRV_FEATURE_REMOTE_COMPACT_TYPED_PARAMS = 16,
 };
 
 
@@ -43,13 +43,28 @@ VIR_LOG_INIT("logging.log_handler");
 
 #define DEFAULT_MODE 0600
 
+/* Data gathered from the pipe before it is written out in one go */
+#define VIR_LOG_HANDLER_BUF_SIZE (64 * 1024)
+
+/* How much a single wakeup may drain before other pipes get a turn */
+#define VIR_LOG_HANDLER_MAX_DRAIN (16 * VIR_LOG_HANDLER_BUF_SIZE)
+
 typedef struct _virLogHandlerLogFile virLogHandlerLogFile;
 typedef virLogHandlerLogFile *virLogHandlerLogFilePtr;
 
+/*
+ * The handler lock protects the list of files, while the lock of
+ * each file protects its writer and buffer. Busy guests thus only
+ * contend for their own log file. The handler lock is always taken
+ * first when both are needed.
+ */
 struct _virLogHandlerLogFile {
+    virObjectLockable parent;
+
     virRotatingFileWriterPtr file;
     int watch;
     int pipefd; /* Read from QEMU via this */
+    char *buf;
 
     char *driver;
     unsigned char domuuid[VIR_UUID_BUFLEN];
@@ -71,7 +86,9 @@ struct _virLogHandler {
 };
 
 static virClassPtr virLogHandlerClass;
+static virClassPtr virLogHandlerLogFileClass;
 static void virLogHandlerDispose(void *obj);
+static void virLogHandlerLogFileDispose(void *obj);
 
 static int
 virLogHandlerOnceInit(void)
@@ -82,17 +99,37 @@ virLogHandlerOnceInit(void)
                                           virLogHandlerDispose)))
         return -1;
 
+    if (!(virLogHandlerLogFileClass = virClassNew(virClassForObjectLockable(),
+                                                 "virLogHandlerLogFile",
+                                                 sizeof(virLogHandlerLogFile),
+                                                 virLogHandlerLogFileDispose)))
+        return -1;
+
     return 0;
 }
 
 VIR_ONCE_GLOBAL_INIT(virLogHandler)
 
 
+static virLogHandlerLogFilePtr
+virLogHandlerLogFileNew(void)
+{
+    virLogHandlerLogFilePtr file;
+
+    if (!(file = virObjectLockableNew(virLogHandlerLogFileClass)))
+        return NULL;
+
+    file->watch = -1;
+    file->pipefd = -1;
+
+    return file;
+}
+
+
 static void
-virLogHandlerLogFileFree(virLogHandlerLogFilePtr file)
+virLogHandlerLogFileDispose(void *obj)
 {
-    if (!file)
-        return;
+    virLogHandlerLogFilePtr file = obj;
 
     VIR_FORCE_CLOSE(file->pipefd);
     virRotatingFileWriterFree(file->file);
@@ -100,9 +137,9 @@ virLogHandlerLogFileFree(virLogHandlerLogFilePtr file)
     if (file->watch != -1)
         virEventRemoveHandle(file->watch);
 
+    VIR_FREE(file->buf);
     VIR_FREE(file->driver);
     VIR_FREE(file->domname);
-    VIR_FREE(file);
 }
 
 
@@ -114,14 +151,38 @@ virLogHandlerLogFileClose(virLogHandlerPtr handler,
 
     for (i = 0; i < handler->nfiles; i++) {
         if (handler->files[i] == file) {
+            handler->inhibitor(false, handler->opaque);
             VIR_DELETE_ELEMENT(handler->files, i, handler->nfiles);
-            virLogHandlerLogFileFree(file);
+            virObjectUnref(file);
             break;
         }
     }
 }
 
 
+/*
+ * Look up the file open at @path and return it referenced and
+ * locked. Must be called with the handler lock held.
+ */
+static virLogHandlerLogFilePtr
+virLogHandlerGetLogFileFromPath(virLogHandlerPtr handler,
+                                const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < handler->nfiles; i++) {
+        if (STREQ(virRotatingFileWriterGetPath(handler->files[i]->file),
+                  path)) {
+            virObjectRef(handler->files[i]);
+            virObjectLock(handler->files[i]);
+            return handler->files[i];
+        }
+    }
+
+    return NULL;
+}
+
+
 static virLogHandlerLogFilePtr
 virLogHandlerGetLogFileFromWatch(virLogHandlerPtr handler,
                                  int watch)
@@ -145,8 +206,8 @@ virLogHandlerDomainLogFileEvent(int watch,
 {
     virLogHandlerPtr handler = opaque;
     virLogHandlerLogFilePtr logfile;
-    char buf[1024];
-    ssize_t len;
+    size_t drained = 0;
+    bool eof = false;
 
     virObjectLock(handler);
     logfile = virLogHandlerGetLogFileFromWatch(handler, watch);
@@ -155,31 +216,67 @@ virLogHandlerDomainLogFileEvent(int watch,
         virObjectUnlock(handler);
         return;
     }
+    virObjectRef(logfile);
+    virObjectLock(logfile);
+    virObjectUnlock(handler);
 
- reread:
-    len = read(fd, buf, sizeof(buf));
-    if (len < 0) {
-        if (errno == EINTR)
-            goto reread;
-
-        virReportSystemError(errno, "%s",
-                             _("Unable to read from log pipe"));
+    if (!logfile->buf &&
+        VIR_ALLOC_N(logfile->buf, VIR_LOG_HANDLER_BUF_SIZE) < 0)
         goto error;
-    }
 
-    if (virRotatingFileWriterAppend(logfile->file, buf, len) != len)
-        goto error;
+    /* Once the writer went away, whatever is left in the
+     * pipe is drained in one go */
+    while (!eof &&
+           (drained < VIR_LOG_HANDLER_MAX_DRAIN ||
+            (events & VIR_EVENT_HANDLE_HANGUP))) {
+        size_t used = 0;
+        ssize_t len;
+
+        while (used < VIR_LOG_HANDLER_BUF_SIZE) {
+            len = read(fd, logfile->buf + used,
+                       VIR_LOG_HANDLER_BUF_SIZE - used);
+            if (len < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN)
+                    break;
+
+                virReportSystemError(errno, "%s",
+                                     _("Unable to read from log pipe"));
+                goto error;
+            }
+            if (len == 0) {
+                eof = true;
+                break;
+            }
+            used += len;
+        }
+
+        if (used &&
+            virRotatingFileWriterAppend(logfile->file,
+                                        logfile->buf, used) != (ssize_t) used)
+            goto error;
+        drained += used;
+
+        /* The pipe is empty for now */
+        if (used < VIR_LOG_HANDLER_BUF_SIZE && !eof &&
+            !(events & VIR_EVENT_HANDLE_HANGUP))
+            break;
+    }
 
-    if (events & VIR_EVENT_HANDLE_HANGUP)
+    if (eof || (events & VIR_EVENT_HANDLE_HANGUP))
         goto error;
 
-    virObjectUnlock(handler);
+    virObjectUnlock(logfile);
+    virObjectUnref(logfile);
     return;
 
  error:
-    handler->inhibitor(false, handler->opaque);
+    virObjectUnlock(logfile);
+    virObjectLock(handler);
     virLogHandlerLogFileClose(handler, logfile);
     virObjectUnlock(handler);
+    virObjectUnref(logfile);
 }
 
 
@@ -220,7 +317,7 @@ virLogHandlerLogFilePostExecRestart(virLogHandlerPtr handler,
     const char *domuuid;
     const char *tmp;
 
-    if (VIR_ALLOC(file) < 0)
+    if (!(file = virLogHandlerLogFileNew()))
         return NULL;
 
     handler->inhibitor(true, handler->opaque);
@@ -275,12 +372,19 @@ virLogHandlerLogFilePostExecRestart(virLogHandlerPtr handler,
                              _("Cannot enable close-on-exec flag"));
         goto error;
     }
+    /* In case we were restarted from a version reading one chunk
+     * per wakeup, which kept the pipe blocking */
+    if (virSetNonBlock(file->pipefd) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Cannot enable non-blocking flag"));
+        goto error;
+    }
 
     return file;
 
  error:
     handler->inhibitor(false, handler->opaque);
-    virLogHandlerLogFileFree(file);
+    virObjectUnref(file);
     return NULL;
 }
 
@@ -354,7 +458,7 @@ virLogHandlerDispose(void *obj)
 
     for (i = 0; i < handler->nfiles; i++) {
         handler->inhibitor(false, handler->opaque);
-        virLogHandlerLogFileFree(handler->files[i]);
+        virObjectUnref(handler->files[i]);
     }
     VIR_FREE(handler->files);
 }
@@ -393,10 +497,15 @@ virLogHandlerDomainOpenLogFile(virLogHandlerPtr handler,
                              _("Cannot open fifo pipe"));
         goto error;
     }
-    if (VIR_ALLOC(file) < 0)
+    /* Only our end, QEMU keeps blocking on a full pipe */
+    if (virSetNonBlock(pipefd[0]) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Cannot enable non-blocking flag"));
+        goto error;
+    }
+    if (!(file = virLogHandlerLogFileNew()))
         goto error;
 
-    file->watch = -1;
     file->pipefd = pipefd[0];
     pipefd[0] = -1;
     memcpy(file->domuuid, domuuid, VIR_UUID_BUFLEN);
@@ -411,6 +520,9 @@ virLogHandlerDomainOpenLogFile(virLogHandlerPtr handler,
                                                DEFAULT_MODE)) == NULL)
         goto error;
 
+    *inode = virRotatingFileWriterGetINode(file->file);
+    *offset = virRotatingFileWriterGetOffset(file->file);
+
     if (VIR_APPEND_ELEMENT_COPY(handler->files, handler->nfiles, file) < 0)
         goto error;
 
@@ -423,9 +535,6 @@ virLogHandlerDomainOpenLogFile(virLogHandlerPtr handler,
         goto error;
     }
 
-    *inode = virRotatingFileWriterGetINode(file->file);
-    *offset = virRotatingFileWriterGetOffset(file->file);
-
     virObjectUnlock(handler);
     return pipefd[1];
 
@@ -433,7 +542,7 @@ virLogHandlerDomainOpenLogFile(virLogHandlerPtr handler,
     VIR_FORCE_CLOSE(pipefd[0]);
     VIR_FORCE_CLOSE(pipefd[1]);
     handler->inhibitor(false, handler->opaque);
-    virLogHandlerLogFileFree(file);
+    virObjectUnref(file);
     virObjectUnlock(handler);
     return -1;
 }
@@ -447,36 +556,26 @@ virLogHandlerDomainGetLogFilePosition(virLogHandlerPtr handler,
                                       off_t *offset)
 {
     virLogHandlerLogFilePtr file = NULL;
-    int ret = -1;
-    size_t i;
 
     virCheckFlags(0, -1);
 
     virObjectLock(handler);
-
-    for (i = 0; i < handler->nfiles; i++) {
-        if (STREQ(virRotatingFileWriterGetPath(handler->files[i]->file),
-                  path)) {
-            file = handler->files[i];
-            break;
-        }
-    }
+    file = virLogHandlerGetLogFileFromPath(handler, path);
+    virObjectUnlock(handler);
 
     if (!file) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("No open log file %s"),
                        path);
-        goto cleanup;
+        return -1;
     }
 
     *inode = virRotatingFileWriterGetINode(file->file);
     *offset = virRotatingFileWriterGetOffset(file->file);
 
-    ret = 0;
-
- cleanup:
-    virObjectUnlock(handler);
-    return ret;
+    virObjectUnlock(file);
+    virObjectUnref(file);
+    return 0;
 }
 
 
@@ -531,7 +630,7 @@ virLogHandlerDomainAppendLogFile(virLogHandlerPtr handler,
                                  const char *message,
                                  unsigned int flags)
 {
-    size_t i;
+    virLogHandlerLogFilePtr file = NULL;
     virRotatingFileWriterPtr writer = NULL;
     virRotatingFileWriterPtr newwriter = NULL;
     int ret = -1;
@@ -542,14 +641,12 @@ virLogHandlerDomainAppendLogFile(virLogHandlerPtr handler,
 
     virObjectLock(handler);
 
-    for (i = 0; i < handler->nfiles; i++) {
-        if (STREQ(virRotatingFileWriterGetPath(handler->files[i]->file), path)) {
-            writer = handler->files[i]->file;
-            break;
-        }
-    }
-
-    if (!writer) {
+    /* Files which are not open stay under the handler lock, so
+     * that they cannot be opened in the meantime */
+    if ((file = virLogHandlerGetLogFileFromPath(handler, path))) {
+        virObjectUnlock(handler);
+        writer = file->file;
+    } else {
         if (!(newwriter = virRotatingFileWriterNew(path,
                                                    handler->max_size,
                                                    handler->max_backups,
@@ -567,7 +664,12 @@ virLogHandlerDomainAppendLogFile(virLogHandlerPtr handler,
 
  cleanup:
     virRotatingFileWriterFree(newwriter);
-    virObjectUnlock(handler);
+    if (file) {
+        virObjectUnlock(file);
+        virObjectUnref(file);
+    } else {
+        virObjectUnlock(handler);
+    }
     return ret;
 }
 
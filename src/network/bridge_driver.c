@@ -74,17 +74,11 @@
 #include "network_event.h"
 #include "virhook.h"
 #include "virjson.h"
+#include "virlease.h"
 
 #define VIR_FROM_THIS VIR_FROM_NETWORK
 #define MAX_BRIDGE_ID 256
 
-/**
- * VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX:
- *
- * Macro providing the upper limit on the size of leases file
- */
-#define VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX (32 * 1024 * 1024)
-
 VIR_LOG_INIT("network.bridge_driver");
 
 static virNetworkDriverStatePtr network_driver;
@@ -348,8 +342,13 @@ networkRemoveInactive(virNetworkDriverStatePtr driver,
     dnsmasqDelete(dctx);
     unlink(leasefile);
     unlink(customleasefile);
+    virLeaseJournalRemove(customleasefile);
     unlink(configfile);
 
+    networkDriverLock(driver);
+    virHashRemoveEntry(driver->leaseDBs, def->bridge);
+    networkDriverUnlock(driver);
+
     /* MAC map manager */
     unlink(macMapFile);
 
@@ -754,6 +753,9 @@ networkStateInitialize(bool privileged,
     if (!(network_driver->networks = virNetworkObjListNew()))
         goto error;
 
+    if (!(network_driver->leaseDBs = virHashCreate(10, virObjectFreeHashData)))
+        goto error;
+
     if (virNetworkLoadAllState(network_driver->networks,
                                network_driver->stateDir) < 0)
         goto error;
@@ -880,6 +882,7 @@ networkStateCleanup(void)
     VIR_FREE(network_driver->radvdStateDir);
 
     virObjectUnref(network_driver->dnsmasqCaps);
+    virHashFree(network_driver->leaseDBs);
 
     virMutexDestroy(&network_driver->lock);
 
@@ -3882,6 +3885,37 @@ static int networkSetAutostart(virNetworkPtr net,
     return ret;
 }
 
+/* Returns a reference to the lease database of @bridge */
+static virLeaseDBPtr
+networkGetLeaseDB(virNetworkDriverStatePtr driver,
+                  const char *bridge)
+{
+    virLeaseDBPtr db = NULL;
+    char *custom_lease_file = NULL;
+
+    networkDriverLock(driver);
+
+    if (!(db = virHashLookup(driver->leaseDBs, bridge))) {
+        if (!(custom_lease_file = networkDnsmasqLeaseFileNameCustom(driver,
+                                                                    bridge)) ||
+            !(db = virLeaseDBNew(custom_lease_file)))
+            goto cleanup;
+
+        if (virHashAddEntry(driver->leaseDBs, bridge, db) < 0) {
+            virObjectUnref(db);
+            db = NULL;
+            goto cleanup;
+        }
+    }
+
+    virObjectRef(db);
+
+ cleanup:
+    networkDriverUnlock(driver);
+    VIR_FREE(custom_lease_file);
+    return db;
+}
+
 static int
 networkGetDHCPLeases(virNetworkPtr network,
                      const char *mac,
@@ -3893,13 +3927,10 @@ networkGetDHCPLeases(virNetworkPtr network,
     size_t nleases = 0;
     int rv = -1;
     ssize_t size = 0;
-    int custom_lease_file_len = 0;
     bool need_results = !!leases;
     long long currtime = 0;
     long long expirytime_tmp = -1;
     bool ipv6 = false;
-    char *lease_entries = NULL;
-    char *custom_lease_file = NULL;
     const char *ip_tmp = NULL;
     const char *mac_tmp = NULL;
     virJSONValuePtr lease_tmp = NULL;
@@ -3908,6 +3939,7 @@ networkGetDHCPLeases(virNetworkPtr network,
     virNetworkDHCPLeasePtr lease = NULL;
     virNetworkDHCPLeasePtr *leases_ret = NULL;
     virNetworkObjPtr obj;
+    virLeaseDBPtr db = NULL;
     virMacAddr mac_addr;
 
     virCheckFlags(0, -1);
@@ -3924,32 +3956,20 @@ networkGetDHCPLeases(virNetworkPtr network,
     if (virNetworkGetDHCPLeasesEnsureACL(network->conn, obj->def) < 0)
         goto cleanup;
 
-    /* Retrieve custom leases file location */
-    custom_lease_file = networkDnsmasqLeaseFileNameCustom(driver, obj->def->bridge);
-
-    /* Read entire contents */
-    if ((custom_lease_file_len = virFileReadAll(custom_lease_file,
-                                                VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX,
-                                                &lease_entries)) < 0) {
-        /* Even though src/network/leaseshelper.c guarantees the existence of
-         * leases file (even if no leases are present), and the control reaches
-         * here, instead of reporting error, return 0 leases */
-        rv = 0;
+    /* Only the leases changed since the last call are read */
+    if (!(db = networkGetLeaseDB(driver, obj->def->bridge)))
         goto error;
-    }
 
-    if (custom_lease_file_len) {
-        if (!(leases_array = virJSONValueFromString(lease_entries))) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("invalid json in file: %s"), custom_lease_file);
-            goto error;
-        }
+    virObjectLock(db);
 
-        if ((size = virJSONValueArraySize(leases_array)) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                           _("couldn't fetch array of leases"));
-            goto error;
-        }
+    if (virLeaseDBRefresh(db) < 0)
+        goto error;
+
+    leases_array = virLeaseDBGetLeases(db);
+    if ((size = virJSONValueArraySize(leases_array)) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("couldn't fetch array of leases"));
+        goto error;
     }
 
     currtime = (long long) time(NULL);
@@ -4053,9 +4073,10 @@ networkGetDHCPLeases(virNetworkPtr network,
 
  cleanup:
     VIR_FREE(lease);
-    VIR_FREE(lease_entries);
-    VIR_FREE(custom_lease_file);
-    virJSONValueFree(leases_array);
+    if (db) {
+        virObjectUnlock(db);
+        virObjectUnref(db);
+    }
 
     virNetworkObjEndAPI(&obj);
 
@@ -27,6 +27,7 @@
 # include "internal.h"
 # include "virthread.h"
 # include "virdnsmasq.h"
+# include "virhash.h"
 # include "network_conf.h"
 # include "object_event.h"
 
@@ -52,6 +53,10 @@ struct _virNetworkDriverState {
 
     /* Immutable pointer, self-locking APIs */
     virObjectEventStatePtr networkEventState;
+
+    /* Require lock to get a reference on the objects,
+     * which are self-locking, bridge name -> virLeaseDB */
+    virHashTablePtr leaseDBs;
 };
 
 typedef struct _virNetworkDriverState virNetworkDriverState;
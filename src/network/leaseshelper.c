@@ -86,7 +86,6 @@ main(int argc, char **argv)
     char *custom_lease_file = NULL;
     const char *ip = NULL;
     const char *mac = NULL;
-    const char *leases_str = NULL;
     const char *iaid = virGetEnvAllowSUID("DNSMASQ_IAID");
     const char *clientid = virGetEnvAllowSUID("DNSMASQ_CLIENT_ID");
     const char *interface = virGetEnvAllowSUID("DNSMASQ_INTERFACE");
@@ -206,18 +205,18 @@ main(int argc, char **argv)
         break;
     }
 
-    if (!(leases_array_new = virJSONValueNewArray())) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("failed to create json"));
-        goto cleanup;
-    }
-
-    if (virLeaseReadCustomLeaseFile(leases_array_new, custom_lease_file,
-                                    delete ? ip : NULL, &server_duid) < 0)
-        goto cleanup;
-
     switch ((enum virLeaseActionFlags) action) {
     case VIR_LEASE_ACTION_INIT:
+        if (!(leases_array_new = virJSONValueNewArray())) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("failed to create json"));
+            goto cleanup;
+        }
+
+        if (virLeaseReadCustomLeaseFile(leases_array_new, custom_lease_file,
+                                        NULL, &server_duid) < 0)
+            goto cleanup;
+
         if (virLeasePrintLeases(leases_array_new, server_duid) < 0)
             goto cleanup;
 
@@ -225,23 +224,17 @@ main(int argc, char **argv)
 
     case VIR_LEASE_ACTION_OLD:
     case VIR_LEASE_ACTION_ADD:
-        if (lease_new && virJSONValueArrayAppend(leases_array_new, lease_new) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                           _("failed to create json"));
-            goto cleanup;
-        }
-        lease_new = NULL;
-
-        /* fallthrough */
     case VIR_LEASE_ACTION_DEL:
-        if (!(leases_str = virJSONValueToString(leases_array_new, true))) {
-            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                           _("empty json array"));
-            goto cleanup;
+        /* Only record the change, rather than rewriting all the leases */
+        if (lease_new) {
+            if (virLeaseJournalAdd(custom_lease_file, lease_new) < 0)
+                goto cleanup;
+        } else if (delete) {
+            if (virLeaseJournalDelete(custom_lease_file, ip) < 0)
+                goto cleanup;
         }
 
-        /* Write to file */
-        if (virFileRewriteStr(custom_lease_file, 0644, leases_str) < 0)
+        if (virLeaseJournalCompact(custom_lease_file, &server_duid) < 0)
             goto cleanup;
         break;
 
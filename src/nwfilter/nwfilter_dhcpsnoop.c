@@ -34,8 +34,8 @@
  *   Inside a couple of VMs that for example use the 'clean-traffic' filter:
  *      while :; do kill -SIGTERM `pidof dhclient`; dhclient eth0; ifconfig eth0; done
  *
- *   On the host check the lease file and that it's periodically shortened:
- *      cat /var/run/libvirt/network/nwfilter.leases; date +%s
+ *   On the host check the lease files and that they're periodically shortened:
+ *      cat /var/run/libvirt/network/nwfilter-*.leases; date +%s
  *
  *   On the host also check that the ebtables rules 'look' ok:
  *      ebtables -t nat -L
@@ -48,6 +48,7 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/ip.h>
@@ -61,14 +62,18 @@
 #include "conf/domain_conf.h"
 #include "nwfilter_gentech_driver.h"
 #include "nwfilter_dhcpsnoop.h"
+#define __NWFILTER_DHCPSNOOP_PRIV_H_ALLOW__
+#include "nwfilter_dhcpsnooppriv.h"
 #include "nwfilter_ipaddrmap.h"
 #include "virnetdev.h"
 #include "virfile.h"
+#include "virhashcode.h"
 #include "viratomic.h"
 #include "virthreadpool.h"
 #include "configmake.h"
 #include "virtime.h"
 #include "virstring.h"
+#include "stat-time.h"
 
 #define VIR_FROM_THIS VIR_FROM_NWFILTER
 
@@ -76,20 +81,43 @@ VIR_LOG_INIT("nwfilter.nwfilter_dhcpsnoop");
 
 #ifdef HAVE_LIBPCAP
 
-# define LEASEFILE_DIR LOCALSTATEDIR "/run/libvirt/network/"
-# define LEASEFILE LEASEFILE_DIR "nwfilter.leases"
-# define TMPLEASEFILE LEASEFILE_DIR "nwfilter.ltmp"
+# define LEASEFILE_DIR LOCALSTATEDIR "/run/libvirt/network"
+# define LEASEFILE_FMT "%s/nwfilter-%zu.leases"
+# define TMPLEASEFILE_FMT "%s/nwfilter-%zu.ltmp"
+/*
+ * Single lease file read and written by older versions. It still gets
+ * a snapshot of all leases on shutdown, so that going back to an older
+ * version keeps them, and it is loaded instead of the shards as long
+ * as it is newer than all of them.
+ */
+# define LEGACY_LEASEFILE LEASEFILE_DIR "/nwfilter.leases"
+
+/*
+ * The leases are spread over LEASEFILE_SHARDS files by interface key,
+ * each with its own lock, so that lease changes on different interfaces
+ * don't serialize on a single file. A change is appended to the file of
+ * its interface; once a file holds mostly dead leases, it is rewritten
+ * in the background from the leases in memory, carrying over what was
+ * appended in the meantime.
+ */
+# define LEASEFILE_SHARDS       16
+# define LEASEFILE_COMPACT_MIN  100 /* written leases before a rewrite */
+
+typedef struct _virNWFilterSnoopPoller virNWFilterSnoopPoller;
+typedef virNWFilterSnoopPoller *virNWFilterSnoopPollerPtr;
 
 struct virNWFilterSnoopState {
-    /* lease file */
-    int                  leaseFD;
-    int                  nLeases; /* number of active leases */
-    int                  wLeases; /* number of written leases */
-    int                  nThreads; /* number of running threads */
+    /* lease files */
+    virNWFilterSnoopLeaseShard leaseShards[LEASEFILE_SHARDS];
+    virThreadPoolPtr     compactor;
+    int                  nIfaces; /* number of snooped interfaces */
     /* thread management */
     virHashTablePtr      snoopReqs;
     virHashTablePtr      ifnameToKey;
-    virMutex             snoopLock;  /* protects SnoopReqs and IfNameToKey */
+    virNWFilterSnoopPollerPtr *pollers;
+    size_t               nPollers;
+    virMutex             snoopLock;  /* protects SnoopReqs, IfNameToKey and
+                                      * the pollers */
     virHashTablePtr      active;
     virMutex             activeLock; /* protects Active */
 };
@@ -119,12 +147,6 @@ typedef virNWFilterSnoopReq *virNWFilterSnoopReqPtr;
 typedef struct _virNWFilterSnoopIPLease virNWFilterSnoopIPLease;
 typedef virNWFilterSnoopIPLease *virNWFilterSnoopIPLeasePtr;
 
-typedef enum {
-    THREAD_STATUS_NONE,
-    THREAD_STATUS_OK,
-    THREAD_STATUS_FAIL,
-} virNWFilterSnoopThreadStatus;
-
 struct _virNWFilterSnoopReq {
     /*
      * reference counter: while the req is on the
@@ -146,12 +168,12 @@ struct _virNWFilterSnoopReq {
     virNWFilterSnoopIPLeasePtr           start;
     virNWFilterSnoopIPLeasePtr           end;
     char                                *threadkey;
-
-    virNWFilterSnoopThreadStatus         threadStatus;
-    virCond                              threadStatusCond;
+    /* index of the lease file */
+    size_t                               shard;
 
     int                                  jobCompletionStatus;
-    /* the number of submitted jobs in the worker's queue */
+    /* the number of submitted jobs in the worker's queue, per direction */
+    int                                  qCtr[2];
     /*
      * protect those members that can change while the
      * req is on the public SnoopReq hash and
@@ -161,7 +183,6 @@ struct _virNWFilterSnoopReq {
      * - start
      * - end
      * - a lease while it is on the list
-     * - threadStatus
      * (for refctr, see above)
      */
     virMutex                             lock;
@@ -169,10 +190,14 @@ struct _virNWFilterSnoopReq {
 
 /*
  * Note about lock-order:
- * 1st: virNWFilterSnoopLock()
- * 2nd: virNWFilterSnoopReqLock(req)
+ * 1st: compactLock of a lease file shard
+ * 2nd: virNWFilterSnoopLock()
+ * 3rd: virNWFilterSnoopReqLock(req)
+ * 4th: lock of a lease file shard
  *
- * Rationale: Former protects the SnoopReqs hash, latter its contents
+ * Rationale: SnoopLock protects the SnoopReqs hash, the req its contents;
+ * a lease file is appended to with the req locked, and rewritten from
+ * the contents of the reqs
  */
 
 struct _virNWFilterSnoopIPLease {
@@ -244,6 +269,7 @@ struct _virNWFilterDHCPDecodeJob {
     unsigned char packet[PCAP_PBUFSIZE];
     int caplen;
     bool fromVM;
+    virNWFilterSnoopReqPtr req; /* holds a reference */
     int *qCtr;
 };
 
@@ -270,7 +296,11 @@ struct _virNWFilterSnoopRateLimitConf {
     const unsigned int burstRate;
     const unsigned int burstInterval;
 };
-# define SNOOP_POLL_MAX_TIMEOUT_MS  (10 * 1000) /* milliseconds */
+/* lease timers and cancellation are checked at least this often */
+# define SNOOP_POLL_MAX_TIMEOUT_MS  1000 /* milliseconds */
+
+/* threads sharing the work of snooping on all interfaces */
+# define SNOOP_MAX_POLLERS          4
 
 typedef struct _virNWFilterSnoopPcapConf virNWFilterSnoopPcapConf;
 typedef virNWFilterSnoopPcapConf *virNWFilterSnoopPcapConfPtr;
@@ -280,11 +310,40 @@ struct _virNWFilterSnoopPcapConf {
     const pcap_direction_t dir;
     const char *filter;
     virNWFilterSnoopRateLimitConf rateLimit; /* indep. rate limiters */
-    int qCtr; /* number of jobs in the worker's queue */
     const unsigned int maxQSize;
     unsigned long long penaltyTimeoutAbs;
 };
 
+typedef struct _virNWFilterSnoopIf virNWFilterSnoopIf;
+typedef virNWFilterSnoopIf *virNWFilterSnoopIfPtr;
+
+/* An interface being snooped on, owned by its poller */
+struct _virNWFilterSnoopIf {
+    virNWFilterSnoopReqPtr req; /* holds a reference */
+    char *threadkey;
+    int ifindex;
+    int errcount;
+    bool failed;
+    time_t last_displayed;
+    time_t last_displayed_queue;
+    virNWFilterSnoopPcapConf pcapConf[2];
+};
+
+struct _virNWFilterSnoopPoller {
+    virThread thread;
+    /* decodes the packets of all the interfaces, in order */
+    virThreadPoolPtr worker;
+    int wakeupFD[2];
+    /* for use by the thread only, the wakeup pipe and 2 per interface */
+    struct pollfd *fds;
+    size_t nfds;
+    int nIfaces; /* number of interfaces, atomic */
+    virMutex lock; /* protects the members below */
+    virNWFilterSnoopIfPtr *pending; /* interfaces to be picked up */
+    size_t nPending;
+    bool quit;
+};
+
 /* local function prototypes */
 static int virNWFilterSnoopReqLeaseDel(virNWFilterSnoopReqPtr req,
                                        virSocketAddrPtr ipaddr,
@@ -297,10 +356,13 @@ static void virNWFilterSnoopReqUnlock(virNWFilterSnoopReqPtr req);
 static void virNWFilterSnoopLeaseFileLoad(void);
 static void virNWFilterSnoopLeaseFileSave(virNWFilterSnoopIPLeasePtr ipl);
 
+static void virNWFilterSnoopPollerWakeup(virNWFilterSnoopPollerPtr poller);
+
 /* local variables */
-static struct virNWFilterSnoopState virNWFilterSnoopState = {
-    .leaseFD = -1,
-};
+static struct virNWFilterSnoopState virNWFilterSnoopState;
+
+# define virNWFilterSnoopReqShard(req) \
+    (&virNWFilterSnoopState.leaseShards[(req)->shard])
 
 static const unsigned char dhcp_magic[4] = { 99, 130, 83, 99 };
 
@@ -323,9 +385,14 @@ virNWFilterSnoopActivate(virNWFilterSnoopReqPtr req)
     return key;
 }
 
+/*
+ * Call this function with the SnoopLock held.
+ */
 static void
 virNWFilterSnoopCancel(char **threadKey)
 {
+    size_t i;
+
     if (*threadKey == NULL)
         return;
 
@@ -335,6 +402,10 @@ virNWFilterSnoopCancel(char **threadKey)
     VIR_FREE(*threadKey);
 
     virNWFilterSnoopActiveUnlock();
+
+    /* have the interface dropped right away */
+    for (i = 0; i < virNWFilterSnoopState.nPollers; i++)
+        virNWFilterSnoopPollerWakeup(virNWFilterSnoopState.pollers[i]);
 }
 
 static bool
@@ -589,22 +660,16 @@ virNWFilterSnoopReqNew(const char *ifkey)
     if (VIR_ALLOC(req) < 0)
         return NULL;
 
-    req->threadStatus = THREAD_STATUS_NONE;
-
     if (virStrcpyStatic(req->ifkey, ifkey) == NULL ||
         virMutexInitRecursive(&req->lock) < 0)
         goto err_free_req;
 
-    if (virCondInit(&req->threadStatusCond) < 0)
-        goto err_destroy_mutex;
+    req->shard = virHashCodeGen(ifkey, strlen(ifkey), 0) % LEASEFILE_SHARDS;
 
     virNWFilterSnoopReqGet(req);
 
     return req;
 
- err_destroy_mutex:
-    virMutexDestroy(&req->lock);
-
  err_free_req:
     VIR_FREE(req);
 
@@ -638,7 +703,6 @@ virNWFilterSnoopReqFree(virNWFilterSnoopReqPtr req)
     virNWFilterHashTableFree(req->vars);
 
     virMutexDestroy(&req->lock);
-    virCondDestroy(&req->threadStatusCond);
 
     VIR_FREE(req);
 }
@@ -781,7 +845,7 @@ virNWFilterSnoopReqLeaseAdd(virNWFilterSnoopReqPtr req,
     /* put the lease on the req's list */
     virNWFilterSnoopIPLeaseTimerAdd(pl);
 
-    virAtomicIntInc(&virNWFilterSnoopState.nLeases);
+    virAtomicIntInc(&virNWFilterSnoopReqShard(req)->nLeases);
 
  exit:
     if (update_leasefile)
@@ -896,7 +960,7 @@ virNWFilterSnoopReqLeaseDel(virNWFilterSnoopReqPtr req,
  skip_instantiate:
     VIR_FREE(ipl);
 
-    virAtomicIntDecAndTest(&virNWFilterSnoopState.nLeases);
+    virAtomicIntDecAndTest(&virNWFilterSnoopReqShard(req)->nLeases);
 
  lease_not_found:
     VIR_FREE(ipstr);
@@ -1140,6 +1204,15 @@ virNWFilterSnoopDHCPOpen(const char *ifname, virMacAddr *mac,
         goto cleanup_freecode;
     }
 
+    /* A poller serves many interfaces, so reading from one must not
+     * block when libpcap drops everything that woke us up, e.g. the
+     * packets of the other direction */
+    if (pcap_setnonblock(handle, 1, pcap_errbuf) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("pcap_setnonblock: %s"), pcap_errbuf);
+        goto cleanup_freecode;
+    }
+
     pcap_freecode(&fp);
     VIR_FREE(ext_filter);
 
@@ -1159,10 +1232,11 @@ virNWFilterSnoopDHCPOpen(const char *ifname, virMacAddr *mac,
  * Worker function to decode the DHCP message and with that
  * also do the time-consuming work of instantiating the filters
  */
-static void virNWFilterDHCPDecodeWorker(void *jobdata, void *opaque)
+static void virNWFilterDHCPDecodeWorker(void *jobdata,
+                                        void *opaque ATTRIBUTE_UNUSED)
 {
-    virNWFilterSnoopReqPtr req = opaque;
     virNWFilterDHCPDecodeJobPtr job = jobdata;
+    virNWFilterSnoopReqPtr req = job->req;
     virNWFilterSnoopEthHdrPtr packet = (virNWFilterSnoopEthHdrPtr)job->packet;
 
     if (virNWFilterSnoopDHCPDecode(req, packet,
@@ -1174,6 +1248,7 @@ static void virNWFilterDHCPDecodeWorker(void *jobdata, void *opaque)
                          "interface '%s'"), req->ifname);
     }
     virAtomicIntDecAndTest(job->qCtr);
+    virNWFilterSnoopReqPut(req);
     VIR_FREE(job);
 }
 
@@ -1182,6 +1257,7 @@ static void virNWFilterDHCPDecodeWorker(void *jobdata, void *opaque)
  */
 static int
 virNWFilterSnoopDHCPDecodeJobSubmit(virThreadPoolPtr pool,
+                                    virNWFilterSnoopReqPtr req,
                                     virNWFilterSnoopEthHdrPtr pep,
                                     int len, pcap_direction_t dir,
                                     int *qCtr)
@@ -1198,14 +1274,20 @@ virNWFilterSnoopDHCPDecodeJobSubmit(virThreadPoolPtr pool,
     memcpy(job->packet, pep, len);
     job->caplen = len;
     job->fromVM = (dir == PCAP_D_IN);
+    job->req = req;
     job->qCtr = qCtr;
 
+    /* the interface may be gone by the time the job runs */
+    virNWFilterSnoopReqGet(req);
+
     ret = virThreadPoolSendJob(pool, 0, job);
 
-    if (ret == 0)
+    if (ret == 0) {
         virAtomicIntInc(qCtr);
-    else
+    } else {
+        virNWFilterSnoopReqPut(req);
         VIR_FREE(job);
+    }
 
     return ret;
 }
@@ -1327,30 +1409,35 @@ virNWFilterSnoopAdjustPoll(virNWFilterSnoopPcapConfPtr pc,
     return ret;
 }
 
-/*
- * The DHCP snooping thread. It spends most of its time in the pcap
- * library and if it gets suitable packets, it submits them to the worker
- * thread for processing.
- */
 static void
-virNWFilterDHCPSnoopThread(void *req0)
+virNWFilterSnoopIfFree(virNWFilterSnoopIfPtr ifs)
 {
-    virNWFilterSnoopReqPtr req = req0;
-    struct pcap_pkthdr *hdr;
-    virNWFilterSnoopEthHdrPtr packet;
-    int ifindex = 0;
-    int errcount = 0;
-    int tmp = -1, rv, n, pollTo;
     size_t i;
-    char *threadkey = NULL;
-    virThreadPoolPtr worker = NULL;
-    time_t last_displayed = 0, last_displayed_queue = 0;
-    virNWFilterSnoopPcapConf pcapConf[] = {
+
+    if (!ifs)
+        return;
+
+    for (i = 0; i < ARRAY_CARDINALITY(ifs->pcapConf); i++) {
+        if (ifs->pcapConf[i].handle)
+            pcap_close(ifs->pcapConf[i].handle);
+    }
+
+    VIR_FREE(ifs->threadkey);
+    VIR_FREE(ifs);
+}
+
+/*
+ * Open the pcap handles for snooping on the interface of a request.
+ * Call this function with the req locked.
+ */
+static virNWFilterSnoopIfPtr
+virNWFilterSnoopIfNew(virNWFilterSnoopReqPtr req)
+{
+    static const virNWFilterSnoopPcapConf pcapConf[2] = {
         {
             .dir = PCAP_D_IN, /* from VM */
             .filter = "dst port 67 and src port 68",
             .rateLimit = {
-                .prev = time(0),
                 .rate = DHCP_PKT_RATE,
                 .burstRate = DHCP_PKT_BURST,
                 .burstInterval = DHCP_BURST_INTERVAL_S,
@@ -1360,7 +1447,6 @@ virNWFilterDHCPSnoopThread(void *req0)
             .dir = PCAP_D_OUT, /* to VM */
             .filter = "src port 67 and dst port 68",
             .rateLimit = {
-                .prev = time(0),
                 .rate = DHCP_PKT_RATE,
                 .burstRate = DHCP_PKT_BURST,
                 .burstInterval = DHCP_BURST_INTERVAL_S,
@@ -1368,211 +1454,480 @@ virNWFilterDHCPSnoopThread(void *req0)
             .maxQSize = MAX_QUEUED_JOBS,
         },
     };
-    struct pollfd fds[] = {
-        {
-            /* get a POLLERR if interface goes down or disappears */
-            .events = POLLIN | POLLERR,
-        }, {
-            .events = POLLIN | POLLERR,
-        },
-    };
-    bool error = false;
+    virNWFilterSnoopIfPtr ifs;
+    size_t i;
 
-    /* whoever started us increased the reference counter for the req for us */
+    if (VIR_ALLOC(ifs) < 0)
+        return NULL;
 
-    /* protect req->ifname & req->threadkey */
-    virNWFilterSnoopReqLock(req);
+    memcpy(ifs->pcapConf, pcapConf, sizeof(pcapConf));
 
-    if (req->ifname && req->threadkey) {
-        for (i = 0; i < ARRAY_CARDINALITY(pcapConf); i++) {
-            pcapConf[i].handle =
-                virNWFilterSnoopDHCPOpen(req->ifname, &req->macaddr,
-                                         pcapConf[i].filter,
-                                         pcapConf[i].dir);
-            if (!pcapConf[i].handle) {
-                error = true;
-                break;
-            }
-            fds[i].fd = pcap_fileno(pcapConf[i].handle);
+    if (VIR_STRDUP(ifs->threadkey, req->threadkey) < 0)
+        goto error;
+
+    for (i = 0; i < ARRAY_CARDINALITY(ifs->pcapConf); i++) {
+        ifs->pcapConf[i].rateLimit.prev = time(0);
+        ifs->pcapConf[i].handle =
+            virNWFilterSnoopDHCPOpen(req->ifname, &req->macaddr,
+                                     ifs->pcapConf[i].filter,
+                                     ifs->pcapConf[i].dir);
+        if (!ifs->pcapConf[i].handle)
+            goto error;
+    }
+
+    if (virNetDevGetIndex(req->ifname, &ifs->ifindex) < 0)
+        goto error;
+
+    if (ifs->ifindex != req->ifindex) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("interface '%s' changed while setting up "
+                         "DHCP snooping"), req->ifname);
+        goto error;
+    }
+
+    ifs->req = req;
+
+    return ifs;
+
+ error:
+    virNWFilterSnoopIfFree(ifs);
+    return NULL;
+}
+
+/*
+ * Stop snooping on an interface and drop its reference to the req.
+ * If snooping failed, the req also loses its interface.
+ */
+static void
+virNWFilterSnoopIfRemove(virNWFilterSnoopPollerPtr poller,
+                         virNWFilterSnoopIfPtr ifs,
+                         bool error)
+{
+    virNWFilterSnoopReqPtr req = ifs->req;
+
+    if (error) {
+        /* protect IfNameToKey */
+        virNWFilterSnoopLock();
+
+        /* protect req->ifname & req->threadkey */
+        virNWFilterSnoopReqLock(req);
+
+        virNWFilterSnoopCancel(&req->threadkey);
+
+        ignore_value(virHashRemoveEntry(virNWFilterSnoopState.ifnameToKey,
+                                        req->ifname));
+
+        VIR_FREE(req->ifname);
+
+        virNWFilterSnoopReqUnlock(req);
+        virNWFilterSnoopUnlock();
+    }
+
+    virNWFilterSnoopReqPut(req);
+
+    virNWFilterSnoopIfFree(ifs);
+
+    virAtomicIntDecAndTest(&poller->nIfaces);
+    virAtomicIntDecAndTest(&virNWFilterSnoopState.nIfaces);
+}
+
+/*
+ * Read a packet from the pcap handle @i of an interface, and submit it
+ * to the worker thread of the poller if it is suitable. The handle is
+ * non-blocking, so there may be none.
+ *
+ * Returns 0 on success, -1 if snooping on the interface has to stop.
+ */
+static int
+virNWFilterSnoopIfRead(virNWFilterSnoopPollerPtr poller,
+                       virNWFilterSnoopIfPtr ifs,
+                       size_t i)
+{
+    virNWFilterSnoopReqPtr req = ifs->req;
+    virNWFilterSnoopPcapConfPtr pc = &ifs->pcapConf[i];
+    struct pcap_pkthdr *hdr;
+    virNWFilterSnoopEthHdrPtr packet;
+    unsigned int diff;
+    int rv, tmp;
+
+    rv = pcap_next_ex(pc->handle, &hdr, (const u_char **)&packet);
+
+    if (rv < 0) {
+        /* error reading from socket */
+        tmp = -1;
+
+        /* protect req->ifname */
+        virNWFilterSnoopReqLock(req);
+
+        if (req->ifname)
+            tmp = virNetDevValidateConfig(req->ifname, NULL, ifs->ifindex);
+
+        virNWFilterSnoopReqUnlock(req);
+
+        if (tmp <= 0)
+            return -1;
+
+        if (++ifs->errcount > PCAP_READ_MAXERRS) {
+            pcap_close(pc->handle);
+            pc->handle = NULL;
+
+            /* protect req->ifname */
+            virNWFilterSnoopReqLock(req);
+
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("interface '%s' failing; "
+                             "reopening"),
+                           req->ifname);
+            if (req->ifname)
+                pc->handle = virNWFilterSnoopDHCPOpen(req->ifname,
+                                                      &req->macaddr,
+                                                      pc->filter,
+                                                      pc->dir);
+
+            virNWFilterSnoopReqUnlock(req);
+
+            if (!pc->handle)
+                return -1;
         }
-        tmp = virNetDevGetIndex(req->ifname, &ifindex);
-        ignore_value(VIR_STRDUP(threadkey, req->threadkey));
-        worker = virThreadPoolNew(1, 1, 0,
-                                  virNWFilterDHCPDecodeWorker,
-                                  req);
+        return 0;
     }
 
-    /* let creator know how well we initialized */
-    if (error || !threadkey || tmp < 0 || !worker ||
-        ifindex != req->ifindex)
-        req->threadStatus = THREAD_STATUS_FAIL;
-    else
-        req->threadStatus = THREAD_STATUS_OK;
+    ifs->errcount = 0;
 
-    virCondSignal(&req->threadStatusCond);
+    if (rv == 0)
+        return 0;
 
-    virNWFilterSnoopReqUnlock(req);
+    /* submit packet to worker thread */
+    if (virAtomicIntGet(&req->qCtr[i]) > pc->maxQSize) {
+        if (time(0) - ifs->last_displayed_queue > 10) {
+            ifs->last_displayed_queue = time(0);
+            VIR_WARN("Worker thread for interface '%s' has a "
+                     "job queue that is too long",
+                     req->ifname);
+        }
+        return 0;
+    }
 
-    if (req->threadStatus != THREAD_STATUS_OK)
-        goto exit;
+    diff = virNWFilterSnoopRateLimit(&pc->rateLimit);
+    if (diff > 0) {
+        virNWFilterSnoopRatePenalty(pc, diff, DHCP_PKT_RATE);
+        /* rate-limited warnings */
+        if (time(0) - ifs->last_displayed > 10) {
+             ifs->last_displayed = time(0);
+             VIR_WARN("Too many DHCP packets on interface '%s'",
+                      req->ifname);
+        }
+        return 0;
+    }
+
+    if (virNWFilterSnoopDHCPDecodeJobSubmit(poller->worker, req, packet,
+                                            hdr->caplen, pc->dir,
+                                            &req->qCtr[i]) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Job submission failed on "
+                         "interface '%s'"), req->ifname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * A DHCP snooping thread. It waits for the pcap handles of all its
+ * interfaces in a single poll() and if it gets suitable packets, it
+ * submits them to its worker thread for processing. Having the packets
+ * of an interface decoded by a single worker keeps its leases in order.
+ */
+static void
+virNWFilterSnoopPollerThread(void *opaque)
+{
+    virNWFilterSnoopPollerPtr poller = opaque;
+    virNWFilterSnoopIfPtr *ifaces = NULL;
+    virNWFilterSnoopIfPtr *pending;
+    size_t nifaces = 0;
+    size_t npending;
+    struct pollfd *fds;
+    time_t lastCheck = 0;
+    bool quit = false;
+    size_t i, k;
+    int n, pollTo, tmp;
+    char buf[64];
+
+    while (!quit) {
+        bool check = false;
+        time_t now;
+
+        virMutexLock(&poller->lock);
+        quit = poller->quit;
+        pending = poller->pending;
+        npending = poller->nPending;
+        poller->pending = NULL;
+        poller->nPending = 0;
+        virMutexUnlock(&poller->lock);
+
+        /* pick up the new interfaces */
+        for (i = 0; i < npending; i++) {
+            if (VIR_APPEND_ELEMENT_COPY(ifaces, nifaces, pending[i]) < 0)
+                virNWFilterSnoopIfRemove(poller, pending[i], true);
+        }
+        VIR_FREE(pending);
 
-    while (!error) {
-        if (virNWFilterSnoopAdjustPoll(pcapConf,
-                                       ARRAY_CARDINALITY(pcapConf),
-                                       fds, &pollTo) < 0) {
+        if (quit)
             break;
+
+        if (VIR_RESIZE_N(poller->fds, poller->nfds, 0, 1 + 2 * nifaces) < 0) {
+            while (1 + 2 * nifaces > poller->nfds) {
+                virNWFilterSnoopIfRemove(poller, ifaces[nifaces - 1], true);
+                VIR_DELETE_ELEMENT(ifaces, nifaces - 1, nifaces);
+            }
         }
+        fds = poller->fds;
+
+        fds[0].fd = poller->wakeupFD[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+
+        pollTo = -1;
+
+        for (k = 0; k < nifaces; k++) {
+            virNWFilterSnoopIfPtr ifs = ifaces[k];
+            struct pollfd *pfd = &fds[1 + 2 * k];
+
+            for (i = 0; i < ARRAY_CARDINALITY(ifs->pcapConf); i++) {
+                pfd[i].fd = pcap_fileno(ifs->pcapConf[i].handle);
+                /* get a POLLERR if interface goes down or disappears */
+                pfd[i].events = POLLIN | POLLERR;
+                pfd[i].revents = 0;
+            }
 
-        /* cap pollTo so we don't hold up the join for too long */
+            if (virNWFilterSnoopAdjustPoll(ifs->pcapConf,
+                                           ARRAY_CARDINALITY(ifs->pcapConf),
+                                           pfd, &tmp) == 0 &&
+                tmp >= 0 && (pollTo < 0 || tmp < pollTo))
+                pollTo = tmp;
+        }
+
+        /* cap pollTo so we don't hold up the lease timers for too long */
         if (pollTo < 0 || pollTo > SNOOP_POLL_MAX_TIMEOUT_MS)
             pollTo = SNOOP_POLL_MAX_TIMEOUT_MS;
 
-        n = poll(fds, ARRAY_CARDINALITY(fds), pollTo);
+        n = poll(fds, 1 + 2 * nifaces, pollTo);
 
         if (n < 0) {
-            if (errno != EAGAIN && errno != EINTR)
-                error = true;
+            if (errno != EAGAIN && errno != EINTR) {
+                virReportSystemError(errno, "%s",
+                                     _("poll on snooped interfaces failed"));
+                for (k = 0; k < nifaces; k++)
+                    ifaces[k]->failed = true;
+            }
+            n = 0;
         }
 
-        virNWFilterSnoopReqLeaseTimerRun(req);
+        if (fds[0].revents) {
+            /* interfaces were added or cancelled */
+            while (read(fds[0].fd, buf, sizeof(buf)) > 0)
+                ; /* empty */
+            check = true;
+            n--;
+        }
+
+        for (k = 0; n > 0 && k < nifaces; k++) {
+            struct pollfd *pfd = &fds[1 + 2 * k];
+
+            for (i = 0; i < ARRAY_CARDINALITY(ifaces[k]->pcapConf); i++) {
+                if (!pfd[i].revents)
+                    continue;
+
+                n--;
+
+                if (!ifaces[k]->failed &&
+                    virNWFilterSnoopIfRead(poller, ifaces[k], i) < 0)
+                    ifaces[k]->failed = true;
+            }
+        }
+
+        now = time(0);
+        if (now != lastCheck)
+            check = true;
+        lastCheck = now;
 
         /*
-         * Check whether we were cancelled or whether
-         * a previously submitted job failed.
+         * Run the lease timers. Drop the interfaces that failed, were
+         * cancelled, or for which a previously submitted job failed.
          */
-        if (!virNWFilterSnoopIsActive(threadkey) ||
-            req->jobCompletionStatus != 0)
-            goto exit;
+        for (k = nifaces; k > 0; k--) {
+            virNWFilterSnoopIfPtr ifs = ifaces[k - 1];
 
-        for (i = 0; n > 0 && i < ARRAY_CARDINALITY(fds); i++) {
-            if (!fds[i].revents)
-                continue;
+            if (ifs->failed) {
+                virNWFilterSnoopIfRemove(poller, ifs, true);
+            } else if (check) {
+                virNWFilterSnoopReqLeaseTimerRun(ifs->req);
 
-            fds[i].revents = 0;
-            n--;
+                if (virNWFilterSnoopIsActive(ifs->threadkey) &&
+                    ifs->req->jobCompletionStatus == 0)
+                    continue;
 
-            rv = pcap_next_ex(pcapConf[i].handle, &hdr,
-                              (const u_char **)&packet);
+                virNWFilterSnoopIfRemove(poller, ifs, false);
+            } else {
+                continue;
+            }
 
-            if (rv < 0) {
-                /* error reading from socket */
-                tmp = -1;
+            VIR_DELETE_ELEMENT(ifaces, k - 1, nifaces);
+        }
+    }
 
-                /* protect req->ifname */
-                virNWFilterSnoopReqLock(req);
+    for (k = 0; k < nifaces; k++)
+        virNWFilterSnoopIfRemove(poller, ifaces[k], false);
 
-                if (req->ifname)
-                    tmp = virNetDevValidateConfig(req->ifname, NULL, ifindex);
+    VIR_FREE(ifaces);
+}
 
-                virNWFilterSnoopReqUnlock(req);
+static void
+virNWFilterSnoopPollerWakeup(virNWFilterSnoopPollerPtr poller)
+{
+    char c = 0;
 
-                if (tmp <= 0) {
-                    error = true;
-                    break;
-                }
+    /* a full pipe will wake up the poller just as well */
+    ignore_value(safewrite(poller->wakeupFD[1], &c, sizeof(c)));
+}
 
-                if (++errcount > PCAP_READ_MAXERRS) {
-                    pcap_close(pcapConf[i].handle);
-                    pcapConf[i].handle = NULL;
-
-                    /* protect req->ifname */
-                    virNWFilterSnoopReqLock(req);
-
-                    virReportError(VIR_ERR_INTERNAL_ERROR,
-                                   _("interface '%s' failing; "
-                                     "reopening"),
-                                   req->ifname);
-                    if (req->ifname)
-                        pcapConf[i].handle =
-                            virNWFilterSnoopDHCPOpen(req->ifname, &req->macaddr,
-                                                     pcapConf[i].filter,
-                                                     pcapConf[i].dir);
-
-                    virNWFilterSnoopReqUnlock(req);
-
-                    if (!pcapConf[i].handle) {
-                        error = true;
-                        break;
-                    }
-                }
-                continue;
-            }
+static virNWFilterSnoopPollerPtr
+virNWFilterSnoopPollerNew(void)
+{
+    virNWFilterSnoopPollerPtr poller;
 
-            errcount = 0;
+    if (VIR_ALLOC(poller) < 0)
+        return NULL;
 
-            if (rv) {
-                unsigned int diff;
+    poller->wakeupFD[0] = poller->wakeupFD[1] = -1;
 
-                /* submit packet to worker thread */
-                if (virAtomicIntGet(&pcapConf[i].qCtr) >
-                    pcapConf[i].maxQSize) {
-                    if (last_displayed_queue - time(0) > 10) {
-                        last_displayed_queue = time(0);
-                        VIR_WARN("Worker thread for interface '%s' has a "
-                                 "job queue that is too long",
-                                 req->ifname);
-                    }
-                    continue;
-                }
+    if (VIR_ALLOC_N(poller->fds, 1) < 0) {
+        VIR_FREE(poller);
+        return NULL;
+    }
+    poller->nfds = 1;
 
-                diff = virNWFilterSnoopRateLimit(&pcapConf[i].rateLimit);
-                if (diff > 0) {
-                    virNWFilterSnoopRatePenalty(&pcapConf[i], diff,
-                                                DHCP_PKT_RATE);
-                    /* rate-limited warnings */
-                    if (time(0) - last_displayed > 10) {
-                         last_displayed = time(0);
-                         VIR_WARN("Too many DHCP packets on interface '%s'",
-                                  req->ifname);
-                    }
-                    continue;
-                }
+    if (virMutexInit(&poller->lock) < 0) {
+        virReportSystemError(errno, "%s", _("unable to initialize mutex"));
+        VIR_FREE(poller->fds);
+        VIR_FREE(poller);
+        return NULL;
+    }
 
-                if (virNWFilterSnoopDHCPDecodeJobSubmit(worker, packet,
-                                                      hdr->caplen,
-                                                      pcapConf[i].dir,
-                                                      &pcapConf[i].qCtr) < 0) {
-                    virReportError(VIR_ERR_INTERNAL_ERROR,
-                                   _("Job submission failed on "
-                                     "interface '%s'"), req->ifname);
-                    error = true;
-                    break;
-                }
-            }
-        } /* for all fds */
-    } /* while (!error) */
+    if (pipe2(poller->wakeupFD, O_CLOEXEC) < 0 ||
+        virSetNonBlock(poller->wakeupFD[0]) < 0 ||
+        virSetNonBlock(poller->wakeupFD[1]) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create DHCP snooping wakeup pipe"));
+        goto error;
+    }
 
-    /* protect IfNameToKey */
-    virNWFilterSnoopLock();
+    /* A single decoder per poller: a pool has no way to keep the
+     * packets of an interface on one thread, so more of them could
+     * apply an interface's leases out of order. The rate limits keep
+     * the load of each interface small, decoding is cheap and only
+     * few messages write a lease, so up to SNOOP_MAX_POLLERS decoders
+     * in all keep up. */
+    if (!(poller->worker = virThreadPoolNew(1, 1, 0,
+                                            virNWFilterDHCPDecodeWorker,
+                                            NULL)))
+        goto error;
+
+    if (virThreadCreate(&poller->thread, true,
+                        virNWFilterSnoopPollerThread, poller) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create DHCP snooping thread"));
+        goto error;
+    }
 
-    /* protect req->ifname & req->threadkey */
-    virNWFilterSnoopReqLock(req);
+    return poller;
 
-    virNWFilterSnoopCancel(&req->threadkey);
+ error:
+    virThreadPoolFree(poller->worker);
+    VIR_FORCE_CLOSE(poller->wakeupFD[0]);
+    VIR_FORCE_CLOSE(poller->wakeupFD[1]);
+    virMutexDestroy(&poller->lock);
+    VIR_FREE(poller->fds);
+    VIR_FREE(poller);
+    return NULL;
+}
 
-    ignore_value(virHashRemoveEntry(virNWFilterSnoopState.ifnameToKey,
-                                    req->ifname));
+/*
+ * Stop a poller. Its interfaces should have been cancelled already.
+ * Call this function without the SnoopLock held.
+ */
+static void
+virNWFilterSnoopPollerFree(virNWFilterSnoopPollerPtr poller)
+{
+    if (!poller)
+        return;
 
-    VIR_FREE(req->ifname);
+    virMutexLock(&poller->lock);
+    poller->quit = true;
+    virMutexUnlock(&poller->lock);
 
-    virNWFilterSnoopReqUnlock(req);
-    virNWFilterSnoopUnlock();
+    virNWFilterSnoopPollerWakeup(poller);
+    virThreadJoin(&poller->thread);
 
- exit:
-    virThreadPoolFree(worker);
+    virThreadPoolFree(poller->worker);
+    VIR_FORCE_CLOSE(poller->wakeupFD[0]);
+    VIR_FORCE_CLOSE(poller->wakeupFD[1]);
+    virMutexDestroy(&poller->lock);
+    VIR_FREE(poller->fds);
+    VIR_FREE(poller);
+}
 
-    virNWFilterSnoopReqPut(req);
+/*
+ * Hand an interface over to the least busy poller, starting another
+ * poller while there are fewer than SNOOP_MAX_POLLERS. The poller takes
+ * over the reference of the interface to its req.
+ * Call this function with the SnoopLock held.
+ */
+static int
+virNWFilterSnoopPollerAdd(virNWFilterSnoopIfPtr ifs)
+{
+    virNWFilterSnoopPollerPtr poller = NULL;
+    size_t i;
+    int ret;
 
-    VIR_FREE(threadkey);
+    for (i = 0; i < virNWFilterSnoopState.nPollers; i++) {
+        virNWFilterSnoopPollerPtr tmp = virNWFilterSnoopState.pollers[i];
 
-    for (i = 0; i < ARRAY_CARDINALITY(pcapConf); i++) {
-        if (pcapConf[i].handle)
-            pcap_close(pcapConf[i].handle);
+        if (!poller ||
+            virAtomicIntGet(&tmp->nIfaces) < virAtomicIntGet(&poller->nIfaces))
+            poller = tmp;
     }
 
-    virAtomicIntDecAndTest(&virNWFilterSnoopState.nThreads);
+    if ((!poller || virAtomicIntGet(&poller->nIfaces) > 0) &&
+        virNWFilterSnoopState.nPollers < SNOOP_MAX_POLLERS) {
+        virNWFilterSnoopPollerPtr tmp;
+
+        /* an existing poller will do if this fails */
+        if ((tmp = virNWFilterSnoopPollerNew())) {
+            if (VIR_APPEND_ELEMENT_COPY(virNWFilterSnoopState.pollers,
+                                        virNWFilterSnoopState.nPollers,
+                                        tmp) < 0)
+                virNWFilterSnoopPollerFree(tmp);
+            else
+                poller = tmp;
+        }
+    }
 
-    return;
+    if (!poller)
+        return -1;
+
+    virMutexLock(&poller->lock);
+    if ((ret = VIR_APPEND_ELEMENT_COPY(poller->pending, poller->nPending,
+                                       ifs)) == 0)
+        virAtomicIntInc(&poller->nIfaces);
+    virMutexUnlock(&poller->lock);
+
+    if (ret < 0)
+        return -1;
+
+    virNWFilterSnoopPollerWakeup(poller);
+
+    return 0;
 }
 
 static void
@@ -1598,9 +1953,8 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
     bool isnewreq;
     char ifkey[VIR_IFKEY_LEN];
     int tmp;
-    virThread thread;
     virNWFilterVarValuePtr dhcpsrvrs;
-    bool threadPuts = false;
+    virNWFilterSnoopIfPtr ifs = NULL;
 
     virNWFilterSnoopIFKeyFMT(ifkey, vmuuid, macaddr);
 
@@ -1682,21 +2036,9 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
         goto exit_rem_ifnametokey;
     }
 
-    /* prevent thread from holding req */
+    /* prevent the poller from holding req */
     virNWFilterSnoopReqLock(req);
 
-    if (virThreadCreate(&thread, false, virNWFilterDHCPSnoopThread,
-                        req) != 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("virNWFilterDHCPSnoopReq virThreadCreate "
-                         "failed on interface '%s'"), ifname);
-        goto exit_snoopreq_unlock;
-    }
-
-    threadPuts = true;
-
-    virAtomicIntInc(&virNWFilterSnoopState.nThreads);
-
     req->threadkey = virNWFilterSnoopActivate(req);
     if (!req->threadkey) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -1712,20 +2054,29 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
         goto exit_snoop_cancel;
     }
 
-    /* sync with thread */
-    if (virCondWait(&req->threadStatusCond, &req->lock) < 0 ||
-        req->threadStatus != THREAD_STATUS_OK)
+    if (!(ifs = virNWFilterSnoopIfNew(req)))
         goto exit_snoop_cancel;
 
+    virAtomicIntInc(&virNWFilterSnoopState.nIfaces);
+
+    if (virNWFilterSnoopPollerAdd(ifs) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Starting to snoop failed on "
+                         "interface '%s'"), req->ifname);
+        virAtomicIntDecAndTest(&virNWFilterSnoopState.nIfaces);
+        goto exit_snoop_cancel;
+    }
+
     virNWFilterSnoopReqUnlock(req);
 
     virNWFilterSnoopUnlock();
 
-    /* do not 'put' the req -- the thread will do this */
+    /* do not 'put' the req -- the poller will do this */
 
     return 0;
 
  exit_snoop_cancel:
+    virNWFilterSnoopIfFree(ifs);
     virNWFilterSnoopCancel(&req->threadkey);
  exit_snoopreq_unlock:
     virNWFilterSnoopReqUnlock(req);
@@ -1734,8 +2085,7 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
  exit_snoopunlock:
     virNWFilterSnoopUnlock();
  exit_snoopreqput:
-    if (!threadPuts)
-        virNWFilterSnoopReqPut(req);
+    virNWFilterSnoopReqPut(req);
 
     return -1;
 }
@@ -1743,90 +2093,186 @@ virNWFilterDHCPSnoopReq(virNWFilterTechDriverPtr techdriver,
 static void
 virNWFilterSnoopLeaseFileClose(void)
 {
-    VIR_FORCE_CLOSE(virNWFilterSnoopState.leaseFD);
+    size_t i;
+
+    for (i = 0; i < LEASEFILE_SHARDS; i++) {
+        virNWFilterSnoopLeaseShardPtr shard =
+            &virNWFilterSnoopState.leaseShards[i];
+
+        virMutexLock(&shard->lock);
+        VIR_FORCE_CLOSE(shard->fd);
+        virMutexUnlock(&shard->lock);
+    }
+}
+
+/*
+ * Set up a shard keeping its leases in the directory @dir.
+ */
+int
+virNWFilterSnoopLeaseShardInit(virNWFilterSnoopLeaseShardPtr shard,
+                               const char *dir,
+                               size_t idx)
+{
+    memset(shard, 0, sizeof(*shard));
+    shard->idx = idx;
+    shard->fd = -1;
+
+    if (virAsprintf(&shard->path, LEASEFILE_FMT, dir, idx) < 0 ||
+        virAsprintf(&shard->tmpPath, TMPLEASEFILE_FMT, dir, idx) < 0)
+        goto error;
+
+    if (virMutexInit(&shard->compactLock) < 0)
+        goto error;
+
+    if (virMutexInit(&shard->lock) < 0) {
+        virMutexDestroy(&shard->compactLock);
+        goto error;
+    }
+
+    return 0;
+
+ error:
+    VIR_FREE(shard->path);
+    VIR_FREE(shard->tmpPath);
+    return -1;
 }
 
+/*
+ * Release what virNWFilterSnoopLeaseShardInit set up. Nobody may use
+ * the shard anymore.
+ */
+void
+virNWFilterSnoopLeaseShardClear(virNWFilterSnoopLeaseShardPtr shard)
+{
+    if (!shard->path)
+        return;
+
+    VIR_FORCE_CLOSE(shard->fd);
+    VIR_FREE(shard->path);
+    VIR_FREE(shard->tmpPath);
+    virMutexDestroy(&shard->lock);
+    virMutexDestroy(&shard->compactLock);
+}
+
+/*
+ * Open the lease file of a shard for appending.
+ * Call this function with the lock of the shard held.
+ */
 static void
-virNWFilterSnoopLeaseFileOpen(void)
+virNWFilterSnoopLeaseShardOpen(virNWFilterSnoopLeaseShardPtr shard)
 {
-    virNWFilterSnoopLeaseFileClose();
+    struct stat sb;
+
+    VIR_FORCE_CLOSE(shard->fd);
+    shard->size = 0;
+
+    shard->fd = open(shard->path, O_CREAT|O_RDWR|O_APPEND, 0644);
 
-    virNWFilterSnoopState.leaseFD = open(LEASEFILE, O_CREAT|O_RDWR|O_APPEND,
-                                         0644);
+    if (shard->fd >= 0 && fstat(shard->fd, &sb) == 0)
+        shard->size = sb.st_size;
 }
 
 /*
- * Write a single lease to the given file.
- *
+ * Format a single lease as a line of a lease file.
  */
-static int
-virNWFilterSnoopLeaseFileWrite(int lfd, const char *ifkey,
-                               virNWFilterSnoopIPLeasePtr ipl)
+static char *
+virNWFilterSnoopLeaseFormat(const char *ifkey,
+                            virNWFilterSnoopIPLeasePtr ipl)
 {
     char *lbuf = NULL;
     char *ipstr, *dhcpstr;
-    int len;
-    int ret = 0;
 
     ipstr = virSocketAddrFormat(&ipl->ipAddress);
     dhcpstr = virSocketAddrFormat(&ipl->ipServer);
 
-    if (!dhcpstr || !ipstr) {
-        ret = -1;
+    if (!dhcpstr || !ipstr)
         goto cleanup;
-    }
 
     /* time intf ip dhcpserver */
-    len = virAsprintf(&lbuf, "%u %s %s %s\n", ipl->timeout,
-                      ifkey, ipstr, dhcpstr);
+    ignore_value(virAsprintf(&lbuf, "%u %s %s %s\n", ipl->timeout,
+                             ifkey, ipstr, dhcpstr));
 
-    if (len < 0) {
-        ret = -1;
-        goto cleanup;
-    }
+ cleanup:
+    VIR_FREE(dhcpstr);
+    VIR_FREE(ipstr);
+
+    return lbuf;
+}
+
+/*
+ * Append a formatted lease to the file of the given shard, opening
+ * it first if needed.
+ * Call this function with the lock of the shard held.
+ */
+int
+virNWFilterSnoopLeaseShardAppend(virNWFilterSnoopLeaseShardPtr shard,
+                                 const char *lease)
+{
+    size_t len = strlen(lease);
+
+    if (shard->fd < 0)
+        virNWFilterSnoopLeaseShardOpen(shard);
 
-    if (safewrite(lfd, lbuf, len) != len) {
+    if (shard->fd < 0 || safewrite(shard->fd, lease, len) < 0) {
         virReportSystemError(errno, "%s", _("lease file write failed"));
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
 
-    ignore_value(fsync(lfd));
+    ignore_value(fsync(shard->fd));
+
+    shard->size += len;
+
+    return 0;
+}
+
+/*
+ * Write a single lease to the file of the given shard.
+ * Call this function with the lock of the shard held.
+ */
+static int
+virNWFilterSnoopLeaseFileWrite(virNWFilterSnoopLeaseShardPtr shard,
+                               const char *ifkey,
+                               virNWFilterSnoopIPLeasePtr ipl)
+{
+    char *lbuf;
+    int ret;
+
+    if (!(lbuf = virNWFilterSnoopLeaseFormat(ifkey, ipl)))
+        return -1;
+
+    ret = virNWFilterSnoopLeaseShardAppend(shard, lbuf);
 
- cleanup:
     VIR_FREE(lbuf);
-    VIR_FREE(dhcpstr);
-    VIR_FREE(ipstr);
 
     return ret;
 }
 
 /*
- * Append a single lease to the end of the lease file.
- * To keep a limited number of dead leases, re-read the lease
- * file if the threshold of active leases versus written ones
+ * Append a single lease to the end of the lease file of its req.
+ * To keep a limited number of dead leases, have the lease file
+ * rewritten if the threshold of active leases versus written ones
  * exceeds a threshold.
  */
 static void
 virNWFilterSnoopLeaseFileSave(virNWFilterSnoopIPLeasePtr ipl)
 {
     virNWFilterSnoopReqPtr req = ipl->snoopReq;
+    virNWFilterSnoopLeaseShardPtr shard = virNWFilterSnoopReqShard(req);
 
-    virNWFilterSnoopLock();
+    virMutexLock(&shard->lock);
 
-    if (virNWFilterSnoopState.leaseFD < 0)
-        virNWFilterSnoopLeaseFileOpen();
-    if (virNWFilterSnoopLeaseFileWrite(virNWFilterSnoopState.leaseFD,
-                                       req->ifkey, ipl) < 0)
+    if (virNWFilterSnoopLeaseFileWrite(shard, req->ifkey, ipl) < 0)
         goto err_exit;
 
     /* keep dead leases at < ~95% of file size */
-    if (virAtomicIntInc(&virNWFilterSnoopState.wLeases) >=
-        virAtomicIntGet(&virNWFilterSnoopState.nLeases) * 20)
-        virNWFilterSnoopLeaseFileLoad();   /* load & refresh lease file */
+    if (++shard->wLeases >= LEASEFILE_COMPACT_MIN &&
+        shard->wLeases >= virAtomicIntGet(&shard->nLeases) * 20 &&
+        !shard->compacting &&
+        virThreadPoolSendJob(virNWFilterSnoopState.compactor, 0, shard) == 0)
+        shard->compacting = true;
 
  err_exit:
-    virNWFilterSnoopUnlock();
+    virMutexUnlock(&shard->lock);
 }
 
 /*
@@ -1860,8 +2306,15 @@ virNWFilterSnoopPruneIter(const void *payload,
     return del_req;
 }
 
+struct virNWFilterSnoopSaveData {
+    size_t shard; /* LEASEFILE_SHARDS for all of them */
+    virBufferPtr buf;
+    int nLeases;
+};
+
 /*
- * Iterator to write all leases of a single request to a file.
+ * Iterator to format all leases of a single request if it belongs
+ * to the given shard.
  * Call this function with the SnoopLock held.
  */
 static int
@@ -1870,73 +2323,185 @@ virNWFilterSnoopSaveIter(void *payload,
                          void *data)
 {
     virNWFilterSnoopReqPtr req = payload;
-    int tfd = *(int *)data;
+    struct virNWFilterSnoopSaveData *save = data;
     virNWFilterSnoopIPLeasePtr ipl;
+    char *lbuf;
+
+    if (save->shard != LEASEFILE_SHARDS && req->shard != save->shard)
+        return 0;
 
     /* protect req->start */
     virNWFilterSnoopReqLock(req);
 
-    for (ipl = req->start; ipl; ipl = ipl->next)
-        ignore_value(virNWFilterSnoopLeaseFileWrite(tfd, req->ifkey, ipl));
+    for (ipl = req->start; ipl; ipl = ipl->next) {
+        if (!(lbuf = virNWFilterSnoopLeaseFormat(req->ifkey, ipl)))
+            continue;
+        virBufferAdd(save->buf, lbuf, -1);
+        save->nLeases++;
+        VIR_FREE(lbuf);
+    }
 
     virNWFilterSnoopReqUnlock(req);
     return 0;
 }
 
 /*
- * Write all valid leases into a temporary file and then
- * rename the file to the final file.
- * Call this function with the SnoopLock held.
+ * Replace the lease file of a shard by one holding @leases, followed by
+ * what was appended to the file from offset @start on, which is where
+ * it ended when @leases were collected. @nLeases is the number of
+ * lines in @leases.
+ * Call this function with the compactLock of the shard held.
  */
-static void
-virNWFilterSnoopLeaseFileRefresh(void)
+int
+virNWFilterSnoopLeaseShardReplace(virNWFilterSnoopLeaseShardPtr shard,
+                                  const char *leases,
+                                  int nLeases,
+                                  off_t start)
 {
-    int tfd;
+    char *tail = NULL;
+    size_t len = leases ? strlen(leases) : 0;
+    off_t tailLen = 0;
+    off_t i;
+    int tfd = -1;
+    int ret = -1;
 
-    if (virFileMakePathWithMode(LEASEFILE_DIR, 0700) < 0) {
-        virReportError(errno, _("mkdir(\"%s\")"), LEASEFILE_DIR);
-        return;
-    }
+    if (unlink(shard->tmpPath) < 0 && errno != ENOENT)
+        virReportSystemError(errno, _("unlink(\"%s\")"), shard->tmpPath);
 
-    if (unlink(TMPLEASEFILE) < 0 && errno != ENOENT)
-        virReportSystemError(errno, _("unlink(\"%s\")"), TMPLEASEFILE);
-
-    /* lease file loaded, delete old one */
-    tfd = open(TMPLEASEFILE, O_CREAT|O_RDWR|O_TRUNC|O_EXCL, 0644);
+    tfd = open(shard->tmpPath, O_CREAT|O_RDWR|O_APPEND|O_TRUNC|O_EXCL, 0644);
     if (tfd < 0) {
-        virReportSystemError(errno, _("open(\"%s\")"), TMPLEASEFILE);
-        return;
+        virReportSystemError(errno, _("open(\"%s\")"), shard->tmpPath);
+        goto cleanup;
     }
 
-    if (virNWFilterSnoopState.snoopReqs) {
-        /* clean up the requests */
-        virHashRemoveSet(virNWFilterSnoopState.snoopReqs,
-                         virNWFilterSnoopPruneIter, NULL);
-        /* now save them */
-        virHashForEach(virNWFilterSnoopState.snoopReqs,
-                       virNWFilterSnoopSaveIter, (void *)&tfd);
+    if (safewrite(tfd, leases, len) < 0) {
+        virReportSystemError(errno, _("unable to write %s"), shard->tmpPath);
+        goto cleanup_unlink;
+    }
+
+    /* no more appending until the new file is in place */
+    virMutexLock(&shard->lock);
+
+    if (shard->size > start) {
+        tailLen = shard->size - start;
+
+        if (VIR_ALLOC_N(tail, tailLen) < 0)
+            goto cleanup_shardunlock;
+
+        if (pread(shard->fd, tail, tailLen, start) != tailLen ||
+            safewrite(tfd, tail, tailLen) < 0) {
+            virReportSystemError(errno, _("unable to copy %s to %s"),
+                                 shard->path, shard->tmpPath);
+            goto cleanup_shardunlock;
+        }
+
+        for (i = 0; i < tailLen; i++) {
+            if (tail[i] == '\n')
+                nLeases++;
+        }
     }
 
-    if (VIR_CLOSE(tfd) < 0) {
-        virReportSystemError(errno, _("unable to close %s"), TMPLEASEFILE);
-        /* assuming the old lease file is still better, skip the renaming */
-        goto skip_rename;
+    if (fsync(tfd) < 0) {
+        virReportSystemError(errno, _("unable to sync %s"), shard->tmpPath);
+        goto cleanup_shardunlock;
     }
 
-    if (rename(TMPLEASEFILE, LEASEFILE) < 0) {
+    if (rename(shard->tmpPath, shard->path) < 0) {
         virReportSystemError(errno, _("rename(\"%s\", \"%s\")"),
-                             TMPLEASEFILE, LEASEFILE);
-        ignore_value(unlink(TMPLEASEFILE));
+                             shard->tmpPath, shard->path);
+        goto cleanup_shardunlock;
     }
-    virAtomicIntSet(&virNWFilterSnoopState.wLeases, 0);
 
- skip_rename:
-    virNWFilterSnoopLeaseFileOpen();
+    VIR_FORCE_CLOSE(shard->fd);
+    shard->fd = tfd;
+    tfd = -1;
+    shard->size = len + tailLen;
+    shard->wLeases = nLeases;
+
+    virMutexUnlock(&shard->lock);
+
+    ret = 0;
+    goto cleanup;
+
+ cleanup_shardunlock:
+    virMutexUnlock(&shard->lock);
+ cleanup_unlink:
+    ignore_value(unlink(shard->tmpPath));
+ cleanup:
+    VIR_FORCE_CLOSE(tfd);
+    VIR_FREE(tail);
+
+    return ret;
 }
 
+/*
+ * Rewrite the lease file of a shard with all its valid leases, keeping
+ * what gets appended to it meanwhile.
+ * Call this function with the compactLock of the shard held.
+ */
+static int
+virNWFilterSnoopLeaseShardRefresh(virNWFilterSnoopLeaseShardPtr shard)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    struct virNWFilterSnoopSaveData data = { shard->idx, &buf, 0 };
+    char *leases = NULL;
+    off_t start;
+    int ret = -1;
+
+    virMutexLock(&shard->lock);
+    if (shard->fd < 0)
+        virNWFilterSnoopLeaseShardOpen(shard);
+    start = shard->size;
+    virMutexUnlock(&shard->lock);
+
+    virNWFilterSnoopLock();
+    if (virNWFilterSnoopState.snoopReqs)
+        virHashForEach(virNWFilterSnoopState.snoopReqs,
+                       virNWFilterSnoopSaveIter, &data);
+    virNWFilterSnoopUnlock();
+
+    if (virBufferCheckError(&buf) < 0)
+        goto cleanup;
+
+    leases = virBufferContentAndReset(&buf);
+
+    ret = virNWFilterSnoopLeaseShardReplace(shard, leases, data.nLeases,
+                                            start);
+
+ cleanup:
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(leases);
+
+    return ret;
+}
 
+/*
+ * Worker function of the compactor, rewriting the lease file of a shard
+ * in the background
+ */
 static void
-virNWFilterSnoopLeaseFileLoad(void)
+virNWFilterSnoopLeaseShardCompact(void *jobdata,
+                                  void *opaque ATTRIBUTE_UNUSED)
+{
+    virNWFilterSnoopLeaseShardPtr shard = jobdata;
+
+    virMutexLock(&shard->compactLock);
+
+    ignore_value(virNWFilterSnoopLeaseShardRefresh(shard));
+
+    virMutexLock(&shard->lock);
+    shard->compacting = false;
+    virMutexUnlock(&shard->lock);
+
+    virMutexUnlock(&shard->compactLock);
+}
+
+/*
+ * Read the leases from a lease file.
+ * Call this function with the SnoopLock held.
+ */
+static void
+virNWFilterSnoopLeaseFileRead(const char *path)
 {
     char line[256], ifkey[VIR_IFKEY_LEN];
     char ipstr[INET_ADDRSTRLEN], srvstr[INET_ADDRSTRLEN];
@@ -1946,10 +2511,7 @@ virNWFilterSnoopLeaseFileLoad(void)
     FILE *fp;
     int ln = 0, tmp;
 
-    /* protect the lease file */
-    virNWFilterSnoopLock();
-
-    fp = fopen(LEASEFILE, "r");
+    fp = fopen(path, "r");
     time(&now);
     while (fp && fgets(line, sizeof(line), fp)) {
         if (line[strlen(line)-1] != '\n') {
@@ -2005,23 +2567,148 @@ virNWFilterSnoopLeaseFileLoad(void)
     }
 
     VIR_FORCE_FCLOSE(fp);
+}
+
+/*
+ * Rewrite all lease files, without the requests that have no leases.
+ * Call this function with the compactLock of all shards and the
+ * SnoopLock held.
+ */
+static void
+virNWFilterSnoopLeaseFileRefresh(void)
+{
+    size_t i;
+
+    if (virFileMakePathWithMode(LEASEFILE_DIR, 0700) < 0) {
+        virReportError(errno, _("mkdir(\"%s\")"), LEASEFILE_DIR);
+        return;
+    }
+
+    if (virNWFilterSnoopState.snoopReqs) {
+        /* clean up the requests */
+        virHashRemoveSet(virNWFilterSnoopState.snoopReqs,
+                         virNWFilterSnoopPruneIter, NULL);
+    }
+
+    for (i = 0; i < LEASEFILE_SHARDS; i++)
+        ignore_value(virNWFilterSnoopLeaseShardRefresh(
+                         &virNWFilterSnoopState.leaseShards[i]));
+}
+
+/*
+ * Write a snapshot of all leases to the legacy lease file.
+ * Call this function with the SnoopLock held.
+ */
+static void
+virNWFilterSnoopLeaseFileSaveLegacy(void)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    struct virNWFilterSnoopSaveData data = { LEASEFILE_SHARDS, &buf, 0 };
+    char *leases = NULL;
+
+    if (virNWFilterSnoopState.snoopReqs)
+        virHashForEach(virNWFilterSnoopState.snoopReqs,
+                       virNWFilterSnoopSaveIter, &data);
+
+    if (virBufferCheckError(&buf) < 0)
+        return;
+
+    leases = virBufferContentAndReset(&buf);
+
+    ignore_value(virFileRewriteStr(LEGACY_LEASEFILE, 0644,
+                                   leases ? leases : ""));
+
+    VIR_FREE(leases);
+}
+
+/*
+ * Whether the legacy lease file was written after all the shards,
+ * by an older version or on our last shutdown, and hence has the
+ * current leases.
+ */
+static bool
+virNWFilterSnoopLeaseFileLegacyIsNewest(void)
+{
+    struct stat sb;
+    struct timespec legacy, mtime;
+    size_t i;
+
+    if (stat(LEGACY_LEASEFILE, &sb) < 0)
+        return false;
+    legacy = get_stat_mtime(&sb);
+
+    for (i = 0; i < LEASEFILE_SHARDS; i++) {
+        if (stat(virNWFilterSnoopState.leaseShards[i].path, &sb) < 0)
+            continue;
+        mtime = get_stat_mtime(&sb);
+
+        if (mtime.tv_sec > legacy.tv_sec ||
+            (mtime.tv_sec == legacy.tv_sec && mtime.tv_nsec > legacy.tv_nsec))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Load the leases from all lease files and rewrite them.
+ * Call this function without the SnoopLock held.
+ */
+static void
+virNWFilterSnoopLeaseFileLoad(void)
+{
+    size_t i;
+
+    for (i = 0; i < LEASEFILE_SHARDS; i++)
+        virMutexLock(&virNWFilterSnoopState.leaseShards[i].compactLock);
+
+    /* protect the lease files */
+    virNWFilterSnoopLock();
+
+    /* the shards have what changed after a crash, the legacy file
+     * what changed while an older version ran */
+    if (virNWFilterSnoopLeaseFileLegacyIsNewest()) {
+        virNWFilterSnoopLeaseFileRead(LEGACY_LEASEFILE);
+    } else {
+        for (i = 0; i < LEASEFILE_SHARDS; i++)
+            virNWFilterSnoopLeaseFileRead(
+                virNWFilterSnoopState.leaseShards[i].path);
+    }
 
     virNWFilterSnoopLeaseFileRefresh();
 
     virNWFilterSnoopUnlock();
+
+    for (i = 0; i < LEASEFILE_SHARDS; i++)
+        virMutexUnlock(&virNWFilterSnoopState.leaseShards[i].compactLock);
 }
 
 /*
- * Wait until all threads have ended.
+ * Wait until snooping stopped on all interfaces, then end the pollers.
  */
 static void
 virNWFilterSnoopJoinThreads(void)
 {
-    while (virAtomicIntGet(&virNWFilterSnoopState.nThreads) != 0) {
-        VIR_WARN("Waiting for snooping threads to terminate: %u",
-                 virAtomicIntGet(&virNWFilterSnoopState.nThreads));
+    virNWFilterSnoopPollerPtr *pollers;
+    size_t npollers;
+    size_t i;
+
+    while (virAtomicIntGet(&virNWFilterSnoopState.nIfaces) != 0) {
+        VIR_WARN("Waiting for snooping to stop on %u interfaces",
+                 virAtomicIntGet(&virNWFilterSnoopState.nIfaces));
         usleep(1000 * 1000);
     }
+
+    virNWFilterSnoopLock();
+    pollers = virNWFilterSnoopState.pollers;
+    npollers = virNWFilterSnoopState.nPollers;
+    virNWFilterSnoopState.pollers = NULL;
+    virNWFilterSnoopState.nPollers = 0;
+    virNWFilterSnoopUnlock();
+
+    for (i = 0; i < npollers; i++)
+        virNWFilterSnoopPollerFree(pollers[i]);
+    VIR_FREE(pollers);
 }
 
 /*
@@ -2078,6 +2765,8 @@ virNWFilterSnoopEndThreads(void)
 int
 virNWFilterDHCPSnoopInit(void)
 {
+    size_t i;
+
     if (virNWFilterSnoopState.snoopReqs)
         return 0;
 
@@ -2087,22 +2776,33 @@ virNWFilterDHCPSnoopInit(void)
         virMutexInit(&virNWFilterSnoopState.activeLock) < 0)
         return -1;
 
+    for (i = 0; i < LEASEFILE_SHARDS; i++) {
+        if (virNWFilterSnoopLeaseShardInit(
+                &virNWFilterSnoopState.leaseShards[i], LEASEFILE_DIR, i) < 0)
+            return -1;
+    }
+
     virNWFilterSnoopState.ifnameToKey = virHashCreate(0, NULL);
     virNWFilterSnoopState.active = virHashCreate(0, NULL);
     virNWFilterSnoopState.snoopReqs =
         virHashCreate(0, virNWFilterSnoopReqRelease);
+    virNWFilterSnoopState.compactor =
+        virThreadPoolNew(1, 1, 0, virNWFilterSnoopLeaseShardCompact, NULL);
 
     if (!virNWFilterSnoopState.ifnameToKey ||
         !virNWFilterSnoopState.snoopReqs ||
-        !virNWFilterSnoopState.active)
+        !virNWFilterSnoopState.active ||
+        !virNWFilterSnoopState.compactor)
         goto err_exit;
 
     virNWFilterSnoopLeaseFileLoad();
-    virNWFilterSnoopLeaseFileOpen();
 
     return 0;
 
  err_exit:
+    virThreadPoolFree(virNWFilterSnoopState.compactor);
+    virNWFilterSnoopState.compactor = NULL;
+
     virHashFree(virNWFilterSnoopState.ifnameToKey);
     virNWFilterSnoopState.ifnameToKey = NULL;
 
@@ -2129,6 +2829,7 @@ void
 virNWFilterDHCPSnoopEnd(const char *ifname)
 {
     char *ifkey = NULL;
+    bool reload = false;
 
     virNWFilterSnoopLock();
 
@@ -2174,25 +2875,39 @@ virNWFilterDHCPSnoopEnd(const char *ifname)
         /* tell the threads to terminate */
         virNWFilterSnoopEndThreads();
 
-        virNWFilterSnoopLeaseFileLoad();
+        reload = true;
     }
 
  cleanup:
     virNWFilterSnoopUnlock();
+
+    /* the compactLocks must not be taken with the SnoopLock held */
+    if (reload)
+        virNWFilterSnoopLeaseFileLoad();
 }
 
 void
 virNWFilterDHCPSnoopShutdown(void)
 {
+    size_t i;
+
     virNWFilterSnoopEndThreads();
     virNWFilterSnoopJoinThreads();
 
+    /* wait for a rewrite in progress */
+    virThreadPoolFree(virNWFilterSnoopState.compactor);
+    virNWFilterSnoopState.compactor = NULL;
+
     virNWFilterSnoopLock();
 
     virNWFilterSnoopLeaseFileClose();
+    virNWFilterSnoopLeaseFileSaveLegacy();
     virHashFree(virNWFilterSnoopState.ifnameToKey);
     virHashFree(virNWFilterSnoopState.snoopReqs);
 
+    for (i = 0; i < LEASEFILE_SHARDS; i++)
+        virNWFilterSnoopLeaseShardClear(&virNWFilterSnoopState.leaseShards[i]);
+
     virNWFilterSnoopUnlock();
 
     virNWFilterSnoopActiveLock();
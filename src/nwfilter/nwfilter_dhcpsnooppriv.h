@@ -0,0 +1,63 @@
+/*
+ * nwfilter_dhcpsnooppriv.h: lease files of DHCP snooping, exposed
+ *                           for the test suite
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __NWFILTER_DHCPSNOOP_PRIV_H_ALLOW__
+# error "nwfilter_dhcpsnooppriv.h may only be included by nwfilter_dhcpsnoop.c or test suites"
+#endif
+
+#ifndef __NWFILTER_DHCPSNOOP_PRIV_H__
+# define __NWFILTER_DHCPSNOOP_PRIV_H__
+
+# include <sys/types.h>
+
+# include "nwfilter_dhcpsnoop.h"
+# include "virthread.h"
+
+typedef struct _virNWFilterSnoopLeaseShard virNWFilterSnoopLeaseShard;
+typedef virNWFilterSnoopLeaseShard *virNWFilterSnoopLeaseShardPtr;
+
+struct _virNWFilterSnoopLeaseShard {
+    size_t               idx;
+    char                *path;
+    char                *tmpPath;
+    int                  nLeases; /* number of active leases, atomic */
+    virMutex             compactLock; /* serializes rewrites of the file */
+    virMutex             lock; /* protects the members below */
+    int                  fd;
+    off_t                size; /* size of the file */
+    int                  wLeases; /* number of written leases */
+    bool                 compacting; /* a rewrite is queued */
+};
+
+int virNWFilterSnoopLeaseShardInit(virNWFilterSnoopLeaseShardPtr shard,
+                                   const char *dir,
+                                   size_t idx);
+
+void virNWFilterSnoopLeaseShardClear(virNWFilterSnoopLeaseShardPtr shard);
+
+int virNWFilterSnoopLeaseShardAppend(virNWFilterSnoopLeaseShardPtr shard,
+                                     const char *lease);
+
+int virNWFilterSnoopLeaseShardReplace(virNWFilterSnoopLeaseShardPtr shard,
+                                      const char *leases,
+                                      int nLeases,
+                                      off_t start);
+
+#endif /* __NWFILTER_DHCPSNOOP_PRIV_H__ */
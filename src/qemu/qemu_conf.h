@@ -33,6 +33,7 @@
 # include "domain_conf.h"
 # include "snapshot_conf.h"
 # include "domain_event.h"
+# include "virdomainstatssampler.h"
 # include "virthread.h"
 # include "security/security_manager.h"
 # include "virpci.h"
@@ -49,6 +50,7 @@
 # include "virhostdev.h"
 # include "virfile.h"
 # include "virfirmware.h"
+# include "qemu_status.h"
 
 # ifdef CPU_SETSIZE /* Linux */
 #  define QEMUD_CPUMASK_LEN CPU_SETSIZE
@@ -164,6 +166,13 @@ struct _virQEMUDriverConfig {
 
     unsigned int maxQueuedJobs;
 
+    unsigned int statsWorkers;
+    unsigned int statsTimeout;
+
+    unsigned int reconnectWorkers;
+
+    unsigned int statusFlushDelay;
+
     char **securityDriverNames;
     bool securityDefaultConfined;
     bool securityRequireConfined;
@@ -208,6 +217,23 @@ struct _virQEMUDriver {
     /* Immutable pointer, self-locking APIs */
     virThreadPoolPtr workerPool;
 
+    /* Immutable pointer, self-locking APIs. NULL unless statistics
+     * are collected in parallel */
+    virThreadPoolPtr statsPool;
+
+    /* Require lock to get the pointer, self-locking APIs. NULL unless
+     * domains are reconnected by a bounded number of threads at
+     * startup, and again once they all are */
+    virThreadPoolPtr reconnectPool;
+
+    /* Atomic inc/dec only. Reconnects queued to reconnectPool, plus
+     * one while they are being queued */
+    int reconnectPending;
+
+    /* Immutable pointer, self-locking APIs. NULL unless status
+     * changes may be written with a delay */
+    qemuStatusFlusherPtr statusFlusher;
+
     /* Atomic increment only */
     int lastvmid;
 
@@ -244,6 +270,9 @@ struct _virQEMUDriver {
     /* Immutable pointer, self-locking APIs */
     virObjectEventStatePtr domainEventState;
 
+    /* Immutable pointer, self-locking APIs */
+    virDomainStatsSamplerListPtr statsSamplers;
+
     /* Immutable pointer. self-locking APIs */
     virSecurityManagerPtr securityManager;
 
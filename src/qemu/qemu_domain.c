@@ -3282,6 +3282,38 @@ qemuDomainObjSaveJob(virQEMUDriverPtr driver, virDomainObjPtr obj)
     virObjectUnref(cfg);
 }
 
+
+/**
+ * qemuDomainSaveStatusDeferred:
+ * @driver: qemu driver data
+ * @vm: locked domain object
+ *
+ * Save the status of @vm after a change which does not need to be on
+ * disk right away to recover the domain if libvirtd crashes. With a
+ * status_flush_delay configured, the write happens later, together
+ * with other changes made by then, unless something saves the status
+ * synchronously first.
+ */
+void
+qemuDomainSaveStatusDeferred(virQEMUDriverPtr driver,
+                             virDomainObjPtr vm)
+{
+    virQEMUDriverConfigPtr cfg;
+
+    if (!virDomainObjIsActive(vm))
+        return;
+
+    if (driver->statusFlusher &&
+        qemuStatusFlusherMarkDirty(driver->statusFlusher, vm) == 0)
+        return;
+
+    cfg = virQEMUDriverGetConfig(driver);
+    if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0)
+        VIR_WARN("Failed to save status on vm %s", vm->def->name);
+    virObjectUnref(cfg);
+}
+
+
 void
 qemuDomainObjSetJobPhase(virQEMUDriverPtr driver,
                          virDomainObjPtr obj,
@@ -3369,7 +3401,8 @@ static int ATTRIBUTE_NONNULL(1)
 qemuDomainObjBeginJobInternal(virQEMUDriverPtr driver,
                               virDomainObjPtr obj,
                               qemuDomainJob job,
-                              qemuDomainAsyncJob asyncJob)
+                              qemuDomainAsyncJob asyncJob,
+                              bool save)
 {
     qemuDomainObjPrivatePtr priv = obj->privateData;
     unsigned long long now;
@@ -3451,7 +3484,7 @@ qemuDomainObjBeginJobInternal(virQEMUDriverPtr driver,
         priv->job.current->started = now;
     }
 
-    if (qemuDomainTrackJob(job))
+    if (save && qemuDomainTrackJob(job))
         qemuDomainObjSaveJob(driver, obj);
 
     virObjectUnref(cfg);
@@ -3528,7 +3561,25 @@ int qemuDomainObjBeginJob(virQEMUDriverPtr driver,
                           qemuDomainJob job)
 {
     if (qemuDomainObjBeginJobInternal(driver, obj, job,
-                                      QEMU_ASYNC_JOB_NONE) < 0)
+                                      QEMU_ASYNC_JOB_NONE, true) < 0)
+        return -1;
+    else
+        return 0;
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Same as qemuDomainObjBeginJob, except that the job is not recorded
+ * in the domain status XML. Meant for callers which are going to
+ * rewrite the status XML anyway once they're done.
+ */
+int qemuDomainObjBeginJobNoSave(virQEMUDriverPtr driver,
+                                virDomainObjPtr obj,
+                                qemuDomainJob job)
+{
+    if (qemuDomainObjBeginJobInternal(driver, obj, job,
+                                      QEMU_ASYNC_JOB_NONE, false) < 0)
         return -1;
     else
         return 0;
@@ -3539,7 +3590,7 @@ int qemuDomainObjBeginAsyncJob(virQEMUDriverPtr driver,
                                qemuDomainAsyncJob asyncJob)
 {
     if (qemuDomainObjBeginJobInternal(driver, obj, QEMU_JOB_ASYNC,
-                                      asyncJob) < 0)
+                                      asyncJob, true) < 0)
         return -1;
     else
         return 0;
@@ -3565,7 +3616,8 @@ qemuDomainObjBeginNestedJob(virQEMUDriverPtr driver,
 
     return qemuDomainObjBeginJobInternal(driver, obj,
                                          QEMU_JOB_ASYNC_NESTED,
-                                         QEMU_ASYNC_JOB_NONE);
+                                         QEMU_ASYNC_JOB_NONE,
+                                         true);
 }
 
 
@@ -3590,7 +3642,7 @@ qemuDomainObjEndJob(virQEMUDriverPtr driver, virDomainObjPtr obj)
 
     qemuDomainObjResetJob(priv);
     if (qemuDomainTrackJob(job))
-        qemuDomainObjSaveJob(driver, obj);
+        qemuDomainSaveStatusDeferred(driver, obj);
     virCondSignal(&priv->job.cond);
 }
 
@@ -3606,6 +3658,9 @@ qemuDomainObjEndAsyncJob(virQEMUDriverPtr driver, virDomainObjPtr obj)
               obj, obj->def->name);
 
     qemuDomainObjResetAsyncJob(priv);
+    /* Not deferred: recovery after a crash acts on the async job and
+     * phase recorded in the status XML, so a stale one would e.g. kill
+     * or resume a domain that finished migrating. */
     qemuDomainObjSaveJob(driver, obj);
     virCondBroadcast(&priv->job.asyncCond);
 }
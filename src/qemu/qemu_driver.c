@@ -136,6 +136,12 @@ VIR_LOG_INIT("qemu.qemu_driver");
 
 #define QEMU_NB_BANDWIDTH_PARAM 7
 
+static void qemuDomainGetStatsBatchWorker(void *jobdata, void *opaque);
+static int qemuDomainStatsSamplerCollect(virConnectPtr conn,
+                                         unsigned int stats,
+                                         virDomainStatsRecordPtr **records,
+                                         unsigned int flags);
+
 static void processWatchdogEvent(virQEMUDriverPtr driver,
                                  virDomainObjPtr vm,
                                  int action);
@@ -618,6 +624,21 @@ qemuDomainFindMaxID(virDomainObjPtr vm,
 }
 
 
+static int
+qemuStateSaveStatus(virDomainObjPtr vm,
+                    void *opaque)
+{
+    virQEMUDriverPtr driver = opaque;
+    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
+    int ret;
+
+    ret = virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps);
+
+    virObjectUnref(cfg);
+    return ret;
+}
+
+
 /**
  * qemuStateInitialize:
  *
@@ -659,6 +680,12 @@ qemuStateInitialize(bool privileged,
     if (!qemu_driver->domainEventState)
         goto error;
 
+    qemu_driver->statsSamplers =
+        virDomainStatsSamplerListNew(qemu_driver->domainEventState,
+                                     qemuDomainStatsSamplerCollect);
+    if (!qemu_driver->statsSamplers)
+        goto error;
+
     /* read the host sysinfo */
     if (privileged)
         qemu_driver->hostsysinfo = virSysinfoRead();
@@ -919,12 +946,26 @@ qemuStateInitialize(bool privileged,
                             qemuDomainManagedSaveLoad,
                             qemu_driver);
 
+    if (cfg->statusFlushDelay &&
+        !(qemu_driver->statusFlusher =
+          qemuStatusFlusherNew(cfg->statusFlushDelay,
+                               qemuStateSaveStatus, qemu_driver)))
+        goto error;
+
     qemuProcessReconnectAll(conn, qemu_driver);
 
     qemu_driver->workerPool = virThreadPoolNew(0, 1, 0, qemuProcessEventHandler, qemu_driver);
     if (!qemu_driver->workerPool)
         goto error;
 
+    if (cfg->statsWorkers) {
+        qemu_driver->statsPool = virThreadPoolNew(0, cfg->statsWorkers, 0,
+                                                  qemuDomainGetStatsBatchWorker,
+                                                  qemu_driver);
+        if (!qemu_driver->statsPool)
+            goto error;
+    }
+
     virObjectUnref(conn);
 
     virNWFilterRegisterCallbackDriver(&qemuCallbackDriver);
@@ -1064,11 +1105,23 @@ qemuStateStop(void)
 static int
 qemuStateCleanup(void)
 {
+    virThreadPoolPtr reconnectPool;
+
     if (!qemu_driver)
         return -1;
 
+    /* Samplers collect statistics through everything freed below */
+    virDomainStatsSamplerListStop(qemu_driver->statsSamplers);
+
     virNWFilterUnRegisterCallbackDriver(&qemuCallbackDriver);
     virThreadPoolFree(qemu_driver->workerPool);
+    virThreadPoolFree(qemu_driver->statsPool);
+    qemuDriverLock(qemu_driver);
+    reconnectPool = qemu_driver->reconnectPool;
+    qemu_driver->reconnectPool = NULL;
+    qemuDriverUnlock(qemu_driver);
+    virThreadPoolFree(reconnectPool);
+    qemuStatusFlusherFree(qemu_driver->statusFlusher);
     virObjectUnref(qemu_driver->config);
     virObjectUnref(qemu_driver->hostdevMgr);
     virHashFree(qemu_driver->sharedDevices);
@@ -1093,6 +1146,8 @@ qemuStateCleanup(void)
 
     ebtablesContextFree(qemu_driver->ebtables);
 
+    virObjectUnref(qemu_driver->statsSamplers);
+
     /* Free domain callback list */
     virObjectUnref(qemu_driver->domainEventState);
 
@@ -19670,6 +19725,393 @@ qemuDomainGetStats(virConnectPtr conn,
 }
 
 
+/* Collect the statistics of a single domain, entering a job if
+ * @privflags asks for one */
+static int
+qemuConnectGetAllDomainStatsOne(virConnectPtr conn,
+                                virDomainObjPtr vm,
+                                unsigned int stats,
+                                unsigned int privflags,
+                                virDomainStatsRecordPtr *record,
+                                unsigned int flags)
+{
+    virQEMUDriverPtr driver = conn->privateData;
+    unsigned int domflags = 0;
+    int ret;
+
+    virObjectLock(vm);
+
+    if (HAVE_JOB(privflags) &&
+        qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) == 0)
+        domflags |= QEMU_DOMAIN_STATS_HAVE_JOB;
+    /* else: without a job it's still possible to gather some data */
+
+    if (flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_BACKING)
+        domflags |= QEMU_DOMAIN_STATS_BACKING;
+
+    ret = qemuDomainGetStats(conn, vm, stats, record, domflags);
+
+    if (HAVE_JOB(domflags))
+        qemuDomainObjEndJob(driver, vm);
+
+    virObjectUnlock(vm);
+    return ret;
+}
+
+
+static void
+qemuDomainStatsRecordFree(virDomainStatsRecordPtr record)
+{
+    if (!record)
+        return;
+
+    virObjectUnref(record->dom);
+    virTypedParamsFree(record->params, record->nparams);
+    VIR_FREE(record);
+}
+
+
+/*
+ * Parallel collection of statistics: the domains are handed over to
+ * the threads of driver->statsPool and the calling thread waits for
+ * their records. A domain whose collection takes longer than the
+ * stats_timeout of qemu.conf is given up on, and only the statistics
+ * which need no job are collected for it by the calling thread. The
+ * worker keeps going in the background and throws its record away,
+ * which is why the batch is reference counted. Until it is done, no
+ * other job is queued for the same domain, so that a domain whose
+ * monitor is stuck holds at most one thread of the pool.
+ */
+typedef enum {
+    QEMU_DOMAIN_GET_STATS_JOB_QUEUED,
+    QEMU_DOMAIN_GET_STATS_JOB_RUNNING,
+    QEMU_DOMAIN_GET_STATS_JOB_DONE,
+    QEMU_DOMAIN_GET_STATS_JOB_EXPIRED,
+} qemuDomainGetStatsJobState;
+
+typedef struct _qemuDomainGetStatsBatch qemuDomainGetStatsBatch;
+typedef qemuDomainGetStatsBatch *qemuDomainGetStatsBatchPtr;
+
+typedef struct _qemuDomainGetStatsJob qemuDomainGetStatsJob;
+typedef qemuDomainGetStatsJob *qemuDomainGetStatsJobPtr;
+struct _qemuDomainGetStatsJob {
+    qemuDomainGetStatsBatchPtr batch;
+    virDomainObjPtr vm;
+    char *name;
+    qemuDomainGetStatsJobState state;
+    unsigned long long started;
+    virDomainStatsRecordPtr record;
+};
+
+struct _qemuDomainGetStatsBatch {
+    virObjectLockable parent;
+
+    virCond cond;
+
+    /* Immutable once jobs are dispatched */
+    virConnectPtr conn;
+    unsigned int stats;
+    unsigned int privflags;
+    unsigned int flags;
+
+    /* Last time a job started or finished */
+    unsigned long long progress;
+
+    size_t njobs;
+    size_t nfinished;
+    qemuDomainGetStatsJobPtr jobs;
+
+    /* First error reported by a job */
+    virErrorPtr error;
+};
+
+static virClassPtr qemuDomainGetStatsBatchClass;
+static void qemuDomainGetStatsBatchDispose(void *obj);
+
+static int
+qemuDomainGetStatsBatchOnceInit(void)
+{
+    if (!(qemuDomainGetStatsBatchClass =
+          virClassNew(virClassForObjectLockable(),
+                      "qemuDomainGetStatsBatch",
+                      sizeof(qemuDomainGetStatsBatch),
+                      qemuDomainGetStatsBatchDispose)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(qemuDomainGetStatsBatch)
+
+
+static void
+qemuDomainGetStatsBatchDispose(void *obj)
+{
+    qemuDomainGetStatsBatchPtr batch = obj;
+    size_t i;
+
+    for (i = 0; i < batch->njobs; i++) {
+        virObjectUnref(batch->jobs[i].vm);
+        VIR_FREE(batch->jobs[i].name);
+        qemuDomainStatsRecordFree(batch->jobs[i].record);
+    }
+    VIR_FREE(batch->jobs);
+
+    virFreeError(batch->error);
+    virObjectUnref(batch->conn);
+    virCondDestroy(&batch->cond);
+}
+
+
+static unsigned long long
+qemuDomainGetStatsNow(void)
+{
+    unsigned long long now = 0;
+
+    ignore_value(virTimeMillisNowRaw(&now));
+    return now;
+}
+
+
+static void
+qemuDomainGetStatsBatchWorker(void *jobdata,
+                              void *opaque ATTRIBUTE_UNUSED)
+{
+    qemuDomainGetStatsJobPtr job = jobdata;
+    qemuDomainGetStatsBatchPtr batch = job->batch;
+    virDomainStatsRecordPtr record = NULL;
+    virErrorPtr error = NULL;
+
+    virObjectLock(batch);
+
+    /* Given up on while still queued */
+    if (job->state != QEMU_DOMAIN_GET_STATS_JOB_QUEUED)
+        goto cleanup;
+
+    job->state = QEMU_DOMAIN_GET_STATS_JOB_RUNNING;
+    job->started = batch->progress = qemuDomainGetStatsNow();
+    virCondBroadcast(&batch->cond);
+    virObjectUnlock(batch);
+
+    if (qemuConnectGetAllDomainStatsOne(batch->conn, job->vm, batch->stats,
+                                        batch->privflags, &record,
+                                        batch->flags) < 0)
+        error = virSaveLastError();
+
+    virObjectLock(batch);
+
+    if (job->state == QEMU_DOMAIN_GET_STATS_JOB_RUNNING) {
+        job->state = QEMU_DOMAIN_GET_STATS_JOB_DONE;
+        job->record = record;
+        record = NULL;
+        if (error && !batch->error) {
+            batch->error = error;
+            error = NULL;
+        }
+        batch->nfinished++;
+        batch->progress = qemuDomainGetStatsNow();
+        virCondBroadcast(&batch->cond);
+    }
+
+ cleanup:
+    virObjectUnlock(batch);
+    qemuDomainStatsRecordFree(record);
+    virFreeError(error);
+
+    virObjectLock(job->vm);
+    QEMU_DOMAIN_PRIVATE(job->vm)->statsPending = false;
+    virObjectUnlock(job->vm);
+
+    virObjectUnref(batch);
+}
+
+
+/* Give up on the jobs running for longer than @timeout, and on all
+ * the queued ones if none started nor finished for that long, which
+ * means every worker is stuck. Returns the time of the next deadline,
+ * or 0 if all jobs are finished. Called with @batch locked. */
+static unsigned long long
+qemuDomainGetStatsBatchExpire(qemuDomainGetStatsBatchPtr batch,
+                              unsigned long long timeout)
+{
+    unsigned long long now = qemuDomainGetStatsNow();
+    unsigned long long next = batch->progress + timeout;
+    bool stalled = now >= batch->progress + timeout;
+    size_t i;
+
+    for (i = 0; i < batch->njobs; i++) {
+        qemuDomainGetStatsJobPtr job = &batch->jobs[i];
+
+        switch (job->state) {
+        case QEMU_DOMAIN_GET_STATS_JOB_QUEUED:
+            if (!stalled)
+                continue;
+            break;
+
+        case QEMU_DOMAIN_GET_STATS_JOB_RUNNING:
+            if (now < job->started + timeout) {
+                next = MIN(next, job->started + timeout);
+                continue;
+            }
+            break;
+
+        case QEMU_DOMAIN_GET_STATS_JOB_DONE:
+        case QEMU_DOMAIN_GET_STATS_JOB_EXPIRED:
+            continue;
+        }
+
+        VIR_WARN("Timed out collecting statistics of domain %s, "
+                 "reporting partial statistics",
+                 job->name);
+        job->state = QEMU_DOMAIN_GET_STATS_JOB_EXPIRED;
+        batch->nfinished++;
+    }
+
+    return batch->nfinished < batch->njobs ? next : 0;
+}
+
+
+static int
+qemuConnectGetAllDomainStatsParallel(virConnectPtr conn,
+                                     virDomainObjPtr *vms,
+                                     size_t nvms,
+                                     unsigned int stats,
+                                     unsigned int privflags,
+                                     virDomainStatsRecordPtr *records,
+                                     int *nrecords,
+                                     unsigned int flags)
+{
+    virQEMUDriverPtr driver = conn->privateData;
+    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
+    qemuDomainGetStatsBatchPtr batch = NULL;
+    unsigned long long deadline;
+    size_t i;
+    int ret = -1;
+
+    if (qemuDomainGetStatsBatchInitialize() < 0 ||
+        !(batch = virObjectLockableNew(qemuDomainGetStatsBatchClass)))
+        goto cleanup;
+
+    if (virCondInit(&batch->cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize condition"));
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(batch->jobs, nvms) < 0)
+        goto cleanup;
+
+    batch->conn = virObjectRef(conn);
+    batch->stats = stats;
+    batch->privflags = privflags;
+    batch->flags = flags;
+    batch->progress = qemuDomainGetStatsNow();
+
+    for (i = 0; i < nvms; i++) {
+        qemuDomainGetStatsJobPtr job = &batch->jobs[i];
+        int rc;
+
+        job->batch = batch;
+        job->vm = virObjectRef(vms[i]);
+        batch->njobs++;
+
+        /* For the warning, the definition may change once unlocked */
+        virObjectLock(vms[i]);
+        rc = VIR_STRDUP(job->name, vms[i]->def->name);
+        virObjectUnlock(vms[i]);
+        if (rc < 0)
+            goto cleanup;
+    }
+
+    virObjectLock(batch);
+
+    for (i = 0; i < nvms; i++) {
+        qemuDomainGetStatsJobPtr job = &batch->jobs[i];
+        qemuDomainObjPrivatePtr priv = vms[i]->privateData;
+        bool pending;
+
+        virObjectLock(vms[i]);
+        pending = priv->statsPending;
+        priv->statsPending = true;
+        virObjectUnlock(vms[i]);
+
+        if (pending) {
+            VIR_DEBUG("Statistics of domain %s are still being collected, "
+                      "reporting partial statistics", job->name);
+        } else {
+            virObjectRef(batch);
+            if (virThreadPoolSendJob(driver->statsPool, 0, job) == 0)
+                continue;
+            virObjectUnref(batch);
+
+            virObjectLock(vms[i]);
+            priv->statsPending = false;
+            virObjectUnlock(vms[i]);
+        }
+
+        /* Collect it below, together with those timing out */
+        job->state = QEMU_DOMAIN_GET_STATS_JOB_EXPIRED;
+        batch->nfinished++;
+    }
+
+    while (batch->nfinished < batch->njobs) {
+        if (cfg->statsTimeout == 0) {
+            if (virCondWait(&batch->cond, &batch->parent.lock) < 0)
+                goto error;
+            continue;
+        }
+
+        if (!(deadline = qemuDomainGetStatsBatchExpire(batch,
+                                                       cfg->statsTimeout)))
+            break;
+
+        if (virCondWaitUntil(&batch->cond, &batch->parent.lock,
+                             deadline) < 0 && errno != ETIMEDOUT)
+            goto error;
+    }
+
+    if (batch->error) {
+        virSetError(batch->error);
+        virObjectUnlock(batch);
+        goto cleanup;
+    }
+
+    /* Records of jobs still running after being given up on are
+     * thrown away by their worker, the others can be moved out */
+    for (i = 0; i < batch->njobs; i++) {
+        qemuDomainGetStatsJobPtr job = &batch->jobs[i];
+
+        if (job->state == QEMU_DOMAIN_GET_STATS_JOB_DONE) {
+            records[i] = job->record;
+            job->record = NULL;
+        }
+    }
+
+    virObjectUnlock(batch);
+
+    for (i = 0; i < nvms; i++) {
+        if (!records[i] &&
+            qemuConnectGetAllDomainStatsOne(conn, vms[i], stats, 0,
+                                            &records[i], flags) < 0)
+            goto cleanup;
+    }
+
+    *nrecords = nvms;
+    ret = 0;
+
+ cleanup:
+    virObjectUnref(batch);
+    virObjectUnref(cfg);
+    return ret;
+
+ error:
+    virReportSystemError(errno, "%s",
+                         _("failed to wait for domain statistics"));
+    virObjectUnlock(batch);
+    goto cleanup;
+}
+
+
 static int
 qemuConnectGetAllDomainStats(virConnectPtr conn,
                              virDomainPtr *doms,
@@ -19680,7 +20122,6 @@ qemuConnectGetAllDomainStats(virConnectPtr conn,
 {
     virQEMUDriverPtr driver = conn->privateData;
     virDomainObjPtr *vms = NULL;
-    virDomainObjPtr vm;
     size_t nvms;
     virDomainStatsRecordPtr *tmpstats = NULL;
     bool enforce = !!(flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS);
@@ -19688,7 +20129,6 @@ qemuConnectGetAllDomainStats(virConnectPtr conn,
     size_t i;
     int ret = -1;
     unsigned int privflags = 0;
-    unsigned int domflags = 0;
     unsigned int lflags = flags & (VIR_CONNECT_LIST_DOMAINS_FILTERS_ACTIVE |
                                    VIR_CONNECT_LIST_DOMAINS_FILTERS_PERSISTENT |
                                    VIR_CONNECT_LIST_DOMAINS_FILTERS_STATE);
@@ -19723,35 +20163,22 @@ qemuConnectGetAllDomainStats(virConnectPtr conn,
     if (qemuDomainGetStatsNeedMonitor(stats))
         privflags |= QEMU_DOMAIN_STATS_HAVE_JOB;
 
-    for (i = 0; i < nvms; i++) {
-        virDomainStatsRecordPtr tmp = NULL;
-        domflags = 0;
-        vm = vms[i];
-
-        virObjectLock(vm);
-
-        if (HAVE_JOB(privflags) &&
-            qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) == 0)
-            domflags |= QEMU_DOMAIN_STATS_HAVE_JOB;
-        /* else: without a job it's still possible to gather some data */
-
-        if (flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_BACKING)
-            domflags |= QEMU_DOMAIN_STATS_BACKING;
-        if (qemuDomainGetStats(conn, vm, stats, &tmp, domflags) < 0) {
-            if (HAVE_JOB(domflags) && vm)
-                qemuDomainObjEndJob(driver, vm);
-
-            virObjectUnlock(vm);
+    if (driver->statsPool && nvms > 1) {
+        if (qemuConnectGetAllDomainStatsParallel(conn, vms, nvms, stats,
+                                                 privflags, tmpstats,
+                                                 &nstats, flags) < 0)
             goto cleanup;
-        }
-
-        if (tmp)
-            tmpstats[nstats++] = tmp;
+    } else {
+        for (i = 0; i < nvms; i++) {
+            virDomainStatsRecordPtr tmp = NULL;
 
-        if (HAVE_JOB(domflags))
-            qemuDomainObjEndJob(driver, vm);
+            if (qemuConnectGetAllDomainStatsOne(conn, vms[i], stats,
+                                                privflags, &tmp, flags) < 0)
+                goto cleanup;
 
-        virObjectUnlock(vm);
+            if (tmp)
+                tmpstats[nstats++] = tmp;
+        }
     }
 
     *retStats = tmpstats;
@@ -19767,6 +20194,60 @@ qemuConnectGetAllDomainStats(virConnectPtr conn,
 }
 
 
+static int
+qemuDomainStatsSamplerCollect(virConnectPtr conn,
+                              unsigned int stats,
+                              virDomainStatsRecordPtr **records,
+                              unsigned int flags)
+{
+    return qemuConnectGetAllDomainStats(conn, NULL, 0, stats, records, flags);
+}
+
+
+static int
+qemuConnectDomainStatsEventRegister(virConnectPtr conn,
+                                    unsigned int stats,
+                                    unsigned int interval,
+                                    virConnectDomainStatsEventCallback cb,
+                                    void *opaque,
+                                    virFreeCallback freecb,
+                                    unsigned int flags)
+{
+    virQEMUDriverPtr driver = conn->privateData;
+    bool enforce = !!(flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS);
+
+    virCheckFlags(VIR_CONNECT_LIST_DOMAINS_FILTERS_ACTIVE |
+                  VIR_CONNECT_LIST_DOMAINS_FILTERS_PERSISTENT |
+                  VIR_CONNECT_LIST_DOMAINS_FILTERS_STATE |
+                  VIR_CONNECT_GET_ALL_DOMAINS_STATS_BACKING |
+                  VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS, -1);
+
+    if (virConnectDomainStatsEventRegisterEnsureACL(conn) < 0)
+        return -1;
+
+    if (qemuDomainGetStatsCheckSupport(&stats, enforce) < 0)
+        return -1;
+
+    return virDomainStatsSamplerListAdd(driver->statsSamplers, conn,
+                                        stats, interval, cb, opaque, freecb,
+                                        flags & ~VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS);
+}
+
+
+static int
+qemuConnectDomainStatsEventDeregister(virConnectPtr conn,
+                                      int callbackID)
+{
+    virQEMUDriverPtr driver = conn->privateData;
+
+    if (virConnectDomainStatsEventDeregisterEnsureACL(conn) < 0)
+        return -1;
+
+    return virDomainStatsSamplerListRemove(driver->statsSamplers, conn,
+                                           callbackID);
+}
+
+
 static int
 qemuNodeAllocPages(virConnectPtr conn,
                    unsigned int npages,
@@ -20602,6 +21083,8 @@ static virHypervisorDriver qemuHypervisorDriver = {
     .domainMigrateStartPostCopy = qemuDomainMigrateStartPostCopy, /* 1.3.3 */
     .domainGetGuestVcpus = qemuDomainGetGuestVcpus, /* 2.0.0 */
     .domainSetGuestVcpus = qemuDomainSetGuestVcpus, /* 2.0.0 */
+    .connectDomainStatsEventRegister = qemuConnectDomainStatsEventRegister, /* 3.1.0 */
+    .connectDomainStatsEventDeregister = qemuConnectDomainStatsEventDeregister, /* 3.1.0 */
 };
 
 
@@ -5894,8 +5894,10 @@ qemuMigrationPerformJob(virQEMUDriverPtr driver,
     }
 
  endjob:
-    if (ret < 0)
+    if (ret < 0) {
         orig_err = virSaveLastError();
+        virLogFlushRecorder("migration failed");
+    }
 
     if (qemuMigrationRestoreDomainState(conn, vm)) {
         event = virDomainEventLifecycleNewFromObj(vm,
@@ -5981,10 +5983,12 @@ qemuMigrationPerformPhase(virQEMUDriverPtr driver,
         goto endjob;
 
  endjob:
-    if (ret < 0)
+    if (ret < 0) {
+        virLogFlushRecorder("migration failed");
         qemuMigrationJobFinish(driver, vm);
-    else
+    } else {
         qemuMigrationJobContinue(vm);
+    }
     if (!virDomainObjIsActive(vm))
         qemuDomainRemoveInactive(driver, vm);
 
@@ -35,6 +35,7 @@
 #include "qemu_domain.h"
 #include "qemu_process.h"
 #include "virerror.h"
+#include "virevent.h"
 #include "viralloc.h"
 #include "virlog.h"
 #include "virfile.h"
@@ -55,6 +56,13 @@ VIR_LOG_INIT("qemu.qemu_monitor");
 #define DEBUG_IO 0
 #define DEBUG_RAW_IO 0
 
+/* Upper limit on the size of a single message from QEMU, so that the
+ * buffered and parsed data can not grow without bound */
+#define QEMU_MONITOR_MAX_RESPONSE (10 * 1024 * 1024)
+
+/* Size the buffer is shrunk back to once a large message is consumed */
+#define QEMU_MONITOR_BUFFER_KEEP (64 * 1024)
+
 struct _qemuMonitor {
     virObjectLockable parent;
 
@@ -79,6 +87,10 @@ struct _qemuMonitor {
     size_t bufferLength;
     char *buffer;
 
+    /* Parser of the JSON monitor, resuming from @buffer as more
+     * data arrives */
+    virJSONStreamParserPtr parser;
+
     /* If anything went wrong, this will be fed back
      * the next monitor msg */
     virError lastError;
@@ -321,6 +333,7 @@ qemuMonitorDispose(void *obj)
     virResetError(&mon->lastError);
     virCondDestroy(&mon->notify);
     VIR_FREE(mon->buffer);
+    virJSONStreamParserFree(mon->parser);
     virJSONValueFree(mon->options);
     VIR_FREE(mon->balloonpath);
 }
@@ -429,7 +442,7 @@ qemuMonitorIOProcess(qemuMonitorPtr mon)
           "mon=%p buf=%s len=%zu", mon, mon->buffer, mon->bufferOffset);
 
     if (mon->json)
-        len = qemuMonitorJSONIOProcess(mon,
+        len = qemuMonitorJSONIOProcess(mon, mon->parser,
                                        mon->buffer, mon->bufferOffset,
                                        msg);
     else
@@ -446,6 +459,17 @@ qemuMonitorIOProcess(qemuMonitorPtr mon)
     if (len < mon->bufferOffset) {
         memmove(mon->buffer, mon->buffer + len, mon->bufferOffset - len);
         mon->bufferOffset -= len;
+
+        /* Don't hold on to the room a large reply needed when only
+         * the start of the next message is left */
+        if (mon->bufferLength > QEMU_MONITOR_BUFFER_KEEP &&
+            mon->bufferOffset < mon->bufferLength / 4) {
+            size_t length = MAX(mon->bufferOffset * 2,
+                                QEMU_MONITOR_BUFFER_KEEP);
+
+            if (VIR_REALLOC_N_QUIET(mon->buffer, length) == 0)
+                mon->bufferLength = length;
+        }
     } else {
         VIR_FREE(mon->buffer);
         mon->bufferOffset = mon->bufferLength = 0;
@@ -562,14 +586,25 @@ static int
 qemuMonitorIORead(qemuMonitorPtr mon)
 {
     size_t avail = mon->bufferLength - mon->bufferOffset;
+    size_t grow;
     int ret = 0;
 
     if (avail < 1024) {
-        if (VIR_REALLOC_N(mon->buffer,
-                          mon->bufferLength + 1024) < 0)
+        if (mon->bufferLength >= QEMU_MONITOR_MAX_RESPONSE) {
+            virReportSystemError(ERANGE,
+                                 _("No complete monitor response found in %d bytes"),
+                                 QEMU_MONITOR_MAX_RESPONSE);
             return -1;
-        mon->bufferLength += 1024;
-        avail += 1024;
+        }
+        /* Grow geometrically, large replies would otherwise be
+         * reallocated every 1024 bytes, but not beyond the limit */
+        grow = MAX(1024, mon->bufferLength / 2);
+        if (grow > QEMU_MONITOR_MAX_RESPONSE - mon->bufferLength)
+            grow = QEMU_MONITOR_MAX_RESPONSE - mon->bufferLength;
+
+        if (VIR_EXPAND_N(mon->buffer, mon->bufferLength, grow) < 0)
+            return -1;
+        avail = mon->bufferLength - mon->bufferOffset;
     }
 
     /* Read as much as we can get into our buffer,
@@ -817,8 +852,11 @@ qemuMonitorOpenInternal(virDomainObjPtr vm,
     mon->hasSendFD = hasSendFD;
     mon->vm = virObjectRef(vm);
     mon->json = json;
-    if (json)
+    if (json) {
         mon->waitGreeting = true;
+        if (!(mon->parser = virJSONStreamParserNew(QEMU_MONITOR_MAX_RESPONSE)))
+            goto cleanup;
+    }
     mon->cb = cb;
     mon->callbackOpaque = opaque;
 
@@ -836,13 +874,13 @@ qemuMonitorOpenInternal(virDomainObjPtr vm,
 
     virObjectLock(mon);
     virObjectRef(mon);
-    if ((mon->watch = virEventAddHandle(mon->fd,
-                                        VIR_EVENT_HANDLE_HANGUP |
-                                        VIR_EVENT_HANDLE_ERROR |
-                                        VIR_EVENT_HANDLE_READABLE,
-                                        qemuMonitorIO,
-                                        mon,
-                                        virObjectFreeCallback)) < 0) {
+    if ((mon->watch = virEventAddHandleSharded(mon->fd,
+                                               VIR_EVENT_HANDLE_HANGUP |
+                                               VIR_EVENT_HANDLE_ERROR |
+                                               VIR_EVENT_HANDLE_READABLE,
+                                               qemuMonitorIO,
+                                               mon,
+                                               virObjectFreeCallback)) < 0) {
         virObjectUnref(mon);
         virObjectUnlock(mon);
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
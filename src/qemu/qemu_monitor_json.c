@@ -45,6 +45,7 @@
 #include "virprobe.h"
 #include "virstring.h"
 #include "cpu/cpu_x86.h"
+#include "c-ctype.h"
 #include "c-strcasestr.h"
 
 #ifdef WITH_DTRACE_PROBES
@@ -57,8 +58,6 @@ VIR_LOG_INIT("qemu.qemu_monitor_json");
 
 #define QOM_CPU_PATH  "/machine/unattached/device[0]"
 
-#define LINE_ENDING "\r\n"
-
 static void qemuMonitorJSONHandleShutdown(qemuMonitorPtr mon, virJSONValuePtr data);
 static void qemuMonitorJSONHandleReset(qemuMonitorPtr mon, virJSONValuePtr data);
 static void qemuMonitorJSONHandlePowerdown(qemuMonitorPtr mon, virJSONValuePtr data);
@@ -180,19 +179,27 @@ qemuMonitorJSONIOProcessEvent(qemuMonitorPtr mon,
     return 0;
 }
 
+/**
+ * qemuMonitorJSONIOProcessMessage:
+ * @mon: monitor the message was received from
+ * @obj: the parsed message, consumed by this function
+ * @line: text of the message
+ * @msg: command waiting for a reply, if any
+ *
+ * Dispatch a greeting, event or reply received from QEMU.
+ *
+ * Returns 0 on success, -1 on error.
+ */
 int
-qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
-                             const char *line,
-                             qemuMonitorMessagePtr msg)
+qemuMonitorJSONIOProcessMessage(qemuMonitorPtr mon,
+                                virJSONValuePtr obj,
+                                const char *line,
+                                qemuMonitorMessagePtr msg)
 {
-    virJSONValuePtr obj = NULL;
     int ret = -1;
 
     VIR_DEBUG("Line [%s]", line);
 
-    if (!(obj = virJSONValueFromString(line)))
-        goto cleanup;
-
     if (obj->type != VIR_JSON_TYPE_OBJECT) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("Parsed JSON reply '%s' isn't an object"), line);
@@ -228,36 +235,52 @@ qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
     return ret;
 }
 
+/*
+ * Messages are parsed straight out of the monitor buffer as the data
+ * arrives, so large replies are neither scanned for their end over
+ * and over nor copied before being parsed. The text of a message that
+ * is not complete yet is kept in the buffer, by not counting it as
+ * used, for @parser to resume from on the next call.
+ *
+ * @data must have room for a NUL byte after @len, which the text of
+ * each message gets terminated with while it is being processed.
+ */
 int qemuMonitorJSONIOProcess(qemuMonitorPtr mon,
-                             const char *data,
+                             virJSONStreamParserPtr parser,
+                             char *data,
                              size_t len,
                              qemuMonitorMessagePtr msg)
 {
-    int used = 0;
+    size_t used = 0;
+    virJSONValuePtr obj;
+    ssize_t got;
     /*VIR_DEBUG("Data %d bytes [%s]", len, data);*/
 
-    while (used < len) {
-        char *nl = strstr(data + used, LINE_ENDING);
+    while ((got = virJSONStreamParserFeed(parser, data + used,
+                                          len - used, &obj)) > 0) {
+        char *line = data + used;
+        char *end = line + got;
+        char saved = *end;
+        int rc;
 
-        if (nl) {
-            int got = nl - (data + used);
-            char *line;
-            if (VIR_STRNDUP(line, data + used, got) < 0)
-                return -1;
-            used += got + strlen(LINE_ENDING);
-            line[got] = '\0'; /* kill \n */
-            if (qemuMonitorJSONIOProcessLine(mon, line, msg) < 0) {
-                VIR_FREE(line);
-                return -1;
-            }
+        /* Skip the line ending of the previous message */
+        while (c_isspace(*line))
+            line++;
 
-            VIR_FREE(line);
-        } else {
-            break;
-        }
+        *end = '\0';
+        rc = qemuMonitorJSONIOProcessMessage(mon, obj, line, msg);
+        *end = saved;
+
+        if (rc < 0)
+            return -1;
+
+        used += got;
     }
 
-    VIR_DEBUG("Total used %d bytes out of %zd available in buffer", used, len);
+    if (got < 0)
+        return -1;
+
+    VIR_DEBUG("Total used %zu bytes out of %zu available in buffer", used, len);
     return used;
 }
 
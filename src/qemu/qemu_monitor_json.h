@@ -32,12 +32,14 @@
 # include "cpu/cpu.h"
 # include "util/virgic.h"
 
-int qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
-                                 const char *line,
-                                 qemuMonitorMessagePtr msg);
+int qemuMonitorJSONIOProcessMessage(qemuMonitorPtr mon,
+                                    virJSONValuePtr obj,
+                                    const char *line,
+                                    qemuMonitorMessagePtr msg);
 
 int qemuMonitorJSONIOProcess(qemuMonitorPtr mon,
-                             const char *data,
+                             virJSONStreamParserPtr parser,
+                             char *data,
                              size_t len,
                              qemuMonitorMessagePtr msg);
 
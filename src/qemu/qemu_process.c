@@ -63,6 +63,7 @@
 #include "viruuid.h"
 #include "virprocess.h"
 #include "virtime.h"
+#include "virprobe.h"
 #include "virnetdevtap.h"
 #include "virnetdevopenvswitch.h"
 #include "virnetdevmidonet.h"
@@ -77,6 +78,10 @@
 #include "nwfilter_conf.h"
 #include "netdev_bandwidth_conf.h"
 
+#ifdef WITH_DTRACE_PROBES
+# include "libvirt_qemu_probes.h"
+#endif
+
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
 VIR_LOG_INIT("qemu.qemu_process");
@@ -795,7 +800,6 @@ qemuProcessHandleRTCChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
 {
     virQEMUDriverPtr driver = opaque;
     virObjectEventPtr event = NULL;
-    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
     virObjectLock(vm);
 
@@ -818,8 +822,7 @@ qemuProcessHandleRTCChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
         offset += vm->def->clock.data.variable.adjustment0;
         vm->def->clock.data.variable.adjustment = offset;
 
-        if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0)
-           VIR_WARN("unable to save domain status with RTC change");
+        qemuDomainSaveStatusDeferred(driver, vm);
     }
 
     event = virDomainEventRTCChangeNewFromObj(vm, offset);
@@ -827,7 +830,6 @@ qemuProcessHandleRTCChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     virObjectUnlock(vm);
 
     qemuDomainEventQueue(driver, event);
-    virObjectUnref(cfg);
     return 0;
 }
 
@@ -1111,7 +1113,6 @@ qemuProcessHandleTrayChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     virQEMUDriverPtr driver = opaque;
     virObjectEventPtr event = NULL;
     virDomainDiskDefPtr disk;
-    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
     virObjectLock(vm);
     disk = qemuProcessFindDomainDiskByAlias(vm, devAlias);
@@ -1126,17 +1127,13 @@ qemuProcessHandleTrayChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
         else if (reason == VIR_DOMAIN_EVENT_TRAY_CHANGE_CLOSE)
             disk->tray_status = VIR_DOMAIN_DISK_TRAY_CLOSED;
 
-        if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0) {
-            VIR_WARN("Unable to save status on vm %s after tray moved event",
-                     vm->def->name);
-        }
+        qemuDomainSaveStatusDeferred(driver, vm);
 
         virDomainObjBroadcast(vm);
     }
 
     virObjectUnlock(vm);
     qemuDomainEventQueue(driver, event);
-    virObjectUnref(cfg);
     return 0;
 }
 
@@ -1148,7 +1145,6 @@ qemuProcessHandlePMWakeup(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     virQEMUDriverPtr driver = opaque;
     virObjectEventPtr event = NULL;
     virObjectEventPtr lifecycleEvent = NULL;
-    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
     virObjectLock(vm);
     event = virDomainEventPMWakeupNewFromObj(vm);
@@ -1166,16 +1162,12 @@ qemuProcessHandlePMWakeup(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
                                                   VIR_DOMAIN_EVENT_STARTED,
                                                   VIR_DOMAIN_EVENT_STARTED_WAKEUP);
 
-        if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0) {
-            VIR_WARN("Unable to save status on vm %s after wakeup event",
-                     vm->def->name);
-        }
+        qemuDomainSaveStatusDeferred(driver, vm);
     }
 
     virObjectUnlock(vm);
     qemuDomainEventQueue(driver, event);
     qemuDomainEventQueue(driver, lifecycleEvent);
-    virObjectUnref(cfg);
     return 0;
 }
 
@@ -1187,7 +1179,6 @@ qemuProcessHandlePMSuspend(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     virQEMUDriverPtr driver = opaque;
     virObjectEventPtr event = NULL;
     virObjectEventPtr lifecycleEvent = NULL;
-    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
     virObjectLock(vm);
     event = virDomainEventPMSuspendNewFromObj(vm);
@@ -1204,10 +1195,7 @@ qemuProcessHandlePMSuspend(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
                                      VIR_DOMAIN_EVENT_PMSUSPENDED,
                                      VIR_DOMAIN_EVENT_PMSUSPENDED_MEMORY);
 
-        if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0) {
-            VIR_WARN("Unable to save status on vm %s after suspend event",
-                     vm->def->name);
-        }
+        qemuDomainSaveStatusDeferred(driver, vm);
 
         if (priv->agent)
             qemuAgentNotifyEvent(priv->agent, QEMU_AGENT_EVENT_SUSPEND);
@@ -1217,7 +1205,6 @@ qemuProcessHandlePMSuspend(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
 
     qemuDomainEventQueue(driver, event);
     qemuDomainEventQueue(driver, lifecycleEvent);
-    virObjectUnref(cfg);
     return 0;
 }
 
@@ -1229,7 +1216,6 @@ qemuProcessHandleBalloonChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
 {
     virQEMUDriverPtr driver = opaque;
     virObjectEventPtr event = NULL;
-    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
     virObjectLock(vm);
     event = virDomainEventBalloonChangeNewFromObj(vm, actual);
@@ -1238,13 +1224,11 @@ qemuProcessHandleBalloonChange(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
               vm->def->mem.cur_balloon, actual);
     vm->def->mem.cur_balloon = actual;
 
-    if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0)
-        VIR_WARN("unable to save domain status with balloon change");
+    qemuDomainSaveStatusDeferred(driver, vm);
 
     virObjectUnlock(vm);
 
     qemuDomainEventQueue(driver, event);
-    virObjectUnref(cfg);
     return 0;
 }
 
@@ -1256,7 +1240,6 @@ qemuProcessHandlePMSuspendDisk(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     virQEMUDriverPtr driver = opaque;
     virObjectEventPtr event = NULL;
     virObjectEventPtr lifecycleEvent = NULL;
-    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
     virObjectLock(vm);
     event = virDomainEventPMSuspendDiskNewFromObj(vm);
@@ -1273,10 +1256,7 @@ qemuProcessHandlePMSuspendDisk(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
                                      VIR_DOMAIN_EVENT_PMSUSPENDED,
                                      VIR_DOMAIN_EVENT_PMSUSPENDED_DISK);
 
-        if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, vm, driver->caps) < 0) {
-            VIR_WARN("Unable to save status on vm %s after suspend event",
-                     vm->def->name);
-        }
+        qemuDomainSaveStatusDeferred(driver, vm);
 
         if (priv->agent)
             qemuAgentNotifyEvent(priv->agent, QEMU_AGENT_EVENT_SUSPEND);
@@ -1286,7 +1266,6 @@ qemuProcessHandlePMSuspendDisk(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
 
     qemuDomainEventQueue(driver, event);
     qemuDomainEventQueue(driver, lifecycleEvent);
-    virObjectUnref(cfg);
 
     return 0;
 }
@@ -3288,7 +3267,29 @@ struct qemuProcessReconnectData {
     virConnectPtr conn;
     virQEMUDriverPtr driver;
     virDomainObjPtr obj;
+    struct qemuDomainJobObj oldjob;
+    unsigned long long queued;
 };
+
+
+/* Report the time spent since @then in a phase of reconnecting to
+ * @obj, and start timing the next one */
+static void
+qemuProcessReconnectPhase(virDomainObjPtr obj,
+                          const char *phase,
+                          unsigned long long *then)
+{
+    unsigned long long now;
+
+    if (virTimeMillisNow(&now) < 0)
+        return;
+
+    PROBE(QEMU_RECONNECT_PHASE, "vm=%p name=%s phase=%s ms=%llu",
+          obj, obj->def->name, phase, now - *then);
+    *then = now;
+}
+
+
 /*
  * Open an existing VM's monitor, re-detect VCPU threads
  * and re-reserve the security labels in use
@@ -3297,10 +3298,11 @@ struct qemuProcessReconnectData {
  * this thread function has increased the reference counter to it
  * so that we now have to close it.
  *
- * This function also inherits a locked and ref'd domain object.
+ * This function also inherits a ref'd domain object, on which
+ * qemuProcessReconnectHelper already started a modify job.
  *
  * This function needs to:
- * 1. Enter job
+ * 1. Lock the domain object
  * 1. just before monitor reconnect do lightweight MonitorEnter
  *    (increase VM refcount and unlock VM)
  * 2. reconnect to monitor
@@ -3319,30 +3321,34 @@ qemuProcessReconnect(void *opaque)
     virDomainObjPtr obj = data->obj;
     qemuDomainObjPrivatePtr priv;
     virConnectPtr conn = data->conn;
-    struct qemuDomainJobObj oldjob;
+    struct qemuDomainJobObj oldjob = data->oldjob;
+    unsigned long long then = data->queued;
+    unsigned long long started;
     int state;
     int reason;
     virQEMUDriverConfigPtr cfg;
     size_t i;
     unsigned int stopFlags = 0;
-    bool jobStarted = false;
     virCapsPtr caps = NULL;
 
     VIR_FREE(data);
 
-    qemuDomainObjRestoreJob(obj, &oldjob);
+    virObjectLock(obj);
+    qemuProcessReconnectPhase(obj, "queue", &then);
+    started = then;
+
     if (oldjob.asyncJob == QEMU_ASYNC_JOB_MIGRATION_IN)
         stopFlags |= VIR_QEMU_PROCESS_STOP_MIGRATED;
 
     cfg = virQEMUDriverGetConfig(driver);
     priv = obj->privateData;
 
-    if (!(caps = virQEMUDriverGetCapabilities(driver, false)))
-        goto error;
+    /* The job was begun by qemuProcessReconnectHelper, it's this
+     * thread which owns it from now on */
+    priv->job.owner = virThreadSelfID();
 
-    if (qemuDomainObjBeginJob(driver, obj, QEMU_JOB_MODIFY) < 0)
+    if (!(caps = virQEMUDriverGetCapabilities(driver, false)))
         goto error;
-    jobStarted = true;
 
     /* XXX If we ever gonna change pid file pattern, come up with
      * some intelligence here to deal with old paths. */
@@ -3357,16 +3363,22 @@ qemuProcessReconnect(void *opaque)
 
     VIR_DEBUG("Reconnect monitor to %p '%s'", obj, obj->def->name);
 
+    qemuProcessReconnectPhase(obj, "prepare", &then);
+
     /* XXX check PID liveliness & EXE path */
     if (qemuConnectMonitor(driver, obj, QEMU_ASYNC_JOB_NONE, NULL) < 0)
         goto error;
 
+    qemuProcessReconnectPhase(obj, "monitor", &then);
+
     if (qemuHostdevUpdateActiveDomainDevices(driver, obj->def) < 0)
         goto error;
 
     if (qemuConnectCgroup(driver, obj) < 0)
         goto error;
 
+    qemuProcessReconnectPhase(obj, "cgroup", &then);
+
     if (qemuDomainPerfRestart(obj) < 0)
         goto error;
 
@@ -3477,10 +3489,14 @@ qemuProcessReconnect(void *opaque)
     if (qemuConnectAgent(driver, obj) < 0)
         goto error;
 
+    qemuProcessReconnectPhase(obj, "refresh", &then);
+
     /* update domain state XML with possibly updated state in virDomainObj */
     if (virDomainSaveStatus(driver->xmlopt, cfg->stateDir, obj, driver->caps) < 0)
         goto error;
 
+    qemuProcessReconnectPhase(obj, "status", &then);
+
     /* Run an hook to allow admins to do some magic */
     if (virHookPresent(VIR_HOOK_DRIVER_QEMU)) {
         char *xml = qemuDomainDefFormatXML(driver, obj->def, 0);
@@ -3502,8 +3518,8 @@ qemuProcessReconnect(void *opaque)
         driver->inhibitCallback(true, driver->inhibitOpaque);
 
  cleanup:
-    if (jobStarted)
-        qemuDomainObjEndJob(driver, obj);
+    qemuProcessReconnectPhase(obj, "total", &started);
+    qemuDomainObjEndJob(driver, obj);
     if (!virDomainObjIsActive(obj))
         qemuDomainRemoveInactive(driver, obj);
     virDomainObjEndAPI(&obj);
@@ -3529,15 +3545,60 @@ qemuProcessReconnect(void *opaque)
              * really is and FAILED means "failed to start" */
             state = VIR_DOMAIN_SHUTOFF_UNKNOWN;
         }
-        /* If BeginJob failed, we jumped here without a job, let's hope another
-         * thread didn't have a chance to start playing with the domain yet
-         * (it's all we can do anyway).
-         */
         qemuProcessStop(driver, obj, state, QEMU_ASYNC_JOB_NONE, stopFlags);
     }
     goto cleanup;
 }
 
+
+static void
+qemuProcessReconnectPoolFree(void *opaque)
+{
+    virThreadPoolFree(opaque);
+}
+
+
+/* Drop a reference on the reconnects queued to driver->reconnectPool,
+ * freeing the pool along with its threads once they are all done */
+static void
+qemuProcessReconnectPoolRelease(virQEMUDriverPtr driver)
+{
+    virThreadPoolPtr pool;
+    virThread thread;
+
+    if (!virAtomicIntDecAndTest(&driver->reconnectPending))
+        return;
+
+    qemuDriverLock(driver);
+    pool = driver->reconnectPool;
+    driver->reconnectPool = NULL;
+    qemuDriverUnlock(driver);
+
+    if (!pool)
+        return;
+
+    /* This may run in one of the workers, which the pool waits for */
+    if (virThreadCreate(&thread, false, qemuProcessReconnectPoolFree,
+                        pool) < 0) {
+        VIR_WARN("Unable to free the reconnect thread pool");
+        qemuDriverLock(driver);
+        driver->reconnectPool = pool;
+        qemuDriverUnlock(driver);
+    }
+}
+
+
+static void
+qemuProcessReconnectWorker(void *jobdata,
+                           void *opaque)
+{
+    virQEMUDriverPtr driver = opaque;
+
+    qemuProcessReconnect(jobdata);
+    qemuProcessReconnectPoolRelease(driver);
+}
+
+
 static int
 qemuProcessReconnectHelper(virDomainObjPtr obj,
                            void *opaque)
@@ -3545,6 +3606,8 @@ qemuProcessReconnectHelper(virDomainObjPtr obj,
     virThread thread;
     struct qemuProcessReconnectData *src = opaque;
     struct qemuProcessReconnectData *data;
+    virQEMUDriverPtr driver = src->driver;
+    int rc;
 
     /* If the VM was inactive, we don't need to reconnect */
     if (!obj->pid)
@@ -3555,51 +3618,91 @@ qemuProcessReconnectHelper(virDomainObjPtr obj,
 
     memcpy(data, src, sizeof(*data));
     data->obj = obj;
+    if (virTimeMillisNow(&data->queued) < 0)
+        data->queued = 0;
 
-    /* this lock and reference will be eventually transferred to the thread
+    /* This reference will be eventually transferred to the thread
      * that handles the reconnect */
     virObjectLock(obj);
     virObjectRef(obj);
 
+    /* Start the job the reconnect runs under right away, so that API
+     * calls on the domain wait for it even though the domain isn't
+     * kept locked while it waits for a thread. Recording the job in
+     * the status XML is left to the reconnect itself. */
+    qemuDomainObjRestoreJob(obj, &data->oldjob);
+    if (qemuDomainObjBeginJobNoSave(driver, obj, QEMU_JOB_MODIFY) < 0)
+        goto error;
+    virObjectUnlock(obj);
+
     /* Since we close the connection later on, we have to make sure that the
      * threads we start see a valid connection throughout their lifetime. We
      * simply increase the reference counter here.
      */
     virObjectRef(data->conn);
 
-    if (virThreadCreate(&thread, false, qemuProcessReconnect, data) < 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("Could not create thread. QEMU initialization "
-                         "might be incomplete"));
-        /* We can't spawn a thread and thus connect to monitor. Kill qemu.
-         * It's safe to call qemuProcessStop without a job here since there
-         * is no thread that could be doing anything else with the same domain
-         * object.
-         */
-        qemuProcessStop(src->driver, obj, VIR_DOMAIN_SHUTOFF_FAILED,
-                        QEMU_ASYNC_JOB_NONE, 0);
-        qemuDomainRemoveInactive(src->driver, obj);
+    if (driver->reconnectPool) {
+        virAtomicIntInc(&driver->reconnectPending);
+        if ((rc = virThreadPoolSendJob(driver->reconnectPool, 0, data)) < 0)
+            ignore_value(virAtomicIntDecAndTest(&driver->reconnectPending));
+    } else {
+        rc = virThreadCreate(&thread, false, qemuProcessReconnect, data);
+    }
 
-        virDomainObjEndAPI(&obj);
+    if (rc < 0) {
+        virObjectLock(obj);
         virObjectUnref(data->conn);
-        VIR_FREE(data);
-        return -1;
+        qemuDomainObjEndJob(driver, obj);
+        goto error;
     }
 
     return 0;
+
+ error:
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("Could not schedule reconnect. QEMU initialization "
+                     "might be incomplete"));
+    /* We can't connect to monitor. Kill qemu. It's safe to call
+     * qemuProcessStop without a job here since there is no thread
+     * that could be doing anything else with the same domain object.
+     */
+    qemuProcessStop(driver, obj, VIR_DOMAIN_SHUTOFF_FAILED,
+                    QEMU_ASYNC_JOB_NONE, 0);
+    qemuDomainRemoveInactive(driver, obj);
+
+    virDomainObjEndAPI(&obj);
+    VIR_FREE(data);
+    return -1;
 }
 
 /**
  * qemuProcessReconnectAll
  *
  * Try to re-open the resources for live VMs that we care
- * about.
+ * about. With reconnect_workers set in qemu.conf, at most that many
+ * domains are reconnected at once by a dedicated thread pool,
+ * otherwise each domain gets a thread of its own.
  */
 void
 qemuProcessReconnectAll(virConnectPtr conn, virQEMUDriverPtr driver)
 {
+    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
     struct qemuProcessReconnectData data = {.conn = conn, .driver = driver};
+
+    if (cfg->reconnectWorkers &&
+        !(driver->reconnectPool = virThreadPoolNew(0, cfg->reconnectWorkers, 0,
+                                                   qemuProcessReconnectWorker,
+                                                   driver))) {
+        VIR_WARN("Unable to create reconnect thread pool, "
+                 "reconnecting all domains at once");
+        virResetLastError();
+    }
+
+    /* Keep the pool until every domain was queued */
+    virAtomicIntSet(&driver->reconnectPending, 1);
     virDomainObjListForEach(driver->domains, qemuProcessReconnectHelper, &data);
+    qemuProcessReconnectPoolRelease(driver);
+    virObjectUnref(cfg);
 }
 
 static int
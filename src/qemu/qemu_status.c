@@ -0,0 +1,332 @@
+/*
+ * qemu_status.c: deferred writing of domain status XML
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include "qemu_status.h"
+
+#include "viralloc.h"
+#include "virerror.h"
+#include "virlog.h"
+#include "virthread.h"
+
+#define VIR_FROM_THIS VIR_FROM_QEMU
+
+VIR_LOG_INIT("qemu.qemu_status");
+
+/*
+ * Every status change of a domain used to rewrite and fsync its whole
+ * status XML. Changes which don't have to survive a crash of libvirtd
+ * right away can instead mark the domain dirty here. A worker thread
+ * writes the status of each dirty domain once, at most @delay
+ * milliseconds after it was first marked, however many changes were
+ * made meanwhile. A synchronous virDomainSaveStatus clears the mark,
+ * so the deferred write is skipped if nothing changed since.
+ *
+ * Lock ordering: the domain object, then the flusher.
+ */
+
+typedef struct _qemuStatusFlusherStats qemuStatusFlusherStats;
+struct _qemuStatusFlusherStats {
+    unsigned long long marked;       /* status changes deferred */
+    unsigned long long written;      /* status files written for them */
+    unsigned long long avoided;      /* writes, and fsyncs, saved */
+    unsigned long long avoidedBytes; /* size of the writes saved */
+};
+
+typedef struct _qemuStatusFlusherEntry qemuStatusFlusherEntry;
+typedef qemuStatusFlusherEntry *qemuStatusFlusherEntryPtr;
+struct _qemuStatusFlusherEntry {
+    virDomainObjPtr vm;
+    unsigned long long deadline; /* in virCondMonotonicNow time */
+};
+
+struct _qemuStatusFlusher {
+    virMutex lock;
+    virCond cond;
+    virThread thread;
+    bool quit;
+
+    unsigned int delay;
+    qemuStatusFlusherSaveFunc save;
+    void *opaque;
+
+    /* Domains to write, by increasing deadline */
+    qemuStatusFlusherEntryPtr queue;
+    size_t nqueue;
+
+    qemuStatusFlusherStats stats;
+};
+
+
+static void
+qemuStatusFlusherWrite(qemuStatusFlusherPtr flusher,
+                       virDomainObjPtr vm)
+{
+    bool written = false;
+    size_t size;
+
+    virObjectLock(vm);
+
+    if (vm->statusDirty && virDomainObjIsActive(vm)) {
+        if (flusher->save(vm, flusher->opaque) < 0)
+            VIR_WARN("Failed to save status on vm %s", vm->def->name);
+        else
+            written = true;
+    }
+    vm->statusDirty = false;
+    size = vm->statusSize;
+
+    virObjectUnlock(vm);
+    virObjectUnref(vm);
+
+    virMutexLock(&flusher->lock);
+    if (written) {
+        flusher->stats.written++;
+    } else {
+        /* Already saved synchronously, or the domain is gone */
+        flusher->stats.avoided++;
+        flusher->stats.avoidedBytes += size;
+    }
+    virMutexUnlock(&flusher->lock);
+}
+
+
+/* Called with the flusher locked, drops the lock while writing */
+static void
+qemuStatusFlusherWriteDue(qemuStatusFlusherPtr flusher,
+                          unsigned long long now)
+{
+    qemuStatusFlusherEntryPtr due = NULL;
+    size_t ndue = 0;
+    size_t i;
+
+    while (ndue < flusher->nqueue &&
+           flusher->queue[ndue].deadline <= now)
+        ndue++;
+
+    if (ndue == 0)
+        return;
+
+    if (ndue == flusher->nqueue) {
+        due = flusher->queue;
+        flusher->queue = NULL;
+        flusher->nqueue = 0;
+    } else {
+        if (VIR_ALLOC_N_QUIET(due, ndue) < 0) {
+            /* Write them one at a time then */
+            ndue = 1;
+            if (VIR_ALLOC_N_QUIET(due, ndue) < 0)
+                return;
+        }
+        memcpy(due, flusher->queue, ndue * sizeof(*due));
+        memmove(flusher->queue, flusher->queue + ndue,
+                (flusher->nqueue - ndue) * sizeof(*due));
+        VIR_SHRINK_N(flusher->queue, flusher->nqueue, ndue);
+    }
+
+    virMutexUnlock(&flusher->lock);
+
+    for (i = 0; i < ndue; i++)
+        qemuStatusFlusherWrite(flusher, due[i].vm);
+    VIR_FREE(due);
+
+    virMutexLock(&flusher->lock);
+
+    VIR_DEBUG("Flushed %zu domain status changes, %llu of %llu written, "
+              "%llu bytes not written", ndue, flusher->stats.written,
+              flusher->stats.marked, flusher->stats.avoidedBytes);
+}
+
+
+static void
+qemuStatusFlusherWorker(void *opaque)
+{
+    qemuStatusFlusherPtr flusher = opaque;
+    unsigned long long now;
+
+    virMutexLock(&flusher->lock);
+
+    while (!flusher->quit) {
+        if (flusher->nqueue == 0) {
+            if (virCondWait(&flusher->cond, &flusher->lock) < 0) {
+                VIR_WARN("Unable to wait on status flusher condition");
+                break;
+            }
+            continue;
+        }
+
+        /* Fail safe: write rather than wait if the time is unknown */
+        if (virCondMonotonicNow(&now) < 0)
+            now = flusher->queue[0].deadline;
+
+        if (now < flusher->queue[0].deadline) {
+            if (virCondWaitUntil(&flusher->cond, &flusher->lock,
+                                 flusher->queue[0].deadline) < 0 &&
+                errno != ETIMEDOUT) {
+                VIR_WARN("Unable to wait on status flusher condition");
+                break;
+            }
+            continue;
+        }
+
+        qemuStatusFlusherWriteDue(flusher, now);
+    }
+
+    virMutexUnlock(&flusher->lock);
+}
+
+
+/**
+ * qemuStatusFlusherNew:
+ * @delay: maximum time in milliseconds a change may wait
+ * @save: callback writing the status XML of a domain
+ * @opaque: data for @save
+ *
+ * Start a thread writing the status of domains marked dirty with
+ * qemuStatusFlusherMarkDirty.
+ *
+ * Returns the new flusher, or NULL on error.
+ */
+qemuStatusFlusherPtr
+qemuStatusFlusherNew(unsigned int delay,
+                     qemuStatusFlusherSaveFunc save,
+                     void *opaque)
+{
+    qemuStatusFlusherPtr flusher;
+
+    if (VIR_ALLOC(flusher) < 0)
+        return NULL;
+
+    flusher->delay = delay;
+    flusher->save = save;
+    flusher->opaque = opaque;
+
+    if (virMutexInit(&flusher->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize mutex"));
+        VIR_FREE(flusher);
+        return NULL;
+    }
+
+    /* Deadlines must not move with the system time */
+    if (virCondInitMonotonic(&flusher->cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        virMutexDestroy(&flusher->lock);
+        VIR_FREE(flusher);
+        return NULL;
+    }
+
+    if (virThreadCreate(&flusher->thread, true,
+                        qemuStatusFlusherWorker, flusher) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create status flusher thread"));
+        virCondDestroy(&flusher->cond);
+        virMutexDestroy(&flusher->lock);
+        VIR_FREE(flusher);
+        return NULL;
+    }
+
+    return flusher;
+}
+
+
+/**
+ * qemuStatusFlusherFree:
+ * @flusher: the flusher
+ *
+ * Stop the thread of @flusher, and write all pending changes.
+ */
+void
+qemuStatusFlusherFree(qemuStatusFlusherPtr flusher)
+{
+    if (!flusher)
+        return;
+
+    virMutexLock(&flusher->lock);
+    flusher->quit = true;
+    virCondSignal(&flusher->cond);
+    virMutexUnlock(&flusher->lock);
+
+    virThreadJoin(&flusher->thread);
+
+    virMutexLock(&flusher->lock);
+    while (flusher->nqueue > 0)
+        qemuStatusFlusherWriteDue(flusher, ULLONG_MAX);
+
+    VIR_INFO("Domain status changes: %llu deferred, %llu written, "
+             "%llu writes avoided (%llu bytes)",
+             flusher->stats.marked, flusher->stats.written,
+             flusher->stats.avoided, flusher->stats.avoidedBytes);
+    virMutexUnlock(&flusher->lock);
+
+    virCondDestroy(&flusher->cond);
+    virMutexDestroy(&flusher->lock);
+    VIR_FREE(flusher);
+}
+
+
+/**
+ * qemuStatusFlusherMarkDirty:
+ * @flusher: the flusher
+ * @vm: locked domain object
+ *
+ * Record that the status of @vm changed, to be written later.
+ *
+ * Returns 0 on success, -1 if the caller must save the status itself.
+ */
+int
+qemuStatusFlusherMarkDirty(qemuStatusFlusherPtr flusher,
+                           virDomainObjPtr vm)
+{
+    qemuStatusFlusherEntry entry = { vm, 0 };
+    size_t i;
+    int ret = -1;
+
+    virMutexLock(&flusher->lock);
+
+    for (i = 0; i < flusher->nqueue; i++) {
+        if (flusher->queue[i].vm == vm) {
+            /* Goes out along with the pending write */
+            vm->statusDirty = true;
+            flusher->stats.marked++;
+            flusher->stats.avoided++;
+            flusher->stats.avoidedBytes += vm->statusSize;
+            ret = 0;
+            goto cleanup;
+        }
+    }
+
+    if (virCondMonotonicNow(&entry.deadline) == 0)
+        entry.deadline += flusher->delay;
+
+    if (VIR_APPEND_ELEMENT_QUIET(flusher->queue, flusher->nqueue, entry) < 0)
+        goto cleanup;
+
+    virObjectRef(vm);
+    vm->statusDirty = true;
+    flusher->stats.marked++;
+    if (flusher->nqueue == 1)
+        virCondSignal(&flusher->cond);
+    ret = 0;
+
+ cleanup:
+    virMutexUnlock(&flusher->lock);
+    return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * qemu_status.h: deferred writing of domain status XML
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QEMU_STATUS_H__
+# define __QEMU_STATUS_H__
+
+# include "internal.h"
+# include "domain_conf.h"
+
+typedef struct _qemuStatusFlusher qemuStatusFlusher;
+typedef qemuStatusFlusher *qemuStatusFlusherPtr;
+
+/* Called with @vm locked to write its status XML */
+typedef int (*qemuStatusFlusherSaveFunc)(virDomainObjPtr vm,
+                                         void *opaque);
+
+qemuStatusFlusherPtr qemuStatusFlusherNew(unsigned int delay,
+                                          qemuStatusFlusherSaveFunc save,
+                                          void *opaque);
+void qemuStatusFlusherFree(qemuStatusFlusherPtr flusher);
+
+int qemuStatusFlusherMarkDirty(qemuStatusFlusherPtr flusher,
+                               virDomainObjPtr vm);
+
+#endif /* __QEMU_STATUS_H__ */
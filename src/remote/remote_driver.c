@@ -97,6 +97,12 @@ struct private_data {
     bool serverKeepAlive;       /* Does server support keepalive protocol? */
     bool serverEventFilter;     /* Does server support modern event filtering */
     bool serverCloseCallback;   /* Does server support driver close callback */
+    bool serverCompactTypedParams; /* Does server support compact bulk stats */
+
+    /* Typed parameter names learned from the server, indexed
+     * by the compact bulk stats encoding */
+    char **typedParamFields;
+    size_t ntypedParamFields;
 
     virObjectEventStatePtr eventState;
     virConnectCloseCallbackDataPtr closeCallback;
@@ -379,6 +385,11 @@ remoteNodeDeviceBuildEventUpdate(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
                                  virNetClientPtr client ATTRIBUTE_UNUSED,
                                  void *evdata, void *opaque);
 
+static void
+remoteDomainBuildStatsEvent(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
+                            virNetClientPtr client ATTRIBUTE_UNUSED,
+                            void *evdata, void *opaque);
+
 static void
 remoteConnectNotifyEventConnectionClosed(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
                                          virNetClientPtr client ATTRIBUTE_UNUSED,
@@ -574,6 +585,10 @@ static virNetClientProgramEvent remoteEvents[] = {
       remoteNodeDeviceBuildEventUpdate,
       sizeof(remote_node_device_event_update_msg),
       (xdrproc_t)xdr_remote_node_device_event_update_msg },
+    { REMOTE_PROC_DOMAIN_STATS_EVENT,
+      remoteDomainBuildStatsEvent,
+      sizeof(remote_domain_stats_event_msg),
+      (xdrproc_t)xdr_remote_domain_stats_event_msg },
 };
 
 static void
@@ -1200,6 +1215,9 @@ doRemoteOpen(virConnectPtr conn,
                  "by the remote side.");
     }
 
+    priv->serverCompactTypedParams = remoteConnectSupportsFeatureUnlocked(conn,
+                                priv, VIR_DRV_FEATURE_REMOTE_COMPACT_TYPED_PARAMS);
+
     /* Successful. */
     retcode = VIR_DRV_OPEN_SUCCESS;
 
@@ -1387,6 +1405,10 @@ doRemoteClose(virConnectPtr conn, struct private_data *priv)
     virObjectUnref(priv->eventState);
     priv->eventState = NULL;
 
+    virStringListFreeCount(priv->typedParamFields, priv->ntypedParamFields);
+    priv->typedParamFields = NULL;
+    priv->ntypedParamFields = 0;
+
     return ret;
 }
 
@@ -3363,6 +3385,87 @@ remoteConnectDomainQemuMonitorEventRegister(virConnectPtr conn,
 }
 
 
+static int
+remoteConnectDomainStatsEventRegister(virConnectPtr conn,
+                                      unsigned int stats,
+                                      unsigned int interval,
+                                      virConnectDomainStatsEventCallback callback,
+                                      void *opaque,
+                                      virFreeCallback freecb,
+                                      unsigned int flags)
+{
+    int rv = -1;
+    struct private_data *priv = conn->privateData;
+    remote_connect_domain_stats_event_register_args args;
+    remote_connect_domain_stats_event_register_ret ret;
+    int callbackID;
+
+    remoteDriverLock(priv);
+
+    if (virDomainStatsEventStateRegisterID(conn, priv->eventState,
+                                           callback, opaque, freecb,
+                                           &callbackID) < 0)
+        goto done;
+
+    /* Every subscription samples on its own, so each of them needs
+     * its own counterpart on the server */
+    args.stats = stats;
+    args.interval = interval;
+    args.flags = flags;
+
+    memset(&ret, 0, sizeof(ret));
+    if (call(conn, priv, 0, REMOTE_PROC_CONNECT_DOMAIN_STATS_EVENT_REGISTER,
+             (xdrproc_t) xdr_remote_connect_domain_stats_event_register_args, (char *) &args,
+             (xdrproc_t) xdr_remote_connect_domain_stats_event_register_ret, (char *) &ret) == -1) {
+        virObjectEventStateDeregisterID(conn, priv->eventState,
+                                        callbackID);
+        goto done;
+    }
+    virObjectEventStateSetRemote(conn, priv->eventState, callbackID,
+                                 ret.callbackID);
+
+    rv = callbackID;
+
+ done:
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
+
+static int
+remoteConnectDomainStatsEventDeregister(virConnectPtr conn,
+                                        int callbackID)
+{
+    struct private_data *priv = conn->privateData;
+    int rv = -1;
+    remote_connect_domain_stats_event_deregister_args args;
+    int remoteID;
+
+    remoteDriverLock(priv);
+
+    if (virObjectEventStateEventID(conn, priv->eventState,
+                                   callbackID, &remoteID) < 0)
+        goto done;
+
+    if (virObjectEventStateDeregisterID(conn, priv->eventState,
+                                        callbackID) < 0)
+        goto done;
+
+    args.callbackID = remoteID;
+
+    if (call(conn, priv, 0, REMOTE_PROC_CONNECT_DOMAIN_STATS_EVENT_DEREGISTER,
+             (xdrproc_t) xdr_remote_connect_domain_stats_event_deregister_args, (char *) &args,
+             (xdrproc_t) xdr_void, (char *) NULL) == -1)
+        goto done;
+
+    rv = 0;
+
+ done:
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
+
 static int
 remoteConnectDomainQemuMonitorEventDeregister(virConnectPtr conn,
                                               int callbackID)
@@ -5356,6 +5459,56 @@ remoteNodeDeviceBuildEventUpdate(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
     remoteEventQueue(priv, event, msg->callbackID);
 }
 
+static void
+remoteDomainBuildStatsEvent(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
+                            virNetClientPtr client ATTRIBUTE_UNUSED,
+                            void *evdata, void *opaque)
+{
+    virConnectPtr conn = opaque;
+    struct private_data *priv = conn->privateData;
+    remote_domain_stats_event_msg *msg = evdata;
+    virDomainStatsRecordPtr elem = NULL;
+    virDomainStatsRecordPtr *records = NULL;
+    virObjectEventPtr event = NULL;
+    size_t i;
+
+    if (msg->records.records_len > REMOTE_DOMAIN_LIST_MAX ||
+        VIR_ALLOC_N(records, msg->records.records_len + 1) < 0)
+        goto cleanup;
+
+    for (i = 0; i < msg->records.records_len; i++) {
+        remote_domain_stats_record *rec = msg->records.records_val + i;
+
+        if (VIR_ALLOC(elem) < 0)
+            goto cleanup;
+
+        if (!(elem->dom = get_nonnull_domain(conn, rec->dom)))
+            goto cleanup;
+
+        if (virTypedParamsDeserialize((virTypedParameterRemotePtr) rec->params.params_val,
+                                      rec->params.params_len,
+                                      REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX,
+                                      &elem->params,
+                                      &elem->nparams))
+            goto cleanup;
+
+        records[i] = elem;
+        elem = NULL;
+    }
+
+    event = virDomainStatsEventNew(records, msg->records.records_len);
+    records = NULL;
+
+    remoteEventQueue(priv, event, msg->callbackID);
+
+ cleanup:
+    if (elem) {
+        virObjectUnref(elem->dom);
+        VIR_FREE(elem);
+    }
+    virDomainStatsRecordListFree(records);
+}
+
 static void
 remoteDomainBuildQemuMonitorEvent(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
                                   virNetClientPtr client ATTRIBUTE_UNUSED,
@@ -5447,15 +5600,19 @@ remoteStreamSend(virStreamPtr st,
 
 
 static int
-remoteStreamRecv(virStreamPtr st,
-                 char *data,
-                 size_t nbytes)
+remoteStreamRecvFlags(virStreamPtr st,
+                      char *data,
+                      size_t nbytes,
+                      unsigned int flags)
 {
-    VIR_DEBUG("st=%p data=%p nbytes=%zu", st, data, nbytes);
+    VIR_DEBUG("st=%p data=%p nbytes=%zu flags=%x",
+              st, data, nbytes, flags);
     struct private_data *priv = st->conn->privateData;
     virNetClientStreamPtr privst = st->privateData;
     int rv;
 
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
     if (virNetClientStreamRaiseError(privst))
         return -1;
 
@@ -5467,7 +5624,8 @@ remoteStreamRecv(virStreamPtr st,
                                       priv->client,
                                       data,
                                       nbytes,
-                                      (st->flags & VIR_STREAM_NONBLOCK));
+                                      (st->flags & VIR_STREAM_NONBLOCK),
+                                      flags);
 
     VIR_DEBUG("Done %d", rv);
 
@@ -5477,6 +5635,74 @@ remoteStreamRecv(virStreamPtr st,
     return rv;
 }
 
+static int
+remoteStreamRecv(virStreamPtr st,
+                 char *data,
+                 size_t nbytes)
+{
+    return remoteStreamRecvFlags(st, data, nbytes, 0);
+}
+
+
+static int
+remoteStreamSendHole(virStreamPtr st,
+                     long long length,
+                     unsigned int flags)
+{
+    VIR_DEBUG("st=%p length=%lld flags=%x",
+              st, length, flags);
+    struct private_data *priv = st->conn->privateData;
+    virNetClientStreamPtr privst = st->privateData;
+    int rv;
+
+    if (virNetClientStreamRaiseError(privst))
+        return -1;
+
+    remoteDriverLock(priv);
+    priv->localUses++;
+    remoteDriverUnlock(priv);
+
+    rv = virNetClientStreamSendHole(privst,
+                                    priv->client,
+                                    length,
+                                    flags);
+
+    remoteDriverLock(priv);
+    priv->localUses--;
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
+
+static int
+remoteStreamRecvHole(virStreamPtr st,
+                     long long *length,
+                     unsigned int flags)
+{
+    struct private_data *priv = st->conn->privateData;
+    virNetClientStreamPtr privst = st->privateData;
+    int rv;
+
+    VIR_DEBUG("st=%p length=%p flags=%x",
+              st, length, flags);
+
+    virCheckFlags(0, -1);
+
+    if (virNetClientStreamRaiseError(privst))
+        return -1;
+
+    remoteDriverLock(priv);
+    priv->localUses++;
+    remoteDriverUnlock(priv);
+
+    rv = virNetClientStreamRecvHole(priv->client, privst, length);
+
+    remoteDriverLock(priv);
+    priv->localUses--;
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
 struct remoteStreamCallbackData {
     virStreamPtr st;
     virStreamEventCallback cb;
@@ -5649,7 +5875,10 @@ remoteStreamAbort(virStreamPtr st)
 
 static virStreamDriver remoteStreamDrv = {
     .streamRecv = remoteStreamRecv,
+    .streamRecvFlags = remoteStreamRecvFlags,
     .streamSend = remoteStreamSend,
+    .streamSendHole = remoteStreamSendHole,
+    .streamRecvHole = remoteStreamRecvHole,
     .streamFinish = remoteStreamFinish,
     .streamAbort = remoteStreamAbort,
     .streamEventAddCallback = remoteStreamEventAddCallback,
@@ -5965,7 +6194,8 @@ remoteDomainMigratePrepareTunnel3(virConnectPtr dconn,
 
     if (!(netst = virNetClientStreamNew(priv->remoteProgram,
                                         REMOTE_PROC_DOMAIN_MIGRATE_PREPARE_TUNNEL3,
-                                        priv->counter)))
+                                        priv->counter,
+                                        false)))
         goto done;
 
     if (virNetClientAddStream(priv->client, netst) < 0) {
@@ -6889,7 +7119,8 @@ remoteDomainMigratePrepareTunnel3Params(virConnectPtr dconn,
 
     if (!(netst = virNetClientStreamNew(priv->remoteProgram,
                                         REMOTE_PROC_DOMAIN_MIGRATE_PREPARE_TUNNEL3_PARAMS,
-                                        priv->counter)))
+                                        priv->counter,
+                                        false)))
         goto cleanup;
 
     if (virNetClientAddStream(priv->client, netst) < 0) {
@@ -7408,6 +7639,221 @@ remoteNetworkGetDHCPLeases(virNetworkPtr net,
 }
 
 
+/* Merge the typed parameter names sent by the server into the
+ * connection's dictionary. Replies to concurrent calls may repeat
+ * names already learned from another one. Called with the driver
+ * lock held */
+static int
+remoteTypedParamFieldsMerge(struct private_data *priv,
+                            unsigned int firstField,
+                            char **fields,
+                            u_int nfields)
+{
+    size_t i;
+
+    if (firstField > priv->ntypedParamFields) {
+        virReportError(VIR_ERR_RPC,
+                       _("typed parameter names start at %u, "
+                         "but only %zu are known"),
+                       firstField, priv->ntypedParamFields);
+        return -1;
+    }
+
+    for (i = priv->ntypedParamFields - firstField; i < nfields; i++) {
+        if (strlen(fields[i]) >= VIR_TYPED_PARAM_FIELD_LENGTH) {
+            virReportError(VIR_ERR_RPC,
+                           _("typed parameter name '%s' too long"),
+                           fields[i]);
+            return -1;
+        }
+
+        if (VIR_APPEND_ELEMENT(priv->typedParamFields,
+                               priv->ntypedParamFields, fields[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* Decode @nparams compact typed parameters into @params, stealing
+ * the string values. Called with the driver lock held */
+static int
+remoteDeserializeTypedParametersCompact(struct private_data *priv,
+                                        remote_typed_param_compact *val,
+                                        u_int nparams,
+                                        virTypedParameterPtr *params,
+                                        int *nparamsRet)
+{
+    virTypedParameterPtr tmp = NULL;
+    size_t i;
+
+    if (nparams > REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX) {
+        virReportError(VIR_ERR_RPC,
+                       _("too many parameters '%u' for limit '%d'"),
+                       nparams, REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX);
+        return -1;
+    }
+
+    if (VIR_ALLOC_N(tmp, nparams) < 0)
+        return -1;
+
+    for (i = 0; i < nparams; i++) {
+        virTypedParameterPtr param = tmp + i;
+        remote_typed_param_compact *src = val + i;
+
+        if (src->field >= priv->ntypedParamFields) {
+            virReportError(VIR_ERR_RPC,
+                           _("unknown typed parameter name index %u"),
+                           src->field);
+            goto error;
+        }
+
+        if (virStrcpyStatic(param->field,
+                            priv->typedParamFields[src->field]) == NULL)
+            goto error;
+
+        param->type = src->value.type;
+        switch (param->type) {
+        case VIR_TYPED_PARAM_INT:
+            param->value.i = src->value.remote_typed_param_value_u.i;
+            break;
+        case VIR_TYPED_PARAM_UINT:
+            param->value.ui = src->value.remote_typed_param_value_u.ui;
+            break;
+        case VIR_TYPED_PARAM_LLONG:
+            param->value.l = src->value.remote_typed_param_value_u.l;
+            break;
+        case VIR_TYPED_PARAM_ULLONG:
+            param->value.ul = src->value.remote_typed_param_value_u.ul;
+            break;
+        case VIR_TYPED_PARAM_DOUBLE:
+            param->value.d = src->value.remote_typed_param_value_u.d;
+            break;
+        case VIR_TYPED_PARAM_BOOLEAN:
+            param->value.b = src->value.remote_typed_param_value_u.b;
+            break;
+        case VIR_TYPED_PARAM_STRING:
+            param->value.s = src->value.remote_typed_param_value_u.s;
+            src->value.remote_typed_param_value_u.s = NULL;
+            break;
+        default:
+            virReportError(VIR_ERR_RPC, _("unknown parameter type: %d"),
+                           param->type);
+            goto error;
+        }
+    }
+
+    *params = tmp;
+    *nparamsRet = nparams;
+    return 0;
+
+ error:
+    virTypedParamsFree(tmp, i);
+    return -1;
+}
+
+
+static int
+remoteConnectGetAllDomainStatsCompact(virConnectPtr conn,
+                                      virDomainPtr *doms,
+                                      unsigned int ndoms,
+                                      unsigned int stats,
+                                      virDomainStatsRecordPtr **retStats,
+                                      unsigned int flags)
+{
+    struct private_data *priv = conn->privateData;
+    int rv = -1;
+    size_t i;
+    remote_connect_get_all_domain_stats_compact_args args;
+    remote_connect_get_all_domain_stats_compact_ret ret;
+    virDomainStatsRecordPtr elem = NULL;
+    virDomainStatsRecordPtr *tmpret = NULL;
+
+    memset(&args, 0, sizeof(args));
+
+    if (ndoms) {
+        if (VIR_ALLOC_N(args.doms.doms_val, ndoms) < 0)
+            goto cleanup;
+
+        for (i = 0; i < ndoms; i++)
+            make_nonnull_domain(args.doms.doms_val + i, doms[i]);
+    }
+    args.doms.doms_len = ndoms;
+
+    args.stats = stats;
+    args.flags = flags;
+
+    memset(&ret, 0, sizeof(ret));
+
+    remoteDriverLock(priv);
+    args.nfields = priv->ntypedParamFields;
+    if (call(conn, priv, 0, REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS_COMPACT,
+             (xdrproc_t)xdr_remote_connect_get_all_domain_stats_compact_args, (char *)&args,
+             (xdrproc_t)xdr_remote_connect_get_all_domain_stats_compact_ret, (char *)&ret) == -1) {
+        remoteDriverUnlock(priv);
+        goto cleanup;
+    }
+
+    if (remoteTypedParamFieldsMerge(priv, ret.firstField,
+                                    ret.fields.fields_val,
+                                    ret.fields.fields_len) < 0) {
+        remoteDriverUnlock(priv);
+        goto cleanup;
+    }
+
+    if (ret.retStats.retStats_len > REMOTE_DOMAIN_LIST_MAX) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Number of stats entries is %d, which exceeds max limit: %d"),
+                       ret.retStats.retStats_len, REMOTE_DOMAIN_LIST_MAX);
+        remoteDriverUnlock(priv);
+        goto cleanup;
+    }
+
+    *retStats = NULL;
+
+    if (VIR_ALLOC_N(tmpret, ret.retStats.retStats_len + 1) < 0) {
+        remoteDriverUnlock(priv);
+        goto cleanup;
+    }
+
+    for (i = 0; i < ret.retStats.retStats_len; i++) {
+        remote_domain_stats_record_compact *rec = ret.retStats.retStats_val + i;
+
+        if (VIR_ALLOC(elem) < 0 ||
+            !(elem->dom = get_nonnull_domain(conn, rec->dom)) ||
+            remoteDeserializeTypedParametersCompact(priv,
+                                                    rec->params.params_val,
+                                                    rec->params.params_len,
+                                                    &elem->params,
+                                                    &elem->nparams) < 0) {
+            remoteDriverUnlock(priv);
+            goto cleanup;
+        }
+
+        tmpret[i] = elem;
+        elem = NULL;
+    }
+    remoteDriverUnlock(priv);
+
+    *retStats = tmpret;
+    tmpret = NULL;
+    rv = ret.retStats.retStats_len;
+
+ cleanup:
+    if (elem) {
+        virObjectUnref(elem->dom);
+        VIR_FREE(elem);
+    }
+    virDomainStatsRecordListFree(tmpret);
+    VIR_FREE(args.doms.doms_val);
+    xdr_free((xdrproc_t)xdr_remote_connect_get_all_domain_stats_compact_ret,
+             (char *) &ret);
+
+    return rv;
+}
+
+
 static int
 remoteConnectGetAllDomainStats(virConnectPtr conn,
                                virDomainPtr *doms,
@@ -7424,6 +7870,10 @@ remoteConnectGetAllDomainStats(virConnectPtr conn,
     virDomainStatsRecordPtr elem = NULL;
     virDomainStatsRecordPtr *tmpret = NULL;
 
+    if (priv->serverCompactTypedParams)
+        return remoteConnectGetAllDomainStatsCompact(conn, doms, ndoms, stats,
+                                                     retStats, flags);
+
     memset(&args, 0, sizeof(args));
 
     if (ndoms) {
@@ -8205,6 +8655,8 @@ static virHypervisorDriver hypervisor_driver = {
     .domainMigrateStartPostCopy = remoteDomainMigrateStartPostCopy, /* 1.3.3 */
     .domainGetGuestVcpus = remoteDomainGetGuestVcpus, /* 2.0.0 */
     .domainSetGuestVcpus = remoteDomainSetGuestVcpus, /* 2.0.0 */
+    .connectDomainStatsEventRegister = remoteConnectDomainStatsEventRegister, /* 3.1.0 */
+    .connectDomainStatsEventDeregister = remoteConnectDomainStatsEventDeregister, /* 3.1.0 */
 };
 
 static virNetworkDriver network_driver = {
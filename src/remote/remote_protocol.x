@@ -235,6 +235,10 @@ const REMOTE_NETWORK_DHCP_LEASES_MAX = 65536;
 /* Upper limit on count of parameters returned via bulk stats API */
 const REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX = 4096;
 
+/* Upper limit on the number of field names of compact typed parameters
+ * known to a connection */
+const REMOTE_TYPED_PARAM_FIELDS_MAX = 65536;
+
 /* Upper limit of message size for tunable event. */
 const REMOTE_DOMAIN_EVENT_TUNABLE_MAX = 2048;
 
@@ -3341,6 +3345,50 @@ struct remote_domain_set_guest_vcpus_args {
     unsigned int flags;
 };
 
+struct remote_connect_domain_stats_event_register_args {
+    unsigned int stats;
+    unsigned int interval;
+    unsigned int flags;
+};
+
+struct remote_connect_domain_stats_event_register_ret {
+    int callbackID;
+};
+
+struct remote_connect_domain_stats_event_deregister_args {
+    int callbackID;
+};
+
+struct remote_domain_stats_event_msg {
+    int callbackID;
+    remote_domain_stats_record records<REMOTE_DOMAIN_LIST_MAX>;
+};
+
+/* A typed parameter whose name is an index in the field names the
+ * server has already sent over the connection */
+struct remote_typed_param_compact {
+    unsigned int field;
+    remote_typed_param_value value;
+};
+
+struct remote_domain_stats_record_compact {
+    remote_nonnull_domain dom;
+    remote_typed_param_compact params<REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX>;
+};
+
+struct remote_connect_get_all_domain_stats_compact_args {
+    remote_nonnull_domain doms<REMOTE_DOMAIN_LIST_MAX>;
+    unsigned int stats;
+    unsigned int flags;
+    unsigned int nfields; /* field names already known by the client */
+};
+
+struct remote_connect_get_all_domain_stats_compact_ret {
+    unsigned int firstField; /* index of the first name in fields */
+    remote_nonnull_string fields<REMOTE_TYPED_PARAM_FIELDS_MAX>;
+    remote_domain_stats_record_compact retStats<REMOTE_DOMAIN_LIST_MAX>;
+};
+
 
 /*----- Protocol. -----*/
 
@@ -3366,6 +3414,12 @@ enum remote_procedure {
      *   <paramnumber> specifies at which offset the stream parameter is inserted
      *   in the function parameter list.
      *
+     * - @sparseflag: flag
+     *
+     *   The @sparseflag annotation names the API flag which, when set,
+     *   makes the stream created by @readstream or @writestream able to
+     *   transfer holes in addition to data.
+     *
      * - @priority: low|high
      *
      *   Each API that might eventually access hypervisor's monitor (and thus
@@ -4828,6 +4882,7 @@ enum remote_procedure {
     /**
      * @generate: both
      * @writestream: 1
+     * @sparseflag: VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM
      * @acl: storage_vol:data_write
      */
     REMOTE_PROC_STORAGE_VOL_UPLOAD = 208,
@@ -4835,6 +4890,7 @@ enum remote_procedure {
     /**
      * @generate: both
      * @readstream: 1
+     * @sparseflag: VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM
      * @acl: storage_vol:data_read
      */
     REMOTE_PROC_STORAGE_VOL_DOWNLOAD = 209,
@@ -5934,5 +5990,33 @@ enum remote_procedure {
      * @generate: both
      * @acl: none
      */
-    REMOTE_PROC_NODE_DEVICE_EVENT_UPDATE = 377
+    REMOTE_PROC_NODE_DEVICE_EVENT_UPDATE = 377,
+
+    /**
+     * @generate: none
+     * @priority: high
+     * @acl: connect:search_domains
+     * @aclfilter: domain:read
+     */
+    REMOTE_PROC_CONNECT_DOMAIN_STATS_EVENT_REGISTER = 378,
+
+    /**
+     * @generate: none
+     * @priority: high
+     * @acl: connect:read
+     */
+    REMOTE_PROC_CONNECT_DOMAIN_STATS_EVENT_DEREGISTER = 379,
+
+    /**
+     * @generate: both
+     * @acl: none
+     */
+    REMOTE_PROC_DOMAIN_STATS_EVENT = 380,
+
+    /**
+     * @generate: none
+     * @acl: connect:search_domains
+     * @aclfilter: domain:read
+     */
+    REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS_COMPACT = 381
 };
@@ -52,6 +52,9 @@ struct _virNetClientStream {
     virNetMessagePtr rx;
     bool incomingEOF;
 
+    bool allowSkip;
+    long long holeLength;  /* Size of incoming hole in stream. */
+
     virNetClientStreamEventCallback cb;
     void *cbOpaque;
     virFreeCallback cbFree;
@@ -86,7 +89,7 @@ virNetClientStreamEventTimerUpdate(virNetClientStreamPtr st)
 
     VIR_DEBUG("Check timer rx=%p cbEvents=%d", st->rx, st->cbEvents);
 
-    if (((st->rx || st->incomingEOF) &&
+    if (((st->rx || st->holeLength || st->incomingEOF) &&
          (st->cbEvents & VIR_STREAM_EVENT_READABLE)) ||
         (st->cbEvents & VIR_STREAM_EVENT_WRITABLE)) {
         VIR_DEBUG("Enabling event timer");
@@ -108,7 +111,7 @@ virNetClientStreamEventTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
 
     if (st->cb &&
         (st->cbEvents & VIR_STREAM_EVENT_READABLE) &&
-        (st->rx || st->incomingEOF))
+        (st->rx || st->holeLength || st->incomingEOF))
         events |= VIR_STREAM_EVENT_READABLE;
     if (st->cb &&
         (st->cbEvents & VIR_STREAM_EVENT_WRITABLE))
@@ -135,7 +138,8 @@ virNetClientStreamEventTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
 
 virNetClientStreamPtr virNetClientStreamNew(virNetClientProgramPtr prog,
                                             int proc,
-                                            unsigned serial)
+                                            unsigned serial,
+                                            bool allowSkip)
 {
     virNetClientStreamPtr st;
 
@@ -148,6 +152,7 @@ virNetClientStreamPtr virNetClientStreamNew(virNetClientProgramPtr prog,
     st->prog = prog;
     st->proc = proc;
     st->serial = serial;
+    st->allowSkip = allowSkip;
 
     virObjectRef(prog);
 
@@ -350,19 +355,131 @@ int virNetClientStreamSendPacket(virNetClientStreamPtr st,
     return -1;
 }
 
+int virNetClientStreamSendHole(virNetClientStreamPtr st,
+                               virNetClientPtr client,
+                               long long length,
+                               unsigned int flags)
+{
+    virNetMessagePtr msg = NULL;
+    virNetStreamHole data;
+    int ret = -1;
+
+    VIR_DEBUG("st=%p client=%p length=%lld flags=%x",
+              st, client, length, flags);
+
+    if (!st->allowSkip) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("Skipping is not supported with this stream"));
+        return -1;
+    }
+
+    memset(&data, 0, sizeof(data));
+    data.length = length;
+    data.flags = flags;
+
+    if (!(msg = virNetMessageNew(false)))
+        return -1;
+
+    virObjectLock(st);
+
+    msg->header.prog = virNetClientProgramGetProgram(st->prog);
+    msg->header.vers = virNetClientProgramGetVersion(st->prog);
+    msg->header.status = VIR_NET_CONTINUE;
+    msg->header.type = VIR_NET_STREAM_HOLE;
+    msg->header.serial = st->serial;
+    msg->header.proc = st->proc;
+
+    virObjectUnlock(st);
+
+    if (virNetMessageEncodeHeader(msg) < 0 ||
+        virNetMessageEncodePayload(msg,
+                                   (xdrproc_t) xdr_virNetStreamHole,
+                                   &data) < 0 ||
+        virNetClientSendNoReply(client, msg) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    virNetMessageFree(msg);
+    return ret;
+}
+
+
+/* Consume the hole message at the head of the incoming queue.
+ * Called with @st locked. */
+static int
+virNetClientStreamHandleHole(virNetClientPtr client,
+                             virNetClientStreamPtr st)
+{
+    virNetMessagePtr msg;
+    virNetStreamHole data;
+    int ret = -1;
+
+    VIR_DEBUG("client=%p st=%p", client, st);
+
+    msg = st->rx;
+    memset(&data, 0, sizeof(data));
+
+    /* We should not be called unless there's VIR_NET_STREAM_HOLE
+     * message at the head of the list. But doesn't hurt to check */
+    if (!msg ||
+        msg->header.type != VIR_NET_STREAM_HOLE) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Invalid message prog=%d type=%d serial=%u proc=%d"),
+                       msg ? msg->header.prog : -1,
+                       msg ? msg->header.type : -1,
+                       msg ? msg->header.serial : 0,
+                       msg ? msg->header.proc : -1);
+        goto cleanup;
+    }
+
+    if (!st->allowSkip) {
+        virReportError(VIR_ERR_RPC, "%s",
+                       _("Unexpected stream hole"));
+        goto cleanup;
+    }
+
+    if (virNetMessageDecodePayload(msg,
+                                   (xdrproc_t) xdr_virNetStreamHole,
+                                   &data) < 0)
+        goto cleanup;
+
+    if (data.flags != 0 || data.length < 0) {
+        virReportError(VIR_ERR_RPC,
+                       _("Malformed stream hole length=%lld flags=%u"),
+                       (long long) data.length, data.flags);
+        goto cleanup;
+    }
+
+    virNetMessageQueueServe(&st->rx);
+    virNetMessageFree(msg);
+
+    /* Consecutive holes merge into one */
+    st->holeLength += data.length;
+
+    ret = 0;
+ cleanup:
+    return ret;
+}
+
+
 int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
                                  virNetClientPtr client,
                                  char *data,
                                  size_t nbytes,
-                                 bool nonblock)
+                                 bool nonblock,
+                                 unsigned int flags)
 {
     int rv = -1;
     size_t want;
 
-    VIR_DEBUG("st=%p client=%p data=%p nbytes=%zu nonblock=%d",
-              st, client, data, nbytes, nonblock);
+    VIR_DEBUG("st=%p client=%p data=%p nbytes=%zu nonblock=%d flags=%x",
+              st, client, data, nbytes, nonblock, flags);
+
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
     virObjectLock(st);
-    if (!st->rx && !st->incomingEOF) {
+    if (!st->rx && !st->holeLength && !st->incomingEOF) {
         virNetMessagePtr msg;
         int ret;
 
@@ -394,10 +511,35 @@ int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
 
     VIR_DEBUG("After IO rx=%p", st->rx);
     want = nbytes;
-    while (want && st->rx) {
+    while (want && (st->rx || st->holeLength)) {
         virNetMessagePtr msg = st->rx;
         size_t len = want;
 
+        if (!st->holeLength && msg->header.type == VIR_NET_STREAM_HOLE) {
+            if (virNetClientStreamHandleHole(client, st) < 0)
+                goto cleanup;
+            continue;
+        }
+
+        if (st->holeLength) {
+            if (flags & VIR_STREAM_RECV_STOP_AT_HOLE) {
+                /* Hand out data read so far before reporting the hole */
+                if (want == nbytes) {
+                    rv = -3;
+                    goto cleanup;
+                }
+                break;
+            }
+
+            /* Caller doesn't care about holes, so fill in zeroes */
+            if (len > st->holeLength)
+                len = st->holeLength;
+            memset(data + (nbytes - want), 0, len);
+            want -= len;
+            st->holeLength -= len;
+            continue;
+        }
+
         if (len > msg->bufferLength - msg->bufferOffset)
             len = msg->bufferLength - msg->bufferOffset;
 
@@ -423,6 +565,39 @@ int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
 }
 
 
+int virNetClientStreamRecvHole(virNetClientPtr client,
+                               virNetClientStreamPtr st,
+                               long long *length)
+{
+    int ret = -1;
+
+    VIR_DEBUG("client=%p st=%p length=%p", client, st, length);
+
+    virObjectLock(st);
+
+    if (!st->allowSkip) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("Holes are not supported with this stream"));
+        goto cleanup;
+    }
+
+    if (!st->holeLength && st->rx &&
+        st->rx->header.type == VIR_NET_STREAM_HOLE &&
+        virNetClientStreamHandleHole(client, st) < 0)
+        goto cleanup;
+
+    *length = st->holeLength;
+    st->holeLength = 0;
+
+    virNetClientStreamEventTimerUpdate(st);
+
+    ret = 0;
+ cleanup:
+    virObjectUnlock(st);
+    return ret;
+}
+
+
 int virNetClientStreamEventAddCallback(virNetClientStreamPtr st,
                                        int events,
                                        virNetClientStreamEventCallback cb,
@@ -215,11 +215,11 @@ static int virNetServerClientRegisterEvent(virNetServerClientPtr client)
 
     virObjectRef(client);
     VIR_DEBUG("Registering client event callback %d", mode);
-    if (virNetSocketAddIOCallback(client->sock,
-                                  mode,
-                                  virNetServerClientDispatchEvent,
-                                  client,
-                                  virObjectFreeCallback) < 0) {
+    if (virNetSocketAddIOCallbackSharded(client->sock,
+                                         mode,
+                                         virNetServerClientDispatchEvent,
+                                         client,
+                                         virObjectFreeCallback) < 0) {
         virObjectUnref(client);
         return -1;
     }
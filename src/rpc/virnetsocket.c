@@ -51,6 +51,7 @@
 #include "virutil.h"
 #include "viralloc.h"
 #include "virerror.h"
+#include "virevent.h"
 #include "virlog.h"
 #include "virfile.h"
 #include "virthread.h"
@@ -2144,11 +2145,12 @@ static void virNetSocketEventFree(void *opaque)
     virObjectUnref(sock);
 }
 
-int virNetSocketAddIOCallback(virNetSocketPtr sock,
-                              int events,
-                              virNetSocketIOFunc func,
-                              void *opaque,
-                              virFreeCallback ff)
+static int virNetSocketAddIOCallbackInternal(virNetSocketPtr sock,
+                                             bool sharded,
+                                             int events,
+                                             virNetSocketIOFunc func,
+                                             void *opaque,
+                                             virFreeCallback ff)
 {
     int ret = -1;
 
@@ -2159,11 +2161,19 @@ int virNetSocketAddIOCallback(virNetSocketPtr sock,
         goto cleanup;
     }
 
-    if ((sock->watch = virEventAddHandle(sock->fd,
-                                         events,
-                                         virNetSocketEventHandle,
-                                         sock,
-                                         virNetSocketEventFree)) < 0) {
+    if (sharded)
+        sock->watch = virEventAddHandleSharded(sock->fd,
+                                               events,
+                                               virNetSocketEventHandle,
+                                               sock,
+                                               virNetSocketEventFree);
+    else
+        sock->watch = virEventAddHandle(sock->fd,
+                                        events,
+                                        virNetSocketEventHandle,
+                                        sock,
+                                        virNetSocketEventFree);
+    if (sock->watch < 0) {
         VIR_DEBUG("Failed to register watch on socket %p", sock);
         goto cleanup;
     }
@@ -2180,6 +2190,30 @@ int virNetSocketAddIOCallback(virNetSocketPtr sock,
     return ret;
 }
 
+int virNetSocketAddIOCallback(virNetSocketPtr sock,
+                              int events,
+                              virNetSocketIOFunc func,
+                              void *opaque,
+                              virFreeCallback ff)
+{
+    return virNetSocketAddIOCallbackInternal(sock, false, events,
+                                             func, opaque, ff);
+}
+
+/*
+ * Like virNetSocketAddIOCallback, but let the event loop serve
+ * the socket from one of its additional threads, if any
+ */
+int virNetSocketAddIOCallbackSharded(virNetSocketPtr sock,
+                                     int events,
+                                     virNetSocketIOFunc func,
+                                     void *opaque,
+                                     virFreeCallback ff)
+{
+    return virNetSocketAddIOCallbackInternal(sock, true, events,
+                                             func, opaque, ff);
+}
+
 void virNetSocketUpdateIOCallback(virNetSocketPtr sock,
                                   int events)
 {
@@ -175,6 +175,12 @@ int virNetSocketAddIOCallback(virNetSocketPtr sock,
                               void *opaque,
                               virFreeCallback ff);
 
+int virNetSocketAddIOCallbackSharded(virNetSocketPtr sock,
+                                     int events,
+                                     virNetSocketIOFunc func,
+                                     void *opaque,
+                                     virFreeCallback ff);
+
 void virNetSocketUpdateIOCallback(virNetSocketPtr sock,
                                   int events);
 
@@ -2199,7 +2199,7 @@ virStorageBackendVolUploadLocal(virConnectPtr conn ATTRIBUTE_UNUSED,
     int ret = -1;
     int has_snap = 0;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM, -1);
     /* if volume has target format VIR_STORAGE_FILE_PLOOP
      * we need to restore DiskDescriptor.xml, according to
      * new contents of volume. This operation will be perfomed
@@ -2224,7 +2224,8 @@ virStorageBackendVolUploadLocal(virConnectPtr conn ATTRIBUTE_UNUSED,
     /* Not using O_CREAT because the file is required to already exist at
      * this point */
     ret = virFDStreamOpenBlockDevice(stream, target_path,
-                                     offset, len, O_WRONLY);
+                                     offset, len, O_WRONLY,
+                                     flags & VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM);
 
  cleanup:
     VIR_FREE(path);
@@ -2245,7 +2246,7 @@ virStorageBackendVolDownloadLocal(virConnectPtr conn ATTRIBUTE_UNUSED,
     int ret = -1;
     int has_snap = 0;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM, -1);
     if (vol->target.format == VIR_STORAGE_FILE_PLOOP) {
         has_snap = virStorageBackendPloopHasSnapshots(vol->target.path);
         if (has_snap < 0) {
@@ -2262,7 +2263,8 @@ virStorageBackendVolDownloadLocal(virConnectPtr conn ATTRIBUTE_UNUSED,
     }
 
     ret = virFDStreamOpenBlockDevice(stream, target_path,
-                                     offset, len, O_RDONLY);
+                                     offset, len, O_RDONLY,
+                                     flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM);
 
  cleanup:
     VIR_FREE(path);
@@ -2367,6 +2369,153 @@ virStorageBackendWipeLocal(const char *path,
 }
 
 
+/* Size of each request sent to the storage by the fast wipe, so that
+ * the device is not tied up for too long. Each one is logged, there is
+ * no API reporting the progress of a wipe. */
+#define WIPE_CHUNK_SIZE (1024ULL * 1024 * 1024)
+
+typedef enum {
+    VIR_STORAGE_WIPE_FAST_DISCARD,      /* BLKDISCARD */
+    VIR_STORAGE_WIPE_FAST_ZEROOUT,      /* BLKZEROOUT */
+    VIR_STORAGE_WIPE_FAST_ZERO_RANGE,   /* fallocate(FALLOC_FL_ZERO_RANGE) */
+    VIR_STORAGE_WIPE_FAST_PUNCH_HOLE,   /* fallocate(FALLOC_FL_PUNCH_HOLE) */
+
+    VIR_STORAGE_WIPE_FAST_LAST
+} virStorageBackendWipeFastMethod;
+
+
+static int
+virStorageBackendWipeLocalRange(int fd,
+                                virStorageBackendWipeFastMethod method,
+                                unsigned long long offset,
+                                unsigned long long length)
+{
+#if defined(__linux__) && (defined(BLKDISCARD) || defined(BLKZEROOUT))
+    uint64_t range[2] = { offset, length };
+#endif
+
+    switch (method) {
+    case VIR_STORAGE_WIPE_FAST_DISCARD:
+#if defined(__linux__) && defined(BLKDISCARD)
+        return ioctl(fd, BLKDISCARD, range);
+#else
+        break;
+#endif
+    case VIR_STORAGE_WIPE_FAST_ZEROOUT:
+#if defined(__linux__) && defined(BLKZEROOUT)
+        return ioctl(fd, BLKZEROOUT, range);
+#else
+        break;
+#endif
+    case VIR_STORAGE_WIPE_FAST_ZERO_RANGE:
+#if HAVE_FALLOCATE - 0 && defined(FALLOC_FL_ZERO_RANGE)
+        return fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                         offset, length);
+#else
+        break;
+#endif
+    case VIR_STORAGE_WIPE_FAST_PUNCH_HOLE:
+#if HAVE_FALLOCATE - 0 && defined(FALLOC_FL_PUNCH_HOLE)
+        return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         offset, length);
+#else
+        break;
+#endif
+    case VIR_STORAGE_WIPE_FAST_LAST:
+        break;
+    }
+
+    errno = ENOSYS;
+    return -1;
+}
+
+
+/*
+ * Wipe the volume without writing its whole extent: have the storage
+ * zero the data out, or for @trim just discard it.
+ *
+ * Block devices are discarded if discarded blocks are guaranteed to
+ * read back as zeroes, and zeroed out with BLKZEROOUT otherwise, which
+ * lets the device do the work where it can. Regular files have their
+ * blocks zeroed, or deallocated, by the file system.
+ *
+ * Returns 0 on success, 1 if the storage can't do it and the data has
+ * to be written instead, -1 on error.
+ */
+static int
+virStorageBackendWipeLocalFast(const char *path,
+                               int fd,
+                               struct stat *st,
+                               unsigned long long wipe_len,
+                               bool trim)
+{
+    virStorageBackendWipeFastMethod methods[2];
+    size_t nmethods = 0;
+    size_t i = 0;
+    unsigned long long offset = 0;
+    unsigned long long length;
+
+    if (S_ISBLK(st->st_mode)) {
+        if (trim) {
+            methods[nmethods++] = VIR_STORAGE_WIPE_FAST_DISCARD;
+        } else {
+#if defined(__linux__) && defined(BLKDISCARDZEROES)
+            unsigned int zeroes = 0;
+
+            if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes)
+                methods[nmethods++] = VIR_STORAGE_WIPE_FAST_DISCARD;
+#endif
+            methods[nmethods++] = VIR_STORAGE_WIPE_FAST_ZEROOUT;
+        }
+    } else if (S_ISREG(st->st_mode)) {
+        /* The whole file, not just what is allocated */
+        wipe_len = st->st_size;
+        if (!trim)
+            methods[nmethods++] = VIR_STORAGE_WIPE_FAST_ZERO_RANGE;
+        methods[nmethods++] = VIR_STORAGE_WIPE_FAST_PUNCH_HOLE;
+    } else {
+        return 1;
+    }
+
+    while (offset < wipe_len) {
+        length = MIN(wipe_len - offset, WIPE_CHUNK_SIZE);
+
+        if (virStorageBackendWipeLocalRange(fd, methods[i],
+                                            offset, length) < 0) {
+            /* Only the first request can tell what is supported */
+            if (offset == 0 &&
+                (errno == EOPNOTSUPP || errno == ENOTTY ||
+                 errno == ENOSYS || errno == EINVAL)) {
+                if (++i < nmethods)
+                    continue;
+                VIR_DEBUG("Volume with path '%s' can't be wiped in place",
+                          path);
+                return 1;
+            }
+
+            virReportSystemError(errno,
+                                 _("Failed to wipe %llu bytes at offset %llu "
+                                   "of volume with path '%s'"),
+                                 length, offset, path);
+            return -1;
+        }
+
+        offset += length;
+        VIR_DEBUG("Wiped %llu of %llu bytes of volume with path '%s'",
+                  offset, wipe_len, path);
+    }
+
+    if (fdatasync(fd) < 0) {
+        virReportSystemError(errno,
+                             _("cannot sync data to volume with path '%s'"),
+                             path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
 static int
 virStorageBackendVolWipeLocalFile(const char *path,
                                   unsigned int algorithm,
@@ -2421,9 +2570,8 @@ virStorageBackendVolWipeLocalFile(const char *path,
         alg_char = "random";
         break;
     case VIR_STORAGE_VOL_WIPE_ALG_TRIM:
-        virReportError(VIR_ERR_ARGUMENT_UNSUPPORTED, "%s",
-                       _("'trim' algorithm not supported"));
-        goto cleanup;
+        alg_char = "trim";
+        break;
     case VIR_STORAGE_VOL_WIPE_ALG_LAST:
         virReportError(VIR_ERR_INVALID_ARG,
                        _("unsupported algorithm %d"),
@@ -2433,7 +2581,17 @@ virStorageBackendVolWipeLocalFile(const char *path,
 
     VIR_DEBUG("Wiping file '%s' with algorithm '%s'", path, alg_char);
 
-    if (algorithm != VIR_STORAGE_VOL_WIPE_ALG_ZERO) {
+    if (algorithm == VIR_STORAGE_VOL_WIPE_ALG_TRIM) {
+        if ((ret = virStorageBackendWipeLocalFast(path, fd, &st,
+                                                  allocation, true)) == 1) {
+            virReportError(VIR_ERR_ARGUMENT_UNSUPPORTED,
+                           _("'trim' algorithm not supported for volume "
+                             "with path '%s'"), path);
+            ret = -1;
+        }
+        if (ret < 0)
+            goto cleanup;
+    } else if (algorithm != VIR_STORAGE_VOL_WIPE_ALG_ZERO) {
         cmd = virCommandNew(SCRUB);
         virCommandAddArgList(cmd, "-f", "-p", alg_char, path, NULL);
 
@@ -2444,7 +2602,9 @@ virStorageBackendVolWipeLocalFile(const char *path,
     } else {
         if (S_ISREG(st.st_mode) && st.st_blocks < (st.st_size / DEV_BSIZE)) {
             ret = virStorageBackendVolZeroSparseFileLocal(path, st.st_size, fd);
-        } else {
+        } else if ((ret = virStorageBackendWipeLocalFast(path, fd, &st,
+                                                         allocation,
+                                                         false)) == 1) {
             ret = virStorageBackendWipeLocal(path,
                                              fd,
                                              allocation,
@@ -2222,7 +2222,7 @@ storageVolDownload(virStorageVolPtr obj,
     virStorageVolDefPtr vol = NULL;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM, -1);
 
     if (!(vol = virStorageVolDefFromVol(obj, &pool, &backend)))
         return -1;
@@ -2390,7 +2390,7 @@ storageVolUpload(virStorageVolPtr obj,
     virStorageVolStreamInfoPtr cbdata = NULL;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM, -1);
 
     if (!(vol = virStorageVolDefFromVol(obj, &pool, &backend)))
         return -1;
@@ -2558,6 +2558,7 @@ storageVolWipePattern(virStorageVolPtr obj,
     virStorageBackendPtr backend;
     virStoragePoolObjPtr pool = NULL;
     virStorageVolDefPtr vol = NULL;
+    int rc;
     int ret = -1;
 
     virCheckFlags(0, -1);
@@ -2596,7 +2597,21 @@ storageVolWipePattern(virStorageVolPtr obj,
         goto cleanup;
     }
 
-    if (backend->wipeVol(obj->conn, pool, vol, algorithm, flags) < 0)
+    /* Drop the pool lock during the wipe, which can take a while */
+    pool->asyncjobs++;
+    vol->in_use++;
+    virStoragePoolObjUnlock(pool);
+
+    rc = backend->wipeVol(obj->conn, pool, vol, algorithm, flags);
+
+    storageDriverLock();
+    virStoragePoolObjLock(pool);
+    storageDriverUnlock();
+
+    vol->in_use--;
+    pool->asyncjobs--;
+
+    if (rc < 0)
         goto cleanup;
 
     if (backend->refreshVol &&
@@ -63,6 +63,7 @@
 #include "virauth.h"
 #include "viratomic.h"
 #include "virdomainobjlist.h"
+#include "virdomainstatssampler.h"
 #include "virhostcpu.h"
 
 #define VIR_FROM_THIS VIR_FROM_TEST
@@ -118,6 +119,7 @@ struct _testDriver {
     virDomainObjListPtr domains;
     virNetworkObjListPtr networks;
     virObjectEventStatePtr eventState;
+    virDomainStatsSamplerListPtr statsSamplers;
 };
 typedef struct _testDriver testDriver;
 typedef testDriver *testDriverPtr;
@@ -153,6 +155,9 @@ testDriverFree(testDriverPtr driver)
     virObjectUnref(driver->networks);
     virInterfaceObjListFree(&driver->ifaces);
     virStoragePoolObjListFree(&driver->pools);
+    /* Every sampler holds a reference on its connection, so none is
+     * left running once the last connection is closed */
+    virObjectUnref(driver->statsSamplers);
     virObjectUnref(driver->eventState);
     virMutexUnlock(&driver->lock);
     virMutexDestroy(&driver->lock);
@@ -393,6 +398,11 @@ testBuildCapabilities(virConnectPtr conn)
 }
 
 
+static int testDomainStatsSamplerCollect(virConnectPtr conn,
+                                         unsigned int stats,
+                                         virDomainStatsRecordPtr **records,
+                                         unsigned int flags);
+
 static testDriverPtr
 testDriverNew(void)
 {
@@ -413,6 +423,9 @@ testDriverNew(void)
 
     if (!(ret->xmlopt = virDomainXMLOptionNew(NULL, NULL, &ns)) ||
         !(ret->eventState = virObjectEventStateNew()) ||
+        !(ret->statsSamplers =
+          virDomainStatsSamplerListNew(ret->eventState,
+                                       testDomainStatsSamplerCollect)) ||
         !(ret->domains = virDomainObjListNew()) ||
         !(ret->networks = virNetworkObjListNew()))
         goto error;
@@ -5878,6 +5891,123 @@ testConnectNodeDeviceEventDeregisterAny(virConnectPtr conn,
     return ret;
 }
 
+#define TEST_DOMAIN_STATS_SUPPORTED \
+    (VIR_DOMAIN_STATS_STATE | VIR_DOMAIN_STATS_BALLOON)
+
+/* Report the state and the balloon size of every domain, which is
+ * all there is to sample in the test driver */
+static int
+testDomainStatsSamplerCollect(virConnectPtr conn,
+                              unsigned int stats,
+                              virDomainStatsRecordPtr **records,
+                              unsigned int flags)
+{
+    testDriverPtr privconn = conn->privateData;
+    virDomainObjPtr *vms = NULL;
+    size_t nvms = 0;
+    virDomainStatsRecordPtr *tmpstats = NULL;
+    size_t nstats = 0;
+    size_t i;
+    int ret = -1;
+
+    if (virDomainObjListCollect(privconn->domains, conn, &vms, &nvms,
+                                NULL, flags) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(tmpstats, nvms + 1) < 0)
+        goto cleanup;
+
+    for (i = 0; i < nvms; i++) {
+        virDomainObjPtr vm = vms[i];
+        virDomainStatsRecordPtr record = NULL;
+        int maxparams = 0;
+        int state;
+        int reason;
+
+        if (VIR_ALLOC(record) < 0)
+            goto cleanup;
+        tmpstats[nstats++] = record;
+
+        virObjectLock(vm);
+        state = virDomainObjGetState(vm, &reason);
+        if (!(record->dom = virGetDomain(conn, vm->def->name,
+                                         vm->def->uuid))) {
+            virObjectUnlock(vm);
+            goto cleanup;
+        }
+        record->dom->id = vm->def->id;
+
+        if (stats & VIR_DOMAIN_STATS_STATE &&
+            (virTypedParamsAddInt(&record->params, &record->nparams,
+                                  &maxparams, "state.state", state) < 0 ||
+             virTypedParamsAddInt(&record->params, &record->nparams,
+                                  &maxparams, "state.reason", reason) < 0)) {
+            virObjectUnlock(vm);
+            goto cleanup;
+        }
+
+        if (stats & VIR_DOMAIN_STATS_BALLOON &&
+            virTypedParamsAddULLong(&record->params, &record->nparams,
+                                    &maxparams, "balloon.current",
+                                    vm->def->mem.cur_balloon) < 0) {
+            virObjectUnlock(vm);
+            goto cleanup;
+        }
+        virObjectUnlock(vm);
+    }
+
+    *records = tmpstats;
+    tmpstats = NULL;
+    ret = nstats;
+
+ cleanup:
+    virDomainStatsRecordListFree(tmpstats);
+    virObjectListFreeCount(vms, nvms);
+    return ret;
+}
+
+static int
+testConnectDomainStatsEventRegister(virConnectPtr conn,
+                                    unsigned int stats,
+                                    unsigned int interval,
+                                    virConnectDomainStatsEventCallback cb,
+                                    void *opaque,
+                                    virFreeCallback freecb,
+                                    unsigned int flags)
+{
+    testDriverPtr driver = conn->privateData;
+
+    virCheckFlags(VIR_CONNECT_LIST_DOMAINS_FILTERS_ACTIVE |
+                  VIR_CONNECT_LIST_DOMAINS_FILTERS_PERSISTENT |
+                  VIR_CONNECT_LIST_DOMAINS_FILTERS_STATE |
+                  VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS, -1);
+
+    if (!stats) {
+        stats = TEST_DOMAIN_STATS_SUPPORTED;
+    } else if (flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS &&
+               stats & ~TEST_DOMAIN_STATS_SUPPORTED) {
+        virReportError(VIR_ERR_ARGUMENT_UNSUPPORTED,
+                       _("Stats types bits 0x%x are not supported by this daemon"),
+                       stats & ~TEST_DOMAIN_STATS_SUPPORTED);
+        return -1;
+    }
+    stats &= TEST_DOMAIN_STATS_SUPPORTED;
+
+    return virDomainStatsSamplerListAdd(driver->statsSamplers, conn,
+                                        stats, interval, cb, opaque, freecb,
+                                        flags & ~VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS);
+}
+
+static int
+testConnectDomainStatsEventDeregister(virConnectPtr conn,
+                                      int callbackID)
+{
+    testDriverPtr driver = conn->privateData;
+
+    return virDomainStatsSamplerListRemove(driver->statsSamplers, conn,
+                                           callbackID);
+}
+
 static int testConnectListAllDomains(virConnectPtr conn,
                                      virDomainPtr **domains,
                                      unsigned int flags)
@@ -6949,6 +7079,8 @@ static virHypervisorDriver testHypervisorDriver = {
     .domainSnapshotDelete = testDomainSnapshotDelete, /* 1.1.4 */
 
     .connectBaselineCPU = testConnectBaselineCPU, /* 1.2.0 */
+    .connectDomainStatsEventRegister = testConnectDomainStatsEventRegister, /* 3.1.0 */
+    .connectDomainStatsEventDeregister = testConnectDomainStatsEventDeregister, /* 3.1.0 */
 };
 
 static virNetworkDriver testNetworkDriver = {
@@ -23,6 +23,15 @@
  *   - Read existing file
  *   - Write existing file
  *   - Create & write new file
+ *   - Read or write existing file as a sparse stream
+ *
+ * The copy uses splice() or copy_file_range() where the kernel can move
+ * the data itself, and otherwise overlaps reading and writing through a
+ * queue of buffers. Both can be tuned through the environment:
+ *
+ *   LIBVIRT_IOHELPER_BUFFER_SIZE  size of each buffer, in bytes
+ *   LIBVIRT_IOHELPER_QUEUE_DEPTH  number of buffers, 1 disables overlap
+ *   LIBVIRT_IOHELPER_ZERO_COPY    0 disables splice()/copy_file_range()
  */
 
 #include <config.h>
@@ -31,6 +40,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "virutil.h"
 #include "virthread.h"
@@ -43,6 +53,37 @@
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
+/* O_DIRECT needs buffers aligned this way */
+#define IOHELPER_ALIGN (64 * 1024)
+#define IOHELPER_BUFFER_SIZE (1024 * 1024)
+#define IOHELPER_BUFFER_SIZE_MAX (256 * 1024 * 1024)
+#define IOHELPER_QUEUE_DEPTH 4
+#define IOHELPER_QUEUE_DEPTH_MAX 64
+
+typedef struct _runIOQueue runIOQueue;
+typedef runIOQueue *runIOQueuePtr;
+struct _runIOQueue {
+    virMutex lock;
+    virCond cond;
+
+    char *bufs;         /* @depth buffers of @buflen bytes each */
+    size_t buflen;
+    size_t depth;
+    ssize_t *lens;      /* bytes held by each buffer */
+    bool *shortReads;   /* whether the buffer was filled by a short read */
+    size_t head;        /* next buffer to write out */
+    size_t count;       /* number of filled buffers */
+
+    bool eof;           /* reader is done */
+    bool quit;          /* writer failed, reader should stop */
+    int err;            /* errno of a failed read */
+    bool tooShort;      /* reader hit more than one short read */
+
+    int fdin;
+    unsigned long long length;
+    bool direct;
+};
+
 static int
 prepare(const char *path, int oflags, int mode,
         unsigned long long offset)
@@ -72,29 +113,480 @@ prepare(const char *path, int oflags, int mode,
     return fd;
 }
 
+/*
+ * Read @fd as a sequence of data and hole segments, see
+ * virFileSegmentHeader
+ */
+static int
+runIOSparseRead(const char *path, int fd, char *buf, size_t buflen,
+                unsigned long long length)
+{
+    unsigned long long total = 0;
+
+    while (!length || total < length) {
+        virFileSegmentHeader hdr = { 0 };
+        bool inData;
+        long long seglen;
+
+        if (virFileInData(fd, &inData, &seglen) < 0)
+            return -1;
+
+        if (length && seglen > length - total)
+            seglen = length - total;
+
+        if (seglen == 0)
+            break; /* End of file */
+
+        if (!inData) {
+            hdr.type = VIR_FILE_SEGMENT_HOLE;
+            hdr.length = seglen;
+            if (safewrite(STDOUT_FILENO, &hdr, sizeof(hdr)) < 0) {
+                virReportSystemError(errno, "%s", _("Unable to write stdout"));
+                return -1;
+            }
+            if (lseek(fd, seglen, SEEK_CUR) < 0) {
+                virReportSystemError(errno, _("Unable to seek %s"), path);
+                return -1;
+            }
+            total += seglen;
+            continue;
+        }
+
+        while (seglen > 0) {
+            ssize_t got;
+
+            if ((got = saferead(fd, buf, MIN(seglen, buflen))) < 0) {
+                virReportSystemError(errno, _("Unable to read %s"), path);
+                return -1;
+            }
+            if (got == 0)
+                return 0; /* File shrunk meanwhile */
+
+            hdr.type = VIR_FILE_SEGMENT_DATA;
+            hdr.length = got;
+            if (safewrite(STDOUT_FILENO, &hdr, sizeof(hdr)) < 0 ||
+                safewrite(STDOUT_FILENO, buf, got) < 0) {
+                virReportSystemError(errno, "%s", _("Unable to write stdout"));
+                return -1;
+            }
+            seglen -= got;
+            total += got;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write a sequence of data and hole segments read from stdin to @fd.
+ * Holes are punched into the file rather than written as zeroes.
+ */
+static int
+runIOSparseWrite(const char *path, int fd, char *buf, size_t buflen,
+                 unsigned long long length)
+{
+    unsigned long long total = 0;
+    struct stat sb;
+    off_t pos;
+
+    if (fstat(fd, &sb) < 0) {
+        virReportSystemError(errno, _("Unable to access %s"), path);
+        return -1;
+    }
+
+    if ((pos = lseek(fd, 0, SEEK_CUR)) < 0) {
+        virReportSystemError(errno, _("Unable to seek %s"), path);
+        return -1;
+    }
+
+    while (1) {
+        virFileSegmentHeader hdr;
+        ssize_t got;
+
+        if ((got = saferead(STDIN_FILENO, &hdr, sizeof(hdr))) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to read stdin"));
+            return -1;
+        }
+        if (got == 0)
+            break; /* End of stream */
+        if (got != sizeof(hdr) ||
+            (hdr.type != VIR_FILE_SEGMENT_DATA &&
+             hdr.type != VIR_FILE_SEGMENT_HOLE)) {
+            virReportSystemError(EINVAL, "%s", _("Malformed sparse stream"));
+            return -1;
+        }
+
+        if (length && hdr.length > length - total) {
+            virReportSystemError(ENOSPC, _("Unable to write %s"), path);
+            return -1;
+        }
+
+        if (hdr.type == VIR_FILE_SEGMENT_HOLE) {
+            /* Past the end of regular files, seeking is enough */
+            if ((!S_ISREG(sb.st_mode) || pos < sb.st_size) &&
+                virFilePunchHole(fd, pos, hdr.length) < 0) {
+                virReportSystemError(errno, _("Unable to punch hole in %s"),
+                                     path);
+                return -1;
+            }
+            pos += hdr.length;
+            total += hdr.length;
+            if (lseek(fd, pos, SEEK_SET) < 0) {
+                virReportSystemError(errno, _("Unable to seek %s"), path);
+                return -1;
+            }
+            continue;
+        }
+
+        while (hdr.length > 0) {
+            if ((got = saferead(STDIN_FILENO, buf,
+                                MIN(hdr.length, buflen))) <= 0) {
+                virReportSystemError(got < 0 ? errno : EINVAL, "%s",
+                                     _("Unable to read stdin"));
+                return -1;
+            }
+            if (safewrite(fd, buf, got) < 0) {
+                virReportSystemError(errno, _("Unable to write %s"), path);
+                return -1;
+            }
+            hdr.length -= got;
+            pos += got;
+            total += got;
+        }
+    }
+
+    /* A trailing hole has to extend the file */
+    if (S_ISREG(sb.st_mode) && pos > sb.st_size &&
+        pos > lseek(fd, 0, SEEK_END) &&
+        ftruncate(fd, pos) < 0) {
+        virReportSystemError(errno, _("Unable to truncate %s"), path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+runIOTunable(const char *name, unsigned long long min,
+             unsigned long long max, unsigned long long *value)
+{
+    const char *str = virGetEnvBlockSUID(name);
+
+    if (!str)
+        return 0;
+
+    if (virStrToLong_ullp(str, NULL, 10, value) < 0 ||
+        *value < min || *value > max) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED,
+                       _("%s must be a number between %llu and %llu"),
+                       name, min, max);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+#if HAVE_COPY_FILE_RANGE || HAVE_SPLICE
+/*
+ * Let the kernel move the data from @fdin to @fdout, with
+ * copy_file_range() between two regular files, or splice() when
+ * one end is a pipe. Returns 1 if that is not possible and the
+ * caller has to copy the data itself, 0 on success and -1 on error.
+ */
+static int
+runIOZeroCopy(int fdin, const char *fdinname,
+              int fdout, const char *fdoutname,
+              unsigned long long length, size_t buflen)
+{
+    struct stat sbin, sbout;
+    unsigned long long total = 0;
+    bool range = false;
+
+    if (fstat(fdin, &sbin) < 0 || fstat(fdout, &sbout) < 0)
+        return 1;
+
+    if (S_ISREG(sbin.st_mode) && S_ISREG(sbout.st_mode)) {
+# if HAVE_COPY_FILE_RANGE
+        range = true;
+# else
+        return 1;
+# endif
+    } else if (!S_ISFIFO(sbin.st_mode) && !S_ISFIFO(sbout.st_mode)) {
+        return 1;
+    }
+# if !HAVE_SPLICE
+    if (!range)
+        return 1;
+# endif
+
+    while (!length || total < length) {
+        size_t want = buflen;
+        ssize_t got = -1;
+
+        if (length && (length - total) < want)
+            want = length - total;
+
+# if HAVE_COPY_FILE_RANGE
+        if (range)
+            got = copy_file_range(fdin, NULL, fdout, NULL, want, 0);
+# endif
+# if HAVE_SPLICE
+        if (!range)
+            got = splice(fdin, NULL, fdout, NULL, want,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+# endif
+
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Not supported for this pair of files, or by the kernel */
+            if (total == 0 &&
+                (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                 errno == EOPNOTSUPP || errno == EBADF))
+                return 1;
+            virReportSystemError(errno, _("Unable to copy %s to %s"),
+                                 fdinname, fdoutname);
+            return -1;
+        }
+        if (got == 0)
+            break; /* End of file before end of requested data */
+
+        total += got;
+    }
+
+    return 0;
+}
+#endif /* HAVE_COPY_FILE_RANGE || HAVE_SPLICE */
+
+
+/*
+ * Fill the buffers of the queue from its input, while the main
+ * thread writes them out.
+ */
+static void
+runIOReader(void *opaque)
+{
+    runIOQueuePtr q = opaque;
+    unsigned long long total = 0;
+    bool shortRead = false;
+
+    virMutexLock(&q->lock);
+
+    while (1) {
+        size_t slot;
+        size_t want = q->buflen;
+        ssize_t got;
+        int err;
+
+        while (q->count == q->depth && !q->quit)
+            ignore_value(virCondWait(&q->cond, &q->lock));
+
+        if (q->quit)
+            break;
+
+        slot = (q->head + q->count) % q->depth;
+
+        virMutexUnlock(&q->lock);
+
+        if (q->length &&
+            (q->length - total) < want)
+            want = q->length - total;
+
+        if (want == 0)
+            got = 0; /* End of requested data from client */
+        else
+            got = saferead(q->fdin, q->bufs + slot * q->buflen, want);
+        err = errno;
+
+        virMutexLock(&q->lock);
+
+        if (got < 0) {
+            q->err = err;
+            break;
+        }
+        if (got == 0)
+            break; /* End of file before end of requested data */
+
+        q->shortReads[slot] = false;
+        if (got < want || (want & (IOHELPER_ALIGN - 1))) {
+            /* O_DIRECT can handle at most one short read, at end of file */
+            if (q->direct && shortRead) {
+                q->tooShort = true;
+                break;
+            }
+            shortRead = true;
+            q->shortReads[slot] = true;
+        }
+
+        total += got;
+        q->lens[slot] = got;
+        q->count++;
+        virCondSignal(&q->cond);
+    }
+
+    q->eof = true;
+    virCondSignal(&q->cond);
+    virMutexUnlock(&q->lock);
+}
+
+
+static int
+runIOCopy(int fd, int fdin, const char *fdinname,
+          int fdout, const char *fdoutname,
+          unsigned long long length, bool direct,
+          char *bufs, size_t buflen, size_t depth)
+{
+    runIOQueue q;
+    virThread reader;
+    bool started = false;
+    bool shortRead = false; /* true if we hit a short read */
+    unsigned long long total = 0;
+    off_t end = 0;
+    int ret = -1;
+
+    memset(&q, 0, sizeof(q));
+    q.bufs = bufs;
+    q.buflen = buflen;
+    q.depth = depth;
+    q.fdin = fdin;
+    q.length = length;
+    q.direct = direct;
+
+    if (VIR_ALLOC_N(q.lens, depth) < 0 ||
+        VIR_ALLOC_N(q.shortReads, depth) < 0)
+        goto cleanup;
+
+    if (virMutexInit(&q.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        goto cleanup;
+    }
+    if (virCondInit(&q.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        virMutexDestroy(&q.lock);
+        goto cleanup;
+    }
+
+    if (virThreadCreate(&reader, true, runIOReader, &q) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to create reader thread"));
+        goto destroy;
+    }
+    started = true;
+
+    virMutexLock(&q.lock);
+    while (1) {
+        char *buf;
+        ssize_t got;
+
+        while (q.count == 0 && !q.eof)
+            ignore_value(virCondWait(&q.cond, &q.lock));
+
+        if (q.count == 0)
+            break;
+
+        buf = q.bufs + q.head * q.buflen;
+        got = q.lens[q.head];
+        shortRead |= q.shortReads[q.head];
+
+        virMutexUnlock(&q.lock);
+
+        total += got;
+        if (fdout == fd && direct && shortRead) {
+            end = total;
+            memset(buf + got, 0, buflen - got);
+            got = (got + IOHELPER_ALIGN - 1) & ~(IOHELPER_ALIGN - 1);
+        }
+        if (safewrite(fdout, buf, got) < 0) {
+            virReportSystemError(errno, _("Unable to write %s"), fdoutname);
+            goto stop;
+        }
+        if (end && ftruncate(fd, end) < 0) {
+            virReportSystemError(errno, _("Unable to truncate %s"), fdoutname);
+            goto stop;
+        }
+
+        virMutexLock(&q.lock);
+        q.head = (q.head + 1) % q.depth;
+        q.count--;
+        virCondSignal(&q.cond);
+    }
+    virMutexUnlock(&q.lock);
+
+    virThreadJoin(&reader);
+    started = false;
+
+    if (q.tooShort) {
+        virReportSystemError(EINVAL, "%s",
+                             _("Too many short reads for O_DIRECT"));
+        goto destroy;
+    }
+    if (q.err) {
+        virReportSystemError(q.err, _("Unable to read %s"), fdinname);
+        goto destroy;
+    }
+
+    ret = 0;
+    goto destroy;
+
+ stop:
+    virMutexLock(&q.lock);
+    q.quit = true;
+    virCondSignal(&q.cond);
+    virMutexUnlock(&q.lock);
+
+ destroy:
+    if (started)
+        virThreadJoin(&reader);
+    virCondDestroy(&q.cond);
+    virMutexDestroy(&q.lock);
+ cleanup:
+    VIR_FREE(q.lens);
+    VIR_FREE(q.shortReads);
+    return ret;
+}
+
+
 static int
-runIO(const char *path, int fd, int oflags, unsigned long long length)
+runIO(const char *path, int fd, int oflags, unsigned long long length,
+      bool sparse)
 {
     void *base = NULL; /* Location to be freed */
     char *buf = NULL; /* Aligned location within base */
-    size_t buflen = 1024*1024;
-    intptr_t alignMask = 64*1024 - 1;
+    unsigned long long buflen = IOHELPER_BUFFER_SIZE;
+    unsigned long long depth = IOHELPER_QUEUE_DEPTH;
+    unsigned long long zerocopy = 1;
+    intptr_t alignMask = IOHELPER_ALIGN - 1;
     int ret = -1;
     int fdin, fdout;
     const char *fdinname, *fdoutname;
-    unsigned long long total = 0;
     bool direct = O_DIRECT && ((oflags & O_DIRECT) != 0);
-    bool shortRead = false; /* true if we hit a short read */
     off_t end = 0;
 
+    if (runIOTunable("LIBVIRT_IOHELPER_BUFFER_SIZE", IOHELPER_ALIGN,
+                     IOHELPER_BUFFER_SIZE_MAX, &buflen) < 0 ||
+        runIOTunable("LIBVIRT_IOHELPER_QUEUE_DEPTH", 1,
+                     IOHELPER_QUEUE_DEPTH_MAX, &depth) < 0 ||
+        runIOTunable("LIBVIRT_IOHELPER_ZERO_COPY", 0, 1, &zerocopy) < 0)
+        goto cleanup;
+
+    /* Each buffer of the queue has to stay aligned for O_DIRECT */
+    buflen = VIR_ROUND_UP(buflen, IOHELPER_ALIGN);
+
+    /* Sparse streams are copied one buffer at a time */
+    if (sparse)
+        depth = 1;
+
 #if HAVE_POSIX_MEMALIGN
-    if (posix_memalign(&base, alignMask + 1, buflen)) {
+    if (posix_memalign(&base, alignMask + 1, buflen * depth)) {
         virReportOOMError();
         goto cleanup;
     }
     buf = base;
 #else
-    if (VIR_ALLOC_N(buf, buflen + alignMask) < 0)
+    if (VIR_ALLOC_N(buf, buflen * depth + alignMask) < 0)
         goto cleanup;
     base = buf;
     buf = (char *) (((intptr_t) base + alignMask) & ~alignMask);
@@ -136,48 +628,41 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
         goto cleanup;
     }
 
-    while (1) {
-        ssize_t got;
-
-        if (length &&
-            (length - total) < buflen)
-            buflen = length - total;
-
-        if (buflen == 0)
-            break; /* End of requested data from client */
-
-        if ((got = saferead(fdin, buf, buflen)) < 0) {
-            virReportSystemError(errno, _("Unable to read %s"), fdinname);
+    if (sparse) {
+        if (direct) {
+            virReportSystemError(EINVAL, "%s",
+                                 _("O_DIRECT is not supported with sparse streams"));
             goto cleanup;
         }
-        if (got == 0)
-            break; /* End of file before end of requested data */
-        if (got < buflen || (buflen & alignMask)) {
-            /* O_DIRECT can handle at most one short read, at end of file */
-            if (direct && shortRead) {
-                virReportSystemError(EINVAL, "%s",
-                                     _("Too many short reads for O_DIRECT"));
-            }
-            shortRead = true;
-        }
 
-        total += got;
-        if (fdout == fd && direct && shortRead) {
-            end = total;
-            memset(buf + got, 0, buflen - got);
-            got = (got + alignMask) & ~alignMask;
+        if (fdin == fd) {
+            if (runIOSparseRead(path, fd, buf, buflen, length) < 0)
+                goto cleanup;
+        } else {
+            if (runIOSparseWrite(path, fd, buf, buflen, length) < 0)
+                goto cleanup;
         }
-        if (safewrite(fdout, buf, got) < 0) {
-            virReportSystemError(errno, _("Unable to write %s"), fdoutname);
-            goto cleanup;
-        }
-        if (end && ftruncate(fd, end) < 0) {
-            virReportSystemError(errno, _("Unable to truncate %s"), fdoutname);
+        goto sync;
+    }
+
+#if HAVE_COPY_FILE_RANGE || HAVE_SPLICE
+    /* O_DIRECT needs the padding and truncation done by runIOCopy */
+    if (zerocopy && !direct) {
+        int rc = runIOZeroCopy(fdin, fdinname, fdout, fdoutname,
+                               length, buflen);
+        if (rc < 0)
             goto cleanup;
-        }
+        if (rc == 0)
+            goto sync;
     }
+#endif
+
+    if (runIOCopy(fd, fdin, fdinname, fdout, fdoutname,
+                  length, direct, buf, buflen, depth) < 0)
+        goto cleanup;
 
     /* Ensure all data is written */
+ sync:
     if (fdatasync(fdout) < 0) {
         if (errno != EINVAL && errno != EROFS) {
             /* fdatasync() may fail on some special FDs, e.g. pipes */
@@ -208,7 +693,7 @@ usage(int status)
         fprintf(stderr, _("%s: try --help for more details"), program_name);
     } else {
         printf(_("Usage: %s FILENAME OFLAGS MODE OFFSET LENGTH DELETE\n"
-                 "   or: %s FILENAME LENGTH FD\n"),
+                 "   or: %s FILENAME LENGTH FD [SPARSE]\n"),
                program_name, program_name);
     }
     exit(status);
@@ -223,6 +708,7 @@ main(int argc, char **argv)
     int oflags = -1;
     int mode;
     unsigned int delete = 0;
+    unsigned int sparse = 0;
     int fd = -1;
     int lengthIndex = 0;
 
@@ -262,13 +748,18 @@ main(int argc, char **argv)
             exit(EXIT_FAILURE);
         }
         fd = prepare(path, oflags, mode, offset);
-    } else if (argc == 4) { /* FILENAME LENGTH FD */
+    } else if (argc == 4 || argc == 5) { /* FILENAME LENGTH FD [SPARSE] */
         lengthIndex = 2;
         if (virStrToLong_i(argv[3], NULL, 10, &fd) < 0) {
             fprintf(stderr, _("%s: malformed fd %s"),
                     program_name, argv[3]);
             exit(EXIT_FAILURE);
         }
+        if (argc == 5 && virStrToLong_ui(argv[4], NULL, 10, &sparse) < 0) {
+            fprintf(stderr, _("%s: malformed sparse flag %s"),
+                    program_name, argv[4]);
+            exit(EXIT_FAILURE);
+        }
 #ifdef F_GETFL
         oflags = fcntl(fd, F_GETFL);
 #else
@@ -293,7 +784,7 @@ main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    if (fd < 0 || runIO(path, fd, oflags, length) < 0)
+    if (fd < 0 || runIO(path, fd, oflags, length, sparse != 0) < 0)
         goto error;
 
     if (delete)
@@ -30,6 +30,12 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+# include <spawn.h>
+#endif
 
 #if WITH_CAPNG
 # include <cap-ng.h>
@@ -54,6 +60,7 @@
 #include "virbuffer.h"
 #include "virthread.h"
 #include "virstring.h"
+#include "virbitmap.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
@@ -145,6 +152,9 @@ static virCommandDryRunCallback dryRunCallback;
 static void *dryRunOpaque;
 static int dryRunStatus;
 
+/* See virCommandSetForceFork for description for this variable */
+static bool forceFork;
+
 /*
  * virCommandFDIsSet:
  * @fd: FD to test
@@ -464,6 +474,359 @@ virCommandHandshakeChild(virCommandPtr cmd)
     return 0;
 }
 
+/*
+ * virCommandMassCloseFD:
+ *
+ * Close @fd in the child unless it is one of the descriptors
+ * the child is meant to get, which are marked inheritable instead.
+ */
+static int
+virCommandMassCloseFD(virCommandPtr cmd,
+                      int fd,
+                      int childin,
+                      int childout,
+                      int childerr)
+{
+    int tmpfd = fd;
+
+    if (fd == childin || fd == childout || fd == childerr)
+        return 0;
+
+    if (!virCommandFDIsSet(cmd, fd)) {
+        VIR_MASS_CLOSE(tmpfd);
+    } else if (virSetInherit(fd, true) < 0) {
+        virReportSystemError(errno, _("failed to preserve fd %d"), fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+# if defined(__linux__) && defined(SYS_close_range)
+static int
+virCommandIntCompare(const void *a,
+                     const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/*
+ * virCommandMassCloseRange:
+ *
+ * Close everything above stderr except for the descriptors the
+ * child is meant to get, with a single close_range() call per gap
+ * between them.
+ *
+ * Returns 0 on success, 1 if close_range() is not supported by the
+ * running kernel and nothing was closed, -1 on error.
+ */
+static int
+virCommandMassCloseRange(virCommandPtr cmd,
+                         int childin,
+                         int childout,
+                         int childerr)
+{
+    int *keep = NULL;
+    size_t nkeep = 0;
+    int first = STDERR_FILENO + 1;
+    bool closed = false;
+    size_t i;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(keep, cmd->npassfd + 3) < 0)
+        return -1;
+
+    if (childin > STDERR_FILENO)
+        keep[nkeep++] = childin;
+    if (childout > STDERR_FILENO)
+        keep[nkeep++] = childout;
+    if (childerr > STDERR_FILENO)
+        keep[nkeep++] = childerr;
+    for (i = 0; i < cmd->npassfd; i++) {
+        if (cmd->passfd[i].fd > STDERR_FILENO)
+            keep[nkeep++] = cmd->passfd[i].fd;
+    }
+
+    qsort(keep, nkeep, sizeof(*keep), virCommandIntCompare);
+
+    for (i = 0; i < nkeep; i++) {
+        if (keep[i] < first)
+            continue;
+
+        if (keep[i] > first) {
+            if (syscall(SYS_close_range, first, keep[i] - 1, 0) < 0)
+                goto error;
+            closed = true;
+        }
+        first = keep[i] + 1;
+    }
+
+    if (syscall(SYS_close_range, first, ~0U, 0) < 0)
+        goto error;
+
+    for (i = 0; i < cmd->npassfd; i++) {
+        if (virCommandMassCloseFD(cmd, cmd->passfd[i].fd,
+                                  childin, childout, childerr) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(keep);
+    return ret;
+
+ error:
+    /* Nothing has been closed if the very first call fails */
+    if (errno == ENOSYS && !closed) {
+        ret = 1;
+    } else {
+        virReportSystemError(errno, "%s",
+                             _("unable to close file descriptors"));
+    }
+    goto cleanup;
+}
+# endif /* __linux__ && SYS_close_range */
+
+
+# ifdef __linux__
+/*
+ * virCommandMassCloseGetFDs:
+ *
+ * Collect the descriptors this process has open into @fds, which
+ * is much cheaper than probing each one below the open files limit
+ * when that limit is high.
+ */
+static int
+virCommandMassCloseGetFDs(virBitmapPtr fds)
+{
+    DIR *dp = NULL;
+    struct dirent *entry;
+    const char *dirName = "/proc/self/fd";
+    int rc;
+    int ret = -1;
+
+    if (virDirOpen(&dp, dirName) < 0)
+        return -1;
+
+    while ((rc = virDirRead(dp, &entry, dirName)) > 0) {
+        int fd;
+
+        if (virStrToLong_i(entry->d_name, NULL, 10, &fd) < 0) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unable to parse FD: %s"),
+                           entry->d_name);
+            goto cleanup;
+        }
+
+        ignore_value(virBitmapSetBit(fds, fd));
+    }
+
+    if (rc < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    VIR_DIR_CLOSE(dp);
+    return ret;
+}
+
+# else /* !__linux__ */
+
+static int
+virCommandMassCloseGetFDs(virBitmapPtr fds)
+{
+    virBitmapSetAll(fds);
+    return 0;
+}
+# endif /* !__linux__ */
+
+
+/*
+ * virCommandMassClose:
+ *
+ * Close all descriptors above stderr in the child, except for
+ * @childin, @childout, @childerr and those passed by the caller.
+ */
+static int
+virCommandMassClose(virCommandPtr cmd,
+                    int childin,
+                    int childout,
+                    int childerr)
+{
+    virBitmapPtr fds = NULL;
+    int openmax = sysconf(_SC_OPEN_MAX);
+    ssize_t fd = STDERR_FILENO;
+    int ret = -1;
+
+# if defined(__linux__) && defined(SYS_close_range)
+    if ((ret = virCommandMassCloseRange(cmd, childin, childout, childerr)) <= 0)
+        return ret;
+    ret = -1;
+# endif
+
+    if (openmax < 0) {
+        virReportSystemError(errno,  "%s",
+                             _("sysconf(_SC_OPEN_MAX) failed"));
+        return -1;
+    }
+
+    if (!(fds = virBitmapNew(openmax)))
+        return -1;
+
+    if (virCommandMassCloseGetFDs(fds) < 0)
+        goto cleanup;
+
+    while ((fd = virBitmapNextSetBit(fds, fd)) >= 0) {
+        if (virCommandMassCloseFD(cmd, fd, childin, childout, childerr) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virBitmapFree(fds);
+    return ret;
+}
+
+
+# if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+/*
+ * virCommandCanSpawn:
+ *
+ * Check whether @cmd needs nothing to be done in the child between
+ * fork and exec beyond setting up stdio and closing descriptors, in
+ * which case it can be started by posix_spawn().
+ */
+static bool
+virCommandCanSpawn(virCommandPtr cmd)
+{
+    if (forceFork)
+        return false;
+
+    if (cmd->flags & (VIR_EXEC_DAEMON | VIR_EXEC_CLEAR_CAPS |
+                      VIR_EXEC_LISTEN_FDS))
+        return false;
+
+    if (cmd->npassfd || cmd->hook || cmd->handshake || cmd->pwd ||
+        cmd->mask)
+        return false;
+
+    if (cmd->uid != (uid_t)-1 || cmd->gid != (gid_t)-1 ||
+        cmd->capabilities)
+        return false;
+
+    if (cmd->maxMemLock || cmd->maxProcesses || cmd->maxFiles ||
+        cmd->setMaxCore)
+        return false;
+
+#  if defined(WITH_SECDRIVER_SELINUX)
+    if (cmd->seLinuxLabel)
+        return false;
+#  endif
+#  if defined(WITH_SECDRIVER_APPARMOR)
+    if (cmd->appArmorProfile)
+        return false;
+#  endif
+
+    return true;
+}
+
+
+/*
+ * virExecSpawn:
+ *
+ * Start @cmd with posix_spawn(), which unlike fork() does not need
+ * to copy the page tables of the whole daemon. The child gets the
+ * same treatment as from virFork() and virExec(): default signal
+ * handlers, an empty signal mask, @childin, @childout and @childerr
+ * as its stdio and no other descriptors.
+ *
+ * Returns the pid of the child, or -1 if it couldn't be started,
+ * without reporting an error. The caller is then expected to fall
+ * back to fork() and exec(), which takes care of reporting errors
+ * like a missing binary the usual way.
+ */
+static pid_t
+virExecSpawn(virCommandPtr cmd,
+             const char *binary,
+             int childin,
+             int childout,
+             int childerr)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault, sigmask;
+    pid_t pid = -1;
+    char ebuf[1024];
+    int rc;
+
+    if ((rc = posix_spawn_file_actions_init(&actions)) != 0)
+        goto error;
+
+    if ((rc = posix_spawnattr_init(&attr)) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        goto error;
+    }
+
+    sigfillset(&sigdefault);
+    sigdelset(&sigdefault, SIGKILL);
+    sigdelset(&sigdefault, SIGSTOP);
+    sigemptyset(&sigmask);
+
+    if ((rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                                              POSIX_SPAWN_SETSIGMASK)) != 0 ||
+        (rc = posix_spawnattr_setsigdefault(&attr, &sigdefault)) != 0 ||
+        (rc = posix_spawnattr_setsigmask(&attr, &sigmask)) != 0)
+        goto cleanup;
+
+    if ((rc = posix_spawn_file_actions_adddup2(&actions, childin,
+                                               STDIN_FILENO)) != 0 ||
+        (childout > 0 &&
+         (rc = posix_spawn_file_actions_adddup2(&actions, childout,
+                                                STDOUT_FILENO)) != 0) ||
+        (childerr > 0 &&
+         (rc = posix_spawn_file_actions_adddup2(&actions, childerr,
+                                                STDERR_FILENO)) != 0) ||
+        (rc = posix_spawn_file_actions_addclosefrom_np(&actions,
+                                                       STDERR_FILENO + 1)) != 0)
+        goto cleanup;
+
+    rc = posix_spawn(&pid, binary, &actions, &attr, cmd->args,
+                     cmd->env ? cmd->env : environ);
+
+ cleanup:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc == 0)
+        return pid;
+
+ error:
+    VIR_DEBUG("Unable to spawn %s, falling back to fork: %s",
+              binary, virStrerror(rc, ebuf, sizeof(ebuf)));
+    return -1;
+}
+
+# else /* !HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP */
+
+static bool
+virCommandCanSpawn(virCommandPtr cmd ATTRIBUTE_UNUSED)
+{
+    return false;
+}
+
+static pid_t
+virExecSpawn(virCommandPtr cmd ATTRIBUTE_UNUSED,
+             const char *binary ATTRIBUTE_UNUSED,
+             int childin ATTRIBUTE_UNUSED,
+             int childout ATTRIBUTE_UNUSED,
+             int childerr ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+# endif /* !HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP */
+
+
 /*
  * virExec:
  * @cmd virCommandPtr containing all information about the program to
@@ -473,19 +836,18 @@ static int
 virExec(virCommandPtr cmd)
 {
     pid_t pid;
-    int null = -1, fd, openmax;
+    int null = -1;
     int pipeout[2] = {-1, -1};
     int pipeerr[2] = {-1, -1};
     int childin = cmd->infd;
     int childout = -1;
     int childerr = -1;
-    int tmpfd;
     char *binarystr = NULL;
     const char *binary = NULL;
     int ret;
     struct sigaction waxon, waxoff;
     gid_t *groups = NULL;
-    int ngroups;
+    int ngroups = 0;
 
     if (cmd->args[0][0] != '/') {
         if (!(binary = binarystr = virFindFileInPath(cmd->args[0]))) {
@@ -556,13 +918,21 @@ virExec(virCommandPtr cmd)
         childerr = null;
     }
 
-    if ((ngroups = virGetGroupList(cmd->uid, cmd->gid, &groups)) < 0)
-        goto cleanup;
+    /* Commands which need nothing done between fork and exec take
+     * the cheaper route, unless it fails */
+    pid = -1;
+    if (virCommandCanSpawn(cmd))
+        pid = virExecSpawn(cmd, binary, childin, childout, childerr);
+
+    if (pid < 0) {
+        if ((ngroups = virGetGroupList(cmd->uid, cmd->gid, &groups)) < 0)
+            goto cleanup;
 
-    pid = virFork();
+        pid = virFork();
 
-    if (pid < 0)
-        goto cleanup;
+        if (pid < 0)
+            goto cleanup;
+    }
 
     if (pid) { /* parent */
         VIR_FORCE_CLOSE(null);
@@ -588,23 +958,9 @@ virExec(virCommandPtr cmd)
     if (cmd->mask)
         umask(cmd->mask);
     ret = EXIT_CANCELED;
-    openmax = sysconf(_SC_OPEN_MAX);
-    if (openmax < 0) {
-        virReportSystemError(errno,  "%s",
-                             _("sysconf(_SC_OPEN_MAX) failed"));
+
+    if (virCommandMassClose(cmd, childin, childout, childerr) < 0)
         goto fork_error;
-    }
-    for (fd = 3; fd < openmax; fd++) {
-        if (fd == childin || fd == childout || fd == childerr)
-            continue;
-        if (!virCommandFDIsSet(cmd, fd)) {
-            tmpfd = fd;
-            VIR_MASS_CLOSE(tmpfd);
-        } else if (virSetInherit(fd, true) < 0) {
-            virReportSystemError(errno, _("failed to preserve fd %d"), fd);
-            goto fork_error;
-        }
-    }
 
     if (prepareStdFd(childin, STDIN_FILENO) < 0) {
         virReportSystemError(errno,
@@ -2908,6 +3264,21 @@ virCommandSetDryRun(virBufferPtr buf,
     dryRunOpaque = opaque;
 }
 
+/**
+ * virCommandSetForceFork:
+ * @force: whether to always fork
+ *
+ * Commands which need nothing done in the child before exec are
+ * started with posix_spawn() where available, instead of fork() and
+ * exec(). Passing true makes every command take the latter path, so
+ * that tests can compare the two.
+ */
+void
+virCommandSetForceFork(bool force)
+{
+    forceFork = force;
+}
+
 #ifndef WIN32
 /**
  * virCommandRunRegex:
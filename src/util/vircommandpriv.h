@@ -40,4 +40,6 @@ void virCommandSetDryRun(virBufferPtr buf,
                          virCommandDryRunCallback cb,
                          void *opaque);
 
+void virCommandSetForceFork(bool force);
+
 #endif /* __VIR_COMMAND_PRIV_H__ */
@@ -38,6 +38,8 @@
 VIR_LOG_INIT("util.error");
 
 virThreadLocal virLastErr;
+/* Set while errors of the thread are not to be logged */
+static virThreadLocal virErrorLogQuiet;
 
 virErrorFunc virErrorHandler = NULL;     /* global error handler */
 void *virUserData = NULL;        /* associated data */
@@ -167,7 +169,10 @@ virLastErrFreeData(void *data)
 int
 virErrorInitialize(void)
 {
-    return virThreadLocalInit(&virLastErr, virLastErrFreeData);
+    if (virThreadLocalInit(&virLastErr, virLastErrFreeData) < 0 ||
+        virThreadLocalInit(&virErrorLogQuiet, NULL) < 0)
+        return -1;
+    return 0;
 }
 
 
@@ -653,6 +658,9 @@ void virRaiseErrorLog(const char *filename,
 {
     int priority;
 
+    if (virThreadLocalGet(&virErrorLogQuiet))
+        return;
+
     /*
      * Hook up the error or warning to the logging facility
      */
@@ -1563,6 +1571,22 @@ void virSetErrorLogPriorityFunc(virErrorLogPriorityFunc func)
 }
 
 
+/**
+ * virSetErrorLogQuiet:
+ * @quiet: whether to stop logging errors
+ *
+ * Stop or resume logging the errors raised by the calling thread.
+ * They are still recorded as its last error. This is for callers
+ * which save the errors to report them later, in an order of their
+ * choosing, so that each is reported just once.
+ */
+void virSetErrorLogQuiet(bool quiet)
+{
+    ignore_value(virThreadLocalSet(&virErrorLogQuiet,
+                                   quiet ? &virErrorLogQuiet : NULL));
+}
+
+
 /**
  * virErrorSetErrnoFromLastError:
  *
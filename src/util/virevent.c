@@ -40,6 +40,32 @@ static virEventUpdateTimeoutFunc updateTimeoutImpl;
 static virEventRemoveTimeoutFunc removeTimeoutImpl;
 
 
+/**
+ * virEventAddHandleSharded:
+ *
+ * Same as virEventAddHandle, except that when the default event
+ * implementation is in use the handle may be served by one of the
+ * additional event loop threads set up by virEventPollSetShards.
+ * Meant for busy descriptors, like client connections or monitor
+ * sockets, whose callbacks do their own locking.
+ *
+ * Returns -1 if the file handle cannot be registered, otherwise a handle
+ * watch number to be used for updating and unregistering for events.
+ */
+int
+virEventAddHandleSharded(int fd,
+                         int events,
+                         virEventHandleCallback cb,
+                         void *opaque,
+                         virFreeCallback ff)
+{
+    if (addHandleImpl == virEventPollAddHandle)
+        return virEventPollAddHandleSharded(fd, events, cb, opaque, ff);
+
+    return virEventAddHandle(fd, events, cb, opaque, ff);
+}
+
+
 /*****************************************************
  *
  * Below this point are  *PUBLIC*  APIs for event
@@ -25,4 +25,10 @@
 # define __VIR_EVENT_H__
 # include "internal.h"
 
+int virEventAddHandleSharded(int fd,
+                             int events,
+                             virEventHandleCallback cb,
+                             void *opaque,
+                             virFreeCallback ff);
+
 #endif /* __VIR_EVENT_H__ */
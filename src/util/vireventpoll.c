@@ -27,9 +27,13 @@
 #include <string.h>
 #include <poll.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 
 #include "virthread.h"
 #include "virlog.h"
@@ -40,6 +44,8 @@
 #include "virerror.h"
 #include "virprobe.h"
 #include "virtime.h"
+#include "virhash.h"
+#include "virhashcode.h"
 
 #define EVENT_DEBUG(fmt, ...) VIR_DEBUG(fmt, __VA_ARGS__)
 
@@ -47,7 +53,12 @@
 
 VIR_LOG_INIT("util.eventpoll");
 
-static int virEventPollInterruptLocked(void);
+struct virEventPollLoop;
+static int virEventPollInterruptLocked(struct virEventPollLoop *loop);
+
+VIR_ENUM_IMPL(virEventPollBackend, VIR_EVENT_POLL_BACKEND_LAST,
+              "poll",
+              "epoll");
 
 /* State for a single file handle being monitored */
 struct virEventPollHandle {
@@ -69,84 +80,553 @@ struct virEventPollTimeout {
     virFreeCallback ff;
     void *opaque;
     int deleted;
+    /* Position in the expiry heap, or -1 while disabled */
+    ssize_t heapIndex;
+    /* Link in the list of timers pending purge or dispatch */
+    struct virEventPollTimeout *nextDeleted;
+    struct virEventPollTimeout *nextExpired;
+};
+
+/* Handles registered against a single file descriptor when the
+ * epoll backend is in use. The kernel allows only one registration
+ * per descriptor, so the events it watches are the union of the
+ * events of all live handles sharing the descriptor */
+struct virEventPollFD {
+    int events;
+    /* epoll refuses regular files and directories. poll() reports
+     * them as always ready, which is emulated for these */
+    bool unpollable;
+    size_t nhandles;
+    struct virEventPollHandle **handles;
 };
 
 /* Allocate extra slots for virEventPollHandle/virEventPollTimeout
    records in this multiple */
 #define EVENT_ALLOC_EXTENT 10
 
-/* State for the main event loop */
+/* Initial size of the watch and timer id indexes */
+#define EVENT_HASH_SIZE 64
+
+/* Upper bound on the number of ready descriptors collected by a
+ * single epoll_wait() call. Any others remain ready and will be
+ * reported by the next iteration */
+#define EVENT_EPOLL_MAX_EVENTS 256
+
+/* State for an event loop. The main loop, run by the application
+ * through virEventPollRunOnce, owns all timers and any handles not
+ * explicitly placed elsewhere. Additional loops, each with a thread
+ * of its own, only ever carry handles registered through
+ * virEventPollAddHandleSharded */
 struct virEventPollLoop {
     virMutex lock;
+    /* Position in the list of loops, 0 for the main loop */
+    size_t index;
     int running;
+    /* Thread running an additional loop, and whether it must exit */
+    virThread thread;
+    bool quit;
     virThread leader;
     int wakeupfd[2];
     size_t handlesCount;
     size_t handlesAlloc;
-    struct virEventPollHandle *handles;
-    size_t timeoutsCount;
-    size_t timeoutsAlloc;
-    struct virEventPollTimeout *timeouts;
+    struct virEventPollHandle **handles;
+    /* Number of handles marked deleted, but not purged yet */
+    size_t handlesDeleted;
+    /* Handles indexed by watch */
+    virHashTablePtr handlesByWatch;
+    /* Unique ID for the next FD watch to be registered, local to
+     * the loop, see virEventPollWatchLoop */
+    int nextWatch;
+
+    /* Timers indexed by timer id */
+    virHashTablePtr timeouts;
+    /* Timers marked deleted, but not purged yet */
+    struct virEventPollTimeout *timeoutsDeleted;
+    /* Binary min-heap of the enabled timers, keyed on expiry */
+    size_t timeoutHeapCount;
+    size_t timeoutHeapAlloc;
+    struct virEventPollTimeout **timeoutHeap;
+
+    int epollfd;
+    /* Number of descriptors currently in the epoll set */
+    size_t epollCount;
+    /* Number of watched descriptors epoll refused */
+    size_t unpollableCount;
+    /* Indexed by file descriptor */
+    size_t fdtableCount;
+    struct virEventPollFD *fdtable;
+
+    /* Number of iterations run so far */
+    unsigned long long iterations;
+    /* Time spent dispatching events, in microseconds */
+    unsigned long long busy;
 };
 
-/* Only have one event loop */
+/* The main event loop */
 static struct virEventPollLoop eventLoop;
 
-/* Unique ID for the next FD watch to be registered */
-static int nextWatch = 1;
+/* Loops dedicated to client and monitor I/O */
+static size_t eventShardsCount;
+static struct virEventPollLoop *eventShards;
+/* Number of additional loops with a thread running */
+static size_t eventShardsStarted;
+
+static bool eventInitialized;
+
+static virEventPollBackend eventBackend;
 
 /* Unique ID for the next timer to be registered */
 static int nextTimer = 1;
 
+/* Watch and timer ids are used directly as hash keys */
+static uint32_t
+virEventPollIdCode(const void *name, uint32_t seed)
+{
+    int id = (intptr_t)name;
+    return virHashCodeGen(&id, sizeof(id), seed);
+}
+
+
+static bool
+virEventPollIdEqual(const void *namea, const void *nameb)
+{
+    return namea == nameb;
+}
+
+
+static void *
+virEventPollIdCopy(const void *name)
+{
+    return (void *)name;
+}
+
+
+static struct virEventPollLoop *
+virEventPollGetLoop(size_t index)
+{
+    if (index == 0)
+        return &eventLoop;
+    return &eventShards[index - 1];
+}
+
+
+/*
+ * Watches encode the loop they belong to, so they can be updated or
+ * removed without any global lookup: each loop hands out the ids
+ * congruent to its own index modulo the number of loops. With a
+ * single loop these are simply 1, 2, 3, ...
+ */
+static struct virEventPollLoop *
+virEventPollWatchLoop(int watch)
+{
+    return virEventPollGetLoop(watch % (eventShardsCount + 1));
+}
+
+
+static unsigned long long
+virEventPollNowMicros(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        return 0;
+    return tv.tv_sec * 1000000ull + tv.tv_usec;
+#endif
+}
+
+
+/*
+ * The enabled timers are kept in a binary min-heap ordered by
+ * expiry time, ties broken by registration order, so finding the
+ * next deadline is O(1) and rescheduling a timer is O(log n).
+ * Each timer records its own position so it can be moved or
+ * removed without searching for it.
+ */
+static bool
+virEventPollTimeoutBefore(struct virEventPollTimeout *a,
+                          struct virEventPollTimeout *b)
+{
+    if (a->expiresAt != b->expiresAt)
+        return a->expiresAt < b->expiresAt;
+    return a->timer < b->timer;
+}
+
+
+static void
+virEventPollTimeoutHeapSet(struct virEventPollLoop *loop,
+                           size_t i,
+                           struct virEventPollTimeout *t)
+{
+    loop->timeoutHeap[i] = t;
+    t->heapIndex = i;
+}
+
+
+static void
+virEventPollTimeoutHeapSiftUp(struct virEventPollLoop *loop, size_t i)
+{
+    struct virEventPollTimeout *t = loop->timeoutHeap[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!virEventPollTimeoutBefore(t, loop->timeoutHeap[parent]))
+            break;
+        virEventPollTimeoutHeapSet(loop, i, loop->timeoutHeap[parent]);
+        i = parent;
+    }
+    virEventPollTimeoutHeapSet(loop, i, t);
+}
+
+
+static void
+virEventPollTimeoutHeapSiftDown(struct virEventPollLoop *loop, size_t i)
+{
+    struct virEventPollTimeout *t = loop->timeoutHeap[i];
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= loop->timeoutHeapCount)
+            break;
+        if (child + 1 < loop->timeoutHeapCount &&
+            virEventPollTimeoutBefore(loop->timeoutHeap[child + 1],
+                                      loop->timeoutHeap[child]))
+            child++;
+        if (!virEventPollTimeoutBefore(loop->timeoutHeap[child], t))
+            break;
+        virEventPollTimeoutHeapSet(loop, i, loop->timeoutHeap[child]);
+        i = child;
+    }
+    virEventPollTimeoutHeapSet(loop, i, t);
+}
+
+
+static void
+virEventPollTimeoutHeapRemove(struct virEventPollLoop *loop,
+                              struct virEventPollTimeout *t)
+{
+    size_t i = t->heapIndex;
+    struct virEventPollTimeout *last;
+
+    if (t->heapIndex < 0)
+        return;
+
+    t->heapIndex = -1;
+    last = loop->timeoutHeap[--loop->timeoutHeapCount];
+    if (last == t)
+        return;
+
+    virEventPollTimeoutHeapSet(loop, i, last);
+    virEventPollTimeoutHeapSiftUp(loop, i);
+    virEventPollTimeoutHeapSiftDown(loop, last->heapIndex);
+}
+
+
+/*
+ * Put @t at the right place in the heap after its expiry time
+ * or frequency changed, inserting or removing it as needed
+ */
+static int
+virEventPollTimeoutHeapUpdate(struct virEventPollLoop *loop,
+                              struct virEventPollTimeout *t)
+{
+    if (t->deleted || t->frequency < 0) {
+        virEventPollTimeoutHeapRemove(loop, t);
+        return 0;
+    }
+
+    if (t->heapIndex < 0) {
+        if (VIR_RESIZE_N(loop->timeoutHeap, loop->timeoutHeapAlloc,
+                         loop->timeoutHeapCount, 1) < 0)
+            return -1;
+        virEventPollTimeoutHeapSet(loop, loop->timeoutHeapCount++, t);
+    }
+
+    virEventPollTimeoutHeapSiftUp(loop, t->heapIndex);
+    virEventPollTimeoutHeapSiftDown(loop, t->heapIndex);
+    return 0;
+}
+
+
+#if HAVE_SYS_EPOLL_H
+static int
+virEventPollToEpollEvents(int events)
+{
+    int ret = 0;
+    if (events & POLLIN)
+        ret |= EPOLLIN;
+    if (events & POLLOUT)
+        ret |= EPOLLOUT;
+    if (events & POLLERR)
+        ret |= EPOLLERR;
+    if (events & POLLHUP)
+        ret |= EPOLLHUP;
+    return ret;
+}
+
+static int
+virEventPollFromEpollEvents(int events)
+{
+    int ret = 0;
+    if (events & EPOLLIN)
+        ret |= POLLIN;
+    if (events & EPOLLOUT)
+        ret |= POLLOUT;
+    if (events & EPOLLERR)
+        ret |= POLLERR;
+    if (events & EPOLLHUP)
+        ret |= POLLHUP;
+    return ret;
+}
+
+
+/*
+ * Recompute the events to watch on @fd from the live handles
+ * registered against it and push any change into the epoll set.
+ * A descriptor nobody is interested in is dropped from the set
+ * entirely, since epoll would otherwise keep reporting errors
+ * and hangups on it, unlike poll() which simply never sees it.
+ */
+static int
+virEventPollEpollUpdateFD(struct virEventPollLoop *loop, int fd)
+{
+    struct virEventPollFD *entry = &loop->fdtable[fd];
+    struct epoll_event ev;
+    int events = 0;
+    int op;
+    size_t i;
+
+    for (i = 0; i < entry->nhandles; i++) {
+        if (!entry->handles[i]->deleted)
+            events |= entry->handles[i]->events;
+    }
+
+    if (events == entry->events)
+        return 0;
+
+    if (entry->unpollable) {
+        if (events == 0) {
+            entry->unpollable = false;
+            loop->unpollableCount--;
+        }
+        entry->events = events;
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = virEventPollToEpollEvents(events);
+    ev.data.fd = fd;
+
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (entry->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    EVENT_DEBUG("epoll op=%d fd=%d events=%d", op, fd, events);
+    if (epoll_ctl(loop->epollfd, op, fd, &ev) < 0) {
+        /* The descriptor may have been closed, or closed and
+         * reused, without the watch being removed first, in
+         * which case the kernel view differs from ours */
+        if (op == EPOLL_CTL_ADD && errno == EEXIST)
+            op = EPOLL_CTL_MOD;
+        else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+            op = EPOLL_CTL_ADD;
+        else if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+            op = -1;
+        else
+            goto error;
+
+        if (op != -1 &&
+            epoll_ctl(loop->epollfd, op, fd, &ev) < 0)
+            goto error;
+    }
+
+    if (entry->events == 0)
+        loop->epollCount++;
+    else if (events == 0)
+        loop->epollCount--;
+    entry->events = events;
+    return 0;
+
+ error:
+    if (op == EPOLL_CTL_ADD && errno == EPERM) {
+        /* A regular file or directory, possibly reusing the number
+         * of a descriptor which was in the set */
+        VIR_DEBUG("fd=%d cannot be watched by epoll, "
+                  "treating it as always ready", fd);
+        if (entry->events != 0)
+            loop->epollCount--;
+        entry->unpollable = true;
+        entry->events = events;
+        loop->unpollableCount++;
+        return 0;
+    }
+
+    virReportSystemError(errno,
+                         _("Unable to update epoll registration for fd %d"),
+                         fd);
+    return -1;
+}
+
+
+static int
+virEventPollEpollAddHandle(struct virEventPollLoop *loop,
+                           struct virEventPollHandle *handle)
+{
+    struct virEventPollFD *entry;
+
+    if (handle->fd < 0) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("Invalid file descriptor %d"), handle->fd);
+        return -1;
+    }
+
+    if (handle->fd >= loop->fdtableCount &&
+        VIR_RESIZE_N(loop->fdtable, loop->fdtableCount,
+                     loop->fdtableCount,
+                     handle->fd + 1 - loop->fdtableCount) < 0)
+        return -1;
+
+    entry = &loop->fdtable[handle->fd];
+    if (VIR_APPEND_ELEMENT_COPY(entry->handles, entry->nhandles, handle) < 0)
+        return -1;
+
+    if (virEventPollEpollUpdateFD(loop, handle->fd) < 0) {
+        VIR_DELETE_ELEMENT(entry->handles, entry->nhandles - 1,
+                           entry->nhandles);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+virEventPollEpollPurgeHandle(struct virEventPollLoop *loop,
+                             struct virEventPollHandle *handle)
+{
+    struct virEventPollFD *entry = &loop->fdtable[handle->fd];
+    size_t i;
+
+    for (i = 0; i < entry->nhandles; i++) {
+        if (entry->handles[i] == handle) {
+            VIR_DELETE_ELEMENT(entry->handles, i, entry->nhandles);
+            break;
+        }
+    }
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+
 /*
  * Register a callback for monitoring file handle events.
  * NB, it *must* be safe to call this from within a callback
  * For this reason we only ever append to existing list.
  */
-int virEventPollAddHandle(int fd, int events,
-                          virEventHandleCallback cb,
-                          void *opaque,
-                          virFreeCallback ff)
+static int virEventPollAddHandleLoop(struct virEventPollLoop *loop,
+                                     int fd, int events,
+                                     virEventHandleCallback cb,
+                                     void *opaque,
+                                     virFreeCallback ff)
 {
+    struct virEventPollHandle *handle;
     int watch;
-    virMutexLock(&eventLoop.lock);
-    if (eventLoop.handlesCount == eventLoop.handlesAlloc) {
+    virMutexLock(&loop->lock);
+    if (loop->handlesCount == loop->handlesAlloc) {
         EVENT_DEBUG("Used %zu handle slots, adding at least %d more",
-                    eventLoop.handlesAlloc, EVENT_ALLOC_EXTENT);
-        if (VIR_RESIZE_N(eventLoop.handles, eventLoop.handlesAlloc,
-                         eventLoop.handlesCount, EVENT_ALLOC_EXTENT) < 0) {
-            virMutexUnlock(&eventLoop.lock);
+                    loop->handlesAlloc, EVENT_ALLOC_EXTENT);
+        if (VIR_RESIZE_N(loop->handles, loop->handlesAlloc,
+                         loop->handlesCount, EVENT_ALLOC_EXTENT) < 0) {
+            virMutexUnlock(&loop->lock);
             return -1;
         }
     }
 
-    watch = nextWatch++;
+    if (VIR_ALLOC(handle) < 0) {
+        virMutexUnlock(&loop->lock);
+        return -1;
+    }
+
+    if (loop->nextWatch > (INT_MAX - loop->index) / (eventShardsCount + 1)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("no more watch ids available in the event loop"));
+        VIR_FREE(handle);
+        virMutexUnlock(&loop->lock);
+        return -1;
+    }
+    watch = loop->nextWatch++ * (eventShardsCount + 1) + loop->index;
+
+    handle->watch = watch;
+    handle->fd = fd;
+    handle->events = virEventPollToNativeEvents(events);
+    handle->cb = cb;
+    handle->ff = ff;
+    handle->opaque = opaque;
+    handle->deleted = 0;
+
+    if (virHashAddEntry(loop->handlesByWatch,
+                        (void *)(intptr_t)watch, handle) < 0) {
+        VIR_FREE(handle);
+        virMutexUnlock(&loop->lock);
+        return -1;
+    }
 
-    eventLoop.handles[eventLoop.handlesCount].watch = watch;
-    eventLoop.handles[eventLoop.handlesCount].fd = fd;
-    eventLoop.handles[eventLoop.handlesCount].events =
-                                         virEventPollToNativeEvents(events);
-    eventLoop.handles[eventLoop.handlesCount].cb = cb;
-    eventLoop.handles[eventLoop.handlesCount].ff = ff;
-    eventLoop.handles[eventLoop.handlesCount].opaque = opaque;
-    eventLoop.handles[eventLoop.handlesCount].deleted = 0;
+#if HAVE_SYS_EPOLL_H
+    if (eventBackend == VIR_EVENT_POLL_BACKEND_EPOLL &&
+        virEventPollEpollAddHandle(loop, handle) < 0) {
+        virHashRemoveEntry(loop->handlesByWatch, (void *)(intptr_t)watch);
+        VIR_FREE(handle);
+        virMutexUnlock(&loop->lock);
+        return -1;
+    }
+#endif
 
-    eventLoop.handlesCount++;
+    loop->handles[loop->handlesCount++] = handle;
 
-    virEventPollInterruptLocked();
+    virEventPollInterruptLocked(loop);
 
     PROBE(EVENT_POLL_ADD_HANDLE,
           "watch=%d fd=%d events=%d cb=%p opaque=%p ff=%p",
           watch, fd, events, cb, opaque, ff);
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 
     return watch;
 }
 
+int virEventPollAddHandle(int fd, int events,
+                          virEventHandleCallback cb,
+                          void *opaque,
+                          virFreeCallback ff)
+{
+    return virEventPollAddHandleLoop(&eventLoop, fd, events, cb, opaque, ff);
+}
+
+int virEventPollAddHandleSharded(int fd, int events,
+                                 virEventHandleCallback cb,
+                                 void *opaque,
+                                 virFreeCallback ff)
+{
+    struct virEventPollLoop *loop = &eventLoop;
+
+    /* Descriptors are spread evenly enough for a plain modulo */
+    if (eventShardsCount > 0 && fd >= 0)
+        loop = &eventShards[fd % eventShardsCount];
+
+    return virEventPollAddHandleLoop(loop, fd, events, cb, opaque, ff);
+}
+
 void virEventPollUpdateHandle(int watch, int events)
 {
-    size_t i;
-    bool found = false;
+    struct virEventPollLoop *loop;
+    struct virEventPollHandle *handle;
     PROBE(EVENT_POLL_UPDATE_HANDLE,
           "watch=%d events=%d",
           watch, events);
@@ -156,20 +636,24 @@ void virEventPollUpdateHandle(int watch, int events)
         return;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0; i < eventLoop.handlesCount; i++) {
-        if (eventLoop.handles[i].watch == watch) {
-            eventLoop.handles[i].events =
-                    virEventPollToNativeEvents(events);
-            virEventPollInterruptLocked();
-            found = true;
-            break;
-        }
+    loop = virEventPollWatchLoop(watch);
+    virMutexLock(&loop->lock);
+    if (!(handle = virHashLookup(loop->handlesByWatch,
+                                 (void *)(intptr_t)watch))) {
+        virMutexUnlock(&loop->lock);
+        VIR_WARN("Got update for non-existent handle watch %d", watch);
+        return;
     }
-    virMutexUnlock(&eventLoop.lock);
 
-    if (!found)
-        VIR_WARN("Got update for non-existent handle watch %d", watch);
+    handle->events = virEventPollToNativeEvents(events);
+#if HAVE_SYS_EPOLL_H
+    if (eventBackend == VIR_EVENT_POLL_BACKEND_EPOLL &&
+        virEventPollEpollUpdateFD(loop, handle->fd) < 0)
+        VIR_WARN("Unable to update events for watch %d: %s",
+                 watch, virGetLastErrorMessage());
+#endif
+    virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
 }
 
 /*
@@ -180,7 +664,8 @@ void virEventPollUpdateHandle(int watch, int events)
  */
 int virEventPollRemoveHandle(int watch)
 {
-    size_t i;
+    struct virEventPollLoop *loop;
+    struct virEventPollHandle *handle;
     PROBE(EVENT_POLL_REMOVE_HANDLE,
           "watch=%d",
           watch);
@@ -190,21 +675,27 @@ int virEventPollRemoveHandle(int watch)
         return -1;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0; i < eventLoop.handlesCount; i++) {
-        if (eventLoop.handles[i].deleted)
-            continue;
-
-        if (eventLoop.handles[i].watch == watch) {
-            EVENT_DEBUG("mark delete %zu %d", i, eventLoop.handles[i].fd);
-            eventLoop.handles[i].deleted = 1;
-            virEventPollInterruptLocked();
-            virMutexUnlock(&eventLoop.lock);
-            return 0;
-        }
+    loop = virEventPollWatchLoop(watch);
+    virMutexLock(&loop->lock);
+    if (!(handle = virHashLookup(loop->handlesByWatch,
+                                 (void *)(intptr_t)watch)) ||
+        handle->deleted) {
+        virMutexUnlock(&loop->lock);
+        return -1;
     }
-    virMutexUnlock(&eventLoop.lock);
-    return -1;
+
+    EVENT_DEBUG("mark delete %d %d", watch, handle->fd);
+    handle->deleted = 1;
+    loop->handlesDeleted++;
+#if HAVE_SYS_EPOLL_H
+    if (eventBackend == VIR_EVENT_POLL_BACKEND_EPOLL &&
+        virEventPollEpollUpdateFD(loop, handle->fd) < 0)
+        VIR_WARN("Unable to remove fd %d from epoll set: %s",
+                 handle->fd, virGetLastErrorMessage());
+#endif
+    virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
+    return 0;
 }
 
 
@@ -218,48 +709,56 @@ int virEventPollAddTimeout(int frequency,
                            void *opaque,
                            virFreeCallback ff)
 {
+    struct virEventPollLoop *loop = &eventLoop;
+    struct virEventPollTimeout *t;
     unsigned long long now;
     int ret;
 
     if (virTimeMillisNow(&now) < 0)
         return -1;
 
-    virMutexLock(&eventLoop.lock);
-    if (eventLoop.timeoutsCount == eventLoop.timeoutsAlloc) {
-        EVENT_DEBUG("Used %zu timeout slots, adding at least %d more",
-                    eventLoop.timeoutsAlloc, EVENT_ALLOC_EXTENT);
-        if (VIR_RESIZE_N(eventLoop.timeouts, eventLoop.timeoutsAlloc,
-                         eventLoop.timeoutsCount, EVENT_ALLOC_EXTENT) < 0) {
-            virMutexUnlock(&eventLoop.lock);
-            return -1;
-        }
-    }
+    if (VIR_ALLOC(t) < 0)
+        return -1;
 
-    eventLoop.timeouts[eventLoop.timeoutsCount].timer = nextTimer++;
-    eventLoop.timeouts[eventLoop.timeoutsCount].frequency = frequency;
-    eventLoop.timeouts[eventLoop.timeoutsCount].cb = cb;
-    eventLoop.timeouts[eventLoop.timeoutsCount].ff = ff;
-    eventLoop.timeouts[eventLoop.timeoutsCount].opaque = opaque;
-    eventLoop.timeouts[eventLoop.timeoutsCount].deleted = 0;
-    eventLoop.timeouts[eventLoop.timeoutsCount].expiresAt =
-        frequency >= 0 ? frequency + now : 0;
+    virMutexLock(&loop->lock);
+    t->timer = nextTimer++;
+    t->frequency = frequency;
+    t->cb = cb;
+    t->ff = ff;
+    t->opaque = opaque;
+    t->deleted = 0;
+    t->expiresAt = frequency >= 0 ? frequency + now : 0;
+    t->heapIndex = -1;
+
+    if (virHashAddEntry(loop->timeouts,
+                        (void *)(intptr_t)t->timer, t) < 0)
+        goto error;
 
-    eventLoop.timeoutsCount++;
-    ret = nextTimer-1;
-    virEventPollInterruptLocked();
+    if (virEventPollTimeoutHeapUpdate(loop, t) < 0) {
+        virHashRemoveEntry(loop->timeouts, (void *)(intptr_t)t->timer);
+        goto error;
+    }
+
+    ret = t->timer;
+    virEventPollInterruptLocked(loop);
 
     PROBE(EVENT_POLL_ADD_TIMEOUT,
           "timer=%d frequency=%d cb=%p opaque=%p ff=%p",
           ret, frequency, cb, opaque, ff);
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
     return ret;
+
+ error:
+    virMutexUnlock(&loop->lock);
+    VIR_FREE(t);
+    return -1;
 }
 
 void virEventPollUpdateTimeout(int timer, int frequency)
 {
+    struct virEventPollLoop *loop = &eventLoop;
+    struct virEventPollTimeout *t;
     unsigned long long now;
-    size_t i;
-    bool found = false;
     PROBE(EVENT_POLL_UPDATE_TIMEOUT,
           "timer=%d frequency=%d",
           timer, frequency);
@@ -272,23 +771,21 @@ void virEventPollUpdateTimeout(int timer, int frequency)
     if (virTimeMillisNow(&now) < 0)
         return;
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0; i < eventLoop.timeoutsCount; i++) {
-        if (eventLoop.timeouts[i].timer == timer) {
-            eventLoop.timeouts[i].frequency = frequency;
-            eventLoop.timeouts[i].expiresAt =
-                frequency >= 0 ? frequency + now : 0;
-            VIR_DEBUG("Set timer freq=%d expires=%llu", frequency,
-                      eventLoop.timeouts[i].expiresAt);
-            virEventPollInterruptLocked();
-            found = true;
-            break;
-        }
+    virMutexLock(&loop->lock);
+    if (!(t = virHashLookup(loop->timeouts, (void *)(intptr_t)timer))) {
+        virMutexUnlock(&loop->lock);
+        VIR_WARN("Got update for non-existent timer %d", timer);
+        return;
     }
-    virMutexUnlock(&eventLoop.lock);
 
-    if (!found)
-        VIR_WARN("Got update for non-existent timer %d", timer);
+    t->frequency = frequency;
+    t->expiresAt = frequency >= 0 ? frequency + now : 0;
+    VIR_DEBUG("Set timer freq=%d expires=%llu", frequency, t->expiresAt);
+    if (virEventPollTimeoutHeapUpdate(loop, t) < 0)
+        VIR_WARN("Unable to reschedule timer %d: %s",
+                 timer, virGetLastErrorMessage());
+    virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
 }
 
 /*
@@ -299,7 +796,8 @@ void virEventPollUpdateTimeout(int timer, int frequency)
  */
 int virEventPollRemoveTimeout(int timer)
 {
-    size_t i;
+    struct virEventPollLoop *loop = &eventLoop;
+    struct virEventPollTimeout *t;
     PROBE(EVENT_POLL_REMOVE_TIMEOUT,
           "timer=%d",
           timer);
@@ -309,44 +807,37 @@ int virEventPollRemoveTimeout(int timer)
         return -1;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0; i < eventLoop.timeoutsCount; i++) {
-        if (eventLoop.timeouts[i].deleted)
-            continue;
-
-        if (eventLoop.timeouts[i].timer == timer) {
-            eventLoop.timeouts[i].deleted = 1;
-            virEventPollInterruptLocked();
-            virMutexUnlock(&eventLoop.lock);
-            return 0;
-        }
+    virMutexLock(&loop->lock);
+    if (!(t = virHashLookup(loop->timeouts, (void *)(intptr_t)timer)) ||
+        t->deleted) {
+        virMutexUnlock(&loop->lock);
+        return -1;
     }
-    virMutexUnlock(&eventLoop.lock);
-    return -1;
+
+    t->deleted = 1;
+    virEventPollTimeoutHeapRemove(loop, t);
+    t->nextDeleted = loop->timeoutsDeleted;
+    loop->timeoutsDeleted = t;
+    virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
+    return 0;
 }
 
-/* Iterates over all registered timeouts and determine which
- * will be the first to expire.
+/* Determine when the first of the registered timeouts will
+ * expire, which is simply the top of the expiry heap.
  * @timeout: filled with expiry time of soonest timer, or -1 if
  *           no timeout is pending
  * returns: 0 on success, -1 on error
  */
-static int virEventPollCalculateTimeout(int *timeout)
+static int virEventPollCalculateTimeout(struct virEventPollLoop *loop,
+                                        int *timeout)
 {
     unsigned long long then = 0;
-    size_t i;
-    EVENT_DEBUG("Calculate expiry of %zu timers", eventLoop.timeoutsCount);
-    /* Figure out if we need a timeout */
-    for (i = 0; i < eventLoop.timeoutsCount; i++) {
-        if (eventLoop.timeouts[i].deleted)
-            continue;
-        if (eventLoop.timeouts[i].frequency < 0)
-            continue;
+    EVENT_DEBUG("Calculate expiry of %zu timers", loop->timeoutHeapCount);
 
-        EVENT_DEBUG("Got a timeout scheduled for %llu", eventLoop.timeouts[i].expiresAt);
-        if (then == 0 ||
-            eventLoop.timeouts[i].expiresAt < then)
-            then = eventLoop.timeouts[i].expiresAt;
+    if (loop->timeoutHeapCount > 0) {
+        then = loop->timeoutHeap[0]->expiresAt;
+        EVENT_DEBUG("Got a timeout scheduled for %llu", then);
     }
 
     /* Calculate how long we should wait for a timeout if needed */
@@ -378,13 +869,14 @@ static int virEventPollCalculateTimeout(int *timeout)
  * file handles. The caller must free the returned data struct
  * returns: the pollfd array, or NULL on error
  */
-static struct pollfd *virEventPollMakePollFDs(int *nfds) {
+static struct pollfd *virEventPollMakePollFDs(struct virEventPollLoop *loop,
+                                              int *nfds) {
     struct pollfd *fds;
     size_t i;
 
     *nfds = 0;
-    for (i = 0; i < eventLoop.handlesCount; i++) {
-        if (eventLoop.handles[i].events && !eventLoop.handles[i].deleted)
+    for (i = 0; i < loop->handlesCount; i++) {
+        if (loop->handles[i]->events && !loop->handles[i]->deleted)
             (*nfds)++;
     }
 
@@ -393,16 +885,16 @@ static struct pollfd *virEventPollMakePollFDs(int *nfds) {
         return NULL;
 
     *nfds = 0;
-    for (i = 0; i < eventLoop.handlesCount; i++) {
+    for (i = 0; i < loop->handlesCount; i++) {
         EVENT_DEBUG("Prepare n=%zu w=%d, f=%d e=%d d=%d", i,
-                    eventLoop.handles[i].watch,
-                    eventLoop.handles[i].fd,
-                    eventLoop.handles[i].events,
-                    eventLoop.handles[i].deleted);
-        if (!eventLoop.handles[i].events || eventLoop.handles[i].deleted)
+                    loop->handles[i]->watch,
+                    loop->handles[i]->fd,
+                    loop->handles[i]->events,
+                    loop->handles[i]->deleted);
+        if (!loop->handles[i]->events || loop->handles[i]->deleted)
             continue;
-        fds[*nfds].fd = eventLoop.handles[i].fd;
-        fds[*nfds].events = eventLoop.handles[i].events;
+        fds[*nfds].fd = loop->handles[i]->fd;
+        fds[*nfds].events = loop->handles[i]->events;
         fds[*nfds].revents = 0;
         (*nfds)++;
     }
@@ -412,51 +904,76 @@ static struct pollfd *virEventPollMakePollFDs(int *nfds) {
 
 
 /*
- * Iterate over all timers and determine if any have expired.
- * Invoke the user supplied callback for each timer whose
- * expiry time is met, and schedule the next timeout. Does
- * not try to 'catch up' on time if the actual expiry time
- * was later than the requested time.
+ * Pop all expired timers off the expiry heap and invoke the user
+ * supplied callback for each of them, and schedule the next
+ * timeout. Does not try to 'catch up' on time if the actual
+ * expiry time was later than the requested time.
  *
  * This method must cope with new timers being registered
  * by a callback, and must skip any timers marked as deleted.
  *
  * Returns 0 upon success, -1 if an error occurred
  */
-static int virEventPollDispatchTimeouts(void)
+static int virEventPollDispatchTimeouts(struct virEventPollLoop *loop)
 {
     unsigned long long now;
-    size_t i;
-    /* Save this now - it may be changed during dispatch */
-    int ntimeouts = eventLoop.timeoutsCount;
-    VIR_DEBUG("Dispatch %d", ntimeouts);
+    struct virEventPollTimeout *expired = NULL;
+    struct virEventPollTimeout **tail = &expired;
+    struct virEventPollTimeout *t;
+    VIR_DEBUG("Dispatch %zu", loop->timeoutHeapCount);
 
     if (virTimeMillisNow(&now) < 0)
         return -1;
 
-    for (i = 0; i < ntimeouts; i++) {
-        if (eventLoop.timeouts[i].deleted || eventLoop.timeouts[i].frequency < 0)
+    /* Collect the expired timers first, so that each of them fires
+     * at most once per iteration even if its frequency is shorter
+     * than the fuzz below.
+     *
+     * Add 20ms fuzz so we don't pointlessly spin doing
+     * <10ms sleeps, particularly on kernels with low HZ
+     * it is fine that a timer expires 20ms earlier than
+     * requested
+     */
+    while (loop->timeoutHeapCount > 0 &&
+           loop->timeoutHeap[0]->expiresAt <= (now+20)) {
+        t = loop->timeoutHeap[0];
+        virEventPollTimeoutHeapRemove(loop, t);
+        t->nextExpired = NULL;
+        *tail = t;
+        tail = &t->nextExpired;
+    }
+
+    while ((t = expired)) {
+        virEventTimeoutCallback cb = t->cb;
+        int timer = t->timer;
+        void *opaque = t->opaque;
+        bool fire = false;
+
+        expired = t->nextExpired;
+
+        /* An earlier callback may have deleted, disabled or
+         * rescheduled this timer, in which case it is back in
+         * the heap already */
+        if (t->deleted || t->frequency < 0)
             continue;
 
-        /* Add 20ms fuzz so we don't pointlessly spin doing
-         * <10ms sleeps, particularly on kernels with low HZ
-         * it is fine that a timer expires 20ms earlier than
-         * requested
-         */
-        if (eventLoop.timeouts[i].expiresAt <= (now+20)) {
-            virEventTimeoutCallback cb = eventLoop.timeouts[i].cb;
-            int timer = eventLoop.timeouts[i].timer;
-            void *opaque = eventLoop.timeouts[i].opaque;
-            eventLoop.timeouts[i].expiresAt =
-                now + eventLoop.timeouts[i].frequency;
-
-            PROBE(EVENT_POLL_DISPATCH_TIMEOUT,
-                  "timer=%d",
-                  timer);
-            virMutexUnlock(&eventLoop.lock);
-            (cb)(timer, opaque);
-            virMutexLock(&eventLoop.lock);
+        if (t->expiresAt <= (now+20)) {
+            t->expiresAt = now + t->frequency;
+            fire = true;
         }
+
+        if (virEventPollTimeoutHeapUpdate(loop, t) < 0)
+            return -1;
+
+        if (!fire)
+            continue;
+
+        PROBE(EVENT_POLL_DISPATCH_TIMEOUT,
+              "timer=%d",
+              timer);
+        virMutexUnlock(&loop->lock);
+        (cb)(timer, opaque);
+        virMutexLock(&loop->lock);
     }
     return 0;
 }
@@ -472,41 +989,42 @@ static int virEventPollDispatchTimeouts(void)
  *
  * Returns 0 upon success, -1 if an error occurred
  */
-static int virEventPollDispatchHandles(int nfds, struct pollfd *fds)
+static int virEventPollDispatchHandles(struct virEventPollLoop *loop,
+                                       int nfds, struct pollfd *fds)
 {
     size_t i, n;
     VIR_DEBUG("Dispatch %d", nfds);
 
-    /* NB, use nfds not eventLoop.handlesCount, because new
+    /* NB, use nfds not loop->handlesCount, because new
      * fds might be added on end of list, and they're not
      * in the fds array we've got */
-    for (i = 0, n = 0; n < nfds && i < eventLoop.handlesCount; n++) {
-        while (i < eventLoop.handlesCount &&
-               (eventLoop.handles[i].fd != fds[n].fd ||
-                eventLoop.handles[i].events == 0)) {
+    for (i = 0, n = 0; n < nfds && i < loop->handlesCount; n++) {
+        while (i < loop->handlesCount &&
+               (loop->handles[i]->fd != fds[n].fd ||
+                loop->handles[i]->events == 0)) {
             i++;
         }
-        if (i == eventLoop.handlesCount)
+        if (i == loop->handlesCount)
             break;
 
-        VIR_DEBUG("i=%zu w=%d", i, eventLoop.handles[i].watch);
-        if (eventLoop.handles[i].deleted) {
+        VIR_DEBUG("i=%zu w=%d", i, loop->handles[i]->watch);
+        if (loop->handles[i]->deleted) {
             EVENT_DEBUG("Skip deleted n=%zu w=%d f=%d", i,
-                        eventLoop.handles[i].watch, eventLoop.handles[i].fd);
+                        loop->handles[i]->watch, loop->handles[i]->fd);
             continue;
         }
 
         if (fds[n].revents) {
-            virEventHandleCallback cb = eventLoop.handles[i].cb;
-            int watch = eventLoop.handles[i].watch;
-            void *opaque = eventLoop.handles[i].opaque;
+            virEventHandleCallback cb = loop->handles[i]->cb;
+            int watch = loop->handles[i]->watch;
+            void *opaque = loop->handles[i]->opaque;
             int hEvents = virEventPollFromNativeEvents(fds[n].revents);
             PROBE(EVENT_POLL_DISPATCH_HANDLE,
                   "watch=%d events=%d",
                   watch, hEvents);
-            virMutexUnlock(&eventLoop.lock);
+            virMutexUnlock(&loop->lock);
             (cb)(watch, fds[n].fd, hEvents, opaque);
-            virMutexLock(&eventLoop.lock);
+            virMutexLock(&loop->lock);
         }
     }
 
@@ -514,52 +1032,91 @@ static int virEventPollDispatchHandles(int nfds, struct pollfd *fds)
 }
 
 
+#if HAVE_SYS_EPOLL_H
+/* Iterate over the descriptors reported ready by epoll_wait()
+ * and dispatch the handles registered against each of them.
+ * Unlike virEventPollDispatchHandles() this only touches the
+ * handles which actually have pending events.
+ *
+ * This method must cope with new handles being registered
+ * by a callback, and must skip any handles marked as deleted.
+ *
+ * Returns 0 upon success, -1 if an error occurred
+ */
+static int virEventPollDispatchEpollHandles(struct virEventPollLoop *loop,
+                                            int nevents,
+                                            struct epoll_event *events)
+{
+    size_t i, j;
+    VIR_DEBUG("Dispatch %d", nevents);
+
+    for (i = 0; i < nevents; i++) {
+        int fd = events[i].data.fd;
+        int revents = virEventPollFromEpollEvents(events[i].events);
+        size_t nhandles;
+
+        if (fd >= loop->fdtableCount)
+            continue;
+
+        /* NB, handles are only purged from the table post dispatch,
+         * but callbacks may append new ones which were not part
+         * of the wait, and may resize the table itself */
+        nhandles = loop->fdtable[fd].nhandles;
+        for (j = 0; j < nhandles; j++) {
+            struct virEventPollHandle *handle = loop->fdtable[fd].handles[j];
+            virEventHandleCallback cb = handle->cb;
+            int watch = handle->watch;
+            void *opaque = handle->opaque;
+            int hEvents;
+
+            if (handle->deleted || !handle->events) {
+                EVENT_DEBUG("Skip w=%d f=%d", watch, fd);
+                continue;
+            }
+
+            if (!(hEvents = revents & (handle->events | POLLERR | POLLHUP)))
+                continue;
+
+            hEvents = virEventPollFromNativeEvents(hEvents);
+            PROBE(EVENT_POLL_DISPATCH_HANDLE,
+                  "watch=%d events=%d",
+                  watch, hEvents);
+            virMutexUnlock(&loop->lock);
+            (cb)(watch, fd, hEvents, opaque);
+            virMutexLock(&loop->lock);
+        }
+    }
+
+    return 0;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+
 /* Used post dispatch to actually remove any timers that
  * were previously marked as deleted. This asynchronous
  * cleanup is needed to make dispatch re-entrant safe.
  */
-static void virEventPollCleanupTimeouts(void)
+static void virEventPollCleanupTimeouts(struct virEventPollLoop *loop)
 {
-    size_t i;
-    size_t gap;
-    VIR_DEBUG("Cleanup %zu", eventLoop.timeoutsCount);
+    struct virEventPollTimeout *t;
+    VIR_DEBUG("Cleanup %zd", virHashSize(loop->timeouts));
 
-    /* Remove deleted entries, shuffling down remaining
-     * entries as needed to form contiguous series
-     */
-    for (i = 0; i < eventLoop.timeoutsCount;) {
-        if (!eventLoop.timeouts[i].deleted) {
-            i++;
-            continue;
-        }
+    while ((t = loop->timeoutsDeleted)) {
+        loop->timeoutsDeleted = t->nextDeleted;
 
         PROBE(EVENT_POLL_PURGE_TIMEOUT,
               "timer=%d",
-              eventLoop.timeouts[i].timer);
-        if (eventLoop.timeouts[i].ff) {
-            virFreeCallback ff = eventLoop.timeouts[i].ff;
-            void *opaque = eventLoop.timeouts[i].opaque;
-            virMutexUnlock(&eventLoop.lock);
+              t->timer);
+        if (t->ff) {
+            virFreeCallback ff = t->ff;
+            void *opaque = t->opaque;
+            virMutexUnlock(&loop->lock);
             ff(opaque);
-            virMutexLock(&eventLoop.lock);
+            virMutexLock(&loop->lock);
         }
 
-        if ((i+1) < eventLoop.timeoutsCount) {
-            memmove(eventLoop.timeouts+i,
-                    eventLoop.timeouts+i+1,
-                    sizeof(struct virEventPollTimeout)*(eventLoop.timeoutsCount
-                                                    -(i+1)));
-        }
-        eventLoop.timeoutsCount--;
-    }
-
-    /* Release some memory if we've got a big chunk free */
-    gap = eventLoop.timeoutsAlloc - eventLoop.timeoutsCount;
-    if (eventLoop.timeoutsCount == 0 ||
-        (gap > eventLoop.timeoutsCount && gap > EVENT_ALLOC_EXTENT)) {
-        EVENT_DEBUG("Found %zu out of %zu timeout slots used, releasing %zu",
-                    eventLoop.timeoutsCount, eventLoop.timeoutsAlloc, gap);
-        VIR_SHRINK_N(eventLoop.timeouts, eventLoop.timeoutsAlloc, gap);
+        virHashRemoveEntry(loop->timeouts, (void *)(intptr_t)t->timer);
+        VIR_FREE(t);
     }
 }
 
@@ -567,177 +1124,506 @@ static void virEventPollCleanupTimeouts(void)
  * were previously marked as deleted. This asynchronous
  * cleanup is needed to make dispatch re-entrant safe.
  */
-static void virEventPollCleanupHandles(void)
+static void virEventPollCleanupHandles(struct virEventPollLoop *loop)
 {
     size_t i;
     size_t gap;
-    VIR_DEBUG("Cleanup %zu", eventLoop.handlesCount);
+    VIR_DEBUG("Cleanup %zu", loop->handlesCount);
+
+    if (loop->handlesDeleted == 0)
+        return;
 
     /* Remove deleted entries, shuffling down remaining
      * entries as needed to form contiguous series
      */
-    for (i = 0; i < eventLoop.handlesCount;) {
-        if (!eventLoop.handles[i].deleted) {
+    for (i = 0; i < loop->handlesCount;) {
+        struct virEventPollHandle *handle = loop->handles[i];
+
+        if (!handle->deleted) {
             i++;
             continue;
         }
 
         PROBE(EVENT_POLL_PURGE_HANDLE,
               "watch=%d",
-              eventLoop.handles[i].watch);
-        if (eventLoop.handles[i].ff) {
-            virFreeCallback ff = eventLoop.handles[i].ff;
-            void *opaque = eventLoop.handles[i].opaque;
-            virMutexUnlock(&eventLoop.lock);
+              handle->watch);
+        if (handle->ff) {
+            virFreeCallback ff = handle->ff;
+            void *opaque = handle->opaque;
+            virMutexUnlock(&loop->lock);
             ff(opaque);
-            virMutexLock(&eventLoop.lock);
+            virMutexLock(&loop->lock);
         }
 
-        if ((i+1) < eventLoop.handlesCount) {
-            memmove(eventLoop.handles+i,
-                    eventLoop.handles+i+1,
-                    sizeof(struct virEventPollHandle)*(eventLoop.handlesCount
-                                                   -(i+1)));
+#if HAVE_SYS_EPOLL_H
+        if (eventBackend == VIR_EVENT_POLL_BACKEND_EPOLL)
+            virEventPollEpollPurgeHandle(loop, handle);
+#endif
+        virHashRemoveEntry(loop->handlesByWatch,
+                           (void *)(intptr_t)handle->watch);
+        loop->handlesDeleted--;
+
+        if ((i+1) < loop->handlesCount) {
+            memmove(loop->handles+i,
+                    loop->handles+i+1,
+                    sizeof(*loop->handles)*(loop->handlesCount
+                                                -(i+1)));
         }
-        eventLoop.handlesCount--;
+        loop->handlesCount--;
+        VIR_FREE(handle);
     }
 
     /* Release some memory if we've got a big chunk free */
-    gap = eventLoop.handlesAlloc - eventLoop.handlesCount;
-    if (eventLoop.handlesCount == 0 ||
-        (gap > eventLoop.handlesCount && gap > EVENT_ALLOC_EXTENT)) {
+    gap = loop->handlesAlloc - loop->handlesCount;
+    if (loop->handlesCount == 0 ||
+        (gap > loop->handlesCount && gap > EVENT_ALLOC_EXTENT)) {
         EVENT_DEBUG("Found %zu out of %zu handles slots used, releasing %zu",
-                    eventLoop.handlesCount, eventLoop.handlesAlloc, gap);
-        VIR_SHRINK_N(eventLoop.handles, eventLoop.handlesAlloc, gap);
+                    loop->handlesCount, loop->handlesAlloc, gap);
+        VIR_SHRINK_N(loop->handles, loop->handlesAlloc, gap);
     }
 }
 
 /*
- * Run a single iteration of the event loop, blocking until
- * at least one file handle has an event, or a timer expires
+ * Wait for events using poll() on a freshly built pollfd array,
+ * then dispatch them. Called with the lock held, which is dropped
+ * while waiting.
  */
-int virEventPollRunOnce(void)
+static int virEventPollRunOncePoll(struct virEventPollLoop *loop)
 {
     struct pollfd *fds = NULL;
-    int ret, timeout, nfds;
+    int ret = -1, rc, timeout, nfds;
+    unsigned long long start;
 
-    virMutexLock(&eventLoop.lock);
-    eventLoop.running = 1;
-    virThreadSelf(&eventLoop.leader);
-
-    virEventPollCleanupTimeouts();
-    virEventPollCleanupHandles();
-
-    if (!(fds = virEventPollMakePollFDs(&nfds)) ||
-        virEventPollCalculateTimeout(&timeout) < 0)
-        goto error;
+    if (!(fds = virEventPollMakePollFDs(loop, &nfds)) ||
+        virEventPollCalculateTimeout(loop, &timeout) < 0)
+        goto cleanup;
 
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 
  retry:
     PROBE(EVENT_POLL_RUN,
           "nhandles=%d timeout=%d",
           nfds, timeout);
-    ret = poll(fds, nfds, timeout);
-    if (ret < 0) {
+    rc = poll(fds, nfds, timeout);
+    if (rc < 0) {
         EVENT_DEBUG("Poll got error event %d", errno);
         if (errno == EINTR || errno == EAGAIN)
             goto retry;
         virReportSystemError(errno, "%s",
                              _("Unable to poll on file handles"));
-        goto error_unlocked;
+        virMutexLock(&loop->lock);
+        goto cleanup;
     }
-    EVENT_DEBUG("Poll got %d event(s)", ret);
+    EVENT_DEBUG("Poll got %d event(s)", rc);
 
-    virMutexLock(&eventLoop.lock);
-    if (virEventPollDispatchTimeouts() < 0)
-        goto error;
+    virMutexLock(&loop->lock);
+    start = virEventPollNowMicros();
+    if (virEventPollDispatchTimeouts(loop) < 0)
+        goto cleanup;
 
-    if (ret > 0 &&
-        virEventPollDispatchHandles(nfds, fds) < 0)
-        goto error;
+    if (rc > 0 &&
+        virEventPollDispatchHandles(loop, nfds, fds) < 0)
+        goto cleanup;
 
-    virEventPollCleanupTimeouts();
-    virEventPollCleanupHandles();
+    loop->busy += virEventPollNowMicros() - start;
+    ret = 0;
 
-    eventLoop.running = 0;
-    virMutexUnlock(&eventLoop.lock);
+ cleanup:
     VIR_FREE(fds);
-    return 0;
+    return ret;
+}
 
- error:
-    virMutexUnlock(&eventLoop.lock);
- error_unlocked:
-    VIR_FREE(fds);
-    return -1;
+
+#if HAVE_SYS_EPOLL_H
+/*
+ * Fill @events, which has room for @max entries, with the descriptors
+ * epoll refused, reported ready for whatever their handles watch.
+ *
+ * Returns the number of entries filled.
+ */
+static int virEventPollEpollAddUnpollable(struct virEventPollLoop *loop,
+                                          struct epoll_event *events,
+                                          size_t max)
+{
+    size_t found = 0;
+    size_t n = 0;
+    size_t fd;
+
+    for (fd = 0; fd < loop->fdtableCount && found < loop->unpollableCount &&
+         n < max; fd++) {
+        struct virEventPollFD *entry = &loop->fdtable[fd];
+
+        if (!entry->unpollable)
+            continue;
+        found++;
+
+        memset(&events[n], 0, sizeof(events[n]));
+        events[n].events = virEventPollToEpollEvents(entry->events &
+                                                     (POLLIN | POLLOUT));
+        events[n].data.fd = fd;
+        n++;
+    }
+
+    return n;
+}
+
+
+/*
+ * Wait for events on the persistent epoll set, then dispatch
+ * them. Called with the lock held, which is dropped while waiting.
+ */
+static int virEventPollRunOnceEpoll(struct virEventPollLoop *loop)
+{
+    struct epoll_event *events = NULL;
+    int ret = -1, rc, timeout, nevents;
+    size_t nunpollable;
+    unsigned long long start;
+
+    nevents = MIN(loop->epollCount, EVENT_EPOLL_MAX_EVENTS);
+    if (nevents == 0)
+        nevents = 1;
+
+    nunpollable = loop->unpollableCount;
+    if (VIR_ALLOC_N(events, nevents + nunpollable) < 0 ||
+        virEventPollCalculateTimeout(loop, &timeout) < 0)
+        goto cleanup;
+
+    /* As with poll(), descriptors epoll refused are always ready */
+    if (nunpollable > 0)
+        timeout = 0;
+
+    virMutexUnlock(&loop->lock);
+
+ retry:
+    PROBE(EVENT_POLL_RUN,
+          "nhandles=%zu timeout=%d",
+          loop->epollCount, timeout);
+    rc = epoll_wait(loop->epollfd, events, nevents, timeout);
+    if (rc < 0) {
+        EVENT_DEBUG("Poll got error event %d", errno);
+        if (errno == EINTR || errno == EAGAIN)
+            goto retry;
+        virReportSystemError(errno, "%s",
+                             _("Unable to poll on file handles"));
+        virMutexLock(&loop->lock);
+        goto cleanup;
+    }
+    EVENT_DEBUG("Poll got %d event(s)", rc);
+
+    virMutexLock(&loop->lock);
+    rc += virEventPollEpollAddUnpollable(loop, events + rc,
+                                         nevents + nunpollable - rc);
+
+    start = virEventPollNowMicros();
+    if (virEventPollDispatchTimeouts(loop) < 0)
+        goto cleanup;
+
+    if (rc > 0 &&
+        virEventPollDispatchEpollHandles(loop, rc, events) < 0)
+        goto cleanup;
+
+    loop->busy += virEventPollNowMicros() - start;
+    ret = 0;
+
+ cleanup:
+    VIR_FREE(events);
+    return ret;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+
+/*
+ * Run a single iteration of the event loop, blocking until
+ * at least one file handle has an event, or a timer expires
+ */
+static int virEventPollRunOnceLoop(struct virEventPollLoop *loop)
+{
+    int ret;
+
+    virMutexLock(&loop->lock);
+    loop->running = 1;
+    virThreadSelf(&loop->leader);
+
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
+
+#if HAVE_SYS_EPOLL_H
+    if (eventBackend == VIR_EVENT_POLL_BACKEND_EPOLL)
+        ret = virEventPollRunOnceEpoll(loop);
+    else
+#endif
+        ret = virEventPollRunOncePoll(loop);
+
+    if (ret < 0)
+        goto cleanup;
+
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
+
+    loop->iterations++;
+    loop->running = 0;
+
+ cleanup:
+    virMutexUnlock(&loop->lock);
+    return ret;
+}
+
+int virEventPollRunOnce(void)
+{
+    return virEventPollRunOnceLoop(&eventLoop);
+}
+
+
+/* Body of the threads running the additional loops, until
+ * virEventPollStopShards is called */
+static void virEventPollShardWorker(void *opaque)
+{
+    struct virEventPollLoop *loop = opaque;
+
+    for (;;) {
+        bool quit;
+
+        virMutexLock(&loop->lock);
+        quit = loop->quit;
+        virMutexUnlock(&loop->lock);
+        if (quit)
+            break;
+
+        if (virEventPollRunOnceLoop(loop) < 0) {
+            VIR_WARN("Event loop %zu iteration failed: %s",
+                     loop->index, virGetLastErrorMessage());
+            /* Avoid spinning on a persistent failure */
+            usleep(100 * 1000);
+        }
+    }
 }
 
 
 static void virEventPollHandleWakeup(int watch ATTRIBUTE_UNUSED,
                                      int fd,
                                      int events ATTRIBUTE_UNUSED,
-                                     void *opaque ATTRIBUTE_UNUSED)
+                                     void *opaque)
 {
+    struct virEventPollLoop *loop = opaque;
     char c;
-    virMutexLock(&eventLoop.lock);
+    virMutexLock(&loop->lock);
     ignore_value(saferead(fd, &c, sizeof(c)));
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 }
 
-int virEventPollInit(void)
+int virEventPollSetBackend(virEventPollBackend backend)
+{
+    if (eventInitialized) {
+        virReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                       _("cannot change event loop backend once "
+                         "the event loop is initialized"));
+        return -1;
+    }
+
+#if !HAVE_SYS_EPOLL_H
+    if (backend == VIR_EVENT_POLL_BACKEND_EPOLL) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                       _("epoll event loop backend is not supported "
+                         "on this platform"));
+        return -1;
+    }
+#endif
+
+    eventBackend = backend;
+    return 0;
+}
+
+int virEventPollSetShards(size_t nshards)
 {
-    if (virMutexInit(&eventLoop.lock) < 0) {
+    if (eventInitialized) {
+        virReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                       _("cannot change number of event loop threads "
+                         "once the event loop is initialized"));
+        return -1;
+    }
+
+    if (nshards > VIR_EVENT_POLL_SHARDS_MAX) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("too many event loop threads %zu, maximum is %d"),
+                       nshards, VIR_EVENT_POLL_SHARDS_MAX);
+        return -1;
+    }
+
+    eventShardsCount = nshards;
+    return 0;
+}
+
+static int virEventPollInitLoop(struct virEventPollLoop *loop,
+                                size_t index)
+{
+    if (virMutexInit(&loop->lock) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to initialize mutex"));
         return -1;
     }
 
-    if (pipe2(eventLoop.wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
+    loop->index = index;
+    loop->nextWatch = 1;
+    loop->wakeupfd[0] = loop->wakeupfd[1] = -1;
+
+    if (!(loop->handlesByWatch = virHashCreateFull(EVENT_HASH_SIZE, NULL,
+                                                   virEventPollIdCode,
+                                                   virEventPollIdEqual,
+                                                   virEventPollIdCopy,
+                                                   NULL)) ||
+        !(loop->timeouts = virHashCreateFull(EVENT_HASH_SIZE, NULL,
+                                             virEventPollIdCode,
+                                             virEventPollIdEqual,
+                                             virEventPollIdCopy,
+                                             NULL)))
+        return -1;
+
+    loop->epollfd = -1;
+#if HAVE_SYS_EPOLL_H
+    if (eventBackend == VIR_EVENT_POLL_BACKEND_EPOLL &&
+        (loop->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create epoll instance"));
+        return -1;
+    }
+#endif
+
+    if (pipe2(loop->wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to setup wakeup pipe"));
         return -1;
     }
 
-    if (virEventPollAddHandle(eventLoop.wakeupfd[0],
-                              VIR_EVENT_HANDLE_READABLE,
-                              virEventPollHandleWakeup, NULL, NULL) < 0) {
+    if (virEventPollAddHandleLoop(loop, loop->wakeupfd[0],
+                                  VIR_EVENT_HANDLE_READABLE,
+                                  virEventPollHandleWakeup, loop, NULL) < 0) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("Unable to add handle %d to event loop"),
-                       eventLoop.wakeupfd[0]);
-        VIR_FORCE_CLOSE(eventLoop.wakeupfd[0]);
-        VIR_FORCE_CLOSE(eventLoop.wakeupfd[1]);
+                       loop->wakeupfd[0]);
+        VIR_FORCE_CLOSE(loop->wakeupfd[0]);
+        VIR_FORCE_CLOSE(loop->wakeupfd[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+int virEventPollInit(void)
+{
+    size_t i;
+
+    VIR_DEBUG("Using %s event loop backend with %zu extra threads",
+              virEventPollBackendTypeToString(eventBackend),
+              eventShardsCount);
+
+    if (eventShardsCount > 0 &&
+        VIR_ALLOC_N(eventShards, eventShardsCount) < 0)
         return -1;
+
+    /* The id of a watch depends on the number of loops, so it
+     * cannot change from now on */
+    eventInitialized = true;
+
+    for (i = 0; i <= eventShardsCount; i++) {
+        if (virEventPollInitLoop(virEventPollGetLoop(i), i) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < eventShardsCount; i++) {
+        if (virThreadCreate(&eventShards[i].thread, true,
+                            virEventPollShardWorker, &eventShards[i]) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to create event loop thread"));
+            eventShardsStarted = i;
+            virEventPollStopShards();
+            return -1;
+        }
     }
+    eventShardsStarted = eventShardsCount;
 
     return 0;
 }
 
-static int virEventPollInterruptLocked(void)
+void virEventPollStopShards(void)
+{
+    size_t i;
+
+    for (i = 0; i < eventShardsStarted; i++) {
+        struct virEventPollLoop *loop = &eventShards[i];
+        char c = '\0';
+
+        virMutexLock(&loop->lock);
+        loop->quit = true;
+        /* Whether it is waiting yet or not */
+        ignore_value(safewrite(loop->wakeupfd[1], &c, sizeof(c)));
+        virMutexUnlock(&loop->lock);
+    }
+
+    for (i = 0; i < eventShardsStarted; i++)
+        virThreadJoin(&eventShards[i].thread);
+
+    eventShardsStarted = 0;
+}
+
+static int virEventPollInterruptLocked(struct virEventPollLoop *loop)
 {
     char c = '\0';
 
-    if (!eventLoop.running ||
-        virThreadIsSelf(&eventLoop.leader)) {
-        VIR_DEBUG("Skip interrupt, %d %llu", eventLoop.running,
-                  virThreadID(&eventLoop.leader));
+    if (!loop->running ||
+        virThreadIsSelf(&loop->leader)) {
+        VIR_DEBUG("Skip interrupt, %d %llu", loop->running,
+                  virThreadID(&loop->leader));
         return 0;
     }
 
     VIR_DEBUG("Interrupting");
-    if (safewrite(eventLoop.wakeupfd[1], &c, sizeof(c)) != sizeof(c))
+    if (safewrite(loop->wakeupfd[1], &c, sizeof(c)) != sizeof(c))
         return -1;
     return 0;
 }
 
 int virEventPollInterrupt(void)
 {
+    struct virEventPollLoop *loop = &eventLoop;
     int ret;
-    virMutexLock(&eventLoop.lock);
-    ret = virEventPollInterruptLocked();
-    virMutexUnlock(&eventLoop.lock);
+    virMutexLock(&loop->lock);
+    ret = virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
     return ret;
 }
 
+int virEventPollGetStats(virEventPollStatsPtr *stats,
+                         size_t *nstats)
+{
+    virEventPollStatsPtr tmp = NULL;
+    size_t n = eventShardsCount + 1;
+    size_t i;
+
+    if (!eventInitialized) {
+        virReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                       _("the event loop is not initialized"));
+        return -1;
+    }
+
+    if (VIR_ALLOC_N(tmp, n) < 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        struct virEventPollLoop *loop = virEventPollGetLoop(i);
+
+        virMutexLock(&loop->lock);
+        tmp[i].iterations = loop->iterations;
+        tmp[i].busy = loop->busy;
+        /* Leave out the internal wakeup pipe */
+        tmp[i].handles = loop->handlesCount - loop->handlesDeleted - 1;
+        virMutexUnlock(&loop->lock);
+    }
+
+    *stats = tmp;
+    *nstats = n;
+    return 0;
+}
+
 int
 virEventPollToNativeEvents(int events)
 {
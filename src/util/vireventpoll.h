@@ -25,6 +25,27 @@
 # define __VIR_EVENT_POLL_H__
 
 # include "internal.h"
+# include "virutil.h"
+
+typedef enum {
+    VIR_EVENT_POLL_BACKEND_POLL,
+    VIR_EVENT_POLL_BACKEND_EPOLL,
+
+    VIR_EVENT_POLL_BACKEND_LAST
+} virEventPollBackend;
+
+VIR_ENUM_DECL(virEventPollBackend)
+
+/* Upper limit on the number of additional event loop threads */
+# define VIR_EVENT_POLL_SHARDS_MAX 64
+
+typedef struct _virEventPollStats virEventPollStats;
+typedef virEventPollStats *virEventPollStatsPtr;
+struct _virEventPollStats {
+    unsigned long long iterations; /* number of iterations run */
+    unsigned long long busy; /* time spent dispatching, in microseconds */
+    size_t handles; /* number of registered file handles */
+};
 
 /**
  * virEventPollAddHandle: register a callback for monitoring file handle events
@@ -41,6 +62,29 @@ int virEventPollAddHandle(int fd, int events,
                           void *opaque,
                           virFreeCallback ff);
 
+/**
+ * virEventPollAddHandleSharded: register a callback for monitoring file
+ * handle events, possibly outside of the main loop
+ *
+ * @fd: file handle to monitor for events
+ * @events: bitset of events to watch from POLLnnn constants
+ * @cb: callback to invoke when an event occurs
+ * @opaque: user data to pass to callback
+ *
+ * Like virEventPollAddHandle, but if additional event loop threads
+ * were requested with virEventPollSetShards, the handle is assigned
+ * to one of them instead of the main loop. The callback may then run
+ * concurrently with callbacks of other handles and with timers, so
+ * it must do its own locking.
+ *
+ * returns -1 if the file handle cannot be registered, a positive
+ * integer watch id upon success
+ */
+int virEventPollAddHandleSharded(int fd, int events,
+                                 virEventHandleCallback cb,
+                                 void *opaque,
+                                 virFreeCallback ff);
+
 /**
  * virEventPollUpdateHandle: change event set for a monitored file handle
  *
@@ -100,6 +144,35 @@ void virEventPollUpdateTimeout(int timer, int frequency);
  */
 int virEventPollRemoveTimeout(int timer);
 
+/**
+ * virEventPollSetBackend: select the mechanism used to wait for events
+ *
+ * @backend: the backend to use
+ *
+ * Must be called before virEventPollInit. The poll() backend rebuilds
+ * the set of watched descriptors on every iteration, while the epoll
+ * backend keeps it in the kernel so the cost of an iteration depends
+ * on the number of ready descriptors rather than registered ones.
+ *
+ * returns -1 if the backend is not supported or the loop is already
+ * initialized, 0 upon success
+ */
+int virEventPollSetBackend(virEventPollBackend backend);
+
+/**
+ * virEventPollSetShards: set the number of additional event loop threads
+ *
+ * @nshards: number of threads, 0 to run all handles in the main loop
+ *
+ * Must be called before virEventPollInit. Each additional thread runs
+ * an event loop of its own, serving the handles registered through
+ * virEventPollAddHandleSharded. Timers always stay in the main loop.
+ *
+ * returns -1 if the number is out of range or the loop is already
+ * initialized, 0 upon success
+ */
+int virEventPollSetShards(size_t nshards);
+
 /**
  * virEventPollInit: Initialize the event loop
  *
@@ -107,6 +180,15 @@ int virEventPollRemoveTimeout(int timer);
  */
 int virEventPollInit(void);
 
+/**
+ * virEventPollStopShards: stop the additional event loop threads
+ *
+ * Waits for the threads started by virEventPollInit to finish their
+ * current iteration. Handles registered with them are no longer
+ * dispatched afterwards. Only meant to be called on shutdown.
+ */
+void virEventPollStopShards(void);
+
 /**
  * virEventPollRunOnce: run a single iteration of the event loop.
  *
@@ -128,5 +210,19 @@ int virEventPollToNativeEvents(int events);
  */
 int virEventPollInterrupt(void);
 
+/**
+ * virEventPollGetStats: report activity of the event loops
+ *
+ * @stats: filled with a newly allocated array of statistics
+ * @nstats: filled with the number of elements in @stats
+ *
+ * The first element describes the main loop, the others the
+ * additional threads, if any.
+ *
+ * returns -1 if the event loop is not initialized, 0 upon success
+ */
+int virEventPollGetStats(virEventPollStatsPtr *stats,
+                         size_t *nstats);
+
 
 #endif /* __VIRTD_EVENT_H__ */
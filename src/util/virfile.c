@@ -276,6 +276,13 @@ virFileWrapperFdNew(int *fd, const char *name, unsigned int flags)
      * iohelper's env so virLog functions print to stderr
      */
     virCommandAddEnvPair(ret->cmd, "LIBVIRT_LOG_OUTPUTS", "1:stderr");
+    /* That also hides our environment, so hand over the tunables */
+    virCommandAddEnvPassBlockSUID(ret->cmd,
+                                  "LIBVIRT_IOHELPER_BUFFER_SIZE", NULL);
+    virCommandAddEnvPassBlockSUID(ret->cmd,
+                                  "LIBVIRT_IOHELPER_QUEUE_DEPTH", NULL);
+    virCommandAddEnvPassBlockSUID(ret->cmd,
+                                  "LIBVIRT_IOHELPER_ZERO_COPY", NULL);
     virCommandSetErrorBuffer(ret->cmd, &ret->err_msg);
     virCommandDoAsyncIO(ret->cmd);
 
@@ -1197,6 +1204,127 @@ safezero_slow(int fd, off_t offset, off_t len)
     return 0;
 }
 
+/**
+ * virFilePunchHole:
+ * @fd: file to modify
+ * @offset: start of the range
+ * @len: length of the range
+ *
+ * Make the given range of @fd read back as zeroes, deallocating it if
+ * the file system supports it, or overwriting it with zeroes otherwise.
+ * The size of the file is left unchanged, but its position is not
+ * preserved.
+ *
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int
+virFilePunchHole(int fd, off_t offset, off_t len)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, len) == 0)
+        return 0;
+
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        return -1;
+#endif
+
+    return safezero_slow(fd, offset, len);
+}
+
+
+/**
+ * virFileInData:
+ * @fd: file to check
+ * @inData: set to true if the current position is within data
+ * @length: set to the number of bytes until the end of that section
+ *
+ * Sparse files are made of data sections and holes which take no room
+ * on disk. Find out which kind of section the current position of @fd
+ * is in, and how long it goes on for. The end of the file is reported
+ * as a hole of length 0. Files on which holes can't be looked for are
+ * reported as data up to their end.
+ *
+ * The position of @fd is left unchanged.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virFileInData(int fd,
+              bool *inData,
+              long long *length)
+{
+    off_t cur;
+    off_t end;
+    off_t next;
+    int ret = -1;
+
+    if ((cur = lseek(fd, 0, SEEK_CUR)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to get current position in file"));
+        return -1;
+    }
+
+    if ((end = lseek(fd, 0, SEEK_END)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to seek to end of file"));
+        goto cleanup;
+    }
+
+    if (cur >= end) {
+        *inData = false;
+        *length = 0;
+        ret = 0;
+        goto cleanup;
+    }
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if ((next = lseek(fd, cur, SEEK_DATA)) < 0) {
+        if (errno == ENXIO) {
+            /* Trailing hole */
+            *inData = false;
+            *length = end - cur;
+            ret = 0;
+            goto cleanup;
+        }
+        if (errno != EINVAL && errno != ENOTSUP) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to seek to data"));
+            goto cleanup;
+        }
+        /* Holes are not supported, so it's all data */
+        next = cur;
+    } else if (next > cur) {
+        *inData = false;
+        *length = next - cur;
+        ret = 0;
+        goto cleanup;
+    } else if ((next = lseek(fd, cur, SEEK_HOLE)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to seek to hole"));
+        goto cleanup;
+    }
+
+    if (next <= cur)
+        next = end;
+#else /* !defined(SEEK_DATA) || !defined(SEEK_HOLE) */
+    next = end;
+#endif /* !defined(SEEK_DATA) || !defined(SEEK_HOLE) */
+
+    *inData = true;
+    *length = next - cur;
+    ret = 0;
+
+ cleanup:
+    if (lseek(fd, cur, SEEK_SET) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to restore position in file"));
+        ret = -1;
+    }
+    return ret;
+}
+
+
 int safezero(int fd, off_t offset, off_t len)
 {
     int ret;
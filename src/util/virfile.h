@@ -43,6 +43,28 @@ ssize_t safewrite(int fd, const void *buf, size_t count)
     ATTRIBUTE_RETURN_CHECK;
 int safezero(int fd, off_t offset, off_t len)
     ATTRIBUTE_RETURN_CHECK;
+int virFilePunchHole(int fd, off_t offset, off_t len)
+    ATTRIBUTE_RETURN_CHECK;
+int virFileInData(int fd, bool *inData, long long *length)
+    ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3) ATTRIBUTE_RETURN_CHECK;
+
+/*
+ * Sparse streams are passed between fdstream and the I/O helper as a
+ * sequence of segments, each one made of this header followed by
+ * @length bytes for data segments, or nothing for holes.
+ */
+typedef enum {
+    VIR_FILE_SEGMENT_DATA = 0,
+    VIR_FILE_SEGMENT_HOLE,
+} virFileSegmentType;
+
+typedef struct _virFileSegmentHeader virFileSegmentHeader;
+typedef virFileSegmentHeader *virFileSegmentHeaderPtr;
+struct _virFileSegmentHeader {
+    uint32_t type; /* virFileSegmentType */
+    uint32_t padding;
+    uint64_t length;
+};
 
 /* Don't call these directly - use the macros below */
 int virFileClose(int *fdptr, virFileCloseFlags flags)
@@ -51,6 +51,12 @@ VIR_ENUM_IMPL(virFirewallLayerCommand, VIR_FIREWALL_LAYER_LAST,
               IPTABLES_PATH,
               IP6TABLES_PATH);
 
+VIR_ENUM_DECL(virFirewallLayerRestoreCommand)
+VIR_ENUM_IMPL(virFirewallLayerRestoreCommand, VIR_FIREWALL_LAYER_LAST,
+              EBTABLES_RESTORE_PATH,
+              IPTABLES_RESTORE_PATH,
+              IP6TABLES_RESTORE_PATH);
+
 VIR_ENUM_DECL(virFirewallLayerFirewallD)
 VIR_ENUM_IMPL(virFirewallLayerFirewallD, VIR_FIREWALL_LAYER_LAST,
               "eb", "ipv4", "ipv6")
@@ -62,6 +68,7 @@ struct _virFirewallRule {
     virFirewallQueryCallback queryCB;
     void *queryOpaque;
     bool ignoreErrors;
+    bool lockArg; /* args[0] is the locking option */
 
     size_t argsAlloc;
     size_t argsLen;
@@ -107,7 +114,10 @@ VIR_ONCE_GLOBAL_INIT(virFirewall)
 static bool iptablesUseLock;
 static bool ip6tablesUseLock;
 static bool ebtablesUseLock;
+static bool iptablesRestoreUseLock;
+static bool ip6tablesRestoreUseLock;
 static bool lockOverride; /* true to avoid lock probes */
+static bool batchRules; /* true to prefer the restore backend */
 
 void
 virFirewallSetLockOverride(bool avoid)
@@ -115,6 +125,21 @@ virFirewallSetLockOverride(bool avoid)
     lockOverride = avoid;
 }
 
+/**
+ * virFirewallSetBatchRules:
+ * @batch: whether to apply rules in batches
+ *
+ * Make the automatic backend selection pick the restore backend,
+ * which applies runs of rules with a single *-restore command,
+ * instead of the direct backend whenever the *-restore commands are
+ * installed. Must be called before any firewall is applied.
+ */
+void
+virFirewallSetBatchRules(bool batch)
+{
+    batchRules = batch;
+}
+
 static void
 virFirewallCheckUpdateLock(bool *lockflag,
                            const char *const*args)
@@ -142,6 +167,13 @@ virFirewallCheckUpdateLocking(void)
     const char *ebtablesArgs[] = {
         EBTABLES_PATH, "--concurrent", "-L", NULL,
     };
+    /* Older *-restore do not know -w even if the plain command does */
+    const char *iptablesRestoreArgs[] = {
+        IPTABLES_RESTORE_PATH, "-w", "--test", NULL,
+    };
+    const char *ip6tablesRestoreArgs[] = {
+        IP6TABLES_RESTORE_PATH, "-w", "--test", NULL,
+    };
     if (lockOverride)
         return;
     virFirewallCheckUpdateLock(&iptablesUseLock,
@@ -150,11 +182,19 @@ virFirewallCheckUpdateLocking(void)
                                ip6tablesArgs);
     virFirewallCheckUpdateLock(&ebtablesUseLock,
                                ebtablesArgs);
+    if (currentBackend != VIR_FIREWALL_BACKEND_RESTORE)
+        return;
+    virFirewallCheckUpdateLock(&iptablesRestoreUseLock,
+                               iptablesRestoreArgs);
+    virFirewallCheckUpdateLock(&ip6tablesRestoreUseLock,
+                               ip6tablesRestoreArgs);
 }
 
 static int
 virFirewallValidateBackend(virFirewallBackend backend)
 {
+    bool automatic = backend == VIR_FIREWALL_BACKEND_AUTOMATIC;
+
     VIR_DEBUG("Validating backend %d", backend);
     if (backend == VIR_FIREWALL_BACKEND_AUTOMATIC ||
         backend == VIR_FIREWALL_BACKEND_FIREWALLD) {
@@ -180,7 +220,8 @@ virFirewallValidateBackend(virFirewallBackend backend)
         }
     }
 
-    if (backend == VIR_FIREWALL_BACKEND_DIRECT) {
+    if (backend == VIR_FIREWALL_BACKEND_DIRECT ||
+        backend == VIR_FIREWALL_BACKEND_RESTORE) {
         const char *commands[] = {
             IPTABLES_PATH, IP6TABLES_PATH, EBTABLES_PATH
         };
@@ -197,6 +238,34 @@ virFirewallValidateBackend(virFirewallBackend backend)
         VIR_DEBUG("found iptables/ip6tables/ebtables, using direct backend");
     }
 
+    /* Batching is only picked automatically when asked for */
+    if (backend == VIR_FIREWALL_BACKEND_RESTORE ||
+        (backend == VIR_FIREWALL_BACKEND_DIRECT && automatic && batchRules)) {
+        const char *commands[] = {
+            IPTABLES_RESTORE_PATH, IP6TABLES_RESTORE_PATH, EBTABLES_RESTORE_PATH
+        };
+        size_t i;
+
+        for (i = 0; i < ARRAY_CARDINALITY(commands); i++) {
+            if (!virFileIsExecutable(commands[i]))
+                break;
+        }
+
+        if (i < ARRAY_CARDINALITY(commands)) {
+            if (backend == VIR_FIREWALL_BACKEND_RESTORE) {
+                virReportSystemError(errno,
+                                     _("restore firewall backend requested, but %s is not available"),
+                                     commands[i]);
+                return -1;
+            }
+            VIR_DEBUG("%s not available, applying rules one by one",
+                      commands[i]);
+        } else {
+            VIR_DEBUG("found *-restore commands, using restore backend");
+            backend = VIR_FIREWALL_BACKEND_RESTORE;
+        }
+    }
+
     currentBackend = backend;
 
     virFirewallCheckUpdateLocking();
@@ -380,6 +449,7 @@ virFirewallAddRuleFullV(virFirewallPtr firewall,
     case VIR_FIREWALL_LAYER_LAST:
         break;
     }
+    rule->lockArg = rule->argsLen > 0;
 
     while ((str = va_arg(args, char *)) != NULL)
         ADD_ARG(rule, str);
@@ -843,6 +913,7 @@ virFirewallApplyRule(virFirewallPtr firewall,
 
     switch (currentBackend) {
     case VIR_FIREWALL_BACKEND_DIRECT:
+    case VIR_FIREWALL_BACKEND_RESTORE:
         if (virFirewallApplyRuleDirect(rule, ignoreErrors, &output) < 0)
             return -1;
         break;
@@ -883,23 +954,195 @@ virFirewallApplyRule(virFirewallPtr firewall,
     return ret;
 }
 
+
+/*
+ * Find the table @rule applies to. The position of the option
+ * selecting it is stored in @tableArg, or -1 if it uses the default.
+ */
+static const char *
+virFirewallRuleGetTable(virFirewallRulePtr rule,
+                        ssize_t *tableArg)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < rule->argsLen; i++) {
+        if (STREQ(rule->args[i], "-t") ||
+            STREQ(rule->args[i], "--table")) {
+            *tableArg = i;
+            return rule->args[i + 1];
+        }
+    }
+
+    *tableArg = -1;
+    return "filter";
+}
+
+
+static bool
+virFirewallRuleCanRestore(virFirewallRulePtr rule,
+                          bool ignoreErrors)
+{
+    size_t i;
+
+    /* A failing rule takes the whole batch down with it, and
+     * queries need the output of a command of their own */
+    if (ignoreErrors || rule->ignoreErrors || rule->queryCB)
+        return false;
+
+    /* Stay clear of the quoting rules of the *-restore input */
+    for (i = 0; i < rule->argsLen; i++) {
+        if (!*rule->args[i] ||
+            strpbrk(rule->args[i], " \t\n\"'\\#"))
+            return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * Count how many of the @nrules rules starting at @rules can be
+ * passed to a single *-restore run, ie. are on the same layer and
+ * change the same table. Each run commits a single table at once,
+ * so if it fails none of its rules was applied.
+ */
+static size_t
+virFirewallRestoreBatchSize(virFirewallRulePtr *rules,
+                            size_t nrules,
+                            bool ignoreErrors)
+{
+    const char *table;
+    ssize_t tableArg;
+    size_t n;
+
+    if (!virFirewallRuleCanRestore(rules[0], ignoreErrors))
+        return 1;
+
+    table = virFirewallRuleGetTable(rules[0], &tableArg);
+
+    for (n = 1; n < nrules; n++) {
+        if (rules[n]->layer != rules[0]->layer ||
+            !virFirewallRuleCanRestore(rules[n], ignoreErrors) ||
+            STRNEQ(virFirewallRuleGetTable(rules[n], &tableArg), table))
+            break;
+    }
+
+    return n;
+}
+
+
+/*
+ * Apply @nrules rules with a single *-restore run. Returns 0 on
+ * success, -1 if the rules were not applied. An error is reported
+ * only if the command could not be run at all.
+ */
+static int
+virFirewallApplyRulesRestore(virFirewallRulePtr *rules,
+                             size_t nrules)
+{
+    virFirewallLayer layer = rules[0]->layer;
+    const char *bin = virFirewallLayerRestoreCommandTypeToString(layer);
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virCommandPtr cmd = NULL;
+    char *input = NULL;
+    char *error = NULL;
+    ssize_t tableArg;
+    int status;
+    int ret = -1;
+    size_t i, j;
+
+    virBufferAsprintf(&buf, "*%s\n",
+                      virFirewallRuleGetTable(rules[0], &tableArg));
+
+    for (i = 0; i < nrules; i++) {
+        virFirewallRulePtr rule = rules[i];
+        char *str = virFirewallRuleToString(rule);
+        bool first = true;
+
+        VIR_INFO("Applying rule '%s'", NULLSTR(str));
+        VIR_FREE(str);
+
+        ignore_value(virFirewallRuleGetTable(rule, &tableArg));
+
+        for (j = rule->lockArg ? 1 : 0; j < rule->argsLen; j++) {
+            if (tableArg >= 0 &&
+                ((ssize_t) j == tableArg || (ssize_t) j == tableArg + 1))
+                continue;
+            if (!first)
+                virBufferAddChar(&buf, ' ');
+            virBufferAdd(&buf, rule->args[j], -1);
+            first = false;
+        }
+        virBufferAddChar(&buf, '\n');
+    }
+    virBufferAddLit(&buf, "COMMIT\n");
+
+    if (virBufferCheckError(&buf) < 0)
+        goto cleanup;
+    input = virBufferContentAndReset(&buf);
+
+    cmd = virCommandNewArgList(bin, "--noflush", NULL);
+    if ((layer == VIR_FIREWALL_LAYER_IPV4 && iptablesRestoreUseLock) ||
+        (layer == VIR_FIREWALL_LAYER_IPV6 && ip6tablesRestoreUseLock))
+        virCommandAddArg(cmd, "-w");
+
+    virCommandSetInputBuffer(cmd, input);
+    virCommandSetErrorBuffer(cmd, &error);
+
+    if (virCommandRun(cmd, &status) < 0)
+        goto cleanup;
+
+    if (status != 0) {
+        VIR_DEBUG("%s failed with status %d: %s", bin, status, NULLSTR(error));
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(input);
+    VIR_FREE(error);
+    virCommandFree(cmd);
+    return ret;
+}
+
+
 static int
 virFirewallApplyGroup(virFirewallPtr firewall,
                       size_t idx)
 {
     virFirewallGroupPtr group = firewall->groups[idx];
     bool ignoreErrors = (group->actionFlags & VIR_FIREWALL_TRANSACTION_IGNORE_ERRORS);
-    size_t i;
+    size_t i, j, n;
 
     VIR_INFO("Starting transaction for firewall=%p group=%p flags=%x",
              firewall, group, group->actionFlags);
     firewall->currentGroup = idx;
     group->addingRollback = false;
-    for (i = 0; i < group->naction; i++) {
-        if (virFirewallApplyRule(firewall,
-                                 group->action[i],
-                                 ignoreErrors) < 0)
-            return -1;
+    for (i = 0; i < group->naction; i += n) {
+        n = 1;
+        if (currentBackend == VIR_FIREWALL_BACKEND_RESTORE)
+            n = virFirewallRestoreBatchSize(group->action + i,
+                                            group->naction - i,
+                                            ignoreErrors);
+
+        if (n > 1) {
+            if (virFirewallApplyRulesRestore(group->action + i, n) == 0)
+                continue;
+
+            /* Nothing was applied. Go through the rules one by one
+             * to either get them in anyway, or find the culprit and
+             * report it the usual way */
+            VIR_DEBUG("Batch of %zu rules failed, applying them one by one", n);
+            virResetLastError();
+        }
+
+        for (j = i; j < i + n; j++) {
+            if (virFirewallApplyRule(firewall,
+                                     group->action[j],
+                                     ignoreErrors) < 0)
+                return -1;
+        }
     }
     return 0;
 }
@@ -36,6 +36,7 @@ typedef enum {
     VIR_FIREWALL_BACKEND_AUTOMATIC,
     VIR_FIREWALL_BACKEND_DIRECT,
     VIR_FIREWALL_BACKEND_FIREWALLD,
+    VIR_FIREWALL_BACKEND_RESTORE, /* direct, batched with *-restore */
 
     VIR_FIREWALL_BACKEND_LAST,
 } virFirewallBackend;
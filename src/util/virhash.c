@@ -39,6 +39,13 @@ VIR_LOG_INIT("util.hash");
 
 #define MAX_HASH_LEN 8
 
+/* Number of buckets moved to the grown array by each modification
+ * of a table while it is growing */
+#define REHASH_STEP 8
+
+/* Number of independently locked tables a virHashAtomic is made of */
+#define ATOMIC_STRIPES 16
+
 /* #define DEBUG_GROW */
 
 #define virHashIterationError(ret)                                      \
@@ -66,6 +73,12 @@ struct _virHashTable {
     uint32_t seed;
     size_t size;
     size_t nbElems;
+    /* While the table is growing, the previous array of buckets,
+     * whose entries are moved to the new one a few buckets at a time
+     * starting from @rehashidx. @oldsize is 0 otherwise. */
+    virHashEntryPtr *oldtable;
+    size_t oldsize;
+    size_t rehashidx;
     /* True iff we are iterating over hash entries. */
     bool iterating;
     /* Pointer to the current entry during iteration. */
@@ -77,17 +90,31 @@ struct _virHashTable {
     virHashKeyFree keyFree;
 };
 
-struct _virHashAtomic {
-    virObjectLockable parent;
+/*
+ * A hash table shared by several threads, striped over a few
+ * tables each with their own lock so that operations on keys
+ * belonging to different stripes don't contend
+ */
+typedef struct _virHashAtomicStripe virHashAtomicStripe;
+typedef virHashAtomicStripe *virHashAtomicStripePtr;
+struct _virHashAtomicStripe {
+    virMutex lock;
     virHashTablePtr hash;
 };
 
+struct _virHashAtomic {
+    virObject parent;
+    uint32_t seed;
+    size_t nstripes;
+    virHashAtomicStripe stripes[ATOMIC_STRIPES];
+};
+
 static virClassPtr virHashAtomicClass;
 static void virHashAtomicDispose(void *obj);
 
 static int virHashAtomicOnceInit(void)
 {
-    virHashAtomicClass = virClassNew(virClassForObjectLockable(),
+    virHashAtomicClass = virClassNew(virClassForObject(),
                                      "virHashAtomic",
                                      sizeof(virHashAtomic),
                                      virHashAtomicDispose);
@@ -129,11 +156,53 @@ virHashValueFree(void *value, const void *name ATTRIBUTE_UNUSED)
 }
 
 
+/* Buckets are numbered across the previous array of a growing
+ * table, then the current one */
 static size_t
-virHashComputeKey(const virHashTable *table, const void *name)
+virHashBucketCount(const virHashTable *table)
+{
+    return table->oldsize + table->size;
+}
+
+
+static virHashEntryPtr *
+virHashBucket(const virHashTable *table, size_t i)
 {
-    uint32_t value = table->keyCode(name, table->seed);
-    return value % table->size;
+    if (i < table->oldsize)
+        return table->oldtable + i;
+    return table->table + (i - table->oldsize);
+}
+
+
+/*
+ * virHashFindEntry:
+ *
+ * Returns the link pointing to the entry for @name in @table, which
+ * may still be in the previous array of buckets if the table is
+ * growing, or NULL if there is no such entry
+ */
+static virHashEntryPtr *
+virHashFindEntry(const virHashTable *table,
+                 uint32_t code,
+                 const void *name)
+{
+    virHashEntryPtr *nextptr;
+
+    if (table->oldsize) {
+        for (nextptr = table->oldtable + code % table->oldsize;
+             *nextptr; nextptr = &(*nextptr)->next) {
+            if (table->keyEqual((*nextptr)->name, name))
+                return nextptr;
+        }
+    }
+
+    for (nextptr = table->table + code % table->size;
+         *nextptr; nextptr = &(*nextptr)->next) {
+        if (table->keyEqual((*nextptr)->name, name))
+            return nextptr;
+    }
+
+    return NULL;
 }
 
 /**
@@ -202,23 +271,52 @@ virHashTablePtr virHashCreate(ssize_t size, virHashDataFree dataFree)
 }
 
 
+/**
+ * virHashAtomicNew:
+ * @size: the expected number of elements
+ * @dataFree: callback to free data
+ *
+ * Create a new virHashAtomicPtr, a hash table keyed by strings
+ * which can be used by several threads without further locking.
+ *
+ * Returns the newly created object, or NULL if an error occurred.
+ */
 virHashAtomicPtr
 virHashAtomicNew(ssize_t size,
                  virHashDataFree dataFree)
 {
     virHashAtomicPtr hash;
+    size_t i;
 
     if (virHashAtomicInitialize() < 0)
         return NULL;
 
-    if (!(hash = virObjectLockableNew(virHashAtomicClass)))
+    if (!(hash = virObjectNew(virHashAtomicClass)))
         return NULL;
 
-    if (!(hash->hash = virHashCreate(size, dataFree))) {
-        virObjectUnref(hash);
-        return NULL;
+    if (size <= 0)
+        size = 256;
+
+    hash->seed = virRandomBits(32);
+    for (i = 0; i < ATOMIC_STRIPES; i++) {
+        virHashAtomicStripePtr stripe = hash->stripes + i;
+
+        if (virMutexInit(&stripe->lock) < 0) {
+            virReportSystemError(errno, "%s", _("unable to init mutex"));
+            goto error;
+        }
+        hash->nstripes++;
+
+        if (!(stripe->hash = virHashCreate(size / ATOMIC_STRIPES + 1,
+                                           dataFree)))
+            goto error;
     }
+
     return hash;
+
+ error:
+    virObjectUnref(hash);
+    return NULL;
 }
 
 
@@ -226,8 +324,63 @@ static void
 virHashAtomicDispose(void *obj)
 {
     virHashAtomicPtr hash = obj;
+    size_t i;
+
+    for (i = 0; i < hash->nstripes; i++) {
+        virHashFree(hash->stripes[i].hash);
+        virMutexDestroy(&hash->stripes[i].lock);
+    }
+}
+
+
+/* Returns the stripe @name belongs to, locked */
+static virHashAtomicStripePtr
+virHashAtomicLockStripe(virHashAtomicPtr hash,
+                        const void *name)
+{
+    virHashAtomicStripePtr stripe;
+
+    stripe = hash->stripes + virHashStrCode(name, hash->seed) % ATOMIC_STRIPES;
+    virMutexLock(&stripe->lock);
+    return stripe;
+}
+
+
+/**
+ * virHashRehash:
+ * @table: the hash table
+ * @nbuckets: how many buckets to move at most
+ *
+ * Move the entries of the next @nbuckets buckets of a growing
+ * table to the new array, and drop the previous array once
+ * it is empty.
+ */
+static void
+virHashRehash(virHashTablePtr table, size_t nbuckets)
+{
+    while (nbuckets-- && table->rehashidx < table->oldsize) {
+        virHashEntryPtr iter = table->oldtable[table->rehashidx];
+
+        while (iter) {
+            virHashEntryPtr next = iter->next;
+            size_t key = table->keyCode(iter->name, table->seed) % table->size;
+
+            iter->next = table->table[key];
+            table->table[key] = iter;
+            iter = next;
+        }
+        table->oldtable[table->rehashidx++] = NULL;
+    }
 
-    virHashFree(hash->hash);
+    if (table->oldsize && table->rehashidx == table->oldsize) {
+#ifdef DEBUG_GROW
+        VIR_DEBUG("virHashRehash : from %zu to %zu done, %zu elems",
+                  table->oldsize, table->size, table->nbElems);
+#endif
+        VIR_FREE(table->oldtable);
+        table->oldsize = 0;
+        table->rehashidx = 0;
+    }
 }
 
 
@@ -236,19 +389,16 @@ virHashAtomicDispose(void *obj)
  * @table: the hash table
  * @size: the new size of the hash table
  *
- * resize the hash table
+ * resize the hash table. Entries are moved to the new buckets
+ * incrementally by the following modifications of the table, so
+ * that no single one of them has to rehash all of it.
  *
  * Returns 0 in case of success, -1 in case of failure
  */
 static int
 virHashGrow(virHashTablePtr table, size_t size)
 {
-    size_t oldsize, i;
-    virHashEntryPtr *oldtable;
-
-#ifdef DEBUG_GROW
-    size_t nbElem = 0;
-#endif
+    virHashEntryPtr *newtable;
 
     if (table == NULL)
         return -1;
@@ -256,40 +406,22 @@ virHashGrow(virHashTablePtr table, size_t size)
         return -1;
     if (size > 8 * 2048)
         return -1;
-
-    oldsize = table->size;
-    oldtable = table->table;
-    if (oldtable == NULL)
+    if (table->table == NULL || table->oldsize)
         return -1;
 
-    if (VIR_ALLOC_N(table->table, size) < 0) {
-        table->table = oldtable;
+    if (VIR_ALLOC_N(newtable, size) < 0)
         return -1;
-    }
-    table->size = size;
-
-    for (i = 0; i < oldsize; i++) {
-        virHashEntryPtr iter = oldtable[i];
-        while (iter) {
-            virHashEntryPtr next = iter->next;
-            size_t key = virHashComputeKey(table, iter->name);
-
-            iter->next = table->table[key];
-            table->table[key] = iter;
 
 #ifdef DEBUG_GROW
-            nbElem++;
+    VIR_DEBUG("virHashGrow : from %zu to %zu, %zu elems", table->size,
+              size, table->nbElems);
 #endif
-            iter = next;
-        }
-    }
 
-    VIR_FREE(oldtable);
-
-#ifdef DEBUG_GROW
-    VIR_DEBUG("virHashGrow : from %d to %d, %ld elems", oldsize,
-              size, nbElem);
-#endif
+    table->oldtable = table->table;
+    table->oldsize = table->size;
+    table->rehashidx = 0;
+    table->table = newtable;
+    table->size = size;
 
     return 0;
 }
@@ -309,8 +441,8 @@ virHashFree(virHashTablePtr table)
     if (table == NULL)
         return;
 
-    for (i = 0; i < table->size; i++) {
-        virHashEntryPtr iter = table->table[i];
+    for (i = 0; i < virHashBucketCount(table); i++) {
+        virHashEntryPtr iter = *virHashBucket(table, i);
         while (iter) {
             virHashEntryPtr next = iter->next;
 
@@ -323,6 +455,7 @@ virHashFree(virHashTablePtr table)
         }
     }
 
+    VIR_FREE(table->oldtable);
     VIR_FREE(table->table);
     VIR_FREE(table);
 }
@@ -333,7 +466,9 @@ virHashAddOrUpdateEntry(virHashTablePtr table, const void *name,
                         bool is_update)
 {
     size_t key, len = 0;
+    uint32_t code;
     virHashEntryPtr entry;
+    virHashEntryPtr *entryptr;
     void *new_name;
 
     if ((table == NULL) || (name == NULL))
@@ -342,23 +477,21 @@ virHashAddOrUpdateEntry(virHashTablePtr table, const void *name,
     if (table->iterating)
         virHashIterationError(-1);
 
-    key = virHashComputeKey(table, name);
+    code = table->keyCode(name, table->seed);
 
     /* Check for duplicate entry */
-    for (entry = table->table[key]; entry; entry = entry->next) {
-        if (table->keyEqual(entry->name, name)) {
-            if (is_update) {
-                if (table->dataFree)
-                    table->dataFree(entry->payload, entry->name);
-                entry->payload = userdata;
-                return 0;
-            } else {
-                virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                               _("Duplicate key"));
-                return -1;
-            }
+    if ((entryptr = virHashFindEntry(table, code, name))) {
+        entry = *entryptr;
+        if (is_update) {
+            if (table->dataFree)
+                table->dataFree(entry->payload, entry->name);
+            entry->payload = userdata;
+            return 0;
+        } else {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("Duplicate key"));
+            return -1;
         }
-        len++;
     }
 
     if (VIR_ALLOC(entry) < 0 || !(new_name = table->keyCopy(name))) {
@@ -366,6 +499,11 @@ virHashAddOrUpdateEntry(virHashTablePtr table, const void *name,
         return -1;
     }
 
+    key = code % table->size;
+    for (entryptr = table->table + key; *entryptr;
+         entryptr = &(*entryptr)->next)
+        len++;
+
     entry->name = new_name;
     entry->payload = userdata;
     entry->next = table->table[key];
@@ -373,7 +511,9 @@ virHashAddOrUpdateEntry(virHashTablePtr table, const void *name,
 
     table->nbElems++;
 
-    if (len > MAX_HASH_LEN)
+    if (table->oldsize)
+        virHashRehash(table, REHASH_STEP);
+    else if (len > MAX_HASH_LEN)
         virHashGrow(table, MAX_HASH_LEN * table->size);
 
     return 0;
@@ -420,11 +560,12 @@ virHashAtomicUpdate(virHashAtomicPtr table,
                     const void *name,
                     void *userdata)
 {
+    virHashAtomicStripePtr stripe;
     int ret;
 
-    virObjectLock(table);
-    ret = virHashAddOrUpdateEntry(table->hash, name, userdata, true);
-    virObjectUnlock(table);
+    stripe = virHashAtomicLockStripe(table, name);
+    ret = virHashAddOrUpdateEntry(stripe->hash, name, userdata, true);
+    virMutexUnlock(&stripe->lock);
 
     return ret;
 }
@@ -442,18 +583,43 @@ virHashAtomicUpdate(virHashAtomicPtr table,
 void *
 virHashLookup(const virHashTable *table, const void *name)
 {
-    size_t key;
-    virHashEntryPtr entry;
+    virHashEntryPtr *entryptr;
 
     if (!table || !name)
         return NULL;
 
-    key = virHashComputeKey(table, name);
-    for (entry = table->table[key]; entry; entry = entry->next) {
-        if (table->keyEqual(entry->name, name))
-            return entry->payload;
-    }
-    return NULL;
+    if (!(entryptr = virHashFindEntry(table,
+                                      table->keyCode(name, table->seed),
+                                      name)))
+        return NULL;
+
+    return (*entryptr)->payload;
+}
+
+
+/**
+ * virHashAtomicLookup:
+ * @table: the hash table
+ * @name: the name of the userdata
+ *
+ * Find the userdata specified by @name. Nothing prevents another
+ * thread from removing it right after, so this is only useful if
+ * the caller otherwise guarantees the userdata stays alive.
+ *
+ * Returns a pointer to the userdata
+ */
+void *
+virHashAtomicLookup(virHashAtomicPtr table,
+                    const void *name)
+{
+    virHashAtomicStripePtr stripe;
+    void *data;
+
+    stripe = virHashAtomicLockStripe(table, name);
+    data = virHashLookup(stripe->hash, name);
+    virMutexUnlock(&stripe->lock);
+
+    return data;
 }
 
 
@@ -483,11 +649,12 @@ void *
 virHashAtomicSteal(virHashAtomicPtr table,
                    const void *name)
 {
+    virHashAtomicStripePtr stripe;
     void *data;
 
-    virObjectLock(table);
-    data = virHashSteal(table->hash, name);
-    virObjectUnlock(table);
+    stripe = virHashAtomicLockStripe(table, name);
+    data = virHashSteal(stripe->hash, name);
+    virMutexUnlock(&stripe->lock);
 
     return data;
 }
@@ -548,25 +715,28 @@ virHashRemoveEntry(virHashTablePtr table, const void *name)
     if (table == NULL || name == NULL)
         return -1;
 
-    nextptr = table->table + virHashComputeKey(table, name);
-    for (entry = *nextptr; entry; entry = entry->next) {
-        if (table->keyEqual(entry->name, name)) {
-            if (table->iterating && table->current != entry)
-                virHashIterationError(-1);
+    if (!(nextptr = virHashFindEntry(table,
+                                     table->keyCode(name, table->seed),
+                                     name)))
+        return -1;
 
-            if (table->dataFree)
-                table->dataFree(entry->payload, entry->name);
-            if (table->keyFree)
-                table->keyFree(entry->name);
-            *nextptr = entry->next;
-            VIR_FREE(entry);
-            table->nbElems--;
-            return 0;
-        }
-        nextptr = &entry->next;
-    }
+    entry = *nextptr;
+    if (table->iterating && table->current != entry)
+        virHashIterationError(-1);
+
+    if (table->dataFree)
+        table->dataFree(entry->payload, entry->name);
+    if (table->keyFree)
+        table->keyFree(entry->name);
+    *nextptr = entry->next;
+    VIR_FREE(entry);
+    table->nbElems--;
 
-    return -1;
+    /* Entries must stay where they are while iterating */
+    if (table->oldsize && !table->iterating)
+        virHashRehash(table, REHASH_STEP);
+
+    return 0;
 }
 
 
@@ -598,8 +768,8 @@ virHashForEach(virHashTablePtr table, virHashIterator iter, void *data)
 
     table->iterating = true;
     table->current = NULL;
-    for (i = 0; i < table->size; i++) {
-        virHashEntryPtr entry = table->table[i];
+    for (i = 0; i < virHashBucketCount(table); i++) {
+        virHashEntryPtr entry = *virHashBucket(table, i);
         while (entry) {
             virHashEntryPtr next = entry->next;
             table->current = entry;
@@ -648,8 +818,8 @@ virHashRemoveSet(virHashTablePtr table,
 
     table->iterating = true;
     table->current = NULL;
-    for (i = 0; i < table->size; i++) {
-        virHashEntryPtr *nextptr = table->table + i;
+    for (i = 0; i < virHashBucketCount(table); i++) {
+        virHashEntryPtr *nextptr = virHashBucket(table, i);
 
         while (*nextptr) {
             virHashEntryPtr entry = *nextptr;
@@ -725,9 +895,9 @@ void *virHashSearch(const virHashTable *ctable,
 
     table->iterating = true;
     table->current = NULL;
-    for (i = 0; i < table->size; i++) {
+    for (i = 0; i < virHashBucketCount(table); i++) {
         virHashEntryPtr entry;
-        for (entry = table->table[i]; entry; entry = entry->next) {
+        for (entry = *virHashBucket(table, i); entry; entry = entry->next) {
             if (iter(entry->payload, entry->name, data)) {
                 table->iterating = false;
                 return entry->payload;
@@ -145,6 +145,8 @@ ssize_t virHashRemoveAll(virHashTablePtr table);
  * Retrieve the userdata.
  */
 void *virHashLookup(const virHashTable *table, const void *name);
+void *virHashAtomicLookup(virHashAtomicPtr table,
+                          const void *name);
 
 /*
  * Retrieve & remove the userdata.
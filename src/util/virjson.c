@@ -26,6 +26,7 @@
 #include "virjson.h"
 #include "viralloc.h"
 #include "virerror.h"
+#include "virhashcode.h"
 #include "virlog.h"
 #include "virstring.h"
 #include "virutil.h"
@@ -49,6 +50,12 @@
 /* XXX fixme */
 #define VIR_FROM_THIS VIR_FROM_NONE
 
+/* Objects with at least this many keys get a hash index of their
+ * keys as they are built. Below it, a linear scan is cheaper than
+ * hashing the key, and most objects, e.g. QMP events or the members
+ * of a schema entry, never get there */
+#define VIR_JSON_OBJECT_INDEX_MIN 16
+
 VIR_LOG_INIT("util.json");
 
 typedef struct _virJSONParserState virJSONParserState;
@@ -67,6 +74,15 @@ struct _virJSONParser {
     int wrap;
 };
 
+struct _virJSONStreamParser {
+#if WITH_YAJL
+    yajl_handle handle;
+    virJSONParser parser;
+#endif
+    size_t fed;     /* bytes of the pending value already parsed */
+    size_t maxlen;  /* refuse values longer than this, if non-zero */
+};
+
 
 /**
  * virJSONValueObjectAddVArgs:
@@ -350,6 +366,7 @@ virJSONValueFree(virJSONValuePtr value)
 
     switch ((virJSONType) value->type) {
     case VIR_JSON_TYPE_OBJECT:
+        virHashFree(value->data.object.index);
         for (i = 0; i < value->data.object.npairs; i++) {
             VIR_FREE(value->data.object.pairs[i].key);
             virJSONValueFree(value->data.object.pairs[i].value);
@@ -559,6 +576,126 @@ virJSONValueNewObject(void)
 }
 
 
+/* The index refers to the keys stored in the pairs themselves,
+ * which are never moved nor reallocated while part of the object */
+static uint32_t
+virJSONValueObjectIndexCode(const void *name, uint32_t seed)
+{
+    return virHashCodeGen(name, strlen(name), seed);
+}
+
+
+static bool
+virJSONValueObjectIndexEqual(const void *namea, const void *nameb)
+{
+    return STREQ(namea, nameb);
+}
+
+
+static void *
+virJSONValueObjectIndexCopy(const void *name)
+{
+    return (void *)name;
+}
+
+
+static void
+virJSONValueObjectIndexDrop(virJSONValuePtr object)
+{
+    virHashFree(object->data.object.index);
+    object->data.object.index = NULL;
+}
+
+
+/* Positions are stored off by one so that a missing key, for which
+ * virHashLookup returns NULL, can be told apart from the first pair */
+static int
+virJSONValueObjectIndexAdd(virJSONValuePtr object,
+                           size_t n)
+{
+    return virHashAddEntry(object->data.object.index,
+                           object->data.object.pairs[n].key,
+                           (void *)(uintptr_t)(n + 1));
+}
+
+
+static int
+virJSONValueObjectIndexBuild(virJSONValuePtr object)
+{
+    size_t i;
+
+    if (!(object->data.object.index =
+          virHashCreateFull(object->data.object.npairs, NULL,
+                            virJSONValueObjectIndexCode,
+                            virJSONValueObjectIndexEqual,
+                            virJSONValueObjectIndexCopy,
+                            NULL)))
+        return -1;
+
+    for (i = 0; i < object->data.object.npairs; i++) {
+        if (virJSONValueObjectIndexAdd(object, i) < 0) {
+            virJSONValueObjectIndexDrop(object);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns the position of @key in @object, or -1 if not present.
+ * Small objects are scanned linearly. Larger ones have an index,
+ * which is only ever changed along with the object itself, so that
+ * lookups don't modify the object and can run concurrently.
+ */
+static ssize_t
+virJSONValueObjectFind(virJSONValuePtr object,
+                       const char *key)
+{
+    size_t i;
+
+    if (object->data.object.index)
+        return (uintptr_t)virHashLookup(object->data.object.index, key) - 1;
+
+    /* Without an index, possibly due to OOM, fall back to a scan */
+    for (i = 0; i < object->data.object.npairs; i++) {
+        if (STREQ(object->data.object.pairs[i].key, key))
+            return i;
+    }
+
+    return -1;
+}
+
+
+static void
+virJSONValueObjectDeletePair(virJSONValuePtr object,
+                             size_t n)
+{
+    virHashTablePtr index = object->data.object.index;
+    size_t i;
+
+    if (index && virHashRemoveEntry(index, object->data.object.pairs[n].key) < 0)
+        virJSONValueObjectIndexDrop(object);
+
+    VIR_FREE(object->data.object.pairs[n].key);
+    VIR_DELETE_ELEMENT(object->data.object.pairs, n,
+                       object->data.object.npairs);
+
+    if (!(index = object->data.object.index))
+        return;
+
+    /* The following pairs moved down by one */
+    for (i = n; i < object->data.object.npairs; i++) {
+        if (virHashUpdateEntry(index, object->data.object.pairs[i].key,
+                               (void *)(uintptr_t)(i + 1)) < 0) {
+            virJSONValueObjectIndexDrop(object);
+            return;
+        }
+    }
+}
+
+
 int
 virJSONValueObjectAppend(virJSONValuePtr object,
                          const char *key,
@@ -585,6 +722,15 @@ virJSONValueObjectAppend(virJSONValuePtr object,
     object->data.object.pairs[object->data.object.npairs].value = value;
     object->data.object.npairs++;
 
+    /* Lookups fall back to a scan if the index can't be built */
+    if (object->data.object.index) {
+        if (virJSONValueObjectIndexAdd(object,
+                                       object->data.object.npairs - 1) < 0)
+            virJSONValueObjectIndexDrop(object);
+    } else if (object->data.object.npairs >= VIR_JSON_OBJECT_INDEX_MIN) {
+        ignore_value(virJSONValueObjectIndexBuild(object));
+    }
+
     return 0;
 }
 
@@ -738,17 +884,10 @@ int
 virJSONValueObjectHasKey(virJSONValuePtr object,
                          const char *key)
 {
-    size_t i;
-
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return -1;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key))
-            return 1;
-    }
-
-    return 0;
+    return virJSONValueObjectFind(object, key) >= 0;
 }
 
 
@@ -756,17 +895,15 @@ virJSONValuePtr
 virJSONValueObjectGet(virJSONValuePtr object,
                       const char *key)
 {
-    size_t i;
+    ssize_t i;
 
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return NULL;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key))
-            return object->data.object.pairs[i].value;
-    }
+    if ((i = virJSONValueObjectFind(object, key)) < 0)
+        return NULL;
 
-    return NULL;
+    return object->data.object.pairs[i].value;
 }
 
 
@@ -774,21 +911,17 @@ static virJSONValuePtr
 virJSONValueObjectSteal(virJSONValuePtr object,
                         const char *key)
 {
-    size_t i;
+    ssize_t i;
     virJSONValuePtr obj = NULL;
 
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return NULL;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key)) {
-            VIR_STEAL_PTR(obj, object->data.object.pairs[i].value);
-            VIR_FREE(object->data.object.pairs[i].key);
-            VIR_DELETE_ELEMENT(object->data.object.pairs, i,
-                               object->data.object.npairs);
-            break;
-        }
-    }
+    if ((i = virJSONValueObjectFind(object, key)) < 0)
+        return NULL;
+
+    VIR_STEAL_PTR(obj, object->data.object.pairs[i].value);
+    virJSONValueObjectDeletePair(object, i);
 
     return obj;
 }
@@ -856,7 +989,7 @@ virJSONValueObjectRemoveKey(virJSONValuePtr object,
                             const char *key,
                             virJSONValuePtr *value)
 {
-    size_t i;
+    ssize_t i;
 
     if (value)
         *value = NULL;
@@ -864,21 +997,16 @@ virJSONValueObjectRemoveKey(virJSONValuePtr object,
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return -1;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key)) {
-            if (value) {
-                *value = object->data.object.pairs[i].value;
-                object->data.object.pairs[i].value = NULL;
-            }
-            VIR_FREE(object->data.object.pairs[i].key);
-            virJSONValueFree(object->data.object.pairs[i].value);
-            VIR_DELETE_ELEMENT(object->data.object.pairs, i,
-                               object->data.object.npairs);
-            return 1;
-        }
-    }
+    if ((i = virJSONValueObjectFind(object, key)) < 0)
+        return 0;
 
-    return 0;
+    if (value) {
+        *value = object->data.object.pairs[i].value;
+        object->data.object.pairs[i].value = NULL;
+    }
+    virJSONValueFree(object->data.object.pairs[i].value);
+    virJSONValueObjectDeletePair(object, i);
+    return 1;
 }
 
 
@@ -1783,6 +1911,128 @@ virJSONValueFromString(const char *jsonstring)
 }
 
 
+static void
+virJSONStreamParserReset(virJSONStreamParserPtr stream)
+{
+    size_t i;
+
+    if (stream->handle) {
+        yajl_free(stream->handle);
+        stream->handle = NULL;
+    }
+
+    for (i = 0; i < stream->parser.nstate; i++)
+        VIR_FREE(stream->parser.state[i].key);
+    VIR_FREE(stream->parser.state);
+    stream->parser.nstate = 0;
+
+    virJSONValueFree(stream->parser.head);
+    stream->parser.head = NULL;
+
+    stream->fed = 0;
+}
+
+
+/**
+ * virJSONStreamParserFeed:
+ * @stream: the parser
+ * @data: data to parse
+ * @len: length of @data
+ * @value: filled with the parsed value
+ *
+ * Parse a stream of JSON objects or arrays as it is received, building
+ * each value while its text arrives rather than once it is complete.
+ * @data must start with any bytes passed to previous calls that were
+ * not returned as part of a value yet: they are not parsed again, and
+ * the caller keeps them around, e.g. to log the text of the value once
+ * complete. Parsing stops at the end of the first complete value.
+ *
+ * Returns the number of bytes of @data up to the end of the value and
+ * fills @value if a value was completed, 0 if more data is needed, or
+ * -1 on error, which includes a value exceeding the maximum length
+ * the parser was created with.
+ */
+ssize_t
+virJSONStreamParserFeed(virJSONStreamParserPtr stream,
+                        const char *data,
+                        size_t len,
+                        virJSONValuePtr *value)
+{
+    ssize_t ret;
+
+    *value = NULL;
+
+    while (stream->fed < len) {
+        const char *chunk = data + stream->fed;
+        size_t chunklen = 0;
+        bool closing = false;
+        int rc;
+
+        /* An object or array can only be complete right after a closing
+         * bracket, so hand over to yajl up to the next one and check the
+         * parser state there. This avoids relying on yajl reporting the
+         * number of bytes consumed, which yajl 1.0.7 does not */
+        while (chunklen < len - stream->fed && !closing) {
+            closing = chunk[chunklen] == '}' || chunk[chunklen] == ']';
+            chunklen++;
+        }
+
+        if (stream->maxlen && stream->fed + chunklen > stream->maxlen) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("JSON value exceeds maximum length %zu"),
+                           stream->maxlen);
+            goto error;
+        }
+
+        if (!stream->handle) {
+# ifdef WITH_YAJL2
+            stream->handle = yajl_alloc(&parserCallbacks, NULL,
+                                        &stream->parser);
+# else
+            yajl_parser_config cfg = { 0, 1 };
+            stream->handle = yajl_alloc(&parserCallbacks, &cfg, NULL,
+                                        &stream->parser);
+# endif
+            if (!stream->handle) {
+                virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("Unable to create JSON parser"));
+                goto error;
+            }
+        }
+
+        rc = yajl_parse(stream->handle, (const unsigned char *)chunk,
+                        chunklen);
+        if (!VIR_YAJL_STATUS_OK(rc)) {
+            unsigned char *errstr = yajl_get_error(stream->handle, 1,
+                                                   (const unsigned char *)chunk,
+                                                   chunklen);
+
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("cannot parse json %.*s: %s"),
+                           (int)(stream->fed + chunklen), data,
+                           (const char *)errstr);
+            yajl_free_error(stream->handle, errstr);
+            goto error;
+        }
+        stream->fed += chunklen;
+
+        if (closing && stream->parser.head && !stream->parser.nstate) {
+            ret = stream->fed;
+            *value = stream->parser.head;
+            stream->parser.head = NULL;
+            virJSONStreamParserReset(stream);
+            return ret;
+        }
+    }
+
+    return 0;
+
+ error:
+    virJSONStreamParserReset(stream);
+    return -1;
+}
+
+
 static int
 virJSONValueToStringOne(virJSONValuePtr object,
                         yajl_gen g)
@@ -1909,6 +2159,25 @@ virJSONValueFromString(const char *jsonstring ATTRIBUTE_UNUSED)
 }
 
 
+static void
+virJSONStreamParserReset(virJSONStreamParserPtr stream ATTRIBUTE_UNUSED)
+{
+}
+
+
+ssize_t
+virJSONStreamParserFeed(virJSONStreamParserPtr stream ATTRIBUTE_UNUSED,
+                        const char *data ATTRIBUTE_UNUSED,
+                        size_t len ATTRIBUTE_UNUSED,
+                        virJSONValuePtr *value)
+{
+    *value = NULL;
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("No JSON parser implementation is available"));
+    return -1;
+}
+
+
 char *
 virJSONValueToString(virJSONValuePtr object ATTRIBUTE_UNUSED,
                      bool pretty ATTRIBUTE_UNUSED)
@@ -1918,3 +2187,37 @@ virJSONValueToString(virJSONValuePtr object ATTRIBUTE_UNUSED,
     return NULL;
 }
 #endif
+
+
+/**
+ * virJSONStreamParserNew:
+ * @maxlen: maximum length of a single value, 0 for no limit
+ *
+ * Create a parser for a stream of JSON values, see
+ * virJSONStreamParserFeed.
+ *
+ * Returns the new parser, or NULL on error.
+ */
+virJSONStreamParserPtr
+virJSONStreamParserNew(size_t maxlen)
+{
+    virJSONStreamParserPtr stream;
+
+    if (VIR_ALLOC(stream) < 0)
+        return NULL;
+
+    stream->maxlen = maxlen;
+
+    return stream;
+}
+
+
+void
+virJSONStreamParserFree(virJSONStreamParserPtr stream)
+{
+    if (!stream)
+        return;
+
+    virJSONStreamParserReset(stream);
+    VIR_FREE(stream);
+}
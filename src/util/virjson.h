@@ -25,6 +25,7 @@
 # define __VIR_JSON_H_
 
 # include "internal.h"
+# include "virhash.h"
 # include "virbitmap.h"
 
 # include <stdarg.h>
@@ -60,6 +61,9 @@ struct _virJSONObjectPair {
 struct _virJSONObject {
     size_t npairs;
     virJSONObjectPairPtr pairs;
+    /* Position in @pairs indexed by key, built on demand for large
+     * objects, see virJSONValueObjectFind */
+    virHashTablePtr index;
 };
 
 struct _virJSONArray {
@@ -168,6 +172,17 @@ int virJSONValueObjectRemoveKey(virJSONValuePtr object, const char *key,
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
 
 virJSONValuePtr virJSONValueFromString(const char *jsonstring);
+
+typedef struct _virJSONStreamParser virJSONStreamParser;
+typedef virJSONStreamParser *virJSONStreamParserPtr;
+
+virJSONStreamParserPtr virJSONStreamParserNew(size_t maxlen);
+void virJSONStreamParserFree(virJSONStreamParserPtr stream);
+ssize_t virJSONStreamParserFeed(virJSONStreamParserPtr stream,
+                                const char *data,
+                                size_t len,
+                                virJSONValuePtr *value)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4);
 char *virJSONValueToString(virJSONValuePtr object,
                            bool pretty);
 
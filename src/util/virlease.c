@@ -24,13 +24,18 @@
 
 #include "virlease.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "virfile.h"
 #include "virstring.h"
 #include "virerror.h"
 #include "viralloc.h"
+#include "virobject.h"
 #include "virutil.h"
+#include "stat-time.h"
 
 #define VIR_FROM_THIS VIR_FROM_NETWORK
 
@@ -41,6 +46,14 @@
  */
 #define VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX (32 * 1024 * 1024)
 
+/**
+ * VIR_LEASE_JOURNAL_COMPACT_MIN:
+ *
+ * Macro providing the size the journal can grow to before it is
+ * folded into the leases file, however small that file is
+ */
+#define VIR_LEASE_JOURNAL_COMPACT_MIN (64 * 1024)
+
 
 /*
  * Use this when passing possibly-NULL strings to printf-a-likes.
@@ -49,6 +62,181 @@
 #define EMPTY_STR(s) ((s) ? (s) : "*")
 
 
+/*
+ * Rewriting the whole leases file on every DHCP event costs time
+ * proportional to the number of leases, for each of them. Instead,
+ * each event appends one line to a journal next to the leases file:
+ *
+ *   {"action":"add","ip-address":"...","lease":{...}}
+ *   {"action":"del","ip-address":"..."}
+ *
+ * Both drop any lease of the IP address first. The leases are those
+ * of the file with the journal replayed on top. Once the journal gets
+ * larger than the file, it is folded into it, so the work per event
+ * stays constant on average.
+ *
+ * Readers don't take the lock the leases helper holds while writing.
+ * They read the journal before the file, so they never miss records
+ * which were folded in meanwhile, and replaying a journal on the file
+ * it was folded into changes nothing. But if the journal was appended
+ * to, folded in and removed while they read, the file can hold later
+ * changes which the stale records would undo. So once they are done
+ * with the file, they check the journal is still there as they read
+ * it and start over if not.
+ */
+static char *
+virLeaseJournalPath(const char *custom_lease_file)
+{
+    char *journal;
+
+    ignore_value(virAsprintf(&journal, "%s.journal", custom_lease_file));
+    return journal;
+}
+
+
+static void
+virLeaseRemoveIP(virJSONValuePtr leases_array,
+                 const char *ip)
+{
+    size_t i = 0;
+
+    while (i < virJSONValueArraySize(leases_array)) {
+        virJSONValuePtr lease_tmp = virJSONValueArrayGet(leases_array, i);
+
+        if (STREQ_NULLABLE(virJSONValueObjectGetString(lease_tmp, "ip-address"),
+                           ip)) {
+            virJSONValueFree(virJSONValueArraySteal(leases_array, i));
+            continue;
+        }
+        i++;
+    }
+}
+
+
+static int
+virLeaseJournalApply(virJSONValuePtr leases_array,
+                     virJSONValuePtr record)
+{
+    const char *action = virJSONValueObjectGetString(record, "action");
+    const char *ip = virJSONValueObjectGetString(record, "ip-address");
+    virJSONValuePtr lease = NULL;
+
+    if (!action || !ip ||
+        (STRNEQ(action, "add") && STRNEQ(action, "del"))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("malformed lease journal record"));
+        return -1;
+    }
+
+    virLeaseRemoveIP(leases_array, ip);
+
+    if (STREQ(action, "del"))
+        return 0;
+
+    if (virJSONValueObjectRemoveKey(record, "lease", &lease) <= 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("malformed lease journal record"));
+        return -1;
+    }
+
+    if (virJSONValueArrayAppend(leases_array, lease) < 0) {
+        virJSONValueFree(lease);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Apply the records of the journal contents @buf to @leases_array.
+ * Returns the number of bytes used, which excludes a record still
+ * being written, or -1 on error. Records which can't be parsed, as
+ * left behind by a crash, are skipped. */
+static ssize_t
+virLeaseJournalReplay(virJSONValuePtr leases_array,
+                      char *buf,
+                      size_t len)
+{
+    size_t used = 0;
+    char *eol;
+
+    while (used < len && (eol = memchr(buf + used, '\n', len - used))) {
+        virJSONValuePtr record;
+
+        *eol = '\0';
+        if ((record = virJSONValueFromString(buf + used))) {
+            if (virLeaseJournalApply(leases_array, record) < 0) {
+                virJSONValueFree(record);
+                return -1;
+            }
+            virJSONValueFree(record);
+        } else {
+            virResetLastError();
+        }
+        used = eol - buf + 1;
+    }
+
+    return used;
+}
+
+
+/* Open the journal @path for reading, if there is one. Returns 0
+ * with @fd set to -1 if there isn't, -1 on error. */
+static int
+virLeaseJournalOpen(const char *path,
+                    int *fd)
+{
+    if ((*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT)
+            return 0;
+        virReportSystemError(errno, _("cannot open file '%s'"), path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Tell whether the journal @path is still the file open as @fd,
+ * @len bytes long as it was read. A journal which wasn't there is
+ * fine, the leases file can only hold more records since then. */
+static bool
+virLeaseJournalUnchanged(const char *path,
+                         int fd,
+                         size_t len)
+{
+    struct stat sb, jsb;
+
+    if (fd < 0)
+        return true;
+
+    if (fstat(fd, &sb) < 0 || stat(path, &jsb) < 0)
+        return false;
+
+    return sb.st_dev == jsb.st_dev && sb.st_ino == jsb.st_ino &&
+        jsb.st_size == (off_t) len;
+}
+
+
+/* Read @path, which doesn't have to exist */
+static int
+virLeaseReadFileIfExists(const char *path,
+                         char **buf)
+{
+    int len;
+
+    if ((len = virFileReadAllQuiet(path, VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX,
+                                   buf)) < 0) {
+        if (len == -ENOENT)
+            return 0;
+        virReportSystemError(-len, _("Failed to read file '%s'"), path);
+        return -1;
+    }
+
+    return len;
+}
+
+
 int
 virLeaseReadCustomLeaseFile(virJSONValuePtr leases_array_new,
                             const char *custom_lease_file,
@@ -56,15 +244,35 @@ virLeaseReadCustomLeaseFile(virJSONValuePtr leases_array_new,
                             char **server_duid)
 {
     char *lease_entries = NULL;
+    char *journal = NULL;
+    char *journal_entries = NULL;
     virJSONValuePtr leases_array = NULL;
     long long expirytime;
     int custom_lease_file_len = 0;
+    int journal_len = 0;
+    int journal_fd = -1;
     virJSONValuePtr lease_tmp = NULL;
     const char *ip_tmp = NULL;
     const char *server_duid_tmp = NULL;
     size_t i;
     int ret = -1;
 
+    if (!(journal = virLeaseJournalPath(custom_lease_file)))
+        goto cleanup;
+
+ retry:
+    /* The journal goes first, see above */
+    if (virLeaseJournalOpen(journal, &journal_fd) < 0)
+        goto cleanup;
+
+    if (journal_fd >= 0 &&
+        (journal_len = virFileReadLimFD(journal_fd,
+                                        VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX,
+                                        &journal_entries)) < 0) {
+        virReportSystemError(errno, _("Failed to read file '%s'"), journal);
+        goto cleanup;
+    }
+
     /* Read entire contents */
     if ((custom_lease_file_len = virFileReadAll(custom_lease_file,
                                                 VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX,
@@ -72,18 +280,24 @@ virLeaseReadCustomLeaseFile(virJSONValuePtr leases_array_new,
         goto cleanup;
     }
 
-    /* Check for previous leases */
-    if (custom_lease_file_len == 0) {
-        ret = 0;
-        goto cleanup;
+    if (!virLeaseJournalUnchanged(journal, journal_fd, journal_len)) {
+        VIR_FORCE_CLOSE(journal_fd);
+        VIR_FREE(journal_entries);
+        VIR_FREE(lease_entries);
+        journal_len = 0;
+        goto retry;
     }
 
-    if (!(leases_array = virJSONValueFromString(lease_entries))) {
+    /* Check for previous leases */
+    if (custom_lease_file_len == 0) {
+        if (!(leases_array = virJSONValueNewArray()))
+            goto cleanup;
+    } else if (!(leases_array = virJSONValueFromString(lease_entries))) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("invalid json in file: %s, rewriting it"),
                        custom_lease_file);
-        ret = 0;
-        goto cleanup;
+        if (!(leases_array = virJSONValueNewArray()))
+            goto cleanup;
     }
 
     if (!virJSONValueIsArray(leases_array)) {
@@ -92,6 +306,10 @@ virLeaseReadCustomLeaseFile(virJSONValuePtr leases_array_new,
         goto cleanup;
     }
 
+    if (journal_len > 0 &&
+        virLeaseJournalReplay(leases_array, journal_entries, journal_len) < 0)
+        goto cleanup;
+
     i = 0;
     while (i < virJSONValueArraySize(leases_array)) {
         if (!(lease_tmp = virJSONValueArrayGet(leases_array, i))) {
@@ -145,8 +363,228 @@ virLeaseReadCustomLeaseFile(virJSONValuePtr leases_array_new,
     ret = 0;
 
  cleanup:
+    VIR_FORCE_CLOSE(journal_fd);
     virJSONValueFree(leases_array);
     VIR_FREE(lease_entries);
+    VIR_FREE(journal_entries);
+    VIR_FREE(journal);
+    return ret;
+}
+
+
+static int
+virLeaseJournalAppend(const char *custom_lease_file,
+                      virJSONValuePtr record)
+{
+    char *journal = NULL;
+    char *str = NULL;
+    char *line = NULL;
+    struct stat sb;
+    char last;
+    int fd = -1;
+    int ret = -1;
+
+    if (!(journal = virLeaseJournalPath(custom_lease_file)))
+        goto cleanup;
+
+    if (!(str = virJSONValueToString(record, false)))
+        goto cleanup;
+
+    if ((fd = open(journal, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+                   0644)) < 0 ||
+        fstat(fd, &sb) < 0) {
+        virReportSystemError(errno, _("cannot open file '%s'"), journal);
+        goto cleanup;
+    }
+
+    /* Don't let a record cut short by a crash swallow this one */
+    if (sb.st_size > 0 &&
+        pread(fd, &last, 1, sb.st_size - 1) == 1 && last != '\n') {
+        if (virAsprintf(&line, "\n%s\n", str) < 0)
+            goto cleanup;
+    } else {
+        if (virAsprintf(&line, "%s\n", str) < 0)
+            goto cleanup;
+    }
+
+    if (safewrite(fd, line, strlen(line)) < 0 ||
+        fdatasync(fd) < 0) {
+        virReportSystemError(errno, _("cannot write data to file '%s'"),
+                             journal);
+        goto cleanup;
+    }
+
+    if (VIR_CLOSE(fd) < 0) {
+        virReportSystemError(errno, _("cannot save file '%s'"), journal);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+ cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(line);
+    VIR_FREE(str);
+    VIR_FREE(journal);
+    return ret;
+}
+
+
+/**
+ * virLeaseJournalAdd:
+ * @custom_lease_file: path to the leases file
+ * @lease: the new lease
+ *
+ * Record @lease in the journal of @custom_lease_file, replacing any
+ * lease of the same IP address.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virLeaseJournalAdd(const char *custom_lease_file,
+                   virJSONValuePtr lease)
+{
+    virJSONValuePtr record = NULL;
+    virJSONValuePtr copy = NULL;
+    const char *ip;
+    int ret = -1;
+
+    if (!(ip = virJSONValueObjectGetString(lease, "ip-address"))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("found lease without ip-address"));
+        return -1;
+    }
+
+    if (!(record = virJSONValueNewObject()) ||
+        virJSONValueObjectAppendString(record, "action", "add") < 0 ||
+        virJSONValueObjectAppendString(record, "ip-address", ip) < 0 ||
+        !(copy = virJSONValueCopy(lease)) ||
+        virJSONValueObjectAppend(record, "lease", copy) < 0)
+        goto cleanup;
+    copy = NULL;
+
+    ret = virLeaseJournalAppend(custom_lease_file, record);
+
+ cleanup:
+    virJSONValueFree(copy);
+    virJSONValueFree(record);
+    return ret;
+}
+
+
+/**
+ * virLeaseJournalDelete:
+ * @custom_lease_file: path to the leases file
+ * @ip: IP address of the lease
+ *
+ * Record the removal of the lease of @ip in the journal of
+ * @custom_lease_file.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virLeaseJournalDelete(const char *custom_lease_file,
+                      const char *ip)
+{
+    virJSONValuePtr record = NULL;
+    int ret = -1;
+
+    if (!(record = virJSONValueNewObject()) ||
+        virJSONValueObjectAppendString(record, "action", "del") < 0 ||
+        virJSONValueObjectAppendString(record, "ip-address", ip) < 0)
+        goto cleanup;
+
+    ret = virLeaseJournalAppend(custom_lease_file, record);
+
+ cleanup:
+    virJSONValueFree(record);
+    return ret;
+}
+
+
+/**
+ * virLeaseJournalRemove:
+ * @custom_lease_file: path to the leases file
+ *
+ * Remove the journal of @custom_lease_file, along with the file.
+ */
+void
+virLeaseJournalRemove(const char *custom_lease_file)
+{
+    char *journal;
+
+    if (!(journal = virLeaseJournalPath(custom_lease_file)))
+        return;
+
+    unlink(journal);
+    VIR_FREE(journal);
+}
+
+
+/**
+ * virLeaseJournalCompact:
+ * @custom_lease_file: path to the leases file
+ * @server_duid: DUID to give to IPv6 leases lacking one
+ *
+ * Fold the journal into @custom_lease_file once it got larger than
+ * it. Callers must make sure nobody else writes either file meanwhile.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virLeaseJournalCompact(const char *custom_lease_file,
+                       char **server_duid)
+{
+    char *journal = NULL;
+    char *leases_str = NULL;
+    virJSONValuePtr leases_array = NULL;
+    struct stat sb, jsb;
+    int ret = -1;
+
+    if (!(journal = virLeaseJournalPath(custom_lease_file)))
+        goto cleanup;
+
+    if (stat(journal, &jsb) < 0) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (stat(custom_lease_file, &sb) < 0)
+        sb.st_size = 0;
+
+    if (jsb.st_size < VIR_LEASE_JOURNAL_COMPACT_MIN ||
+        jsb.st_size < sb.st_size) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (!(leases_array = virJSONValueNewArray()))
+        goto cleanup;
+
+    if (virLeaseReadCustomLeaseFile(leases_array, custom_lease_file,
+                                    NULL, server_duid) < 0)
+        goto cleanup;
+
+    if (!(leases_str = virJSONValueToString(leases_array, true))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("empty json array"));
+        goto cleanup;
+    }
+
+    if (virFileRewriteStr(custom_lease_file, 0644, leases_str) < 0)
+        goto cleanup;
+
+    if (unlink(journal) < 0 && errno != ENOENT) {
+        virReportSystemError(errno, _("Unable to remove %s"), journal);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+ cleanup:
+    virJSONValueFree(leases_array);
+    VIR_FREE(leases_str);
+    VIR_FREE(journal);
     return ret;
 }
 
@@ -295,3 +733,254 @@ virLeaseNew(virJSONValuePtr *lease_ret,
     virJSONValueFree(lease_new);
     return ret;
 }
+
+
+/*
+ * virLeaseDB keeps the leases of one leases file in memory for a
+ * reader that asks for them repeatedly, such as the network driver.
+ * It reads the file again only when it was replaced, and otherwise
+ * only replays the part of the journal it hasn't seen yet.
+ */
+struct _virLeaseDB {
+    virObjectLockable parent;
+
+    char *file;
+    char *journal;
+
+    virJSONValuePtr leases;
+
+    /* The leases file @leases were read from */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    /* The journal replayed on top, and how much of it */
+    bool hasJournal;
+    dev_t journalDev;
+    ino_t journalIno;
+    off_t journalUsed;
+};
+
+static virClassPtr virLeaseDBClass;
+
+static void
+virLeaseDBDispose(void *obj)
+{
+    virLeaseDBPtr db = obj;
+
+    virJSONValueFree(db->leases);
+    VIR_FREE(db->file);
+    VIR_FREE(db->journal);
+}
+
+static int
+virLeaseDBOnceInit(void)
+{
+    if (!(virLeaseDBClass = virClassNew(virClassForObjectLockable(),
+                                        "virLeaseDB",
+                                        sizeof(virLeaseDB),
+                                        virLeaseDBDispose)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virLeaseDB)
+
+
+/**
+ * virLeaseDBNew:
+ * @custom_lease_file: path to the leases file
+ *
+ * Returns a new lease database for @custom_lease_file, with no
+ * leases until virLeaseDBRefresh is called, or NULL on error.
+ */
+virLeaseDBPtr
+virLeaseDBNew(const char *custom_lease_file)
+{
+    virLeaseDBPtr db;
+
+    if (virLeaseDBInitialize() < 0)
+        return NULL;
+
+    if (!(db = virObjectLockableNew(virLeaseDBClass)))
+        return NULL;
+
+    if (VIR_STRDUP(db->file, custom_lease_file) < 0 ||
+        !(db->journal = virLeaseJournalPath(custom_lease_file))) {
+        virObjectUnref(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+
+/* Read the leases of @db from scratch. Returns 0 on success, 1 if
+ * the journal changed meanwhile and has to be opened again, -1 on
+ * error. */
+static int
+virLeaseDBLoad(virLeaseDBPtr db,
+               int journal_fd,
+               const struct stat *sb)
+{
+    char *lease_entries = NULL;
+    char *journal_entries = NULL;
+    virJSONValuePtr leases_array = NULL;
+    int len = 0;
+    int journal_len = 0;
+    ssize_t used = 0;
+    int ret = -1;
+
+    if (journal_fd >= 0 &&
+        (journal_len = virFileReadLimFD(journal_fd,
+                                        VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX,
+                                        &journal_entries)) < 0) {
+        virReportSystemError(errno, _("Failed to read file '%s'"),
+                             db->journal);
+        goto cleanup;
+    }
+
+    if ((len = virLeaseReadFileIfExists(db->file, &lease_entries)) < 0)
+        goto cleanup;
+
+    if (!virLeaseJournalUnchanged(db->journal, journal_fd, journal_len)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (len == 0) {
+        if (!(leases_array = virJSONValueNewArray()))
+            goto cleanup;
+    } else if (!(leases_array = virJSONValueFromString(lease_entries)) ||
+               !virJSONValueIsArray(leases_array)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("invalid json in file: %s"), db->file);
+        goto cleanup;
+    }
+
+    if (journal_len > 0 &&
+        (used = virLeaseJournalReplay(leases_array, journal_entries,
+                                      journal_len)) < 0)
+        goto cleanup;
+
+    virJSONValueFree(db->leases);
+    db->leases = leases_array;
+    leases_array = NULL;
+    db->dev = sb->st_dev;
+    db->ino = sb->st_ino;
+    db->size = sb->st_size;
+    db->mtime = get_stat_mtime(sb);
+    db->journalUsed = used;
+    ret = 0;
+
+ cleanup:
+    virJSONValueFree(leases_array);
+    VIR_FREE(lease_entries);
+    VIR_FREE(journal_entries);
+    return ret;
+}
+
+
+/**
+ * virLeaseDBRefresh:
+ * @db: locked lease database
+ *
+ * Bring the leases of @db up to date with the leases file and
+ * its journal.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virLeaseDBRefresh(virLeaseDBPtr db)
+{
+    struct stat sb, jsb;
+    struct timespec mtime;
+    char *journal_entries = NULL;
+    int journal_fd = -1;
+    int journal_len;
+    ssize_t used;
+    int rc;
+    int ret = -1;
+
+ retry:
+    /* The journal goes first, see above */
+    if (virLeaseJournalOpen(db->journal, &journal_fd) < 0)
+        goto cleanup;
+
+    if (journal_fd >= 0 && fstat(journal_fd, &jsb) < 0) {
+        virReportSystemError(errno, _("cannot stat file '%s'"), db->journal);
+        goto cleanup;
+    }
+
+    if (stat(db->file, &sb) < 0) {
+        if (errno != ENOENT) {
+            virReportSystemError(errno, _("cannot stat file '%s'"), db->file);
+            goto cleanup;
+        }
+        memset(&sb, 0, sizeof(sb));
+    }
+    mtime = get_stat_mtime(&sb);
+
+    if (!db->leases ||
+        sb.st_dev != db->dev || sb.st_ino != db->ino ||
+        sb.st_size != db->size ||
+        mtime.tv_sec != db->mtime.tv_sec ||
+        mtime.tv_nsec != db->mtime.tv_nsec ||
+        (journal_fd >= 0) != db->hasJournal ||
+        (journal_fd >= 0 &&
+         (jsb.st_dev != db->journalDev || jsb.st_ino != db->journalIno ||
+          jsb.st_size < db->journalUsed))) {
+        if ((rc = virLeaseDBLoad(db, journal_fd, &sb)) < 0)
+            goto cleanup;
+        if (rc > 0) {
+            VIR_FORCE_CLOSE(journal_fd);
+            goto retry;
+        }
+    } else if (journal_fd >= 0 && jsb.st_size > db->journalUsed) {
+        if (lseek(journal_fd, db->journalUsed, SEEK_SET) < 0 ||
+            (journal_len = virFileReadLimFD(journal_fd,
+                                            VIR_NETWORK_DHCP_LEASE_FILE_SIZE_MAX,
+                                            &journal_entries)) < 0) {
+            virReportSystemError(errno, _("Failed to read file '%s'"),
+                                 db->journal);
+            goto cleanup;
+        }
+
+        if ((used = virLeaseJournalReplay(db->leases, journal_entries,
+                                          journal_len)) < 0) {
+            /* Half applied, start over next time */
+            virJSONValueFree(db->leases);
+            db->leases = NULL;
+            goto cleanup;
+        }
+        db->journalUsed += used;
+    }
+
+    db->hasJournal = journal_fd >= 0;
+    if (db->hasJournal) {
+        db->journalDev = jsb.st_dev;
+        db->journalIno = jsb.st_ino;
+    }
+    ret = 0;
+
+ cleanup:
+    VIR_FORCE_CLOSE(journal_fd);
+    VIR_FREE(journal_entries);
+    return ret;
+}
+
+
+/**
+ * virLeaseDBGetLeases:
+ * @db: locked lease database
+ *
+ * Returns the array of leases of @db, owned by @db and valid until
+ * it is unlocked.
+ */
+virJSONValuePtr
+virLeaseDBGetLeases(virLeaseDBPtr db)
+{
+    return db->leases;
+}
@@ -25,6 +25,9 @@
 
 # include "virjson.h"
 
+typedef struct _virLeaseDB virLeaseDB;
+typedef virLeaseDB *virLeaseDBPtr;
+
 int virLeaseReadCustomLeaseFile(virJSONValuePtr leases_array_new,
                                 const char *custom_lease_file,
                                 const char *ip_to_delete,
@@ -41,4 +44,21 @@ int virLeaseNew(virJSONValuePtr *lease_ret,
                 const char *hostname,
                 const char *iaid,
                 const char *server_duid);
+
+int virLeaseJournalAdd(const char *custom_lease_file,
+                       virJSONValuePtr lease);
+
+int virLeaseJournalDelete(const char *custom_lease_file,
+                          const char *ip);
+
+void virLeaseJournalRemove(const char *custom_lease_file);
+
+int virLeaseJournalCompact(const char *custom_lease_file,
+                           char **server_duid);
+
+virLeaseDBPtr virLeaseDBNew(const char *custom_lease_file);
+
+int virLeaseDBRefresh(virLeaseDBPtr db);
+
+virJSONValuePtr virLeaseDBGetLeases(virLeaseDBPtr db);
 #endif /* __VIR_LEASE_H */
@@ -48,6 +48,7 @@
 #include "virthread.h"
 #include "virfile.h"
 #include "virtime.h"
+#include "viratomic.h"
 #include "intprops.h"
 #include "virstring.h"
 #include "configmake.h"
@@ -117,6 +118,7 @@ static virLogPriority virLogDefaultPriority = VIR_LOG_DEFAULT;
 
 static void virLogResetFilters(void);
 static void virLogResetOutputs(void);
+static void virLogRecorderRingRelease(void *opaque);
 static void virLogOutputToFd(virLogSourcePtr src,
                              virLogPriority priority,
                              const char *filename,
@@ -130,6 +132,108 @@ static void virLogOutputToFd(virLogSourcePtr src,
                              void *data);
 
 
+/*
+ * Asynchronous mode: messages are formatted by the threads emitting
+ * them and queued in a bounded ring, from which a dedicated thread
+ * passes them to the outputs. Any number of threads fill the ring
+ * without taking a lock, while a single consumer drains it.
+ *
+ * Each slot carries a sequence number telling whose turn it is: a
+ * slot is free for the producer at position P when its sequence
+ * is P, and holds a record for the consumer once it is P + 1.
+ */
+typedef struct _virLogRecord virLogRecord;
+typedef virLogRecord *virLogRecordPtr;
+struct _virLogRecord {
+    virLogSourcePtr source;
+    virLogPriority priority;
+    const char *filename;
+    int linenr;
+    const char *funcname;
+    char timestamp[VIR_TIME_STRING_BUFLEN];
+    unsigned int flags;
+    char *str;
+    char *msg;
+};
+
+typedef struct _virLogRingSlot virLogRingSlot;
+typedef virLogRingSlot *virLogRingSlotPtr;
+struct _virLogRingSlot {
+    int seq;
+    virLogRecordPtr record;
+};
+
+/* Positions wrap around, and are compared by their difference */
+#define VIR_LOG_RING_POS(pos, n) ((int) ((unsigned int) (pos) + (n)))
+#define VIR_LOG_RING_DIFF(a, b) ((int) ((unsigned int) (a) - (unsigned int) (b)))
+
+/* How long the writer sleeps at most when it may have missed a wakeup */
+#define VIR_LOG_ASYNC_IDLE_MS 100
+
+/* How many records are written out per acquisition of virLogMutex */
+#define VIR_LOG_ASYNC_BATCH 256
+
+static virLogRingSlotPtr virLogRing;
+static unsigned int virLogRingMask;
+static int virLogRingTail; /* next position to fill */
+static int virLogRingHead; /* next position to drain, owned by the consumer */
+static int virLogRingConsumer; /* 1 while somebody drains the ring */
+static int virLogRingDropped;
+static unsigned int virLogRingReported; /* dropped messages already told about */
+
+static int virLogAsyncEnabled;
+static int virLogAsyncIdle;
+static int virLogAsyncQuit;
+static bool virLogAsyncRunning;
+static virThread virLogAsyncThread;
+static virMutex virLogAsyncLock;
+static virCond virLogAsyncCond;
+
+
+/*
+ * Flight recorder: debug messages of selected sources are kept in
+ * memory whatever the priority of the outputs, so that the last
+ * ones can be looked at once something went wrong. Each thread
+ * records into a ring of its own, so recording takes no lock.
+ * Readers copy entries and check their version did not change
+ * meanwhile, as it is odd while an entry is being written.
+ */
+#define VIR_LOG_RECORDER_MSG_LEN 256
+
+typedef struct _virLogRecorderEntry virLogRecorderEntry;
+typedef virLogRecorderEntry *virLogRecorderEntryPtr;
+struct _virLogRecorderEntry {
+    int version;
+    int seq;
+    unsigned long long when;
+    unsigned long long thread;
+    virLogPriority priority;
+    const char *funcname;
+    int linenr;
+    char msg[VIR_LOG_RECORDER_MSG_LEN];
+};
+
+typedef struct _virLogRecorderRing virLogRecorderRing;
+typedef virLogRecorderRing *virLogRecorderRingPtr;
+struct _virLogRecorderRing {
+    virLogRecorderRingPtr next;
+    bool inuse; /* protected by virLogRecorderLock */
+    unsigned long long thread;
+    size_t pos;
+    size_t nentries;
+    virLogRecorderEntryPtr entries;
+};
+
+/* Rings are never freed, but reused once their thread exited */
+static virLogRecorderRingPtr virLogRecorderRings;
+static virMutex virLogRecorderLock;
+static virThreadLocal virLogRecorderLocal;
+static char **virLogRecorderMatches; /* protected by virLogMutex */
+static size_t virLogRecorderSize;
+static int virLogRecorderSeq;
+static int virLogRecorderFlushed; /* last entry written to the outputs */
+
+
 /*
  * Logs accesses must be serialized though a mutex
  */
@@ -262,6 +366,14 @@ virLogOnceInit(void)
     if (virMutexInit(&virLogMutex) < 0)
         return -1;
 
+    if (virMutexInit(&virLogAsyncLock) < 0 ||
+        virCondInit(&virLogAsyncCond) < 0)
+        return -1;
+
+    if (virMutexInit(&virLogRecorderLock) < 0 ||
+        virThreadLocalInit(&virLogRecorderLocal, virLogRecorderRingRelease) < 0)
+        return -1;
+
     virLogLock();
     virLogDefaultPriority = VIR_LOG_DEFAULT;
 
@@ -295,6 +407,9 @@ virLogReset(void)
     virLogResetOutputs();
     virLogDefaultPriority = VIR_LOG_DEFAULT;
     virLogUnlock();
+
+    /* Forked children have no writer thread */
+    virAtomicIntSet(&virLogAsyncEnabled, 0);
     return 0;
 }
 
@@ -503,6 +618,13 @@ virLogSourceUpdate(virLogSourcePtr source)
             }
         }
 
+        for (i = 0; virLogRecorderMatches && virLogRecorderMatches[i]; i++) {
+            if (strstr(source->name, virLogRecorderMatches[i])) {
+                flags |= VIR_LOG_RECORD;
+                break;
+            }
+        }
+
         source->priority = priority;
         source->flags = flags;
         source->serial = virLogFiltersSerial;
@@ -542,6 +664,820 @@ virLogMessage(virLogSourcePtr source,
 }
 
 
+/*
+ * Push the message to the outputs defined, if none exist then
+ * use stderr. Must be called with virLogMutex held.
+ */
+static void
+virLogDispatch(virLogSourcePtr source,
+               virLogPriority priority,
+               const char *filename,
+               int linenr,
+               const char *funcname,
+               const char *timestamp,
+               virLogMetadataPtr metadata,
+               unsigned int filterflags,
+               const char *str,
+               const char *msg)
+{
+    static bool logInitMessageStderr = true;
+    size_t i;
+
+    for (i = 0; i < virLogNbOutputs; i++) {
+        if (priority >= virLogOutputs[i]->priority) {
+            if (virLogOutputs[i]->logInitMessage) {
+                const char *rawinitmsg;
+                char *hoststr = NULL;
+                char *initmsg = NULL;
+                if (virLogVersionString(&rawinitmsg, &initmsg) >= 0)
+                    virLogOutputs[i]->f(&virLogSelf, VIR_LOG_INFO,
+                                       __FILE__, __LINE__, __func__,
+                                       timestamp, NULL, 0, rawinitmsg, initmsg,
+                                       virLogOutputs[i]->data);
+                VIR_FREE(initmsg);
+                if (virLogHostnameString(&hoststr, &initmsg) >= 0)
+                    virLogOutputs[i]->f(&virLogSelf, VIR_LOG_INFO,
+                                       __FILE__, __LINE__, __func__,
+                                       timestamp, NULL, 0, hoststr, initmsg,
+                                       virLogOutputs[i]->data);
+                VIR_FREE(hoststr);
+                VIR_FREE(initmsg);
+                virLogOutputs[i]->logInitMessage = false;
+            }
+            virLogOutputs[i]->f(source, priority,
+                               filename, linenr, funcname,
+                               timestamp, metadata, filterflags,
+                               str, msg, virLogOutputs[i]->data);
+        }
+    }
+    if (virLogNbOutputs == 0) {
+        if (logInitMessageStderr) {
+            const char *rawinitmsg;
+            char *hoststr = NULL;
+            char *initmsg = NULL;
+            if (virLogVersionString(&rawinitmsg, &initmsg) >= 0)
+                virLogOutputToFd(&virLogSelf, VIR_LOG_INFO,
+                                 __FILE__, __LINE__, __func__,
+                                 timestamp, NULL, 0, rawinitmsg, initmsg,
+                                 (void *) STDERR_FILENO);
+            VIR_FREE(initmsg);
+            if (virLogHostnameString(&hoststr, &initmsg) >= 0)
+                virLogOutputToFd(&virLogSelf, VIR_LOG_INFO,
+                                 __FILE__, __LINE__, __func__,
+                                 timestamp, NULL, 0, hoststr, initmsg,
+                                 (void *) STDERR_FILENO);
+            VIR_FREE(hoststr);
+            VIR_FREE(initmsg);
+            logInitMessageStderr = false;
+        }
+        virLogOutputToFd(source, priority,
+                         filename, linenr, funcname,
+                         timestamp, metadata, filterflags,
+                         str, msg, (void *) STDERR_FILENO);
+    }
+}
+
+
+static void
+virLogRecordFree(virLogRecordPtr record)
+{
+    if (!record)
+        return;
+
+    VIR_FREE(record->str);
+    VIR_FREE(record->msg);
+    VIR_FREE(record);
+}
+
+
+/*
+ * Queue a formatted message for the writer thread, stealing @str
+ * and @msg. Returns 0 if the message was queued or dropped, -1 if
+ * it has to be written out synchronously by the caller.
+ */
+static int
+virLogRingPush(virLogSourcePtr source,
+               virLogPriority priority,
+               const char *filename,
+               int linenr,
+               const char *funcname,
+               const char *timestamp,
+               unsigned int filterflags,
+               char **str,
+               char **msg)
+{
+    virLogRecordPtr record;
+    int pos;
+
+    if (!virAtomicIntGet(&virLogAsyncEnabled))
+        return -1;
+
+    pos = virAtomicIntGet(&virLogRingTail);
+    for (;;) {
+        virLogRingSlotPtr slot = &virLogRing[(unsigned int) pos & virLogRingMask];
+        int diff = VIR_LOG_RING_DIFF(virAtomicIntGet(&slot->seq), pos);
+
+        if (diff == 0) {
+            if (virAtomicIntCompareExchange(&virLogRingTail, pos,
+                                            VIR_LOG_RING_POS(pos, 1)))
+                break;
+        } else if (diff < 0) {
+            /* Full: warnings and errors are too precious to lose */
+            if (priority >= VIR_LOG_WARN)
+                return -1;
+            virAtomicIntInc(&virLogRingDropped);
+            return 0;
+        }
+        pos = virAtomicIntGet(&virLogRingTail);
+    }
+
+    /* The slot at @pos is ours now, but the consumer does not
+     * look at it before its sequence is updated */
+    if (VIR_ALLOC_QUIET(record) < 0) {
+        virAtomicIntInc(&virLogRingDropped);
+    } else {
+        record->source = source;
+        record->priority = priority;
+        record->filename = filename;
+        record->linenr = linenr;
+        record->funcname = funcname;
+        ignore_value(virStrcpyStatic(record->timestamp, timestamp));
+        record->flags = filterflags;
+        record->str = *str;
+        record->msg = *msg;
+        *str = NULL;
+        *msg = NULL;
+    }
+
+    virLogRing[(unsigned int) pos & virLogRingMask].record = record;
+    virAtomicIntSet(&virLogRing[(unsigned int) pos & virLogRingMask].seq,
+                    VIR_LOG_RING_POS(pos, 1));
+
+    if (virAtomicIntGet(&virLogAsyncIdle))
+        virCondSignal(&virLogAsyncCond);
+
+    return 0;
+}
+
+
+/*
+ * Take the next record off the ring. Only the consumer may call
+ * this. Returns true if there was one, which may still be NULL
+ * if its allocation failed.
+ */
+static bool
+virLogRingPop(virLogRecordPtr *record)
+{
+    virLogRingSlotPtr slot = &virLogRing[(unsigned int) virLogRingHead &
+                                         virLogRingMask];
+
+    if (virAtomicIntGet(&slot->seq) != VIR_LOG_RING_POS(virLogRingHead, 1))
+        return false;
+
+    *record = slot->record;
+    slot->record = NULL;
+    virAtomicIntSet(&slot->seq,
+                    VIR_LOG_RING_POS(virLogRingHead, virLogRingMask + 1));
+    virLogRingHead = VIR_LOG_RING_POS(virLogRingHead, 1);
+
+    return true;
+}
+
+
+/*
+ * Write out everything that was queued so far. Returns the number
+ * of records processed, or 0 if somebody else is at it already.
+ */
+static size_t
+virLogRingDrain(void)
+{
+    virLogRecordPtr record;
+    unsigned int dropped;
+    size_t n = 0;
+    bool more = true;
+
+    if (!virLogRing ||
+        !virAtomicIntCompareExchange(&virLogRingConsumer, 0, 1))
+        return 0;
+
+    while (more) {
+        size_t batch = 0;
+
+        virLogLock();
+        while (batch < VIR_LOG_ASYNC_BATCH &&
+               (more = virLogRingPop(&record))) {
+            if (record)
+                virLogDispatch(record->source, record->priority,
+                               record->filename, record->linenr,
+                               record->funcname, record->timestamp,
+                               NULL, record->flags,
+                               record->str, record->msg);
+            virLogRecordFree(record);
+            batch++;
+        }
+
+        dropped = virAtomicIntGet(&virLogRingDropped);
+        if (dropped != virLogRingReported) {
+            char timestamp[VIR_TIME_STRING_BUFLEN];
+            char *str = NULL;
+            char *msg = NULL;
+
+            if (virTimeStringNowRaw(timestamp) < 0)
+                timestamp[0] = '\0';
+
+            if (virAsprintfQuiet(&str,
+                                 "Dropped %u log messages, the queue was full",
+                                 dropped - virLogRingReported) >= 0 &&
+                virLogFormatString(&msg, __LINE__, __func__,
+                                   VIR_LOG_WARN, str) >= 0)
+                virLogDispatch(&virLogSelf, VIR_LOG_WARN,
+                               __FILE__, __LINE__, __func__,
+                               timestamp, NULL, 0, str, msg);
+            VIR_FREE(str);
+            VIR_FREE(msg);
+            virLogRingReported = dropped;
+        }
+        virLogUnlock();
+
+        n += batch;
+    }
+
+    virAtomicIntSet(&virLogRingConsumer, 0);
+    return n;
+}
+
+
+static void
+virLogAsyncWorker(void *opaque ATTRIBUTE_UNUSED)
+{
+    for (;;) {
+        bool quit = virAtomicIntGet(&virLogAsyncQuit);
+        unsigned long long now;
+
+        /* Whatever was queued before we were told to quit
+         * still gets written out */
+        if (virLogRingDrain() > 0)
+            continue;
+        if (quit)
+            break;
+
+        virMutexLock(&virLogAsyncLock);
+        virAtomicIntSet(&virLogAsyncIdle, 1);
+        if (!virAtomicIntGet(&virLogAsyncQuit) &&
+            virAtomicIntGet(&virLogRing[(unsigned int) virLogRingHead &
+                                        virLogRingMask].seq) !=
+            VIR_LOG_RING_POS(virLogRingHead, 1) &&
+            virTimeMillisNow(&now) == 0)
+            ignore_value(virCondWaitUntil(&virLogAsyncCond, &virLogAsyncLock,
+                                          now + VIR_LOG_ASYNC_IDLE_MS));
+        virAtomicIntSet(&virLogAsyncIdle, 0);
+        virMutexUnlock(&virLogAsyncLock);
+    }
+}
+
+
+/**
+ * virLogSetAsync:
+ * @nrecords: how many messages may be queued, 0 to log synchronously
+ *
+ * Hand messages over to a dedicated thread which writes them to the
+ * outputs, instead of writing them from the thread emitting them.
+ * Once @nrecords messages are waiting, further debug and info
+ * messages are dropped and counted, while warnings and errors are
+ * written out synchronously. Messages with metadata or asking for a
+ * stack trace are always written synchronously.
+ *
+ * The queue is allocated only once, later calls may just start and
+ * stop the thread. Disabling the asynchronous mode writes out all
+ * pending messages.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+virLogSetAsync(size_t nrecords)
+{
+    size_t i;
+
+    if (virLogInitialize() < 0)
+        return -1;
+
+    if (nrecords == 0) {
+        if (!virLogAsyncRunning)
+            return 0;
+
+        virAtomicIntSet(&virLogAsyncEnabled, 0);
+        virMutexLock(&virLogAsyncLock);
+        virAtomicIntSet(&virLogAsyncQuit, 1);
+        virCondSignal(&virLogAsyncCond);
+        virMutexUnlock(&virLogAsyncLock);
+        virThreadJoin(&virLogAsyncThread);
+        virLogAsyncRunning = false;
+
+        /* Messages queued while the thread was exiting */
+        virLogFlush();
+        return 0;
+    }
+
+    if (virLogAsyncRunning) {
+        virAtomicIntSet(&virLogAsyncEnabled, 1);
+        return 0;
+    }
+
+    if (!virLogRing) {
+        size_t nslots = 1;
+
+        while (nslots < nrecords && nslots < INT_MAX / 4)
+            nslots <<= 1;
+
+        if (VIR_ALLOC_N_QUIET(virLogRing, nslots) < 0) {
+            virReportOOMError();
+            return -1;
+        }
+
+        for (i = 0; i < nslots; i++)
+            virLogRing[i].seq = i;
+        virLogRingMask = nslots - 1;
+    }
+
+    virAtomicIntSet(&virLogAsyncQuit, 0);
+    if (virThreadCreate(&virLogAsyncThread, true,
+                        virLogAsyncWorker, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create logging thread"));
+        return -1;
+    }
+    virLogAsyncRunning = true;
+    virAtomicIntSet(&virLogAsyncEnabled, 1);
+
+    return 0;
+}
+
+
+/**
+ * virLogFlush:
+ *
+ * Write out the messages queued in asynchronous mode from the
+ * calling thread. It does nothing if the writer thread is busy with
+ * them already. Outputs are written under virLogMutex and messages
+ * get formatted on the heap, so signal handlers must use
+ * virLogFlushFromSignal instead.
+ */
+void
+virLogFlush(void)
+{
+    while (virLogRingDrain() > 0)
+        ;
+}
+
+
+/*
+ * Write @str to @fd with nothing but write(2), for use from a signal
+ * handler.
+ */
+static void
+virLogWriteRaw(int fd, const char *str)
+{
+    size_t len = strlen(str);
+
+    while (len > 0) {
+        ssize_t n = write(fd, str, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        str += n;
+        len -= n;
+    }
+}
+
+
+/**
+ * virLogFlushFromSignal:
+ *
+ * Write the messages queued in asynchronous mode to the file and
+ * stderr outputs, when the process is about to die from a fatal
+ * signal. Unlike virLogFlush, this takes no lock and allocates
+ * nothing, so it is safe to call from a signal handler: the records
+ * are already formatted and are written out as they are, with
+ * write(2). They are left in the ring, and other outputs, such as
+ * syslog or journald, do not get them.
+ */
+void
+virLogFlushFromSignal(void)
+{
+    int errnosave = errno;
+    int pos;
+    size_t i;
+
+    if (!virLogRing)
+        return;
+
+    pos = virLogRingHead;
+    for (;;) {
+        virLogRingSlotPtr slot = &virLogRing[(unsigned int) pos &
+                                             virLogRingMask];
+        virLogRecordPtr record;
+
+        if (virAtomicIntGet(&slot->seq) != VIR_LOG_RING_POS(pos, 1))
+            break;
+
+        if ((record = slot->record) && record->msg) {
+            for (i = 0; i < virLogNbOutputs; i++) {
+                int fd;
+
+                if (virLogOutputs[i]->f != virLogOutputToFd ||
+                    record->priority < virLogOutputs[i]->priority)
+                    continue;
+
+                fd = (intptr_t) virLogOutputs[i]->data;
+                if (fd < 0)
+                    continue;
+
+                virLogWriteRaw(fd, record->timestamp);
+                virLogWriteRaw(fd, ": ");
+                virLogWriteRaw(fd, record->msg);
+            }
+            if (virLogNbOutputs == 0) {
+                virLogWriteRaw(STDERR_FILENO, record->timestamp);
+                virLogWriteRaw(STDERR_FILENO, ": ");
+                virLogWriteRaw(STDERR_FILENO, record->msg);
+            }
+        }
+
+        pos = VIR_LOG_RING_POS(pos, 1);
+        /* The ring may be refilled behind us, stop after one round */
+        if (pos == VIR_LOG_RING_POS(virLogRingHead, virLogRingMask + 1))
+            break;
+    }
+
+    errno = errnosave;
+}
+
+
+/**
+ * virLogGetDropped:
+ *
+ * Returns the number of messages dropped because the queue of the
+ * asynchronous mode was full
+ */
+unsigned int
+virLogGetDropped(void)
+{
+    return virAtomicIntGet(&virLogRingDropped);
+}
+
+
+static void
+virLogRecorderRingRelease(void *opaque)
+{
+    virLogRecorderRingPtr ring = opaque;
+
+    virMutexLock(&virLogRecorderLock);
+    ring->inuse = false;
+    virMutexUnlock(&virLogRecorderLock);
+}
+
+
+/*
+ * Get a ring for the calling thread, reusing one left over by
+ * a thread which exited if possible. Nothing in here may log, as
+ * it would end up here again.
+ */
+static virLogRecorderRingPtr
+virLogRecorderRingGet(void)
+{
+    virLogRecorderRingPtr ring;
+    size_t nentries = virLogRecorderSize;
+
+    if (nentries == 0)
+        return NULL;
+
+    virMutexLock(&virLogRecorderLock);
+
+    for (ring = virLogRecorderRings; ring; ring = ring->next) {
+        if (!ring->inuse && ring->nentries == nentries)
+            break;
+    }
+
+    if (!ring) {
+        if (VIR_ALLOC_QUIET(ring) < 0 ||
+            VIR_ALLOC_N_QUIET(ring->entries, nentries) < 0) {
+            VIR_FREE(ring);
+            goto cleanup;
+        }
+        ring->nentries = nentries;
+        ring->next = virLogRecorderRings;
+        virLogRecorderRings = ring;
+    }
+
+    if (virThreadLocalSet(&virLogRecorderLocal, ring) < 0) {
+        ring = NULL;
+        goto cleanup;
+    }
+
+    ring->inuse = true;
+    ring->thread = virThreadSelfID();
+
+ cleanup:
+    virMutexUnlock(&virLogRecorderLock);
+    return ring;
+}
+
+
+static void
+virLogRecorderAdd(virLogPriority priority,
+                  const char *funcname,
+                  int linenr,
+                  const char *fmt,
+                  va_list vargs)
+{
+    virLogRecorderRingPtr ring = virThreadLocalGet(&virLogRecorderLocal);
+    virLogRecorderEntryPtr entry;
+
+    if (!ring && !(ring = virLogRecorderRingGet()))
+        return;
+
+    entry = &ring->entries[ring->pos];
+    ring->pos = (ring->pos + 1) % ring->nentries;
+
+    virAtomicIntInc(&entry->version);
+    entry->seq = virAtomicIntInc(&virLogRecorderSeq);
+    if (virTimeMillisNowRaw(&entry->when) < 0)
+        entry->when = 0;
+    entry->thread = ring->thread;
+    entry->priority = priority;
+    entry->funcname = funcname;
+    entry->linenr = linenr;
+    if (vsnprintf(entry->msg, sizeof(entry->msg), fmt, vargs) < 0)
+        entry->msg[0] = '\0';
+    virAtomicIntInc(&entry->version);
+}
+
+
+static int
+virLogRecorderEntryCompare(const void *a,
+                           const void *b)
+{
+    const virLogRecorderEntry *ea = a;
+    const virLogRecorderEntry *eb = b;
+
+    /* Sequence numbers wrap around, but the entries are all
+     * recent enough for their difference to make sense */
+    return VIR_LOG_RING_DIFF(ea->seq, eb->seq);
+}
+
+
+/*
+ * Copy the recorded entries which are more recent than @after,
+ * or all of them if it is NULL, oldest first. Returns 0 on success,
+ * or -1 on error.
+ */
+static int
+virLogRecorderCollect(const int *after,
+                      virLogRecorderEntryPtr *entries,
+                      size_t *nentries)
+{
+    virLogRecorderRingPtr ring;
+    virLogRecorderEntryPtr ret = NULL;
+    size_t nret = 0;
+    size_t total = 0;
+    int latest = virAtomicIntGet(&virLogRecorderSeq);
+    size_t i;
+
+    virMutexLock(&virLogRecorderLock);
+
+    for (ring = virLogRecorderRings; ring; ring = ring->next)
+        total += ring->nentries;
+
+    if (total && VIR_ALLOC_N_QUIET(ret, total) < 0) {
+        virMutexUnlock(&virLogRecorderLock);
+        return -1;
+    }
+
+    for (ring = virLogRecorderRings; ring; ring = ring->next) {
+        for (i = 0; i < ring->nentries; i++) {
+            virLogRecorderEntryPtr entry = &ring->entries[i];
+            int version = virAtomicIntGet(&entry->version);
+
+            if (version == 0 || version % 2)
+                continue;
+
+            memcpy(&ret[nret], entry, sizeof(*entry));
+            if (virAtomicIntGet(&entry->version) != version)
+                continue;
+
+            /* Already seen, or recorded while we were copying */
+            if ((after && VIR_LOG_RING_DIFF(ret[nret].seq, *after) <= 0) ||
+                VIR_LOG_RING_DIFF(ret[nret].seq, latest) > 0)
+                continue;
+
+            nret++;
+        }
+    }
+
+    virMutexUnlock(&virLogRecorderLock);
+
+    qsort(ret, nret, sizeof(*ret), virLogRecorderEntryCompare);
+    *entries = ret;
+    *nentries = nret;
+    return 0;
+}
+
+
+static char *
+virLogRecorderFormat(virLogRecorderEntryPtr entry)
+{
+    char timestamp[VIR_TIME_STRING_BUFLEN];
+    char *str;
+
+    if (virTimeStringThenRaw(entry->when, timestamp) < 0)
+        timestamp[0] = '\0';
+
+    if (virAsprintfQuiet(&str, "%s: %llu: %s : %s:%d : %s",
+                         timestamp, entry->thread,
+                         virLogPriorityString(entry->priority),
+                         NULLSTR(entry->funcname), entry->linenr,
+                         entry->msg) < 0)
+        return NULL;
+
+    return str;
+}
+
+
+/**
+ * virLogSetRecorder:
+ * @matches: space separated list of log source names to record
+ * @nentries: how many messages are kept per thread
+ *
+ * Keep the last @nentries messages of any priority each thread
+ * emitted from the sources whose name contains one of @matches,
+ * eg. "qemu rpc util.json", regardless of the filters in effect.
+ * Recording is turned off if @matches is NULL or empty, or if
+ * @nentries is 0. Messages already recorded are kept, and threads
+ * which recorded messages before keep the size of their ring.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+virLogSetRecorder(const char *matches,
+                  size_t nentries)
+{
+    char **tokens = NULL;
+
+    if (virLogInitialize() < 0)
+        return -1;
+
+    if (matches && *matches && nentries > 0 &&
+        !(tokens = virStringSplit(matches, " ", 0)))
+        return -1;
+
+    if (!tokens || !tokens[0])
+        nentries = 0;
+
+    virLogLock();
+    virStringListFree(virLogRecorderMatches);
+    virLogRecorderMatches = tokens;
+    virLogRecorderSize = nentries;
+    virLogFiltersSerial++;
+    virLogUnlock();
+
+    return 0;
+}
+
+
+/**
+ * virLogGetRecorded:
+ * @maxlen: maximum length of the result
+ *
+ * Format the messages kept by the flight recorder, oldest first.
+ * If they do not fit in @maxlen bytes, the oldest are left out.
+ *
+ * Returns the number of messages in @records, or -1 on error
+ */
+int
+virLogGetRecorded(char **records,
+                  size_t maxlen)
+{
+    virLogRecorderEntryPtr entries = NULL;
+    char **lines = NULL;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t nentries;
+    size_t len = 0;
+    size_t first;
+    size_t i;
+    int ret = -1;
+
+    *records = NULL;
+
+    if (virLogInitialize() < 0)
+        return -1;
+
+    if (virLogRecorderCollect(NULL, &entries, &nentries) < 0 ||
+        VIR_ALLOC_N(lines, nentries + 1) < 0)
+        goto cleanup;
+
+    for (i = 0; i < nentries; i++) {
+        if (!(lines[i] = virLogRecorderFormat(&entries[i]))) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    /* Keep the most recent ones */
+    for (first = nentries; first > 0; first--) {
+        size_t linelen = strlen(lines[first - 1]) + 1;
+
+        if (len + linelen >= maxlen)
+            break;
+        len += linelen;
+    }
+
+    for (i = first; i < nentries; i++)
+        virBufferAsprintf(&buf, "%s\n", lines[i]);
+
+    if (virBufferCheckError(&buf) < 0)
+        goto cleanup;
+
+    if (!(*records = virBufferContentAndReset(&buf)) &&
+        VIR_STRDUP(*records, "") < 0)
+        goto cleanup;
+
+    ret = nentries - first;
+
+ cleanup:
+    virBufferFreeAndReset(&buf);
+    virStringListFree(lines);
+    VIR_FREE(entries);
+    return ret;
+}
+
+
+/**
+ * virLogFlushRecorder:
+ * @reason: why the messages are being written out
+ *
+ * Write the messages kept by the flight recorder to the outputs,
+ * eg. once a job failed. Messages written by a previous call are
+ * skipped. They are passed to the outputs as warnings, so that
+ * they are not filtered out, with their own priority within the
+ * text.
+ */
+void
+virLogFlushRecorder(const char *reason)
+{
+    virLogRecorderEntryPtr entries = NULL;
+    char timestamp[VIR_TIME_STRING_BUFLEN];
+    size_t nentries;
+    int latest;
+    size_t i;
+
+    if (virLogInitialize() < 0 || !virLogRecorderRings)
+        return;
+
+    virLogLock();
+
+    latest = virAtomicIntGet(&virLogRecorderSeq);
+    if (VIR_LOG_RING_DIFF(latest, virLogRecorderFlushed) <= 0 ||
+        virLogRecorderCollect(&virLogRecorderFlushed,
+                              &entries, &nentries) < 0 ||
+        nentries == 0)
+        goto cleanup;
+
+    if (virTimeStringNowRaw(timestamp) < 0)
+        timestamp[0] = '\0';
+
+    for (i = 0; i <= nentries + 1; i++) {
+        char *str = NULL;
+        char *msg = NULL;
+
+        if (i == 0)
+            ignore_value(virAsprintfQuiet(&str, "Flight recorder dump (%s):",
+                                          reason));
+        else if (i <= nentries)
+            str = virLogRecorderFormat(&entries[i - 1]);
+        else
+            ignore_value(VIR_STRDUP_QUIET(str, "End of flight recorder dump"));
+
+        if (str &&
+            virLogFormatString(&msg, __LINE__, __func__,
+                               VIR_LOG_WARN, str) >= 0)
+            virLogDispatch(&virLogSelf, VIR_LOG_WARN,
+                           __FILE__, __LINE__, __func__,
+                           timestamp, NULL, 0, str, msg);
+        VIR_FREE(str);
+        VIR_FREE(msg);
+    }
+
+    virLogRecorderFlushed = entries[nentries - 1].seq;
+
+ cleanup:
+    virLogUnlock();
+    VIR_FREE(entries);
+}
+
+
 /**
  * virLogVMessage:
  * @source: where is that message coming from
@@ -566,12 +1502,10 @@ virLogVMessage(virLogSourcePtr source,
                const char *fmt,
                va_list vargs)
 {
-    static bool logInitMessageStderr = true;
     char *str = NULL;
     char *msg = NULL;
     char timestamp[VIR_TIME_STRING_BUFLEN];
     int ret;
-    size_t i;
     int saved_errno = errno;
     unsigned int filterflags = 0;
 
@@ -591,9 +1525,19 @@ virLogVMessage(virLogSourcePtr source,
      */
     if (source->serial < virLogFiltersSerial)
         virLogSourceUpdate(source);
+    filterflags = source->flags;
+
+    if (filterflags & VIR_LOG_RECORD) {
+        va_list ap;
+
+        va_copy(ap, vargs);
+        virLogRecorderAdd(priority, funcname, linenr, fmt, ap);
+        va_end(ap);
+        filterflags &= ~VIR_LOG_RECORD;
+    }
+
     if (priority < source->priority)
         goto cleanup;
-    filterflags = source->flags;
 
     /*
      * serialize the error message, add level and timestamp
@@ -608,64 +1552,16 @@ virLogVMessage(virLogSourcePtr source,
     if (virTimeStringNowRaw(timestamp) < 0)
         timestamp[0] = '\0';
 
-    virLogLock();
+    /* Metadata lives on the caller's stack, and stack
+     * traces are of the caller's thread */
+    if (!metadata && !(filterflags & VIR_LOG_STACK_TRACE) &&
+        virLogRingPush(source, priority, filename, linenr, funcname,
+                       timestamp, filterflags, &str, &msg) == 0)
+        goto cleanup;
 
-    /*
-     * Push the message to the outputs defined, if none exist then
-     * use stderr.
-     */
-    for (i = 0; i < virLogNbOutputs; i++) {
-        if (priority >= virLogOutputs[i]->priority) {
-            if (virLogOutputs[i]->logInitMessage) {
-                const char *rawinitmsg;
-                char *hoststr = NULL;
-                char *initmsg = NULL;
-                if (virLogVersionString(&rawinitmsg, &initmsg) >= 0)
-                    virLogOutputs[i]->f(&virLogSelf, VIR_LOG_INFO,
-                                       __FILE__, __LINE__, __func__,
-                                       timestamp, NULL, 0, rawinitmsg, initmsg,
-                                       virLogOutputs[i]->data);
-                VIR_FREE(initmsg);
-                if (virLogHostnameString(&hoststr, &initmsg) >= 0)
-                    virLogOutputs[i]->f(&virLogSelf, VIR_LOG_INFO,
-                                       __FILE__, __LINE__, __func__,
-                                       timestamp, NULL, 0, hoststr, initmsg,
-                                       virLogOutputs[i]->data);
-                VIR_FREE(hoststr);
-                VIR_FREE(initmsg);
-                virLogOutputs[i]->logInitMessage = false;
-            }
-            virLogOutputs[i]->f(source, priority,
-                               filename, linenr, funcname,
-                               timestamp, metadata, filterflags,
-                               str, msg, virLogOutputs[i]->data);
-        }
-    }
-    if (virLogNbOutputs == 0) {
-        if (logInitMessageStderr) {
-            const char *rawinitmsg;
-            char *hoststr = NULL;
-            char *initmsg = NULL;
-            if (virLogVersionString(&rawinitmsg, &initmsg) >= 0)
-                virLogOutputToFd(&virLogSelf, VIR_LOG_INFO,
-                                 __FILE__, __LINE__, __func__,
-                                 timestamp, NULL, 0, rawinitmsg, initmsg,
-                                 (void *) STDERR_FILENO);
-            VIR_FREE(initmsg);
-            if (virLogHostnameString(&hoststr, &initmsg) >= 0)
-                virLogOutputToFd(&virLogSelf, VIR_LOG_INFO,
-                                 __FILE__, __LINE__, __func__,
-                                 timestamp, NULL, 0, hoststr, initmsg,
-                                 (void *) STDERR_FILENO);
-            VIR_FREE(hoststr);
-            VIR_FREE(initmsg);
-            logInitMessageStderr = false;
-        }
-        virLogOutputToFd(source, priority,
-                         filename, linenr, funcname,
-                         timestamp, metadata, filterflags,
-                         str, msg, (void *) STDERR_FILENO);
-    }
+    virLogLock();
+    virLogDispatch(source, priority, filename, linenr, funcname,
+                   timestamp, metadata, filterflags, str, msg);
     virLogUnlock();
 
  cleanup:
@@ -174,6 +174,7 @@ typedef void (*virLogCloseFunc) (void *data);
 
 typedef enum {
     VIR_LOG_STACK_TRACE = (1 << 0),
+    VIR_LOG_RECORD = (1 << 1), /* keep in the flight recorder */
 } virLogFlags;
 
 int virLogGetNbFilters(void);
@@ -191,6 +192,13 @@ int virLogSetOutputs(const char *outputs);
 int virLogSetFilters(const char *filters);
 char *virLogGetDefaultOutput(void);
 int virLogSetDefaultOutput(const char *fname, bool godaemon, bool privileged);
+int virLogSetAsync(size_t nrecords);
+void virLogFlush(void);
+void virLogFlushFromSignal(void);
+unsigned int virLogGetDropped(void);
+int virLogSetRecorder(const char *matches, size_t nentries);
+int virLogGetRecorded(char **records, size_t maxlen);
+void virLogFlushRecorder(const char *reason);
 
 /*
  * Internal logging API
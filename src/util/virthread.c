@@ -31,6 +31,7 @@
 
 #include "viralloc.h"
 #include "virthreadjob.h"
+#include "virtime.h"
 
 
 /* Nothing special required for pthreads */
@@ -138,6 +139,44 @@ int virCondInit(virCondPtr c)
     return 0;
 }
 
+int virCondInitMonotonic(virCondPtr c)
+{
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(HAVE_CLOCK_GETTIME)
+    pthread_condattr_t attr;
+    int ret;
+
+    if ((ret = pthread_condattr_init(&attr)) != 0) {
+        errno = ret;
+        return -1;
+    }
+    if ((ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) == 0)
+        ret = pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+#else
+    return virCondInit(c);
+#endif
+}
+
+int virCondMonotonicNow(unsigned long long *nowms)
+{
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return -1;
+
+    *nowms = (ts.tv_sec * 1000ull) + (ts.tv_nsec / (1000ull * 1000ull));
+    return 0;
+#else
+    return virTimeMillisNowRaw(nowms);
+#endif
+}
+
 int virCondDestroy(virCondPtr c)
 {
     int ret;
@@ -144,8 +144,14 @@ void virRWLockUnlock(virRWLockPtr m);
 
 
 int virCondInit(virCondPtr c) ATTRIBUTE_RETURN_CHECK;
+int virCondInitMonotonic(virCondPtr c) ATTRIBUTE_RETURN_CHECK;
 int virCondDestroy(virCondPtr c);
 
+/* The current time in the clock virCondWaitUntil uses for conditions
+ * created by virCondInitMonotonic, which is not affected by changes
+ * of the system time where the platform allows */
+int virCondMonotonicNow(unsigned long long *nowms) ATTRIBUTE_RETURN_CHECK;
+
 /* virCondWait, virCondWaitUntil:
  * These functions can return without the associated predicate
  * changing value. Therefore in nearly all cases they
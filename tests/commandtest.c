@@ -25,6 +25,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
@@ -40,9 +41,15 @@
 #include "virthread.h"
 #include "virstring.h"
 #include "virprocess.h"
+#include "virtime.h"
+
+#define __VIR_COMMAND_PRIV_H_ALLOW__
+#include "vircommandpriv.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
+#define NUM_SPAWNS 100
+
 typedef struct _virCommandTestData virCommandTestData;
 typedef virCommandTestData *virCommandTestDataPtr;
 struct _virCommandTestData {
@@ -52,6 +59,11 @@ struct _virCommandTestData {
     bool running;
 };
 
+struct testSpawnData {
+    bool fork;
+    size_t ballast; /* MiB */
+};
+
 #ifdef WIN32
 
 int
@@ -1131,6 +1143,121 @@ static int test25(const void *unused ATTRIBUTE_UNUSED)
 }
 
 
+/*
+ * Run NUM_SPAWNS simple commands, with or without fork(), and store
+ * the average time each took in @ms.
+ */
+static int
+testSpawnTime(bool forceFork, double *ms)
+{
+    unsigned long long start, end;
+    size_t i;
+    int ret = -1;
+
+    virCommandSetForceFork(forceFork);
+
+    if (virTimeMillisNow(&start) < 0)
+        goto cleanup;
+
+    for (i = 0; i < NUM_SPAWNS; i++) {
+        virCommandPtr cmd = virCommandNew("true");
+        int rv = virCommandRun(cmd, NULL);
+
+        virCommandFree(cmd);
+        if (rv < 0) {
+            printf("Cannot run child %s\n", virGetLastErrorMessage());
+            goto cleanup;
+        }
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        goto cleanup;
+
+    *ms = (end - start) * 1.0 / NUM_SPAWNS;
+    ret = 0;
+
+ cleanup:
+    virCommandSetForceFork(false);
+    return ret;
+}
+
+
+/*
+ * Measure how long spawning a child takes with the open files limit
+ * raised as far as it goes, like it often is for libvirtd.
+ */
+static int test26(const void *unused ATTRIBUTE_UNUSED)
+{
+    struct rlimit orig, rlim;
+    double forkMs, spawnMs;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (getrlimit(RLIMIT_NOFILE, &orig) < 0) {
+        fprintf(stderr, "Unable to get open files limit\n");
+        return -1;
+    }
+
+    rlim = orig;
+    rlim.rlim_cur = rlim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+        fprintf(stderr, "Unable to raise open files limit\n");
+        return -1;
+    }
+
+    /* Forking goes through virExec, which closes every possible fd
+     * in the child, unlike posix_spawn() */
+    if (testSpawnTime(true, &forkMs) < 0 ||
+        testSpawnTime(false, &spawnMs) < 0)
+        goto cleanup;
+
+    VIR_TEST_VERBOSE("%.2fms/fork, %.2fms/spawn with %llu open files limit ",
+                     forkMs, spawnMs, (unsigned long long) rlim.rlim_cur);
+    ret = 0;
+
+ cleanup:
+    ignore_value(setrlimit(RLIMIT_NOFILE, &orig));
+    return ret;
+}
+
+
+/*
+ * Measure how long spawning a simple command takes, with or without
+ * fork(), while this process has @ballast MiB of memory in use.
+ */
+static int test27(const void *opaque)
+{
+    const struct testSpawnData *data = opaque;
+    size_t len = data->ballast * 1024 * 1024;
+    char *ballast = NULL;
+    double ms;
+    size_t i;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (VIR_ALLOC_N(ballast, len) < 0)
+        return -1;
+
+    /* Make sure the pages are really there for fork() to copy */
+    for (i = 0; i < len; i += 4096)
+        ballast[i] = 1;
+
+    if (testSpawnTime(data->fork, &ms) < 0)
+        goto cleanup;
+
+    VIR_TEST_VERBOSE("%.2fms/spawn ", ms);
+    ret = 0;
+
+ cleanup:
+    VIR_FREE(ballast);
+    return ret;
+}
+
+
 static void virCommandThreadWorker(void *opaque)
 {
     virCommandTestDataPtr test = opaque;
@@ -1284,6 +1411,23 @@ mymain(void)
     DO_TEST(test23);
     DO_TEST(test24);
     DO_TEST(test25);
+    DO_TEST(test26);
+
+# define DO_TEST_SPAWN(FORK, BALLAST)                                   \
+    do {                                                                \
+        struct testSpawnData data = { FORK, BALLAST };                  \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "Command spawn latency, %zu MiB in use%s", \
+                        data.ballast, data.fork ? ", forced fork" : "") < 0 || \
+            virTestRun(name, test27, &data) < 0)                        \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    DO_TEST_SPAWN(false, 0);
+    DO_TEST_SPAWN(true, 0);
+    DO_TEST_SPAWN(false, 1024);
+    DO_TEST_SPAWN(true, 1024);
 
     virMutexLock(&test->lock);
     if (test->running) {
@@ -0,0 +1,549 @@
+/*
+ * domainobjlistbenchtest.c: Measure domain lookup contention and
+ *                           loading of domain configs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "virdomainobjlist.h"
+#include "virfile.h"
+#include "virthread.h"
+#include "virtime.h"
+#include "viratomic.h"
+#include "virstring.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define NUM_DOMAINS 1000
+#define NUM_LOOKUPS 200000
+
+/* Domain configs loaded at startup are copies of these */
+#define LOAD_CORPUS_DIR abs_srcdir "/qemuxml2argvdata"
+#define LOAD_DIR_TEMPLATE abs_builddir "/domainobjlistbench-XXXXXX"
+
+#define CLASH_UUID "c7a5fdbd-edaf-9455-926a-d65c16db1809"
+#define CLASH_UUID_OTHER "c7a5fdbd-edaf-9455-926a-d65c16db180a"
+
+static virCapsPtr caps;
+static virDomainXMLOptionPtr xmlopt;
+
+struct testDomainObjListBenchData {
+    size_t nreaders;
+    bool churn;
+};
+
+struct testDomainObjListLoadData {
+    size_t ncopies;
+};
+
+struct testDomainObjListClashData {
+    bool liveStatus;
+};
+
+struct testDomainObjListBenchState {
+    virDomainObjListPtr doms;
+    int quit;
+    int failed;
+    int seed;
+};
+
+
+static void
+testDomainObjListBenchUUID(unsigned char *uuid,
+                           size_t n)
+{
+    memset(uuid, 0, VIR_UUID_BUFLEN);
+    memcpy(uuid, &n, sizeof(n));
+}
+
+
+static int
+testDomainObjListBenchAdd(virDomainObjListPtr doms,
+                          size_t n)
+{
+    virDomainDefPtr def;
+    virDomainObjPtr vm;
+
+    if (!(def = virDomainDefNew()))
+        return -1;
+
+    def->virtType = VIR_DOMAIN_VIRT_TEST;
+    testDomainObjListBenchUUID(def->uuid, n);
+    if (virAsprintf(&def->name, "bench-%zu", n) < 0 ||
+        !(vm = virDomainObjListAdd(doms, def, xmlopt, 0, NULL))) {
+        virDomainDefFree(def);
+        return -1;
+    }
+
+    virObjectUnlock(vm);
+    return 0;
+}
+
+
+static void
+testDomainObjListBenchReader(void *opaque)
+{
+    struct testDomainObjListBenchState *state = opaque;
+    unsigned int seed = virAtomicIntInc(&state->seed);
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    char name[32];
+    size_t i;
+
+    for (i = 0; i < NUM_LOOKUPS; i++) {
+        size_t n = rand_r(&seed) % NUM_DOMAINS;
+        virDomainObjPtr vm;
+
+        /* Mix the two lookups most API calls start with */
+        if (i % 2) {
+            testDomainObjListBenchUUID(uuid, n);
+            vm = virDomainObjListFindByUUIDRef(state->doms, uuid);
+        } else {
+            snprintf(name, sizeof(name), "bench-%zu", n);
+            vm = virDomainObjListFindByName(state->doms, name);
+        }
+
+        if (!vm) {
+            virAtomicIntSet(&state->failed, 1);
+            return;
+        }
+
+        virDomainObjEndAPI(&vm);
+    }
+}
+
+
+/* Keep defining and undefining domains while the readers run,
+ * like a management application starting transient guests */
+static void
+testDomainObjListBenchChurn(void *opaque)
+{
+    struct testDomainObjListBenchState *state = opaque;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    size_t n = NUM_DOMAINS;
+
+    while (!virAtomicIntGet(&state->quit)) {
+        virDomainObjPtr vm;
+
+        if (testDomainObjListBenchAdd(state->doms, n) < 0) {
+            virAtomicIntSet(&state->failed, 1);
+            return;
+        }
+
+        testDomainObjListBenchUUID(uuid, n);
+        if (!(vm = virDomainObjListFindByUUID(state->doms, uuid))) {
+            virAtomicIntSet(&state->failed, 1);
+            return;
+        }
+        virDomainObjListRemove(state->doms, vm);
+
+        n++;
+    }
+}
+
+
+static int
+testDomainObjListBench(const void *opaque)
+{
+    const struct testDomainObjListBenchData *data = opaque;
+    struct testDomainObjListBenchState state = { .doms = NULL };
+    virThread *readers = NULL;
+    virThread churn;
+    unsigned long long start, end;
+    size_t nstarted = 0;
+    size_t i;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (!(state.doms = virDomainObjListNew()))
+        return -1;
+
+    for (i = 0; i < NUM_DOMAINS; i++) {
+        if (testDomainObjListBenchAdd(state.doms, i) < 0)
+            goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(readers, data->nreaders) < 0)
+        goto cleanup;
+
+    if (data->churn &&
+        virThreadCreate(&churn, true, testDomainObjListBenchChurn, &state) < 0)
+        goto cleanup;
+
+    if (virTimeMillisNow(&start) < 0)
+        goto join;
+
+    for (nstarted = 0; nstarted < data->nreaders; nstarted++) {
+        if (virThreadCreate(&readers[nstarted], true,
+                            testDomainObjListBenchReader, &state) < 0)
+            goto join;
+    }
+
+    for (i = 0; i < nstarted; i++)
+        virThreadJoin(&readers[i]);
+    nstarted = 0;
+
+    if (virTimeMillisNow(&end) < 0)
+        goto join;
+
+    if (!virAtomicIntGet(&state.failed)) {
+        VIR_TEST_VERBOSE("%.2fus/lookup ",
+                         (end - start) * 1000.0 /
+                         (NUM_LOOKUPS * data->nreaders));
+        ret = 0;
+    }
+
+ join:
+    for (i = 0; i < nstarted; i++)
+        virThreadJoin(&readers[i]);
+    if (data->churn) {
+        virAtomicIntSet(&state.quit, 1);
+        virThreadJoin(&churn);
+    }
+
+ cleanup:
+    VIR_FREE(readers);
+    virObjectUnref(state.doms);
+    return ret;
+}
+
+
+/* Write @ncopies of each domain of the corpus into @configDir, each
+ * copy with its own name and UUID. Domains the generic driver can't
+ * parse, or which are there for negative tests, are left out. */
+static int
+testDomainObjListLoadPrepare(const char *configDir,
+                             size_t ncopies,
+                             size_t *ndomains)
+{
+    DIR *dir = NULL;
+    struct dirent *ent;
+    virDomainDefPtr def = NULL;
+    char *path = NULL;
+    size_t n = 0;
+    size_t i;
+    int rc;
+    int ret = -1;
+
+    if (virDirOpen(&dir, LOAD_CORPUS_DIR) < 0)
+        return -1;
+
+    while ((rc = virDirRead(dir, &ent, LOAD_CORPUS_DIR)) > 0) {
+        if (!STRPREFIX(ent->d_name, "qemuxml2argv-") ||
+            !virFileHasSuffix(ent->d_name, ".xml"))
+            continue;
+
+        if (virAsprintf(&path, "%s/%s", LOAD_CORPUS_DIR, ent->d_name) < 0)
+            goto cleanup;
+
+        def = virDomainDefParseFile(path, caps, xmlopt, NULL,
+                                    VIR_DOMAIN_DEF_PARSE_INACTIVE |
+                                    VIR_DOMAIN_DEF_PARSE_SKIP_OSTYPE_CHECKS |
+                                    VIR_DOMAIN_DEF_PARSE_SKIP_VALIDATE);
+        VIR_FREE(path);
+        if (!def) {
+            virResetLastError();
+            continue;
+        }
+
+        for (i = 0; i < ncopies; i++) {
+            VIR_FREE(def->name);
+            if (virAsprintf(&def->name, "load-%zu", n) < 0)
+                goto cleanup;
+            testDomainObjListBenchUUID(def->uuid, n);
+
+            if (virDomainSaveConfig(configDir, caps, def) < 0) {
+                virResetLastError();
+                break;
+            }
+            n++;
+        }
+
+        virDomainDefFree(def);
+        def = NULL;
+    }
+
+    if (rc < 0)
+        goto cleanup;
+
+    *ndomains = n;
+    ret = 0;
+
+ cleanup:
+    VIR_DIR_CLOSE(dir);
+    virDomainDefFree(def);
+    VIR_FREE(path);
+    return ret;
+}
+
+
+static int
+testDomainObjListLoad(const void *opaque)
+{
+    const struct testDomainObjListLoadData *data = opaque;
+    virDomainObjListPtr doms = NULL;
+    char *configDir = NULL;
+    char *autostartDir = NULL;
+    unsigned long long start, end;
+    size_t ndomains = 0;
+    int nloaded;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (VIR_STRDUP(configDir, LOAD_DIR_TEMPLATE) < 0)
+        return -1;
+    if (!mkdtemp(configDir)) {
+        VIR_FREE(configDir);
+        return -1;
+    }
+
+    if (virAsprintf(&autostartDir, "%s/autostart", configDir) < 0 ||
+        testDomainObjListLoadPrepare(configDir, data->ncopies, &ndomains) < 0 ||
+        !(doms = virDomainObjListNew()))
+        goto cleanup;
+
+    if (virTimeMillisNow(&start) < 0 ||
+        virDomainObjListLoadAllConfigs(doms, configDir, autostartDir, 0,
+                                       caps, xmlopt, NULL, NULL) < 0 ||
+        virTimeMillisNow(&end) < 0)
+        goto cleanup;
+
+    nloaded = virDomainObjListNumOfDomains(doms, false, NULL, NULL);
+    if (nloaded < 0 || (size_t) nloaded != ndomains) {
+        VIR_TEST_DEBUG("Loaded %d of %zu domains\n", nloaded, ndomains);
+        goto cleanup;
+    }
+
+    VIR_TEST_VERBOSE("%zu domains in %llums, %.0f domains/s ",
+                     ndomains, end - start,
+                     ndomains / ((end - start + 1) / 1000.0));
+    ret = 0;
+
+ cleanup:
+    virObjectUnref(doms);
+    virFileDeleteTree(configDir);
+    VIR_FREE(autostartDir);
+    VIR_FREE(configDir);
+    return ret;
+}
+
+
+/* Files which all want to define the same domain, the first one
+ * in file name order wins and each of the others fails to load */
+static const struct {
+    const char *file;
+    const char *name;
+    const char *uuid;
+} clashDomains[] = {
+    { "a", "clash", CLASH_UUID },
+    { "b", "clash", CLASH_UUID_OTHER },
+    { "c", "other", CLASH_UUID },
+};
+
+
+static int
+testDomainObjListClashWrite(const char *configDir,
+                            bool liveStatus)
+{
+    char *path = NULL;
+    char *xml = NULL;
+    size_t i;
+    int ret = -1;
+
+    for (i = 0; i < ARRAY_CARDINALITY(clashDomains); i++) {
+        if (virAsprintf(&xml,
+                        "%s<domain type='test' id='1'>\n"
+                        "  <name>%s</name>\n"
+                        "  <uuid>%s</uuid>\n"
+                        "  <memory>219100</memory>\n"
+                        "  <os><type arch='x86_64'>hvm</type></os>\n"
+                        "</domain>\n%s",
+                        liveStatus ?
+                        "<domstatus state='running' reason='booted' "
+                        "pid='1'>\n" : "",
+                        clashDomains[i].name, clashDomains[i].uuid,
+                        liveStatus ? "</domstatus>\n" : "") < 0 ||
+            virAsprintf(&path, "%s/%s.xml",
+                        configDir, clashDomains[i].file) < 0 ||
+            virFileWriteStr(path, xml, 0600) < 0)
+            goto cleanup;
+        VIR_FREE(path);
+        VIR_FREE(xml);
+    }
+
+    /* Parsed before the others are added, but fails on its own */
+    if (virAsprintf(&path, "%s/malformed.xml", configDir) < 0 ||
+        virFileWriteStr(path, "<domain type='test'><name>broken",
+                        0600) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+ cleanup:
+    VIR_FREE(path);
+    VIR_FREE(xml);
+    return ret;
+}
+
+
+static void
+testDomainObjListClashNotify(virDomainObjPtr dom,
+                             int newDomain,
+                             void *opaque)
+{
+    size_t *nnotified = opaque;
+
+    if (newDomain && STREQ(dom->def->name, "clash"))
+        (*nnotified)++;
+}
+
+
+static int
+testDomainObjListClash(const void *opaque)
+{
+    const struct testDomainObjListClashData *data = opaque;
+    virDomainObjListPtr doms = NULL;
+    virDomainObjPtr vm = NULL;
+    char *configDir = NULL;
+    char *autostartDir = NULL;
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    size_t nnotified = 0;
+    int ret = -1;
+
+    if (VIR_STRDUP(configDir, LOAD_DIR_TEMPLATE) < 0)
+        return -1;
+    if (!mkdtemp(configDir)) {
+        VIR_FREE(configDir);
+        return -1;
+    }
+
+    if (virAsprintf(&autostartDir, "%s/autostart", configDir) < 0 ||
+        testDomainObjListClashWrite(configDir, data->liveStatus) < 0 ||
+        !(doms = virDomainObjListNew()))
+        goto cleanup;
+
+    if (virDomainObjListLoadAllConfigs(doms, configDir, autostartDir,
+                                       data->liveStatus, caps, xmlopt,
+                                       testDomainObjListClashNotify,
+                                       &nnotified) < 0)
+        goto cleanup;
+
+    if (virDomainObjListNumOfDomains(doms, data->liveStatus,
+                                     NULL, NULL) != 1) {
+        VIR_TEST_DEBUG("%s", "Expected exactly one domain to be loaded\n");
+        goto cleanup;
+    }
+
+    if (nnotified != 1) {
+        VIR_TEST_DEBUG("Domain added %zu times\n", nnotified);
+        goto cleanup;
+    }
+
+    if (!(vm = virDomainObjListFindByName(doms, "clash"))) {
+        VIR_TEST_DEBUG("%s", "Domain 'clash' not loaded\n");
+        goto cleanup;
+    }
+
+    virUUIDFormat(vm->def->uuid, uuidstr);
+    if (STRNEQ(uuidstr, CLASH_UUID)) {
+        VIR_TEST_DEBUG("Domain 'clash' loaded with uuid %s instead of %s\n",
+                       uuidstr, CLASH_UUID);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+ cleanup:
+    virDomainObjEndAPI(&vm);
+    virObjectUnref(doms);
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(configDir);
+    VIR_FREE(autostartDir);
+    VIR_FREE(configDir);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    size_t readers[] = { 1, 2, 4, 8, 16 };
+    size_t copies[] = { 1, 10, 50 };
+    size_t i;
+
+    if (!(caps = virTestGenericCapsInit()) ||
+        !(xmlopt = virTestGenericDomainXMLConfInit()))
+        return EXIT_FAILURE;
+
+#define DO_TEST(READERS, CHURN)                                         \
+    do {                                                                \
+        struct testDomainObjListBenchData data = { READERS, CHURN };    \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "%zu lookup threads%s", data.nreaders,   \
+                        data.churn ? ", with define/undefine" : "") < 0) \
+            return EXIT_FAILURE;                                        \
+        if (virTestRun(name, testDomainObjListBench, &data) < 0)        \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    for (i = 0; i < ARRAY_CARDINALITY(readers); i++) {
+        DO_TEST(readers[i], false);
+        DO_TEST(readers[i], true);
+    }
+
+#define DO_TEST_LOAD(COPIES)                                            \
+    do {                                                                \
+        struct testDomainObjListLoadData data = { COPIES };             \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "load %zu copies of the corpus",         \
+                        data.ncopies) < 0)                              \
+            return EXIT_FAILURE;                                        \
+        if (virTestRun(name, testDomainObjListLoad, &data) < 0)         \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    for (i = 0; i < ARRAY_CARDINALITY(copies); i++)
+        DO_TEST_LOAD(copies[i]);
+
+#define DO_TEST_CLASH(NAME, LIVE)                                       \
+    do {                                                                \
+        struct testDomainObjListClashData data = { LIVE };              \
+        if (virTestRun(NAME, testDomainObjListClash, &data) < 0)        \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST_CLASH("load clashing configs", false);
+    DO_TEST_CLASH("load clashing status", true);
+
+    virObjectUnref(xmlopt);
+    virObjectUnref(caps);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,360 @@
+/*
+ * eventbenchtest.c: Measure the wakeup cost of the libvirtd event loop
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "virfile.h"
+#include "virthread.h"
+#include "virtime.h"
+#include "vireventpoll.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define NUM_WAKEUPS 10000
+
+/* Sharded dispatch: descriptors made ready at once, and the
+ * time their callbacks spend working, in microseconds */
+#define NUM_ROUNDS 1000
+#define NUM_BUSY_HANDLES 64
+#define HANDLER_COST 20
+
+struct testEventBenchData {
+    virEventPollBackend backend;
+    size_t nidle;
+    size_t ntimers;
+    bool sharded;
+    size_t nshards;
+};
+
+struct testEventBenchShardData {
+    virMutex lock;
+    virCond cond;
+    size_t fired;
+};
+
+
+static void
+testEventBenchIdle(int watch ATTRIBUTE_UNUSED,
+                   int fd ATTRIBUTE_UNUSED,
+                   int events ATTRIBUTE_UNUSED,
+                   void *opaque)
+{
+    bool *spurious = opaque;
+
+    *spurious = true;
+}
+
+
+static void
+testEventBenchTimer(int timer ATTRIBUTE_UNUSED,
+                    void *opaque)
+{
+    bool *spurious = opaque;
+
+    *spurious = true;
+}
+
+
+static void
+testEventBenchActive(int watch ATTRIBUTE_UNUSED,
+                     int fd,
+                     int events ATTRIBUTE_UNUSED,
+                     void *opaque)
+{
+    size_t *fired = opaque;
+    char c;
+
+    if (saferead(fd, &c, sizeof(c)) == sizeof(c))
+        (*fired)++;
+}
+
+
+static void
+testEventBenchWork(int watch ATTRIBUTE_UNUSED,
+                   int fd,
+                   int events ATTRIBUTE_UNUSED,
+                   void *opaque)
+{
+    struct testEventBenchShardData *data = opaque;
+    unsigned long long start = virTestNowMicros();
+    char c;
+
+    if (saferead(fd, &c, sizeof(c)) != sizeof(c))
+        return;
+
+    /* Stand in for the parsing and dispatching a real client
+     * or monitor callback would do */
+    while (virTestNowMicros() - start < HANDLER_COST)
+        ;
+
+    virMutexLock(&data->lock);
+    data->fired++;
+    virCondSignal(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+
+/* The event loop can only be initialized once per process,
+ * so every measurement runs in a child of its own */
+static int
+testEventBenchRun(const struct testEventBenchData *data)
+{
+    struct rlimit rlim;
+    size_t nidle = data->nidle;
+    int pipefd[2];
+    size_t fired = 0;
+    bool spurious = false;
+    unsigned long long start, end;
+    char c = '1';
+    size_t i;
+
+    /* Each idle handle is backed by a pipe, ie. two descriptors */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        rlim.rlim_cur = rlim.rlim_max;
+        ignore_value(setrlimit(RLIMIT_NOFILE, &rlim));
+        if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+            rlim.rlim_cur != RLIM_INFINITY &&
+            nidle > (rlim.rlim_cur - 32) / 2)
+            nidle = (rlim.rlim_cur - 32) / 2;
+    }
+
+    if (virEventPollSetBackend(data->backend) < 0 ||
+        virEventPollInit() < 0)
+        return -1;
+
+    for (i = 0; i < nidle; i++) {
+        if (pipe(pipefd) < 0 ||
+            virEventPollAddHandle(pipefd[0], VIR_EVENT_HANDLE_READABLE,
+                                  testEventBenchIdle, &spurious, NULL) < 0)
+            return -1;
+    }
+
+    /* Timers armed far enough in the future to never fire */
+    for (i = 0; i < data->ntimers; i++) {
+        if (virEventPollAddTimeout(3600 * 1000, testEventBenchTimer,
+                                   &spurious, NULL) < 0)
+            return -1;
+    }
+
+    if (pipe(pipefd) < 0 ||
+        virEventPollAddHandle(pipefd[0], VIR_EVENT_HANDLE_READABLE,
+                              testEventBenchActive, &fired, NULL) < 0)
+        return -1;
+
+    if (virTimeMillisNow(&start) < 0)
+        return -1;
+
+    for (i = 0; i < NUM_WAKEUPS; i++) {
+        if (safewrite(pipefd[1], &c, sizeof(c)) != sizeof(c) ||
+            virEventPollRunOnce() < 0)
+            return -1;
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        return -1;
+
+    if (fired != NUM_WAKEUPS || spurious) {
+        VIR_TEST_DEBUG("fired=%zu expected=%d spurious=%d\n",
+                       fired, NUM_WAKEUPS, spurious);
+        return -1;
+    }
+
+    VIR_TEST_VERBOSE("%.2fus/wakeup ", (end - start) * 1000.0 / NUM_WAKEUPS);
+    return 0;
+}
+
+
+/* Make a batch of descriptors ready at once and measure how long
+ * it takes for all their callbacks to complete, with the handles
+ * spread over @nshards event loop threads */
+static int
+testEventBenchShardsRun(const struct testEventBenchData *data)
+{
+    struct testEventBenchShardData shard = { .fired = 0 };
+    int wfds[NUM_BUSY_HANDLES];
+    virEventPollStatsPtr stats = NULL;
+    size_t nstats = 0;
+    size_t nhandles = 0;
+    unsigned long long start, end;
+    char c = '1';
+    size_t i, j;
+
+    if (virEventPollSetBackend(data->backend) < 0 ||
+        virEventPollSetShards(data->nshards) < 0 ||
+        virEventPollInit() < 0)
+        return -1;
+
+    if (virMutexInit(&shard.lock) < 0 ||
+        virCondInit(&shard.cond) < 0)
+        return -1;
+
+    for (i = 0; i < NUM_BUSY_HANDLES; i++) {
+        int pipefd[2];
+
+        if (pipe(pipefd) < 0 ||
+            virEventPollAddHandleSharded(pipefd[0], VIR_EVENT_HANDLE_READABLE,
+                                         testEventBenchWork, &shard,
+                                         NULL) < 0)
+            return -1;
+        wfds[i] = pipefd[1];
+    }
+
+    start = virTestNowMicros();
+
+    for (i = 0; i < NUM_ROUNDS; i++) {
+        size_t target = (i + 1) * NUM_BUSY_HANDLES;
+
+        for (j = 0; j < NUM_BUSY_HANDLES; j++) {
+            if (safewrite(wfds[j], &c, sizeof(c)) != sizeof(c))
+                return -1;
+        }
+
+        if (data->nshards == 0) {
+            /* Callbacks run in this very thread */
+            while (shard.fired < target) {
+                if (virEventPollRunOnce() < 0)
+                    return -1;
+            }
+        } else {
+            virMutexLock(&shard.lock);
+            while (shard.fired < target) {
+                if (virCondWait(&shard.cond, &shard.lock) < 0) {
+                    virMutexUnlock(&shard.lock);
+                    return -1;
+                }
+            }
+            virMutexUnlock(&shard.lock);
+        }
+    }
+
+    end = virTestNowMicros();
+
+    if (virEventPollGetStats(&stats, &nstats) < 0)
+        return -1;
+
+    for (i = 0; i < nstats; i++)
+        nhandles += stats[i].handles;
+    VIR_FREE(stats);
+
+    if (nstats != data->nshards + 1 || nhandles != NUM_BUSY_HANDLES) {
+        VIR_TEST_DEBUG("nstats=%zu nhandles=%zu\n", nstats, nhandles);
+        return -1;
+    }
+
+    VIR_TEST_VERBOSE("%.2fus/round ", (end - start) * 1.0 / NUM_ROUNDS);
+    return 0;
+}
+
+
+static int
+testEventBench(const void *opaque)
+{
+    const struct testEventBenchData *data = opaque;
+    pid_t pid;
+    int status;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if ((pid = fork()) < 0)
+        return -1;
+
+    if (pid == 0)
+        _exit((data->sharded ? testEventBenchShardsRun(data) :
+               testEventBenchRun(data)) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+        return -1;
+
+    return 0;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    size_t counts[] = { 10, 100, 1000, 5000 };
+    size_t shards[] = { 0, 1, 2, 4 };
+    size_t i;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+#define DO_TEST(BACKEND, handles, timers)                               \
+    do {                                                                \
+        struct testEventBenchData data = {                              \
+            VIR_EVENT_POLL_BACKEND_ ## BACKEND, handles, timers,        \
+            false, 0                                                    \
+        };                                                              \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "%s wakeup latency, %zu handles, "       \
+                        "%zu timers",                                   \
+                        virEventPollBackendTypeToString(data.backend),  \
+                        data.nidle, data.ntimers) < 0)                  \
+            return EXIT_FAILURE;                                        \
+        if (virTestRun(name, testEventBench, &data) < 0)                \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    for (i = 0; i < ARRAY_CARDINALITY(counts); i++) {
+        DO_TEST(POLL, counts[i], 0);
+#if HAVE_SYS_EPOLL_H
+        DO_TEST(EPOLL, counts[i], 0);
+#endif
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(counts); i++)
+        DO_TEST(POLL, 0, counts[i]);
+
+#define DO_TEST_SHARDS(BACKEND, shards)                                 \
+    do {                                                                \
+        struct testEventBenchData data = {                              \
+            VIR_EVENT_POLL_BACKEND_ ## BACKEND, 0, 0, true, shards      \
+        };                                                              \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "%s dispatch of %d busy handles, "       \
+                        "%zu extra threads",                            \
+                        virEventPollBackendTypeToString(data.backend),  \
+                        NUM_BUSY_HANDLES, data.nshards) < 0)            \
+            return EXIT_FAILURE;                                        \
+        if (virTestRun(name, testEventBench, &data) < 0)                \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    for (i = 0; i < ARRAY_CARDINALITY(shards); i++) {
+        DO_TEST_SHARDS(POLL, shards[i]);
+#if HAVE_SYS_EPOLL_H
+        DO_TEST_SHARDS(EPOLL, shards[i]);
+#endif
+    }
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
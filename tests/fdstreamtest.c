@@ -314,6 +314,230 @@ static int testFDStreamWriteNonblock(const void *data)
     return testFDStreamWriteCommon(data, false);
 }
 
+
+#define SPARSE_CHUNK (64 * 1024)
+#define SPARSE_HOLE (1024 * 1024)
+
+/* Copy a file with holes from one sparse stream to another and
+ * check both the data and the holes made it through */
+static int testFDStreamSparse(const void *data)
+{
+    const char *scratchdir = data;
+    char *infile = NULL;
+    char *outfile = NULL;
+    char *pattern = NULL;
+    char *buf = NULL;
+    char *indata = NULL;
+    char *outdata = NULL;
+    int inlen, outlen;
+    virStreamPtr in = NULL;
+    virStreamPtr out = NULL;
+    virConnectPtr conn = NULL;
+    long long holes = 0;
+    int fd = -1;
+    size_t i;
+    int ret = -1;
+
+    if (!(conn = virConnectOpen("test:///default")))
+        goto cleanup;
+
+    if (VIR_ALLOC_N(pattern, SPARSE_CHUNK) < 0 ||
+        VIR_ALLOC_N(buf, SPARSE_CHUNK) < 0)
+        goto cleanup;
+
+    for (i = 0; i < SPARSE_CHUNK; i++)
+        pattern[i] = i % 251 + 1;
+
+    if (virAsprintf(&infile, "%s/input.sparse", scratchdir) < 0 ||
+        virAsprintf(&outfile, "%s/output.sparse", scratchdir) < 0)
+        goto cleanup;
+
+    /* data, hole, data, trailing hole */
+    if ((fd = open(infile, O_CREAT|O_WRONLY|O_EXCL, 0600)) < 0 ||
+        safewrite(fd, pattern, SPARSE_CHUNK) != SPARSE_CHUNK ||
+        lseek(fd, SPARSE_HOLE, SEEK_CUR) < 0 ||
+        safewrite(fd, pattern, SPARSE_CHUNK) != SPARSE_CHUNK ||
+        ftruncate(fd, 2 * SPARSE_CHUNK + 2 * SPARSE_HOLE) < 0 ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    if ((fd = open(outfile, O_CREAT|O_WRONLY|O_EXCL, 0600)) < 0 ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    if (!(in = virStreamNew(conn, 0)) ||
+        !(out = virStreamNew(conn, 0)))
+        goto cleanup;
+
+    if (virFDStreamOpenBlockDevice(in, infile, 0, 0, O_RDONLY, true) < 0 ||
+        virFDStreamOpenBlockDevice(out, outfile, 0, 0, O_WRONLY, true) < 0)
+        goto cleanup;
+
+    while (1) {
+        int got = in->driver->streamRecvFlags(in, buf, SPARSE_CHUNK,
+                                              VIR_STREAM_RECV_STOP_AT_HOLE);
+        int offset = 0;
+
+        if (got == -3) {
+            long long length;
+
+            if (in->driver->streamRecvHole(in, &length, 0) < 0 ||
+                out->driver->streamSendHole(out, length, 0) < 0)
+                goto error;
+            holes += length;
+            continue;
+        }
+        if (got < 0)
+            goto error;
+        if (got == 0)
+            break;
+
+        while (offset < got) {
+            int done = out->driver->streamSend(out, buf + offset,
+                                               got - offset);
+            if (done < 0)
+                goto error;
+            offset += done;
+        }
+    }
+
+    if (in->driver->streamFinish(in) < 0 ||
+        out->driver->streamFinish(out) < 0)
+        goto error;
+
+    /* Filesystems without SEEK_HOLE report everything as data */
+    if (holes != 0 && holes != 2 * SPARSE_HOLE) {
+        virFilePrintf(stderr, "Unexpected hole size %lld\n", holes);
+        goto cleanup;
+    }
+
+    if ((inlen = virFileReadAll(infile, 4 * SPARSE_HOLE, &indata)) < 0 ||
+        (outlen = virFileReadAll(outfile, 4 * SPARSE_HOLE, &outdata)) < 0)
+        goto cleanup;
+
+    if (inlen != outlen || memcmp(indata, outdata, inlen) != 0) {
+        virFilePrintf(stderr, "Mismatched sparse file contents\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    if (in)
+        virStreamFree(in);
+    if (out)
+        virStreamFree(out);
+    VIR_FORCE_CLOSE(fd);
+    if (infile)
+        unlink(infile);
+    if (outfile)
+        unlink(outfile);
+    if (conn)
+        virConnectClose(conn);
+    VIR_FREE(infile);
+    VIR_FREE(outfile);
+    VIR_FREE(pattern);
+    VIR_FREE(buf);
+    VIR_FREE(indata);
+    VIR_FREE(outdata);
+    return ret;
+
+ error:
+    virFilePrintf(stderr, "Failed to copy sparse stream: %s\n",
+                  virGetLastErrorMessage());
+    goto cleanup;
+}
+
+/* Read a sparse file through a stream limited to end in the middle
+ * of a hole and check the hole is cut where the stream is told to */
+static int testFDStreamSparseLength(const void *data)
+{
+    const char *scratchdir = data;
+    char *infile = NULL;
+    char *pattern = NULL;
+    char *buf = NULL;
+    virStreamPtr in = NULL;
+    virConnectPtr conn = NULL;
+    unsigned long long want = SPARSE_CHUNK + SPARSE_HOLE / 2;
+    unsigned long long total = 0;
+    int fd = -1;
+    size_t i;
+    int ret = -1;
+
+    if (!(conn = virConnectOpen("test:///default")))
+        goto cleanup;
+
+    if (VIR_ALLOC_N(pattern, SPARSE_CHUNK) < 0 ||
+        VIR_ALLOC_N(buf, SPARSE_CHUNK) < 0)
+        goto cleanup;
+
+    for (i = 0; i < SPARSE_CHUNK; i++)
+        pattern[i] = i % 251 + 1;
+
+    if (virAsprintf(&infile, "%s/input-length.sparse", scratchdir) < 0)
+        goto cleanup;
+
+    /* data, hole, data */
+    if ((fd = open(infile, O_CREAT|O_WRONLY|O_EXCL, 0600)) < 0 ||
+        safewrite(fd, pattern, SPARSE_CHUNK) != SPARSE_CHUNK ||
+        lseek(fd, SPARSE_HOLE, SEEK_CUR) < 0 ||
+        safewrite(fd, pattern, SPARSE_CHUNK) != SPARSE_CHUNK ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    if (!(in = virStreamNew(conn, 0)))
+        goto cleanup;
+
+    if (virFDStreamOpenBlockDevice(in, infile, 0, want, O_RDONLY, true) < 0)
+        goto error;
+
+    while (1) {
+        int got = in->driver->streamRecvFlags(in, buf, SPARSE_CHUNK,
+                                              VIR_STREAM_RECV_STOP_AT_HOLE);
+
+        if (got == -3) {
+            long long length;
+
+            if (in->driver->streamRecvHole(in, &length, 0) < 0)
+                goto error;
+            total += length;
+            continue;
+        }
+        if (got < 0)
+            goto error;
+        if (got == 0)
+            break;
+        total += got;
+    }
+
+    if (in->driver->streamFinish(in) < 0)
+        goto error;
+
+    if (total != want) {
+        virFilePrintf(stderr, "Expected %llu bytes, got %llu\n",
+                      want, total);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    if (in)
+        virStreamFree(in);
+    VIR_FORCE_CLOSE(fd);
+    if (infile)
+        unlink(infile);
+    if (conn)
+        virConnectClose(conn);
+    VIR_FREE(infile);
+    VIR_FREE(pattern);
+    VIR_FREE(buf);
+    return ret;
+
+ error:
+    virFilePrintf(stderr, "Failed to read sparse stream: %s\n",
+                  virGetLastErrorMessage());
+    goto cleanup;
+}
+
 #define SCRATCHDIRTEMPLATE abs_builddir "/fakesysfsdir-XXXXXX"
 
 static int
@@ -335,6 +559,10 @@ mymain(void)
         ret = -1;
     if (virTestRun("Stream write non-blocking ", testFDStreamWriteNonblock, scratchdir) < 0)
         ret = -1;
+    if (virTestRun("Stream sparse copy ", testFDStreamSparse, scratchdir) < 0)
+        ret = -1;
+    if (virTestRun("Stream sparse length ", testFDStreamSparseLength, scratchdir) < 0)
+        ret = -1;
 
     if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
         virFileDeleteTree(scratchdir);
@@ -0,0 +1,254 @@
+/*
+ * iohelperbenchtest.c: Measure how fast libvirt_iohelper moves data
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "viralloc.h"
+#include "vircommand.h"
+#include "virfile.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define IOHELPER abs_topbuilddir "/src/libvirt_iohelper"
+
+/* Amount of data moved in each direction */
+#define CHUNK_LEN (1024 * 1024)
+#define NUM_CHUNKS 512
+
+struct testIOHelperBenchData {
+    const char *dir;
+    const char *queueDepth;
+    const char *zeroCopy;
+};
+
+struct testIOHelperBenchFeeder {
+    int fd;
+    char *chunk;
+};
+
+
+/* Stand in for a stream, or the QEMU migration channel */
+static void
+testIOHelperBenchFeed(void *opaque)
+{
+    struct testIOHelperBenchFeeder *feeder = opaque;
+    size_t i;
+
+    for (i = 0; i < NUM_CHUNKS; i++) {
+        if (safewrite(feeder->fd, feeder->chunk, CHUNK_LEN) != CHUNK_LEN)
+            break;
+    }
+
+    VIR_FORCE_CLOSE(feeder->fd);
+}
+
+
+static virCommandPtr
+testIOHelperBenchCommand(const struct testIOHelperBenchData *data,
+                         const char *path,
+                         int fd)
+{
+    virCommandPtr cmd = virCommandNew(IOHELPER);
+
+    virCommandAddArg(cmd, path);
+    virCommandAddArg(cmd, "0");
+    virCommandAddArgFormat(cmd, "%d", fd);
+    virCommandPassFD(cmd, fd, VIR_COMMAND_PASS_FD_CLOSE_PARENT);
+    virCommandAddEnvPair(cmd, "LIBVIRT_IOHELPER_QUEUE_DEPTH",
+                         data->queueDepth);
+    virCommandAddEnvPair(cmd, "LIBVIRT_IOHELPER_ZERO_COPY", data->zeroCopy);
+
+    return cmd;
+}
+
+
+static int
+testIOHelperBench(const void *opaque)
+{
+    const struct testIOHelperBenchData *data = opaque;
+    struct testIOHelperBenchFeeder feeder = { -1, NULL };
+    virCommandPtr cmd = NULL;
+    virThread thread;
+    bool started = false;
+    char *dir = NULL;
+    char *path = NULL;
+    char *buf = NULL;
+    int pipefd[2] = { -1, -1 };
+    int fd = -1;
+    int outfd = -1;
+    unsigned long long start, middle, end;
+    unsigned long long total = 0;
+    ssize_t got;
+    struct stat sb;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (virAsprintf(&dir, "%s/iohelperbench-XXXXXX", data->dir) < 0)
+        return -1;
+    if (!mkdtemp(dir)) {
+        VIR_TEST_DEBUG("Cannot create directory in %s\n", data->dir);
+        VIR_FREE(dir);
+        return -1;
+    }
+
+    if (virAsprintf(&path, "%s/image", dir) < 0 ||
+        VIR_ALLOC_N(feeder.chunk, CHUNK_LEN) < 0 ||
+        VIR_ALLOC_N(buf, CHUNK_LEN) < 0)
+        goto cleanup;
+    memset(feeder.chunk, 'x', CHUNK_LEN);
+
+    /* Write the image from a pipe, as a volume upload would */
+    if (pipe(pipefd) < 0 ||
+        (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto cleanup;
+
+    cmd = testIOHelperBenchCommand(data, path, fd);
+    fd = -1;
+    virCommandSetInputFD(cmd, pipefd[0]);
+
+    if (virTimeMillisNow(&start) < 0 ||
+        virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(pipefd[0]);
+
+    feeder.fd = pipefd[1];
+    pipefd[1] = -1;
+    if (virThreadCreate(&thread, true, testIOHelperBenchFeed, &feeder) < 0)
+        goto cleanup;
+    started = true;
+
+    if (virCommandWait(cmd, NULL) < 0)
+        goto cleanup;
+    virCommandFree(cmd);
+    cmd = NULL;
+
+    virThreadJoin(&thread);
+    started = false;
+
+    if (stat(path, &sb) < 0 ||
+        sb.st_size != (off_t) CHUNK_LEN * NUM_CHUNKS) {
+        VIR_TEST_DEBUG("%s is incomplete\n", path);
+        goto cleanup;
+    }
+
+    /* And read it back into a pipe, as a volume download would */
+    if (virTimeMillisNow(&middle) < 0 ||
+        (fd = open(path, O_RDONLY)) < 0)
+        goto cleanup;
+
+    cmd = testIOHelperBenchCommand(data, path, fd);
+    fd = -1;
+    virCommandSetOutputFD(cmd, &outfd);
+
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+
+    while ((got = saferead(outfd, buf, CHUNK_LEN)) > 0)
+        total += got;
+
+    if (got < 0 ||
+        virCommandWait(cmd, NULL) < 0 ||
+        virTimeMillisNow(&end) < 0)
+        goto cleanup;
+
+    if (total != (unsigned long long) CHUNK_LEN * NUM_CHUNKS) {
+        VIR_TEST_DEBUG("Read back %llu bytes\n", total);
+        goto cleanup;
+    }
+
+    VIR_TEST_VERBOSE("write %.2fMiB/s read %.2fMiB/s ",
+                     NUM_CHUNKS * (CHUNK_LEN / (1024.0 * 1024.0)) /
+                     ((middle - start + 1) / 1000.0),
+                     NUM_CHUNKS * (CHUNK_LEN / (1024.0 * 1024.0)) /
+                     ((end - middle + 1) / 1000.0));
+    ret = 0;
+
+ cleanup:
+    /* The helper gets EPIPE instead of waiting for data */
+    VIR_FORCE_CLOSE(pipefd[0]);
+    VIR_FORCE_CLOSE(outfd);
+    virCommandFree(cmd);
+    if (started)
+        virThreadJoin(&thread);
+    VIR_FORCE_CLOSE(pipefd[1]);
+    VIR_FORCE_CLOSE(feeder.fd);
+    VIR_FORCE_CLOSE(fd);
+    virFileDeleteTree(dir);
+    VIR_FREE(feeder.chunk);
+    VIR_FREE(buf);
+    VIR_FREE(path);
+    VIR_FREE(dir);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    const char *dirs[] = {
+        /* tmpfs, which is limited by copying alone */
+        "/dev/shm",
+        /* e.g. a loop device backed file system, for a real block layer */
+        getenv("VIR_TEST_IOHELPER_DIR"),
+    };
+    size_t i;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    signal(SIGPIPE, SIG_IGN);
+
+#define DO_TEST(DIR, NAME, QUEUE_DEPTH, ZERO_COPY)                      \
+    do {                                                                \
+        struct testIOHelperBenchData data = {                           \
+            DIR, QUEUE_DEPTH, ZERO_COPY                                 \
+        };                                                              \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "%s copy in %s", NAME, DIR) < 0)         \
+            return EXIT_FAILURE;                                        \
+        if (virTestRun(name, testIOHelperBench, &data) < 0)             \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    for (i = 0; i < ARRAY_CARDINALITY(dirs); i++) {
+        if (!dirs[i] || !virFileIsDir(dirs[i]))
+            continue;
+
+        DO_TEST(dirs[i], "serial", "1", "0");
+        DO_TEST(dirs[i], "pipelined", "4", "0");
+        DO_TEST(dirs[i], "zero copy", "4", "1");
+    }
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,57 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <unistd.h>
+
+#include "virmock.h"
+
+/* Preloaded into libvirt_iohelper, not the test itself. Standard
+ * input ends once after IOHELPER_MOCK_EOF bytes and then carries on,
+ * as a file which grows while it is read would, so the helper sees
+ * a short read in the middle of the data. */
+#define IOHELPER_MOCK_EOF 100000
+
+static size_t total;
+static bool faked;
+
+VIR_MOCK_IMPL_RET_ARGS(read, ssize_t,
+                       int, fd,
+                       void *, buf,
+                       size_t, count)
+{
+    ssize_t ret;
+
+    VIR_MOCK_REAL_INIT(read);
+
+    if (fd != STDIN_FILENO || faked)
+        return real_read(fd, buf, count);
+
+    if (total == IOHELPER_MOCK_EOF) {
+        faked = true;
+        return 0;
+    }
+
+    if (count > IOHELPER_MOCK_EOF - total)
+        count = IOHELPER_MOCK_EOF - total;
+
+    if ((ret = real_read(fd, buf, count)) > 0)
+        total += ret;
+
+    return ret;
+}
@@ -0,0 +1,372 @@
+/*
+ * iohelpertest.c: Check libvirt_iohelper moves data intact
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "viralloc.h"
+#include "vircommand.h"
+#include "virfile.h"
+#include "virstring.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define IOHELPER abs_topbuilddir "/src/libvirt_iohelper"
+#define IOHELPER_MOCK abs_builddir "/.libs/iohelpermock.so"
+
+/* Several buffers of the helper and a tail which is not aligned */
+#define BUFFER_LEN (64 * 1024)
+#define DATA_LEN (3 * 1024 * 1024 + 12345)
+#define LIMIT_LEN (1024 * 1024 + 777)
+
+static char *pattern;
+static char *scratchdir;
+
+struct testIOHelperData {
+    const char *queueDepth;
+    const char *zeroCopy;
+};
+
+
+static virCommandPtr
+testIOHelperCommand(const struct testIOHelperData *data,
+                    const char *path,
+                    unsigned long long length,
+                    int fd)
+{
+    virCommandPtr cmd = virCommandNew(IOHELPER);
+
+    virCommandAddArg(cmd, path);
+    virCommandAddArgFormat(cmd, "%llu", length);
+    virCommandAddArgFormat(cmd, "%d", fd);
+    virCommandPassFD(cmd, fd, VIR_COMMAND_PASS_FD_CLOSE_PARENT);
+    virCommandAddEnvFormat(cmd, "LIBVIRT_IOHELPER_BUFFER_SIZE=%d",
+                           BUFFER_LEN);
+    virCommandAddEnvPair(cmd, "LIBVIRT_IOHELPER_QUEUE_DEPTH",
+                         data->queueDepth);
+    virCommandAddEnvPair(cmd, "LIBVIRT_IOHELPER_ZERO_COPY", data->zeroCopy);
+
+    return cmd;
+}
+
+
+static int
+testIOHelperCompare(const char *path,
+                    int len)
+{
+    char *buf = NULL;
+    int got;
+    int ret = -1;
+
+    if ((got = virFileReadAll(path, DATA_LEN + 1, &buf)) < 0)
+        return -1;
+
+    if (got != len || memcmp(buf, pattern, len) != 0) {
+        VIR_TEST_DEBUG("%s holds %d bytes, expected %d\n", path, got, len);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+
+/* Write a file from a pipe, as a volume upload would, read it back
+ * into a pipe, as a download would, and copy it between two regular
+ * files, as a save to a local file would */
+static int
+testIOHelperCopy(const void *opaque)
+{
+    const struct testIOHelperData *data = opaque;
+    virCommandPtr cmd = NULL;
+    char *input = NULL;
+    char *image = NULL;
+    char *copy = NULL;
+    char *outbuf = NULL;
+    int fd = -1;
+    int infd = -1;
+    int ret = -1;
+
+    if (virAsprintf(&input, "%s/input", scratchdir) < 0 ||
+        virAsprintf(&image, "%s/image", scratchdir) < 0 ||
+        virAsprintf(&copy, "%s/copy", scratchdir) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(input, pattern, 0600) < 0)
+        goto cleanup;
+
+    /* Upload */
+    if ((fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto cleanup;
+    cmd = testIOHelperCommand(data, image, 0, fd);
+    fd = -1;
+    virCommandSetInputBuffer(cmd, pattern);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+    virCommandFree(cmd);
+    cmd = NULL;
+
+    if (testIOHelperCompare(image, DATA_LEN) < 0)
+        goto cleanup;
+
+    /* Download */
+    if ((fd = open(image, O_RDONLY)) < 0)
+        goto cleanup;
+    cmd = testIOHelperCommand(data, image, 0, fd);
+    fd = -1;
+    virCommandSetOutputBuffer(cmd, &outbuf);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+    virCommandFree(cmd);
+    cmd = NULL;
+
+    if (strlen(outbuf) != DATA_LEN || memcmp(outbuf, pattern, DATA_LEN) != 0) {
+        VIR_TEST_DEBUG("Downloaded %zu bytes\n", strlen(outbuf));
+        goto cleanup;
+    }
+
+    /* Copy between regular files */
+    if ((infd = open(input, O_RDONLY)) < 0 ||
+        (fd = open(copy, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto cleanup;
+    cmd = testIOHelperCommand(data, copy, 0, fd);
+    fd = -1;
+    virCommandSetInputFD(cmd, infd);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+    virCommandFree(cmd);
+    cmd = NULL;
+
+    if (testIOHelperCompare(copy, DATA_LEN) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    virCommandFree(cmd);
+    VIR_FORCE_CLOSE(fd);
+    VIR_FORCE_CLOSE(infd);
+    if (input)
+        unlink(input);
+    if (image)
+        unlink(image);
+    if (copy)
+        unlink(copy);
+    VIR_FREE(input);
+    VIR_FREE(image);
+    VIR_FREE(copy);
+    VIR_FREE(outbuf);
+    return ret;
+}
+
+
+/* Only the requested part of the file comes out, whatever the
+ * buffer size */
+static int
+testIOHelperLength(const void *opaque)
+{
+    const struct testIOHelperData *data = opaque;
+    virCommandPtr cmd = NULL;
+    char *image = NULL;
+    char *outbuf = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (virAsprintf(&image, "%s/image", scratchdir) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(image, pattern, 0600) < 0 ||
+        (fd = open(image, O_RDONLY)) < 0)
+        goto cleanup;
+
+    cmd = testIOHelperCommand(data, image, LIMIT_LEN, fd);
+    fd = -1;
+    virCommandSetOutputBuffer(cmd, &outbuf);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+
+    if (strlen(outbuf) != LIMIT_LEN ||
+        memcmp(outbuf, pattern, LIMIT_LEN) != 0) {
+        VIR_TEST_DEBUG("Read %zu bytes, expected %d\n",
+                       strlen(outbuf), LIMIT_LEN);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virCommandFree(cmd);
+    VIR_FORCE_CLOSE(fd);
+    if (image)
+        unlink(image);
+    VIR_FREE(image);
+    VIR_FREE(outbuf);
+    return ret;
+}
+
+
+/* The last buffer of an O_DIRECT write is padded to the alignment
+ * and the file truncated back to the size of the data */
+static int
+testIOHelperDirect(const void *opaque)
+{
+    const struct testIOHelperData *data = opaque;
+    virCommandPtr cmd = NULL;
+    char *image = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (virAsprintf(&image, "%s/image", scratchdir) < 0)
+        goto cleanup;
+
+    /* Not every file system supports O_DIRECT */
+    if ((fd = open(image, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0600)) < 0) {
+        if (errno == EINVAL)
+            ret = EXIT_AM_SKIP;
+        goto cleanup;
+    }
+
+    cmd = testIOHelperCommand(data, image, 0, fd);
+    fd = -1;
+    virCommandSetInputBuffer(cmd, pattern);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+
+    if (testIOHelperCompare(image, DATA_LEN) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    virCommandFree(cmd);
+    VIR_FORCE_CLOSE(fd);
+    if (image)
+        unlink(image);
+    VIR_FREE(image);
+    return ret;
+}
+
+
+/* O_DIRECT cannot write the data which follows a short read, so the
+ * helper has to give up rather than leave a hole in the file */
+static int
+testIOHelperDirectShortRead(const void *opaque)
+{
+    const struct testIOHelperData *data = opaque;
+    virCommandPtr cmd = NULL;
+    char *image = NULL;
+    char *errbuf = NULL;
+    int status;
+    int fd = -1;
+    int ret = -1;
+
+    if (virAsprintf(&image, "%s/image", scratchdir) < 0)
+        goto cleanup;
+
+    /* Not every file system supports O_DIRECT */
+    if ((fd = open(image, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0600)) < 0) {
+        if (errno == EINVAL)
+            ret = EXIT_AM_SKIP;
+        goto cleanup;
+    }
+
+    cmd = testIOHelperCommand(data, image, 0, fd);
+    fd = -1;
+    virCommandAddEnvPair(cmd, "LD_PRELOAD", IOHELPER_MOCK);
+    virCommandSetInputBuffer(cmd, pattern);
+    virCommandSetErrorBuffer(cmd, &errbuf);
+    if (virCommandRun(cmd, &status) < 0)
+        goto cleanup;
+
+    if (status == 0) {
+        VIR_TEST_DEBUG("%s", "Helper carried on after two short reads\n");
+        goto cleanup;
+    }
+    if (!strstr(errbuf, "Too many short reads")) {
+        VIR_TEST_DEBUG("Unexpected error: %s\n", errbuf);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virCommandFree(cmd);
+    VIR_FORCE_CLOSE(fd);
+    if (image)
+        unlink(image);
+    VIR_FREE(image);
+    VIR_FREE(errbuf);
+    return ret;
+}
+
+
+#define SCRATCHDIRTEMPLATE abs_builddir "/iohelperdir-XXXXXX"
+
+static int
+mymain(void)
+{
+    char dir[] = SCRATCHDIRTEMPLATE;
+    size_t i;
+    int ret = 0;
+
+    if (!mkdtemp(dir)) {
+        virFilePrintf(stderr, "Cannot create iohelperdir");
+        abort();
+    }
+    scratchdir = dir;
+
+    /* The helper may stop reading its input early */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (VIR_ALLOC_N(pattern, DATA_LEN + 1) < 0)
+        return EXIT_FAILURE;
+    for (i = 0; i < DATA_LEN; i++)
+        pattern[i] = 'A' + i % 53 % 26;
+
+#define DO_TEST(NAME, FUNC, QUEUE_DEPTH, ZERO_COPY)                     \
+    do {                                                                \
+        struct testIOHelperData data = {                                \
+            QUEUE_DEPTH, ZERO_COPY                                      \
+        };                                                              \
+        if (virTestRun(NAME, FUNC, &data) < 0)                          \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("serial copy", testIOHelperCopy, "1", "0");
+    DO_TEST("pipelined copy", testIOHelperCopy, "4", "0");
+    DO_TEST("zero copy", testIOHelperCopy, "4", "1");
+    DO_TEST("serial length", testIOHelperLength, "1", "0");
+    DO_TEST("pipelined length", testIOHelperLength, "4", "0");
+    DO_TEST("zero copy length", testIOHelperLength, "4", "1");
+    DO_TEST("serial O_DIRECT", testIOHelperDirect, "1", "0");
+    DO_TEST("pipelined O_DIRECT", testIOHelperDirect, "4", "0");
+    DO_TEST("O_DIRECT short read", testIOHelperDirectShortRead, "4", "0");
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    VIR_FREE(pattern);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -6,9 +6,14 @@
 #include <time.h>
 
 #include "internal.h"
+#include "viralloc.h"
+#include "virbuffer.h"
 #include "virjson.h"
+#include "virstring.h"
 #include "testutils.h"
 
+#define VIR_FROM_THIS VIR_FROM_NONE
+
 struct testInfo {
     const char *doc;
     const char *expect;
@@ -311,6 +316,330 @@ testJSONCopy(const void *data)
 }
 
 
+/* Feed @doc, made of QMP-like messages separated by "\r\n", to a
+ * stream parser @chunk bytes at a time, and compare the values it
+ * returns with @expect, formatted and separated by '\n' */
+static int
+testJSONStreamChunked(const struct testInfo *info,
+                      size_t chunk)
+{
+    virJSONStreamParserPtr stream = NULL;
+    virJSONValuePtr value = NULL;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t doclen = strlen(info->doc);
+    size_t start = 0;
+    size_t avail = 0;
+    char *result = NULL;
+    char *str = NULL;
+    ssize_t used;
+    int ret = -1;
+
+    if (!(stream = virJSONStreamParserNew(0)))
+        goto cleanup;
+
+    while (avail < doclen) {
+        avail = MIN(avail + chunk, doclen);
+
+        /* Like a monitor would, pass everything not returned yet */
+        while ((used = virJSONStreamParserFeed(stream, info->doc + start,
+                                               avail - start, &value)) > 0) {
+            if (!(str = virJSONValueToString(value, false)))
+                goto cleanup;
+            virBufferAsprintf(&buf, "%s\n", str);
+            VIR_FREE(str);
+            virJSONValueFree(value);
+            value = NULL;
+            start += used;
+        }
+
+        if (used < 0) {
+            if (info->pass)
+                VIR_TEST_VERBOSE("Failed to parse %s\n", info->doc);
+            else
+                ret = 0;
+            goto cleanup;
+        }
+    }
+
+    if (!info->pass) {
+        VIR_TEST_VERBOSE("Should not have parsed %s\n", info->doc);
+        goto cleanup;
+    }
+
+    if (virBufferCheckError(&buf) < 0)
+        goto cleanup;
+
+    result = virBufferContentAndReset(&buf);
+    if (STRNEQ_NULLABLE(result, info->expect)) {
+        virTestDifference(stderr, info->expect, result);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virBufferFreeAndReset(&buf);
+    virJSONStreamParserFree(stream);
+    virJSONValueFree(value);
+    VIR_FREE(result);
+    VIR_FREE(str);
+    return ret;
+}
+
+
+static int
+testJSONStream(const void *data)
+{
+    const struct testInfo *info = data;
+    size_t chunk;
+
+    /* Split messages at every possible position */
+    for (chunk = 1; chunk <= strlen(info->doc); chunk++) {
+        if (testJSONStreamChunked(info, chunk) < 0) {
+            VIR_TEST_VERBOSE("Failed with %zu bytes chunks\n", chunk);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int
+testJSONLookupIndexed(const void *data ATTRIBUTE_UNUSED)
+{
+    virJSONValuePtr json = NULL;
+    virJSONValuePtr value = NULL;
+    char *result = NULL;
+    char *key = NULL;
+    const size_t nkeys = 64;
+    int ret = -1;
+    size_t i;
+    int n;
+
+    if (!(json = virJSONValueNewObject()))
+        goto cleanup;
+
+    for (i = 0; i < nkeys; i++) {
+        if (virAsprintf(&key, "key%zu", i) < 0 ||
+            virJSONValueObjectAppendNumberInt(json, key, i) < 0)
+            goto cleanup;
+        VIR_FREE(key);
+    }
+
+    /* Every third key goes away, which shifts those after it */
+    for (i = 0; i < nkeys; i += 3) {
+        if (virAsprintf(&key, "key%zu", i) < 0)
+            goto cleanup;
+        if (virJSONValueObjectGetNumberInt(json, key, &n) < 0 || n != i) {
+            VIR_TEST_VERBOSE("Wrong value for '%s'\n", key);
+            goto cleanup;
+        }
+        if (virJSONValueObjectRemoveKey(json, key, &value) != 1) {
+            VIR_TEST_VERBOSE("Failed to remove '%s'\n", key);
+            goto cleanup;
+        }
+        virJSONValueFree(value);
+        value = NULL;
+        VIR_FREE(key);
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        if (virAsprintf(&key, "key%zu", i) < 0)
+            goto cleanup;
+        if (i % 3 == 0) {
+            if (virJSONValueObjectHasKey(json, key) != 0) {
+                VIR_TEST_VERBOSE("Removed key '%s' still present\n", key);
+                goto cleanup;
+            }
+            if (virJSONValueObjectAppendNumberInt(json, key, i) < 0)
+                goto cleanup;
+        }
+        if (virJSONValueObjectGetNumberInt(json, key, &n) < 0 || n != i) {
+            VIR_TEST_VERBOSE("Wrong value for '%s'\n", key);
+            goto cleanup;
+        }
+        VIR_FREE(key);
+    }
+
+    if (virJSONValueObjectKeysNumber(json) != nkeys) {
+        VIR_TEST_VERBOSE("Expected %zu keys\n", nkeys);
+        goto cleanup;
+    }
+
+    /* Formatting keeps the order in which the keys were added */
+    if (!(result = virJSONValueToString(json, false)))
+        goto cleanup;
+
+    if (!STRPREFIX(result, "{\"key1\":1,\"key2\":2,\"key4\":4,") ||
+        !strstr(result, ",\"key60\":60,\"key63\":63}")) {
+        VIR_TEST_VERBOSE("Unexpected order of keys: %s\n", result);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(result);
+    VIR_FREE(key);
+    virJSONValueFree(value);
+    virJSONValueFree(json);
+    return ret;
+}
+
+
+#define NUM_SCHEMA_PARSES 20
+#define NUM_SCHEMA_WALKS 200
+
+/* Cut the query-qmp-schema reply out of a capabilities replies file,
+ * where each reply is an object starting and ending at column 0 */
+static char *
+testJSONLoadSchemaReply(const char *path)
+{
+    char *buf = NULL;
+    char *start;
+    char *end;
+    char *reply = NULL;
+
+    if (virTestLoadFile(path, &buf) < 0)
+        return NULL;
+
+    if (!(start = strstr(buf, "\"meta-type\""))) {
+        VIR_TEST_VERBOSE("No schema reply in %s\n", path);
+        goto cleanup;
+    }
+
+    while (start > buf && !(start[-1] == '\n' && start[0] == '{'))
+        start--;
+
+    if (!(end = strstr(start, "\n}"))) {
+        VIR_TEST_VERBOSE("Unterminated schema reply in %s\n", path);
+        goto cleanup;
+    }
+
+    ignore_value(VIR_STRNDUP(reply, start, end - start + 2));
+
+ cleanup:
+    VIR_FREE(buf);
+    return reply;
+}
+
+
+/* Resolve the types referenced by @entry the way the QEMU driver
+ * does when it probes for features in the schema */
+static size_t
+testJSONSchemaWalkEntry(virJSONValuePtr schema,
+                        virJSONValuePtr entry)
+{
+    const char *metatype = virJSONValueObjectGetString(entry, "meta-type");
+    const char *keys[] = { "arg-type", "ret-type", "element-type", "data" };
+    virJSONValuePtr members;
+    size_t found = 0;
+    size_t i;
+
+    if (!metatype)
+        return 0;
+
+    for (i = 0; i < ARRAY_CARDINALITY(keys); i++) {
+        const char *name = virJSONValueObjectGetString(entry, keys[i]);
+
+        if (name && virJSONValueObjectGet(schema, name))
+            found++;
+    }
+
+    if ((members = virJSONValueObjectGetArray(entry, "members"))) {
+        for (i = 0; i < virJSONValueArraySize(members); i++) {
+            virJSONValuePtr member = virJSONValueArrayGet(members, i);
+            const char *type = virJSONValueObjectGetString(member, "type");
+
+            if (type && virJSONValueObjectGet(schema, type))
+                found++;
+        }
+    }
+
+    return found;
+}
+
+
+static int
+testJSONSchemaBench(const void *data)
+{
+    const char *path = data;
+    virJSONValuePtr json = NULL;
+    virJSONValuePtr schema = NULL;
+    virJSONValuePtr entries;
+    char *reply = NULL;
+    unsigned long long start, parsed, walked;
+    size_t found = 0;
+    size_t nentries;
+    int ret = -1;
+    size_t i, j;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (!(reply = testJSONLoadSchemaReply(path)))
+        goto cleanup;
+
+    start = virTestNowMicros();
+
+    for (i = 0; i < NUM_SCHEMA_PARSES; i++) {
+        virJSONValueFree(json);
+        if (!(json = virJSONValueFromString(reply)))
+            goto cleanup;
+    }
+
+    parsed = virTestNowMicros();
+
+    /* Entries are looked up by name, like virQEMUCapsProbeQMPSchema
+     * does by turning the reply array into an object */
+    if (!(entries = virJSONValueObjectGetArray(json, "return")) ||
+        !(schema = virJSONValueNewObject()))
+        goto cleanup;
+
+    nentries = virJSONValueArraySize(entries);
+    for (i = 0; i < nentries; i++) {
+        virJSONValuePtr entry = virJSONValueArrayGet(entries, i);
+        const char *name = virJSONValueObjectGetString(entry, "name");
+        virJSONValuePtr copy;
+
+        if (!name || !(copy = virJSONValueCopy(entry)))
+            goto cleanup;
+
+        if (virJSONValueObjectAppend(schema, name, copy) < 0) {
+            virJSONValueFree(copy);
+            goto cleanup;
+        }
+    }
+
+    walked = virTestNowMicros();
+
+    for (i = 0; i < NUM_SCHEMA_WALKS; i++) {
+        for (j = 0; j < nentries; j++) {
+            virJSONValuePtr entry = virJSONValueArrayGet(entries, j);
+            const char *name = virJSONValueObjectGetString(entry, "name");
+
+            found += testJSONSchemaWalkEntry(schema,
+                                             virJSONValueObjectGet(schema, name));
+        }
+    }
+
+    if (found == 0) {
+        VIR_TEST_VERBOSE("No type references resolved\n");
+        goto cleanup;
+    }
+
+    VIR_TEST_VERBOSE("%zu entries, %.2fms/parse, %.2fms/walk ", nentries,
+                     (parsed - start) / 1000.0 / NUM_SCHEMA_PARSES,
+                     (virTestNowMicros() - walked) / 1000.0 / NUM_SCHEMA_WALKS);
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(reply);
+    virJSONValueFree(schema);
+    virJSONValueFree(json);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -448,6 +777,31 @@ mymain(void)
                  "{ \"a\": {}, \"b\": 1, \"c\": \"str\", \"d\": [] }",
                  NULL, true);
 
+    DO_TEST_FULL("lookup in large object", LookupIndexed, NULL, NULL, true);
+
+    DO_TEST_FULL("stream of messages", Stream,
+                 "{\"QMP\": {\"capabilities\": []}}\r\n"
+                 "{\"return\": {}, \"id\": \"libvirt-1\"}\r\n"
+                 "{\"timestamp\": {\"seconds\": 1, \"microseconds\": 2}, "
+                 "\"event\": \"STOP\"}\r\n"
+                 "{\"return\": [{\"name\": \"a}\\\"]\"}, []], "
+                 "\"id\": \"libvirt-2\"}\r\n",
+                 "{\"QMP\":{\"capabilities\":[]}}\n"
+                 "{\"return\":{},\"id\":\"libvirt-1\"}\n"
+                 "{\"timestamp\":{\"seconds\":1,\"microseconds\":2},"
+                 "\"event\":\"STOP\"}\n"
+                 "{\"return\":[{\"name\":\"a}\\\"]\"},[]],"
+                 "\"id\":\"libvirt-2\"}\n",
+                 true);
+    DO_TEST_FULL("stream with garbage", Stream,
+                 "{\"return\": {}}\r\n{\"return\": ]}\r\n", NULL, false);
+    DO_TEST_FULL("stream with duplicate key", Stream,
+                 "{\"return\": {}, \"return\": {}}\r\n", NULL, false);
+
+    if (virTestRun("schema lookup benchmark", testJSONSchemaBench,
+                   abs_srcdir "/qemucapabilitiesdata/caps_2.8.0.x86_64.replies") < 0)
+        ret = -1;
+
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
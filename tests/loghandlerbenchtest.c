@@ -0,0 +1,238 @@
+/*
+ * loghandlerbenchtest.c: Measure how fast virtlogd drains guest pipes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "log_handler.h"
+#include "viralloc.h"
+#include "viratomic.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "virtime.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+/* Total amount of output, spread over all the pipes */
+#define LINE_LEN 128
+#define NUM_LINES (512 * 1024)
+
+struct testLogHandlerBenchData {
+    size_t npipes;
+};
+
+struct testLogHandlerBenchWriter {
+    int fd;
+    size_t nlines;
+};
+
+
+static void
+testLogHandlerBenchInhibitor(bool inhibit,
+                             void *opaque)
+{
+    int *active = opaque;
+
+    if (inhibit)
+        virAtomicIntInc(active);
+    else
+        virAtomicIntDecAndTest(active);
+}
+
+
+/* Stand in for a guest printing to its serial console
+ * one line at a time */
+static void
+testLogHandlerBenchWrite(void *opaque)
+{
+    struct testLogHandlerBenchWriter *writer = opaque;
+    char line[LINE_LEN];
+    size_t i;
+
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    for (i = 0; i < writer->nlines; i++) {
+        if (safewrite(writer->fd, line, sizeof(line)) != sizeof(line))
+            break;
+    }
+
+    VIR_FORCE_CLOSE(writer->fd);
+}
+
+
+static int
+testLogHandlerBench(const void *opaque)
+{
+    const struct testLogHandlerBenchData *data = opaque;
+    struct testLogHandlerBenchWriter *writers = NULL;
+    virThread *threads = NULL;
+    virLogHandlerPtr handler = NULL;
+    char *dir = NULL;
+    char *path = NULL;
+    int active = 0;
+    unsigned long long start, end;
+    size_t nstarted = 0;
+    size_t i;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (VIR_STRDUP(dir, "/tmp/loghandlerbench-XXXXXX") < 0)
+        return -1;
+    if (!mkdtemp(dir)) {
+        VIR_FREE(dir);
+        return -1;
+    }
+
+    if (VIR_ALLOC_N(writers, data->npipes) < 0 ||
+        VIR_ALLOC_N(threads, data->npipes) < 0)
+        goto cleanup;
+
+    for (i = 0; i < data->npipes; i++)
+        writers[i].fd = -1;
+
+    /* Large enough for no rollover to happen */
+    if (!(handler = virLogHandlerNew(false, 1024 * 1024 * 1024, 3,
+                                     testLogHandlerBenchInhibitor, &active)))
+        goto cleanup;
+
+    for (i = 0; i < data->npipes; i++) {
+        unsigned char uuid[VIR_UUID_BUFLEN] = { 0 };
+        char name[32];
+        ino_t inode;
+        off_t offset;
+
+        memcpy(uuid, &i, sizeof(i));
+        snprintf(name, sizeof(name), "bench-%zu", i);
+
+        if (virAsprintf(&path, "%s/%s.log", dir, name) < 0)
+            goto cleanup;
+
+        writers[i].nlines = NUM_LINES / data->npipes;
+        if ((writers[i].fd = virLogHandlerDomainOpenLogFile(handler, "qemu",
+                                                            uuid, name, path,
+                                                            true, &inode,
+                                                            &offset)) < 0)
+            goto cleanup;
+
+        VIR_FREE(path);
+    }
+
+    if (virTimeMillisNow(&start) < 0)
+        goto cleanup;
+
+    for (nstarted = 0; nstarted < data->npipes; nstarted++) {
+        if (virThreadCreate(&threads[nstarted], true,
+                            testLogHandlerBenchWrite,
+                            &writers[nstarted]) < 0)
+            goto join;
+    }
+
+    /* Each file is closed once its writer went away */
+    while (virAtomicIntGet(&active) > 0) {
+        if (virEventRunDefaultImpl() < 0)
+            goto join;
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        goto join;
+
+    for (i = 0; i < data->npipes; i++) {
+        struct stat sb;
+
+        if (virAsprintf(&path, "%s/bench-%zu.log", dir, i) < 0)
+            goto join;
+
+        if (stat(path, &sb) < 0 ||
+            sb.st_size != (off_t) (writers[i].nlines * LINE_LEN)) {
+            VIR_TEST_DEBUG("%s is incomplete\n", path);
+            goto join;
+        }
+
+        VIR_FREE(path);
+    }
+
+    VIR_TEST_VERBOSE("%.2fMiB/s ",
+                     (NUM_LINES / data->npipes) * data->npipes * LINE_LEN /
+                     (1024.0 * 1024.0) / ((end - start + 1) / 1000.0));
+    ret = 0;
+
+ join:
+    /* Writers still running fail with EPIPE instead of blocking */
+    virObjectUnref(handler);
+    handler = NULL;
+    for (i = 0; i < nstarted; i++)
+        virThreadJoin(&threads[i]);
+
+ cleanup:
+    if (writers) {
+        for (i = nstarted; i < data->npipes; i++)
+            VIR_FORCE_CLOSE(writers[i].fd);
+    }
+    virObjectUnref(handler);
+    virFileDeleteTree(dir);
+    VIR_FREE(writers);
+    VIR_FREE(threads);
+    VIR_FREE(path);
+    VIR_FREE(dir);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    size_t pipes[] = { 1, 16, 64, 256 };
+    size_t i;
+
+    if (virThreadInitialize() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        return EXIT_FAILURE;
+
+    signal(SIGPIPE, SIG_IGN);
+
+#define DO_TEST(PIPES)                                                  \
+    do {                                                                \
+        struct testLogHandlerBenchData data = { PIPES };                \
+        char *name = NULL;                                              \
+        if (virAsprintf(&name, "%zu concurrently writing pipes",        \
+                        data.npipes) < 0)                               \
+            return EXIT_FAILURE;                                        \
+        if (virTestRun(name, testLogHandlerBench, &data) < 0)           \
+            ret = -1;                                                   \
+        VIR_FREE(name);                                                 \
+    } while (0)
+
+    for (i = 0; i < ARRAY_CARDINALITY(pipes); i++)
+        DO_TEST(pipes[i]);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -44,6 +44,22 @@ static const char *abs_top_srcdir;
 #  error "test case not ported to this platform"
 # endif
 
+/* Record the rules fed to the *-restore commands */
+static void
+testCommandDryRunInput(const char *const*args ATTRIBUTE_UNUSED,
+                       const char *const*env ATTRIBUTE_UNUSED,
+                       const char *input,
+                       char **output ATTRIBUTE_UNUSED,
+                       char **error ATTRIBUTE_UNUSED,
+                       int *status ATTRIBUTE_UNUSED,
+                       void *opaque)
+{
+    virBufferPtr buf = opaque;
+
+    if (input)
+        virBufferAdd(buf, input, -1);
+}
+
 static int testCompareXMLToArgvFiles(const char *xml,
                                      const char *cmdline)
 {
@@ -53,7 +69,7 @@ static int testCompareXMLToArgvFiles(const char *xml,
     virNetworkDefPtr def = NULL;
     int ret = -1;
 
-    virCommandSetDryRun(&buf, NULL, NULL);
+    virCommandSetDryRun(&buf, testCommandDryRunInput, &buf);
 
     if (!(def = virNetworkDefParseFile(xml)))
         goto cleanup;
@@ -83,6 +99,7 @@ static int testCompareXMLToArgvFiles(const char *xml,
 
 struct testInfo {
     const char *name;
+    bool restore;
 };
 
 
@@ -96,8 +113,9 @@ testCompareXMLToIPTablesHelper(const void *data)
 
     if (virAsprintf(&xml, "%s/networkxml2firewalldata/%s.xml",
                     abs_srcdir, info->name) < 0 ||
-        virAsprintf(&args, "%s/networkxml2firewalldata/%s-%s.args",
-                    abs_srcdir, info->name, RULESTYPE) < 0)
+        virAsprintf(&args, "%s/networkxml2firewalldata/%s-%s%s.args",
+                    abs_srcdir, info->name,
+                    info->restore ? "restore-" : "", RULESTYPE) < 0)
         goto cleanup;
 
     result = testCompareXMLToArgvFiles(xml, args);
@@ -118,16 +136,21 @@ mymain(void)
     if (!abs_top_srcdir)
         abs_top_srcdir = abs_srcdir "/..";
 
-# define DO_TEST(name)                                                  \
+# define DO_TEST_FULL(prefix, name, restore)                            \
     do {                                                                \
         static struct testInfo info = {                                 \
-            name,                                                       \
+            name, restore,                                              \
         };                                                              \
-        if (virTestRun("Network XML-2-iptables " name,                  \
+        if (virTestRun(prefix " " name,                                 \
                        testCompareXMLToIPTablesHelper, &info) < 0)      \
             ret = -1;                                                   \
     } while (0)
 
+# define DO_TEST(name)                                                  \
+    DO_TEST_FULL("Network XML-2-iptables", name, false)
+# define DO_TEST_RESTORE(name)                                          \
+    DO_TEST_FULL("Network XML-2-iptables-restore", name, true)
+
     virFirewallSetLockOverride(true);
 
     if (virFirewallSetBackend(VIR_FIREWALL_BACKEND_DIRECT) < 0) {
@@ -143,11 +166,23 @@ mymain(void)
     DO_TEST("route-default");
     DO_TEST("route-default");
 
+    if (virFirewallSetBackend(VIR_FIREWALL_BACKEND_RESTORE) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    DO_TEST_RESTORE("nat-default");
+    DO_TEST_RESTORE("nat-tftp");
+    DO_TEST_RESTORE("nat-many-ips");
+    DO_TEST_RESTORE("nat-no-dhcp");
+    DO_TEST_RESTORE("nat-ipv6");
+    DO_TEST_RESTORE("route-default");
+
  cleanup:
     return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-VIRT_TEST_MAIN(mymain)
+VIRT_TEST_MAIN_PRELOAD(mymain, abs_builddir "/.libs/virfirewallmock.so")
 
 #else /* ! defined (__linux__) */
 
@@ -35,6 +35,8 @@
 static int (*real_open)(const char *path, int flags, ...);
 static DIR * (*real_opendir)(const char *name);
 static int (*real_access)(const char *path, int mode);
+static int (*real_stat)(const char *path, struct stat *sb);
+static int (*real___xstat)(int ver, const char *path, struct stat *sb);
 
 # define LEASEDIR LOCALSTATEDIR "/lib/libvirt/dnsmasq/"
 
@@ -50,15 +52,20 @@ init_syms(void)
     VIR_MOCK_REAL_INIT(open);
     VIR_MOCK_REAL_INIT(opendir);
     VIR_MOCK_REAL_INIT(access);
+    VIR_MOCK_REAL_INIT_ALT(stat, __xstat);
 }
 
 static int
 getrealpath(char **newpath,
             const char *path)
 {
+    /* Tests which modify the lease files work on a copy of nssdata
+     * named by NSS_MOCK_LEASEDIR */
+    const char *leasedir = getenv("NSS_MOCK_LEASEDIR");
+
     if (STRPREFIX(path, LEASEDIR)) {
-        if (virAsprintfQuiet(newpath, "%s/nssdata/%s",
-                             abs_srcdir,
+        if (virAsprintfQuiet(newpath, "%s/%s",
+                             leasedir ? leasedir : abs_srcdir "/nssdata",
                              path + strlen(LEASEDIR)) < 0) {
             errno = ENOMEM;
             return -1;
@@ -133,6 +140,42 @@ access(const char *path, int mode)
     free(newpath);
     return ret;
 }
+
+int
+__xstat(int ver, const char *path, struct stat *sb)
+{
+    int ret;
+    char *newpath = NULL;
+
+    init_syms();
+
+    if (STRPREFIX(path, LEASEDIR) &&
+        getrealpath(&newpath, path) < 0)
+        return -1;
+
+    ret = real___xstat(ver, newpath ? newpath : path, sb);
+
+    free(newpath);
+    return ret;
+}
+
+int
+stat(const char *path, struct stat *sb)
+{
+    int ret;
+    char *newpath = NULL;
+
+    init_syms();
+
+    if (STRPREFIX(path, LEASEDIR) &&
+        getrealpath(&newpath, path) < 0)
+        return -1;
+
+    ret = real_stat(newpath ? newpath : path, sb);
+
+    free(newpath);
+    return ret;
+}
 #else
 /* Nothing to override if NSS plugin is not enabled */
 #endif
@@ -28,11 +28,19 @@
 # include <arpa/inet.h>
 # include "libvirt_nss.h"
 # include "virsocketaddr.h"
+# include "virfile.h"
+# include "virstring.h"
+# include "virtime.h"
 
 # define VIR_FROM_THIS VIR_FROM_NONE
 
 # define BUF_SIZE 1024
 
+/* Lookups made by the throughput benchmark */
+# define NUM_LOOKUPS 100000
+
+# define LEASEDIRTEMPLATE abs_builddir "/nssleasedir-XXXXXX"
+
 struct testNSSData {
     const char *hostname;
     const char *const *ipAddr;
@@ -169,6 +177,183 @@ testGetHostByName(const void *opaque)
     return ret;
 }
 
+
+/* Resolve the same name over and over, as build jobs talking
+ * to their guests do */
+static int
+testGetHostByNameBench(const void *opaque)
+{
+    const struct testNSSData *data = opaque;
+    struct hostent resolved;
+    char buf[BUF_SIZE];
+    int rv, tmp_errno = 0, tmp_herrno = 0;
+    unsigned long long start, end;
+    size_t i;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (virTimeMillisNow(&start) < 0)
+        return -1;
+
+    for (i = 0; i < NUM_LOOKUPS; i++) {
+        rv = NSS_NAME(gethostbyname2)(data->hostname,
+                                      data->af,
+                                      &resolved,
+                                      buf, sizeof(buf),
+                                      &tmp_errno,
+                                      &tmp_herrno);
+
+        if (rv != NSS_STATUS_SUCCESS) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           "Resolving of %s failed", data->hostname);
+            return -1;
+        }
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        return -1;
+
+    VIR_TEST_VERBOSE("%.0f lookups/s ",
+                     NUM_LOOKUPS / ((end - start + 1) / 1000.0));
+    return 0;
+}
+
+/* A lease file replacing the one in nssdata/virbr0.status */
+static const char *replacedStatus =
+    "[\n"
+    "    {\n"
+    "        \"ip-address\": \"192.168.122.100\",\n"
+    "        \"mac-address\": \"52:54:00:11:22:33\",\n"
+    "        \"hostname\": \"fedora\",\n"
+    "        \"expiry-time\": 2000000000\n"
+    "    }\n"
+    "]\n";
+
+# if !defined(LIBVIRT_NSS_GUEST)
+#  define CACHE_NAME "fedora"
+static const char *const cacheOrig[] = {
+    "192.168.122.197", "192.168.122.198", "192.168.122.199", NULL
+};
+static const char *const cacheReplaced[] = {
+    "192.168.122.100", "192.168.122.199", NULL
+};
+static const char *const cacheRemoved[] = { "192.168.122.199", NULL };
+# else /* defined(LIBVIRT_NSS_GUEST) */
+#  define CACHE_NAME "debian"
+static const char *const cacheOrig[] = { "192.168.122.2", NULL };
+static const char *const cacheReplaced[] = { "192.168.122.100", NULL };
+static const char *const cacheRemoved[] = { NULL };
+# endif /* defined(LIBVIRT_NSS_GUEST) */
+
+
+static int
+testCopyLeaseFile(const char *dir,
+                  const char *name)
+{
+    char *src = NULL;
+    char *dst = NULL;
+    char *buf = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&src, "%s/nssdata/%s", abs_srcdir, name) < 0 ||
+        virAsprintf(&dst, "%s/%s", dir, name) < 0 ||
+        virFileReadAll(src, 1024 * 1024, &buf) < 0 ||
+        virFileWriteStr(dst, buf, 0644) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(src);
+    VIR_FREE(dst);
+    VIR_FREE(buf);
+    return ret;
+}
+
+
+/* Replace a lease file the way the leases helper does, by renaming
+ * a new file over it */
+static int
+testReplaceLeaseFile(const char *dir,
+                     const char *name,
+                     const char *content)
+{
+    char *path = NULL;
+    char *tmp = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&path, "%s/%s", dir, name) < 0 ||
+        virAsprintf(&tmp, "%s.new", path) < 0 ||
+        virFileWriteStr(tmp, content, 0644) < 0 ||
+        rename(tmp, path) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(path);
+    VIR_FREE(tmp);
+    return ret;
+}
+
+
+/* The leases are kept between lookups, so check they are read again
+ * once a lease file is replaced or removed */
+static int
+testCacheInvalidate(const void *opaque ATTRIBUTE_UNUSED)
+{
+    const char *files[] = {
+        "virbr0.status", "virbr0.macs", "virbr1.status", "virbr1.macs",
+    };
+    char dir[] = LEASEDIRTEMPLATE;
+    char *path = NULL;
+    struct testNSSData data = { .hostname = CACHE_NAME, .af = AF_INET };
+    size_t i;
+    int ret = -1;
+
+    if (!mkdtemp(dir)) {
+        virReportSystemError(errno, "%s", "Cannot create lease dir");
+        return -1;
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(files); i++) {
+        if (testCopyLeaseFile(dir, files[i]) < 0)
+            goto cleanup;
+    }
+
+    if (setenv("NSS_MOCK_LEASEDIR", dir, 1) < 0)
+        goto cleanup;
+
+    data.ipAddr = cacheOrig;
+    if (testGetHostByName(&data) < 0)
+        goto cleanup;
+
+    /* Looked up once more, to make sure it is cached */
+    if (testGetHostByName(&data) < 0 ||
+        testReplaceLeaseFile(dir, "virbr0.status", replacedStatus) < 0)
+        goto cleanup;
+
+    data.ipAddr = cacheReplaced;
+    if (testGetHostByName(&data) < 0)
+        goto cleanup;
+
+    if (virAsprintf(&path, "%s/virbr0.status", dir) < 0 ||
+        unlink(path) < 0)
+        goto cleanup;
+
+    data.ipAddr = cacheRemoved;
+    if (testGetHostByName(&data) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    unsetenv("NSS_MOCK_LEASEDIR");
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(dir);
+    VIR_FREE(path);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -184,17 +369,32 @@ mymain(void)
             ret = -1;                                           \
     } while (0)
 
+# define DO_BENCH(name, family)                                 \
+    do {                                                        \
+        struct testNSSData data = {                             \
+            .hostname = name, .ipAddr = NULL, .af = family,     \
+        };                                                      \
+        if (virTestRun("lookup throughput of " name,            \
+                       testGetHostByNameBench, &data) < 0)      \
+            ret = -1;                                           \
+    } while (0)
+
 # if !defined(LIBVIRT_NSS_GUEST)
     DO_TEST("fedora", AF_INET, "192.168.122.197", "192.168.122.198", "192.168.122.199");
     DO_TEST("gentoo", AF_INET, "192.168.122.254");
     DO_TEST("gentoo", AF_INET6, "2001:1234:dead:beef::2");
     DO_TEST("gentoo", AF_UNSPEC, "192.168.122.254");
     DO_TEST("non-existent", AF_UNSPEC, NULL);
+    DO_BENCH("fedora", AF_INET);
 # else /* defined(LIBVIRT_NSS_GUEST) */
     DO_TEST("debian", AF_INET, "192.168.122.2");
     DO_TEST("suse", AF_INET, "192.168.122.3");
+    DO_BENCH("debian", AF_INET);
 # endif /* defined(LIBVIRT_NSS_GUEST) */
 
+    if (virTestRun("cache invalidation", testCacheInvalidate, NULL) < 0)
+        ret = -1;
+
     return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -0,0 +1,222 @@
+/*
+ * nwfilterdhcpsnooptest.c: rewriting DHCP snooping lease files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "testutils.h"
+
+#ifdef HAVE_LIBPCAP
+
+# include "internal.h"
+# include "viralloc.h"
+# include "virfile.h"
+# include "virstring.h"
+
+# define __NWFILTER_DHCPSNOOP_PRIV_H_ALLOW__
+# include "nwfilter/nwfilter_dhcpsnooppriv.h"
+
+# define VIR_FROM_THIS VIR_FROM_NONE
+
+# define LEASE_A "1999999999 52c09cb7-ac8f-4c5b-a5d3-c3b3f4d9ed7a-52-54-00-aa-bb-01 192.168.122.11 192.168.122.1\n"
+# define LEASE_B "1999999999 52c09cb7-ac8f-4c5b-a5d3-c3b3f4d9ed7a-52-54-00-aa-bb-02 192.168.122.12 192.168.122.1\n"
+# define LEASE_C "1999999999 52c09cb7-ac8f-4c5b-a5d3-c3b3f4d9ed7a-52-54-00-aa-bb-03 192.168.122.13 192.168.122.1\n"
+# define LEASE_GONE "0 52c09cb7-ac8f-4c5b-a5d3-c3b3f4d9ed7a-52-54-00-aa-bb-01 192.168.122.11 192.168.122.1\n"
+
+struct testReplaceData {
+    size_t idx;
+    const char *before;  /* appended before the leases are collected */
+    const char *leases;  /* the leases collected */
+    int nLeases;
+    const char *tail;    /* appended while the file is rewritten */
+};
+
+static char *scratchdir;
+
+
+static int
+testShardAppend(virNWFilterSnoopLeaseShardPtr shard,
+                const char *lease)
+{
+    int ret;
+
+    if (!lease)
+        return 0;
+
+    virMutexLock(&shard->lock);
+    ret = virNWFilterSnoopLeaseShardAppend(shard, lease);
+    virMutexUnlock(&shard->lock);
+
+    return ret;
+}
+
+
+static int
+testShardCheck(virNWFilterSnoopLeaseShardPtr shard,
+               const char *expected,
+               int wLeases)
+{
+    char *actual = NULL;
+    int ret = -1;
+
+    if (virFileReadAll(shard->path, 1024 * 1024, &actual) < 0)
+        goto cleanup;
+
+    if (STRNEQ(actual, expected)) {
+        virTestDifference(stderr, expected, actual);
+        goto cleanup;
+    }
+
+    if (shard->size != (off_t) strlen(expected)) {
+        VIR_TEST_DEBUG("Expected size %zu, got %lld\n",
+                       strlen(expected), (long long) shard->size);
+        goto cleanup;
+    }
+
+    if (wLeases >= 0 && shard->wLeases != wLeases) {
+        VIR_TEST_DEBUG("Expected %d written leases, got %d\n",
+                       wLeases, shard->wLeases);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(actual);
+    return ret;
+}
+
+
+/* The rewritten file holds the collected leases followed by what was
+ * appended since they were collected, and takes further appends */
+static int
+testShardReplace(const void *opaque)
+{
+    const struct testReplaceData *data = opaque;
+    virNWFilterSnoopLeaseShard shard;
+    char *expected = NULL;
+    int tailLeases = 0;
+    off_t start;
+    const char *p;
+    int ret = -1;
+
+    if (virNWFilterSnoopLeaseShardInit(&shard, scratchdir, data->idx) < 0)
+        return -1;
+
+    virMutexLock(&shard.compactLock);
+
+    if (testShardAppend(&shard, data->before) < 0) {
+        virMutexUnlock(&shard.compactLock);
+        goto cleanup;
+    }
+
+    virMutexLock(&shard.lock);
+    start = shard.size;
+    virMutexUnlock(&shard.lock);
+
+    if (testShardAppend(&shard, data->tail) < 0 ||
+        virNWFilterSnoopLeaseShardReplace(&shard, data->leases,
+                                          data->nLeases, start) < 0) {
+        virMutexUnlock(&shard.compactLock);
+        goto cleanup;
+    }
+
+    virMutexUnlock(&shard.compactLock);
+
+    for (p = data->tail; p && *p; p++) {
+        if (*p == '\n')
+            tailLeases++;
+    }
+
+    if (virAsprintf(&expected, "%s%s",
+                    data->leases ? data->leases : "",
+                    data->tail ? data->tail : "") < 0 ||
+        testShardCheck(&shard, expected, data->nLeases + tailLeases) < 0)
+        goto cleanup;
+
+    if (virFileExists(shard.tmpPath)) {
+        VIR_TEST_DEBUG("%s was left behind\n", shard.tmpPath);
+        goto cleanup;
+    }
+
+    VIR_FREE(expected);
+    if (testShardAppend(&shard, LEASE_C) < 0 ||
+        virAsprintf(&expected, "%s%s%s",
+                    data->leases ? data->leases : "",
+                    data->tail ? data->tail : "", LEASE_C) < 0 ||
+        testShardCheck(&shard, expected, -1) < 0)
+        goto cleanup;
+
+    ret = 0;
+ cleanup:
+    if (shard.path)
+        unlink(shard.path);
+    virNWFilterSnoopLeaseShardClear(&shard);
+    VIR_FREE(expected);
+    return ret;
+}
+
+
+# define SCRATCHDIRTEMPLATE abs_builddir "/nwfilterdhcpsnoopdir-XXXXXX"
+
+static int
+mymain(void)
+{
+    char dir[] = SCRATCHDIRTEMPLATE;
+    size_t idx = 0;
+    int ret = 0;
+
+    if (!mkdtemp(dir)) {
+        virFilePrintf(stderr, "Cannot create nwfilterdhcpsnoopdir");
+        abort();
+    }
+    scratchdir = dir;
+
+# define DO_TEST(NAME, BEFORE, LEASES, NLEASES, TAIL)                   \
+    do {                                                                \
+        struct testReplaceData data = {                                 \
+            idx++, BEFORE, LEASES, NLEASES, TAIL                        \
+        };                                                              \
+        if (virTestRun(NAME, testShardReplace, &data) < 0)              \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("replace", LEASE_A LEASE_B LEASE_GONE, LEASE_B, 1, NULL);
+    DO_TEST("replace with tail", LEASE_A LEASE_B LEASE_GONE, LEASE_B, 1,
+            LEASE_A);
+    DO_TEST("replace with longer tail", LEASE_A LEASE_GONE, NULL, 0,
+            LEASE_A LEASE_B);
+    DO_TEST("replace empty file", NULL, NULL, 0, NULL);
+    DO_TEST("replace empty file with tail", NULL, NULL, 0, LEASE_B);
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
+
+#else
+int
+main(void)
+{
+    return EXIT_AM_SKIP;
+}
+#endif
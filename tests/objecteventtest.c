@@ -94,6 +94,12 @@ lifecycleEventCounter_reset(lifecycleEventCounter *counter)
     counter->deletedEvents = 0;
 }
 
+typedef struct {
+    int events;
+    int state;
+    bool balloon;
+} statsEventCounter;
+
 typedef struct {
     virConnectPtr conn;
     virNetworkPtr net;
@@ -131,6 +137,32 @@ domainLifecycleCb(virConnectPtr conn ATTRIBUTE_UNUSED,
     return 0;
 }
 
+static void
+domainStatsCb(virConnectPtr conn ATTRIBUTE_UNUSED,
+              virDomainStatsRecordPtr *stats,
+              int nstats,
+              void *opaque)
+{
+    statsEventCounter *counter = opaque;
+    size_t i;
+
+    counter->events++;
+    counter->state = -1;
+    counter->balloon = false;
+
+    for (i = 0; i < nstats; i++) {
+        if (STRNEQ(virDomainGetName(stats[i]->dom), "test"))
+            continue;
+
+        if (virTypedParamsGetInt(stats[i]->params, stats[i]->nparams,
+                                 "state.state", &counter->state) < 0)
+            counter->state = -1;
+        counter->balloon = !!virTypedParamsGet(stats[i]->params,
+                                               stats[i]->nparams,
+                                               "balloon.current");
+    }
+}
+
 static void
 networkLifecycleCb(virConnectPtr conn ATTRIBUTE_UNUSED,
                    virNetworkPtr net ATTRIBUTE_UNUSED,
@@ -758,6 +790,58 @@ testNodeDeviceCreateXML(const void *data)
     return ret;
 }
 
+static int
+testDomainStatsEvent(const void *data)
+{
+    const objecteventTest *test = data;
+    statsEventCounter counter = { 0, -1, false };
+    virDomainPtr dom;
+    int id;
+    int ret = -1;
+
+    if (!(dom = virDomainLookupByName(test->conn, "test")))
+        return -1;
+
+    if ((id = virConnectDomainStatsEventRegister(test->conn,
+                                                 VIR_DOMAIN_STATS_STATE |
+                                                 VIR_DOMAIN_STATS_BALLOON,
+                                                 1, domainStatsCb,
+                                                 &counter, NULL, 0)) < 0)
+        goto cleanup;
+
+    /* The first sample reports everything */
+    while (counter.events < 1) {
+        if (virEventRunDefaultImpl() < 0)
+            goto deregister;
+    }
+
+    if (counter.state != VIR_DOMAIN_RUNNING || !counter.balloon)
+        goto deregister;
+
+    if (virDomainSuspend(dom) < 0)
+        goto deregister;
+
+    /* The next one only what changed */
+    while (counter.events < 2) {
+        if (virEventRunDefaultImpl() < 0)
+            goto resume;
+    }
+
+    if (counter.state != VIR_DOMAIN_PAUSED || counter.balloon)
+        goto resume;
+
+    ret = 0;
+
+ resume:
+    virDomainResume(dom);
+ deregister:
+    if (virConnectDomainStatsEventDeregister(test->conn, id) < 0)
+        ret = -1;
+ cleanup:
+    virDomainFree(dom);
+    return ret;
+}
+
 static void
 timeout(int id ATTRIBUTE_UNUSED, void *opaque ATTRIBUTE_UNUSED)
 {
@@ -797,6 +881,8 @@ mymain(void)
         ret = EXIT_FAILURE;
     if (virTestRun("Domain start stop events", testDomainStartStopEvent, &test) < 0)
         ret = EXIT_FAILURE;
+    if (virTestRun("Domain statistics events", testDomainStatsEvent, &test) < 0)
+        ret = EXIT_FAILURE;
 
     /* Network event tests */
     /* Tests requiring the test network not to be set up*/
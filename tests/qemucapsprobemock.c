@@ -53,23 +53,25 @@ qemuMonitorSend(qemuMonitorPtr mon,
 }
 
 
-static int (*realQemuMonitorJSONIOProcessLine)(qemuMonitorPtr mon,
-                                               const char *line,
-                                               qemuMonitorMessagePtr msg);
+static int (*realQemuMonitorJSONIOProcessMessage)(qemuMonitorPtr mon,
+                                                  virJSONValuePtr obj,
+                                                  const char *line,
+                                                  qemuMonitorMessagePtr msg);
 
 int
-qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
-                             const char *line,
-                             qemuMonitorMessagePtr msg)
+qemuMonitorJSONIOProcessMessage(qemuMonitorPtr mon,
+                                virJSONValuePtr obj,
+                                const char *line,
+                                qemuMonitorMessagePtr msg)
 {
     static bool first = true;
     virJSONValuePtr value = NULL;
     char *json = NULL;
     int ret;
 
-    REAL_SYM(realQemuMonitorJSONIOProcessLine);
+    REAL_SYM(realQemuMonitorJSONIOProcessMessage);
 
-    ret = realQemuMonitorJSONIOProcessLine(mon, line, msg);
+    ret = realQemuMonitorJSONIOProcessMessage(mon, obj, line, msg);
 
     if (ret == 0 &&
         (value = virJSONValueFromString(line)) &&
@@ -19,6 +19,7 @@
 
 #include <config.h>
 
+
 #include "testutils.h"
 #include "testutilsqemu.h"
 #include "qemumonitortestutils.h"
@@ -2659,6 +2660,191 @@ testQemuMonitorCPUInfo(const void *opaque)
 }
 
 
+struct testQemuMonitorJSONBenchData {
+    size_t ndisks;
+    virDomainXMLOptionPtr xmlopt;
+};
+
+
+/* A query-block reply for a guest with @ndisks disks, on one line
+ * the way QEMU sends it */
+static char *
+testQemuMonitorJSONBenchReply(size_t ndisks)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t i;
+
+    virBufferAddLit(&buf, "{\"return\": [");
+    for (i = 0; i < ndisks; i++) {
+        virBufferAsprintf(&buf,
+                          "%s{\"io-status\": \"ok\", "
+                          "\"device\": \"drive-virtio-disk%zu\", "
+                          "\"locked\": false, \"removable\": false, "
+                          "\"inserted\": {\"iops_rd\": 5, \"iops_wr\": 6, "
+                          "\"ro\": false, \"backing_file_depth\": 0, "
+                          "\"drv\": \"qcow2\", \"iops\": 4, \"bps_wr\": 3, "
+                          "\"encrypted\": false, \"bps\": 1, \"bps_rd\": 2, "
+                          "\"bps_max\": 7, \"iops_max\": 10, "
+                          "\"bps_rd_max\": 8, \"bps_wr_max\": 9, "
+                          "\"iops_rd_max\": 11, \"iops_wr_max\": 12, "
+                          "\"iops_size\": 13, \"group\": \"group14\", "
+                          "\"file\": \"/var/lib/libvirt/images/disk%zu.qcow2\", "
+                          "\"encryption_key_missing\": false}, "
+                          "\"type\": \"unknown\"}",
+                          i ? ", " : "", i, i);
+    }
+    virBufferAddLit(&buf, "], \"id\": \"libvirt-1\"}\r\n");
+
+    if (virBufferCheckError(&buf) < 0)
+        return NULL;
+
+    return virBufferContentAndReset(&buf);
+}
+
+
+/* Feed @reply through the monitor buffer the way qemuMonitorIORead
+ * fills it from a socket with everything available, processing the
+ * buffer after each read. Either with the line based processing the
+ * JSON monitor used to do, which waits for the line ending, copies the
+ * line out of the buffer and parses it in one go, or by resuming the
+ * stream parser. @peak is filled with the largest amount of memory
+ * the buffers took at once */
+static int
+testQemuMonitorJSONBenchRun(qemuMonitorPtr mon,
+                            const char *reply,
+                            bool stream,
+                            size_t *peak,
+                            virJSONValuePtr *obj)
+{
+    virJSONStreamParserPtr parser = NULL;
+    qemuMonitorMessage msg;
+    size_t replylen = strlen(reply);
+    size_t offset = 0;
+    size_t length = 0;
+    size_t sent = 0;
+    char *buffer = NULL;
+    char *line = NULL;
+    int ret = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    *peak = 0;
+
+    if (stream && !(parser = virJSONStreamParserNew(0)))
+        goto cleanup;
+
+    while (!msg.finished) {
+        size_t avail = length - offset;
+        size_t got;
+        int used = 0;
+
+        /* Both modes grow the buffer like qemuMonitorIORead, so
+         * only the processing differs */
+        if (avail < 1024) {
+            if (VIR_EXPAND_N(buffer, length, MAX(1024, length / 2)) < 0)
+                goto cleanup;
+            avail = length - offset;
+        }
+
+        if (sent == replylen) {
+            VIR_TEST_VERBOSE("reply was not processed\n");
+            goto cleanup;
+        }
+
+        got = MIN(avail - 1, replylen - sent);
+        memcpy(buffer + offset, reply + sent, got);
+        sent += got;
+        offset += got;
+        buffer[offset] = '\0';
+
+        if (stream) {
+            if ((used = qemuMonitorJSONIOProcess(mon, parser, buffer,
+                                                 offset, &msg)) < 0)
+                goto cleanup;
+        } else {
+            char *nl = strstr(buffer, "\r\n");
+            virJSONValuePtr value;
+
+            if (nl) {
+                if (VIR_STRNDUP(line, buffer, nl - buffer) < 0)
+                    goto cleanup;
+                used = nl - buffer + 2;
+                *peak = MAX(*peak, length + used);
+
+                if (!(value = virJSONValueFromString(line)) ||
+                    qemuMonitorJSONIOProcessMessage(mon, value, line, &msg) < 0)
+                    goto cleanup;
+                VIR_FREE(line);
+            }
+        }
+
+        *peak = MAX(*peak, length);
+        memmove(buffer, buffer + used, offset - used);
+        offset -= used;
+    }
+
+    *obj = msg.rxObject;
+    ret = 0;
+
+ cleanup:
+    virJSONStreamParserFree(parser);
+    VIR_FREE(buffer);
+    VIR_FREE(line);
+    return ret;
+}
+
+
+static int
+testQemuMonitorJSONBenchStream(const void *opaque)
+{
+    const struct testQemuMonitorJSONBenchData *data = opaque;
+    qemuMonitorTestPtr test = NULL;
+    virJSONValuePtr objs[2] = { NULL, NULL };
+    unsigned long long times[2];
+    size_t peaks[2];
+    char *reply = NULL;
+    int ret = -1;
+    size_t i;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (!(test = qemuMonitorTestNewSimple(true, data->xmlopt)) ||
+        !(reply = testQemuMonitorJSONBenchReply(data->ndisks)))
+        goto cleanup;
+
+    for (i = 0; i < ARRAY_CARDINALITY(objs); i++) {
+        unsigned long long start = virTestNowMicros();
+
+        if (testQemuMonitorJSONBenchRun(qemuMonitorTestGetMonitor(test),
+                                        reply, i == 1, &peaks[i],
+                                        &objs[i]) < 0)
+            goto cleanup;
+
+        times[i] = virTestNowMicros() - start;
+
+        if (virJSONValueArraySize(virJSONValueObjectGet(objs[i], "return")) !=
+            data->ndisks) {
+            VIR_TEST_VERBOSE("expected %zu disks\n", data->ndisks);
+            goto cleanup;
+        }
+    }
+
+    VIR_TEST_VERBOSE("%zuKiB: line based %.1fms peak %zuKiB, "
+                     "streaming %.1fms peak %zuKiB ",
+                     strlen(reply) / 1024,
+                     times[0] / 1000.0, peaks[0] / 1024,
+                     times[1] / 1000.0, peaks[1] / 1024);
+
+    ret = 0;
+ cleanup:
+    virJSONValueFree(objs[0]);
+    virJSONValueFree(objs[1]);
+    VIR_FREE(reply);
+    qemuMonitorTestFree(test);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -2793,6 +2979,18 @@ mymain(void)
     DO_TEST_CPU_INFO("ppc64-hotplug-4", 24);
     DO_TEST_CPU_INFO("ppc64-no-threads", 16);
 
+#define DO_TEST_BENCH_STREAM(ndisks)                                           \
+    do {                                                                       \
+        struct testQemuMonitorJSONBenchData data = { ndisks, driver.xmlopt };  \
+        if (virTestRun("query-block reply with " # ndisks " disks",           \
+                       testQemuMonitorJSONBenchStream, &data) < 0)             \
+            ret = -1;                                                          \
+    } while (0)
+
+    DO_TEST_BENCH_STREAM(100);
+    DO_TEST_BENCH_STREAM(1000);
+    DO_TEST_BENCH_STREAM(10000);
+
     qemuTestDriverFree(&driver);
 
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
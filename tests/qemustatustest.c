@@ -0,0 +1,303 @@
+/*
+ * qemustatustest.c: deferred writing of domain status XML
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "qemu/qemu_status.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+/* Long enough for nothing to be written before the flusher is freed */
+#define NEVER_DELAY (60 * 60 * 1000)
+#define SHORT_DELAY 200
+/* How long to give the flusher thread to write a status at most */
+#define WRITE_TIMEOUT (30 * 1000)
+
+static const char *domainXML =
+    "<domain type='test'>"
+    "  <name>flusher</name>"
+    "  <uuid>c7a5fdbd-edaf-9455-926a-d65c16db1809</uuid>"
+    "  <memory>219100</memory>"
+    "  <os><type arch='x86_64'>hvm</type></os>"
+    "</domain>";
+
+static virCapsPtr caps;
+static virDomainXMLOptionPtr xmlopt;
+static char *statusdir;
+
+/* Stands in for the QEMU driver, counting the writes */
+typedef struct _testStatusSaver testStatusSaver;
+struct _testStatusSaver {
+    virMutex lock;
+    virCond cond;
+    size_t saves;
+    unsigned long long lastSave; /* in virCondMonotonicNow time */
+};
+
+
+static int
+testStatusSave(virDomainObjPtr vm,
+               void *opaque)
+{
+    testStatusSaver *saver = opaque;
+    unsigned long long now;
+
+    if (virDomainSaveStatus(xmlopt, statusdir, vm, caps) < 0 ||
+        virCondMonotonicNow(&now) < 0)
+        return -1;
+
+    virMutexLock(&saver->lock);
+    saver->saves++;
+    saver->lastSave = now;
+    virCondSignal(&saver->cond);
+    virMutexUnlock(&saver->lock);
+
+    return 0;
+}
+
+
+static size_t
+testStatusSaves(testStatusSaver *saver)
+{
+    size_t saves;
+
+    virMutexLock(&saver->lock);
+    saves = saver->saves;
+    virMutexUnlock(&saver->lock);
+
+    return saves;
+}
+
+
+static virDomainObjPtr
+testStatusDomain(void)
+{
+    virDomainObjPtr vm;
+
+    if (!(vm = virDomainObjNew(xmlopt)))
+        return NULL;
+
+    if (!(vm->def = virDomainDefParseString(domainXML, caps, xmlopt, NULL,
+                                            0))) {
+        virObjectUnlock(vm);
+        virObjectUnref(vm);
+        return NULL;
+    }
+    /* Running, so that its status is saved */
+    vm->def->id = 1;
+
+    virObjectUnlock(vm);
+    return vm;
+}
+
+
+static int
+testStatusMarkDirty(qemuStatusFlusherPtr flusher,
+                    virDomainObjPtr vm,
+                    size_t count)
+{
+    size_t i;
+    int ret = 0;
+
+    virObjectLock(vm);
+    for (i = 0; i < count && ret == 0; i++)
+        ret = qemuStatusFlusherMarkDirty(flusher, vm);
+    virObjectUnlock(vm);
+
+    return ret;
+}
+
+
+typedef enum {
+    TEST_STATUS_COALESCE,    /* many changes, one write on free */
+    TEST_STATUS_SYNCHRONOUS, /* saved before the flusher gets to it */
+    TEST_STATUS_INACTIVE,    /* stopped before the flusher gets to it */
+} testStatusMode;
+
+
+/* Whatever is pending is written out, once, when the flusher is freed */
+static int
+testStatusFree(const void *opaque)
+{
+    const testStatusMode *mode = opaque;
+    testStatusSaver saver = { .saves = 0 };
+    qemuStatusFlusherPtr flusher = NULL;
+    virDomainObjPtr vm = NULL;
+    size_t expected = *mode == TEST_STATUS_COALESCE ? 1 : 0;
+    int ret = -1;
+
+    if (virMutexInit(&saver.lock) < 0)
+        return -1;
+    if (virCondInit(&saver.cond) < 0) {
+        virMutexDestroy(&saver.lock);
+        return -1;
+    }
+
+    if (!(vm = testStatusDomain()) ||
+        !(flusher = qemuStatusFlusherNew(NEVER_DELAY, testStatusSave,
+                                         &saver)))
+        goto cleanup;
+
+    if (testStatusMarkDirty(flusher, vm, 20) < 0)
+        goto cleanup;
+
+    virObjectLock(vm);
+    if (*mode == TEST_STATUS_SYNCHRONOUS &&
+        virDomainSaveStatus(xmlopt, statusdir, vm, caps) < 0) {
+        virObjectUnlock(vm);
+        goto cleanup;
+    }
+    if (*mode == TEST_STATUS_INACTIVE)
+        vm->def->id = -1;
+    virObjectUnlock(vm);
+
+    qemuStatusFlusherFree(flusher);
+    flusher = NULL;
+
+    if (testStatusSaves(&saver) != expected) {
+        VIR_TEST_DEBUG("Expected %zu writes, got %zu\n",
+                       expected, testStatusSaves(&saver));
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    qemuStatusFlusherFree(flusher);
+    virObjectUnref(vm);
+    virCondDestroy(&saver.cond);
+    virMutexDestroy(&saver.lock);
+    return ret;
+}
+
+
+/* A change is written once its delay has passed, not before, and
+ * the next change is written again after its own delay */
+static int
+testStatusDeadline(const void *opaque ATTRIBUTE_UNUSED)
+{
+    testStatusSaver saver = { .saves = 0 };
+    qemuStatusFlusherPtr flusher = NULL;
+    virDomainObjPtr vm = NULL;
+    unsigned long long marked;
+    unsigned long long timeout;
+    size_t i;
+    int ret = -1;
+
+    if (virMutexInit(&saver.lock) < 0)
+        return -1;
+    if (virCondInit(&saver.cond) < 0) {
+        virMutexDestroy(&saver.lock);
+        return -1;
+    }
+
+    if (!(vm = testStatusDomain()) ||
+        !(flusher = qemuStatusFlusherNew(SHORT_DELAY, testStatusSave,
+                                         &saver)))
+        goto cleanup;
+
+    for (i = 1; i <= 2; i++) {
+        if (virCondMonotonicNow(&marked) < 0 ||
+            testStatusMarkDirty(flusher, vm, 5) < 0 ||
+            virTimeMillisNow(&timeout) < 0)
+            goto cleanup;
+        timeout += WRITE_TIMEOUT;
+
+        virMutexLock(&saver.lock);
+        while (saver.saves < i) {
+            if (virCondWaitUntil(&saver.cond, &saver.lock, timeout) < 0 &&
+                errno == ETIMEDOUT)
+                break;
+        }
+
+        if (saver.saves != i) {
+            VIR_TEST_DEBUG("Expected %zu writes, got %zu\n", i, saver.saves);
+            virMutexUnlock(&saver.lock);
+            goto cleanup;
+        }
+        if (saver.lastSave < marked + SHORT_DELAY) {
+            VIR_TEST_DEBUG("Written after %llums instead of %dms\n",
+                           saver.lastSave - marked, SHORT_DELAY);
+            virMutexUnlock(&saver.lock);
+            goto cleanup;
+        }
+        virMutexUnlock(&saver.lock);
+    }
+
+    ret = 0;
+ cleanup:
+    qemuStatusFlusherFree(flusher);
+    virObjectUnref(vm);
+    virCondDestroy(&saver.cond);
+    virMutexDestroy(&saver.lock);
+    return ret;
+}
+
+
+#define STATUSDIRTEMPLATE abs_builddir "/qemustatusdir-XXXXXX"
+
+static int
+mymain(void)
+{
+    char dir[] = STATUSDIRTEMPLATE;
+    testStatusMode coalesce = TEST_STATUS_COALESCE;
+    testStatusMode synchronous = TEST_STATUS_SYNCHRONOUS;
+    testStatusMode inactive = TEST_STATUS_INACTIVE;
+    int ret = 0;
+
+    if (!mkdtemp(dir)) {
+        virFilePrintf(stderr, "Cannot create qemustatusdir");
+        abort();
+    }
+    statusdir = dir;
+
+    if (!(caps = virTestGenericCapsInit()) ||
+        !(xmlopt = virTestGenericDomainXMLConfInit())) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (virTestRun("Coalesce changes", testStatusFree, &coalesce) < 0)
+        ret = -1;
+    if (virTestRun("Skip after synchronous save", testStatusFree,
+                   &synchronous) < 0)
+        ret = -1;
+    if (virTestRun("Skip inactive domain", testStatusFree, &inactive) < 0)
+        ret = -1;
+    if (virTestRun("Write after delay", testStatusDeadline, NULL) < 0)
+        ret = -1;
+
+ cleanup:
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(statusdir);
+
+    virObjectUnref(caps);
+    virObjectUnref(xmlopt);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,74 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include "virmock.h"
+#include "virstring.h"
+
+#if HAVE_FALLOCATE - 0 && defined(FALLOC_FL_PUNCH_HOLE) && \
+    defined(FALLOC_FL_ZERO_RANGE)
+
+/* VIR_STORAGE_WIPE_MOCK_FALLOCATE lists the fallocate() modes the
+ * file system pretends to support, out of "zero" and "punch". The
+ * others fail like they would on a file system without them. Zeroing
+ * a range is done by punching a hole and allocating it again, as not
+ * every file system the tests run on can do it. */
+
+static bool
+storageBackendWipeMockSupported(const char *name)
+{
+    const char *modes = getenv("VIR_STORAGE_WIPE_MOCK_FALLOCATE");
+
+    return modes && strstr(modes, name);
+}
+
+
+VIR_MOCK_IMPL_RET_ARGS(fallocate, int,
+                       int, fd,
+                       int, mode,
+                       off_t, offset,
+                       off_t, len)
+{
+    VIR_MOCK_REAL_INIT(fallocate);
+
+    if (mode & FALLOC_FL_ZERO_RANGE) {
+        if (!storageBackendWipeMockSupported("zero")) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        if (real_fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           offset, len) < 0)
+            return -1;
+
+        return real_fallocate(fd, mode & FALLOC_FL_KEEP_SIZE, offset, len);
+    }
+
+    if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+        !storageBackendWipeMockSupported("punch")) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return real_fallocate(fd, mode, offset, len);
+}
+
+#endif
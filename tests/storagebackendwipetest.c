@@ -0,0 +1,224 @@
+/*
+ * storagebackendwipetest.c: wiping local storage volumes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+#include "testutils.h"
+
+#if HAVE_FALLOCATE - 0 && defined(FALLOC_FL_PUNCH_HOLE) && \
+    defined(FALLOC_FL_ZERO_RANGE)
+
+# include "storage/storage_backend.h"
+# include "viralloc.h"
+# include "virfile.h"
+# include "virstring.h"
+
+# define VIR_FROM_THIS VIR_FROM_NONE
+
+# define FILE_LEN (4 * 1024 * 1024)
+
+typedef enum {
+    TEST_WIPE_ZEROED,       /* all zeroes, still allocated */
+    TEST_WIPE_PUNCHED,      /* all zeroes, deallocated */
+    TEST_WIPE_WRITTEN,      /* zeroes written over the allocation only */
+    TEST_WIPE_UNSUPPORTED,  /* the wipe fails */
+} testWipeResult;
+
+struct testWipeData {
+    unsigned int algorithm;
+    const char *fallocate;  /* modes the mock file system supports */
+    testWipeResult result;
+};
+
+static char *scratchdir;
+
+
+static int
+testWipeCheck(const char *path,
+              const struct testWipeData *data)
+{
+    char *buf = NULL;
+    struct stat sb;
+    size_t zeroes = data->result == TEST_WIPE_WRITTEN ? FILE_LEN / 2 : FILE_LEN;
+    size_t i;
+    int ret = -1;
+
+    if (stat(path, &sb) < 0 ||
+        virFileReadAll(path, FILE_LEN, &buf) != FILE_LEN) {
+        VIR_TEST_DEBUG("%s has lost its size\n", path);
+        goto cleanup;
+    }
+
+    for (i = 0; i < FILE_LEN; i++) {
+        if (buf[i] != (i < zeroes ? 0 : 'x')) {
+            VIR_TEST_DEBUG("Unexpected data at offset %zu\n", i);
+            goto cleanup;
+        }
+    }
+
+    if ((data->result == TEST_WIPE_PUNCHED) !=
+        (sb.st_blocks * 512 < FILE_LEN)) {
+        VIR_TEST_DEBUG("%s has %lld blocks allocated\n",
+                       path, (long long) sb.st_blocks);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+
+static int
+testWipe(const void *opaque)
+{
+    const struct testWipeData *data = opaque;
+    virStorageVolDefPtr vol = NULL;
+    char *buf = NULL;
+    int fd = -1;
+    int rc;
+    int ret = -1;
+
+    if (VIR_ALLOC(vol) < 0 ||
+        VIR_ALLOC_N(buf, FILE_LEN) < 0 ||
+        virAsprintf(&vol->target.path, "%s/volume", scratchdir) < 0)
+        goto cleanup;
+
+    vol->target.format = VIR_STORAGE_FILE_RAW;
+    /* Writing zeroes stops here, wiping in place covers the whole
+     * file, so the two can be told apart */
+    vol->target.allocation = FILE_LEN / 2;
+    vol->target.capacity = FILE_LEN;
+
+    memset(buf, 'x', FILE_LEN);
+    if ((fd = open(vol->target.path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+        safewrite(fd, buf, FILE_LEN) != FILE_LEN ||
+        fdatasync(fd) < 0 ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    setenv("VIR_STORAGE_WIPE_MOCK_FALLOCATE", data->fallocate, 1);
+    rc = virStorageBackendVolWipeLocal(NULL, NULL, vol, data->algorithm, 0);
+    unsetenv("VIR_STORAGE_WIPE_MOCK_FALLOCATE");
+
+    if (data->result == TEST_WIPE_UNSUPPORTED) {
+        if (rc == 0) {
+            VIR_TEST_DEBUG("%s", "Wipe succeeded unexpectedly\n");
+            goto cleanup;
+        }
+        virResetLastError();
+    } else if (rc < 0 || testWipeCheck(vol->target.path, data) < 0) {
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    VIR_FORCE_CLOSE(fd);
+    if (vol && vol->target.path)
+        unlink(vol->target.path);
+    virStorageVolDefFree(vol);
+    VIR_FREE(buf);
+    return ret;
+}
+
+
+/* The mock still needs the real file system to punch holes */
+static bool
+testWipeCanPunchHoles(void)
+{
+    char *path = NULL;
+    int fd = -1;
+    bool ret = false;
+
+    if (virAsprintf(&path, "%s/probe", scratchdir) < 0)
+        return false;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0 &&
+        safewrite(fd, "x", 1) == 1) {
+        setenv("VIR_STORAGE_WIPE_MOCK_FALLOCATE", "punch", 1);
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        0, 1) == 0;
+        unsetenv("VIR_STORAGE_WIPE_MOCK_FALLOCATE");
+    }
+
+    VIR_FORCE_CLOSE(fd);
+    unlink(path);
+    VIR_FREE(path);
+    return ret;
+}
+
+
+# define SCRATCHDIRTEMPLATE abs_builddir "/storagewipedir-XXXXXX"
+
+static int
+mymain(void)
+{
+    char dir[] = SCRATCHDIRTEMPLATE;
+    int ret = 0;
+
+    if (!mkdtemp(dir)) {
+        virFilePrintf(stderr, "Cannot create storagewipedir");
+        abort();
+    }
+    scratchdir = dir;
+
+    if (!testWipeCanPunchHoles()) {
+        ret = EXIT_AM_SKIP;
+        goto cleanup;
+    }
+
+# define DO_TEST(NAME, ALGORITHM, FALLOCATE, RESULT)                    \
+    do {                                                                \
+        struct testWipeData data = {                                    \
+            VIR_STORAGE_VOL_WIPE_ALG_ ## ALGORITHM, FALLOCATE,          \
+            TEST_WIPE_ ## RESULT                                        \
+        };                                                              \
+        if (virTestRun(NAME, testWipe, &data) < 0)                      \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("zero with zero range", ZERO, "zero,punch", ZEROED);
+    DO_TEST("zero with punch hole", ZERO, "punch", PUNCHED);
+    DO_TEST("zero with writes", ZERO, "", WRITTEN);
+    DO_TEST("trim with punch hole", TRIM, "zero,punch", PUNCHED);
+    DO_TEST("trim unsupported", TRIM, "zero", UNSUPPORTED);
+
+ cleanup:
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    if (ret == EXIT_AM_SKIP)
+        return ret;
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN_PRELOAD(mymain, abs_builddir "/.libs/storagebackendwipemock.so")
+
+#else
+int
+main(void)
+{
+    return EXIT_AM_SKIP;
+}
+#endif
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
 #include "testutils.h"
 #include "internal.h"
 #include "viralloc.h"
@@ -832,6 +833,19 @@ virTestGetRegenerate(void)
     return testRegenerate;
 }
 
+/*
+ * Returns the time of the monotonic clock in microseconds, for
+ * benchmarks to time what they measure.
+ */
+unsigned long long
+virTestNowMicros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
 static int
 virTestSetEnvPath(void)
 {
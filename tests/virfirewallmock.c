@@ -0,0 +1,43 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "virmock.h"
+#include "virfile.h"
+
+/* The tests run the firewall commands dry, so pretend they are all
+ * installed for the backends which need them to be usable */
+static const char *const firewallCommands[] = {
+    EBTABLES_PATH, IPTABLES_PATH, IP6TABLES_PATH,
+    EBTABLES_RESTORE_PATH, IPTABLES_RESTORE_PATH, IP6TABLES_RESTORE_PATH,
+};
+
+VIR_MOCK_IMPL_RET_ARGS(virFileIsExecutable, bool,
+                       const char *, file)
+{
+    size_t i;
+
+    VIR_MOCK_REAL_INIT(virFileIsExecutable);
+
+    for (i = 0; i < ARRAY_CARDINALITY(firewallCommands); i++) {
+        if (STREQ(file, firewallCommands[i]))
+            return true;
+    }
+
+    return real_virFileIsExecutable(file);
+}
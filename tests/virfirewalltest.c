@@ -1123,6 +1123,280 @@ testFirewallQuery(const void *opaque ATTRIBUTE_UNUSED)
     return ret;
 }
 
+
+static void
+testFirewallRestoreHook(const char *const*args,
+                        const char *const*env,
+                        const char *input,
+                        char **output,
+                        char **error,
+                        int *status,
+                        void *opaque)
+{
+    virBufferPtr buf = opaque;
+
+    if (input) {
+        virBufferAdd(buf, input, -1);
+        /* Fake failure on the batch with this IP addr */
+        if (strstr(input, "-A INPUT --source-host 192.168.122.255 "))
+            *status = 1;
+        return;
+    }
+
+    testFirewallRollbackHook(args, env, input, output, error, status, NULL);
+}
+
+
+static int
+testFirewallRestoreBatch(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virBuffer cmdbuf = VIR_BUFFER_INITIALIZER;
+    virFirewallPtr fw = NULL;
+    int ret = -1;
+    const char *actual = NULL;
+    const char *expected =
+        IPTABLES_RESTORE_PATH " --noflush\n"
+        "*filter\n"
+        "-A INPUT --source-host 192.168.122.1 --jump ACCEPT\n"
+        "-A INPUT --source-host !192.168.122.1 --jump REJECT\n"
+        "COMMIT\n"
+        IPTABLES_PATH " -t nat -A POSTROUTING --source 192.168.122.0/24 --jump MASQUERADE\n"
+        IPTABLES_PATH " -A INPUT --source-host 192.168.122.127 --jump REJECT\n"
+        EBTABLES_RESTORE_PATH " --noflush\n"
+        "*nat\n"
+        "-N libvirt-J-vnet0\n"
+        "-A libvirt-J-vnet0 -s 01:02:03:04:05:06 -j ACCEPT\n"
+        "COMMIT\n"
+        IPTABLES_PATH " -A INPUT --source-host 192.168.122.128 --jump REJECT\n"
+        IPTABLES_PATH " -A INPUT --source-host 192.168.122.129 --jump REJECT\n";
+
+    if (virFirewallSetBackend(VIR_FIREWALL_BACKEND_RESTORE) < 0)
+        return -1;
+
+    virCommandSetDryRun(&cmdbuf, testFirewallRestoreHook, &cmdbuf);
+
+    fw = virFirewallNew();
+
+    virFirewallStartTransaction(fw, 0);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "192.168.122.1",
+                       "--jump", "ACCEPT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "!192.168.122.1",
+                       "--jump", "REJECT", NULL);
+
+    /* Lone rule for another table */
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-t", "nat",
+                       "-A", "POSTROUTING",
+                       "--source", "192.168.122.0/24",
+                       "--jump", "MASQUERADE", NULL);
+
+    /* Rules allowed to fail are never batched */
+    virFirewallAddRuleFull(fw, VIR_FIREWALL_LAYER_IPV4,
+                           true, NULL, NULL,
+                           "-A", "INPUT",
+                           "--source-host", "192.168.122.127",
+                           "--jump", "REJECT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_ETHERNET,
+                       "-t", "nat",
+                       "-N", "libvirt-J-vnet0", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_ETHERNET,
+                       "-t", "nat",
+                       "-A", "libvirt-J-vnet0",
+                       "-s", "01:02:03:04:05:06",
+                       "-j", "ACCEPT", NULL);
+
+    virFirewallStartTransaction(fw, VIR_FIREWALL_TRANSACTION_IGNORE_ERRORS);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "192.168.122.128",
+                       "--jump", "REJECT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "192.168.122.129",
+                       "--jump", "REJECT", NULL);
+
+    if (virFirewallApply(fw) < 0)
+        goto cleanup;
+
+    if (virBufferError(&cmdbuf))
+        goto cleanup;
+
+    actual = virBufferCurrentContent(&cmdbuf);
+
+    if (STRNEQ_NULLABLE(expected, actual)) {
+        fprintf(stderr, "Unexected command execution\n");
+        virTestDifference(stderr, expected, actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virBufferFreeAndReset(&cmdbuf);
+    virCommandSetDryRun(NULL, NULL, NULL);
+    virFirewallFree(fw);
+    return ret;
+}
+
+
+static int
+testFirewallRestoreRollback(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virBuffer cmdbuf = VIR_BUFFER_INITIALIZER;
+    virFirewallPtr fw = NULL;
+    int ret = -1;
+    const char *actual = NULL;
+    const char *expected =
+        IPTABLES_RESTORE_PATH " --noflush\n"
+        "*filter\n"
+        "-A INPUT --source-host 192.168.122.1 --jump ACCEPT\n"
+        "-A INPUT --source-host 192.168.122.255 --jump REJECT\n"
+        "-A INPUT --source-host !192.168.122.1 --jump REJECT\n"
+        "COMMIT\n"
+        IPTABLES_PATH " -A INPUT --source-host 192.168.122.1 --jump ACCEPT\n"
+        IPTABLES_PATH " -A INPUT --source-host 192.168.122.255 --jump REJECT\n"
+        IPTABLES_PATH " -D INPUT --source-host 192.168.122.1 --jump ACCEPT\n"
+        IPTABLES_PATH " -D INPUT --source-host 192.168.122.255 --jump REJECT\n"
+        IPTABLES_PATH " -D INPUT --source-host '!192.168.122.1' --jump REJECT\n";
+
+    if (virFirewallSetBackend(VIR_FIREWALL_BACKEND_RESTORE) < 0)
+        return -1;
+
+    virCommandSetDryRun(&cmdbuf, testFirewallRestoreHook, &cmdbuf);
+
+    fw = virFirewallNew();
+
+    virFirewallStartTransaction(fw, 0);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "192.168.122.1",
+                       "--jump", "ACCEPT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "192.168.122.255",
+                       "--jump", "REJECT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "!192.168.122.1",
+                       "--jump", "REJECT", NULL);
+
+    virFirewallStartRollback(fw, 0);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-D", "INPUT",
+                       "--source-host", "192.168.122.1",
+                       "--jump", "ACCEPT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-D", "INPUT",
+                       "--source-host", "192.168.122.255",
+                       "--jump", "REJECT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-D", "INPUT",
+                       "--source-host", "!192.168.122.1",
+                       "--jump", "REJECT", NULL);
+
+    if (virFirewallApply(fw) == 0) {
+        fprintf(stderr, "Firewall apply unexpectedly worked\n");
+        goto cleanup;
+    }
+
+    if (virTestOOMActive())
+        goto cleanup;
+
+    if (virBufferError(&cmdbuf))
+        goto cleanup;
+
+    actual = virBufferCurrentContent(&cmdbuf);
+
+    if (STRNEQ_NULLABLE(expected, actual)) {
+        fprintf(stderr, "Unexected command execution\n");
+        virTestDifference(stderr, expected, actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virBufferFreeAndReset(&cmdbuf);
+    virCommandSetDryRun(NULL, NULL, NULL);
+    virFirewallFree(fw);
+    return ret;
+}
+
+
+static int
+testFirewallRestoreAutomatic(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virBuffer cmdbuf = VIR_BUFFER_INITIALIZER;
+    virFirewallPtr fw = NULL;
+    int ret = -1;
+    const char *actual = NULL;
+    const char *expected =
+        IPTABLES_RESTORE_PATH " --noflush\n"
+        "*filter\n"
+        "-A INPUT --source-host 192.168.122.1 --jump ACCEPT\n"
+        "-A INPUT --source-host !192.168.122.1 --jump REJECT\n"
+        "COMMIT\n";
+
+    /* Only picked automatically when asked for */
+    fwDisabled = true;
+    virFirewallSetBatchRules(true);
+    if (virFirewallSetBackend(VIR_FIREWALL_BACKEND_AUTOMATIC) < 0)
+        goto cleanup;
+
+    virCommandSetDryRun(&cmdbuf, testFirewallRestoreHook, &cmdbuf);
+
+    fw = virFirewallNew();
+
+    virFirewallStartTransaction(fw, 0);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "192.168.122.1",
+                       "--jump", "ACCEPT", NULL);
+
+    virFirewallAddRule(fw, VIR_FIREWALL_LAYER_IPV4,
+                       "-A", "INPUT",
+                       "--source-host", "!192.168.122.1",
+                       "--jump", "REJECT", NULL);
+
+    if (virFirewallApply(fw) < 0)
+        goto cleanup;
+
+    if (virBufferError(&cmdbuf))
+        goto cleanup;
+
+    actual = virBufferCurrentContent(&cmdbuf);
+
+    if (STRNEQ_NULLABLE(expected, actual)) {
+        fprintf(stderr, "Unexected command execution\n");
+        virTestDifference(stderr, expected, actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virFirewallSetBatchRules(false);
+    virBufferFreeAndReset(&cmdbuf);
+    virCommandSetDryRun(NULL, NULL, NULL);
+    virFirewallFree(fw);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -1180,13 +1454,22 @@ mymain(void)
     RUN_TEST("chained rollback", testFirewallChainedRollback);
     RUN_TEST("query transaction", testFirewallQuery);
 
+    if (virTestRun("restore batch", testFirewallRestoreBatch, NULL) < 0)
+        ret = -1;
+    if (virTestRun("restore rollback", testFirewallRestoreRollback, NULL) < 0)
+        ret = -1;
+    if (virTestRun("restore automatic", testFirewallRestoreAutomatic, NULL) < 0)
+        ret = -1;
+
     return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 # if WITH_DBUS
-VIRT_TEST_MAIN_PRELOAD(mymain, abs_builddir "/.libs/virdbusmock.so")
+VIRT_TEST_MAIN_PRELOAD(mymain,
+                       abs_builddir "/.libs/virdbusmock.so",
+                       abs_builddir "/.libs/virfirewallmock.so")
 # else
-VIRT_TEST_MAIN(mymain)
+VIRT_TEST_MAIN_PRELOAD(mymain, abs_builddir "/.libs/virfirewallmock.so")
 # endif
 
 #else /* ! defined (__linux__) */
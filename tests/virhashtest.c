@@ -12,6 +12,8 @@
 #include "viralloc.h"
 #include "virlog.h"
 #include "virstring.h"
+#include "virthread.h"
+#include "virobject.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
@@ -597,6 +599,265 @@ testHashEqual(const void *data ATTRIBUTE_UNUSED)
 }
 
 
+/* Number of keys used by the incremental growth test and the
+ * benchmarks, and number of lookups of the latter per thread */
+#define NUM_KEYS 100000
+#define NUM_LOOKUPS 1000000
+
+static char **
+testHashGenerateKeys(size_t nkeys, size_t prefix)
+{
+    char **keys;
+    size_t i;
+
+    if (VIR_ALLOC_N(keys, nkeys + 1) < 0)
+        return NULL;
+
+    for (i = 0; i < nkeys; i++) {
+        if (virAsprintf(&keys[i], "key-%zu-%zu", prefix, i) < 0) {
+            virStringListFree(keys);
+            return NULL;
+        }
+    }
+
+    return keys;
+}
+
+
+static int
+testHashGrowIncremental(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashTablePtr hash;
+    char **keys;
+    size_t i, j;
+    int ret = -1;
+
+    if (!(keys = testHashGenerateKeys(NUM_KEYS / 10, 0)))
+        return -1;
+
+    if (!(hash = virHashCreate(1, NULL)))
+        goto cleanup;
+
+    /* Check that every entry stays reachable while the table grows
+     * and its entries are moved over by the following insertions
+     * and removals */
+    for (i = 0; keys[i]; i++) {
+        if (virHashAddEntry(hash, keys[i], keys[i]) < 0)
+            goto cleanup;
+
+        if (i % 3 == 2 &&
+            virHashRemoveEntry(hash, keys[i - 1]) < 0) {
+            VIR_TEST_VERBOSE("\nentry \"%s\" could not be removed\n",
+                             keys[i - 1]);
+            goto cleanup;
+        }
+
+        if (i % 997)
+            continue;
+
+        for (j = 0; j <= i; j++) {
+            void *payload = virHashLookup(hash, keys[j]);
+            bool removed = j % 3 == 1 && j < i;
+
+            if (removed ? !!payload : payload != keys[j]) {
+                VIR_TEST_VERBOSE("\nentry \"%s\" %s after %zu insertions\n",
+                                 keys[j], removed ? "still found" : "lost",
+                                 i + 1);
+                goto cleanup;
+            }
+        }
+    }
+
+    if (testHashCheckCount(hash, i - i / 3) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+ cleanup:
+    virHashFree(hash);
+    virStringListFree(keys);
+    return ret;
+}
+
+
+static int
+testHashInsertPause(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashTablePtr hash = NULL;
+    char **keys;
+    unsigned long long start, end, pause = 0, total = 0;
+    size_t i;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (!(keys = testHashGenerateKeys(NUM_KEYS, 0)))
+        return -1;
+
+    if (!(hash = virHashCreate(0, NULL)))
+        goto cleanup;
+
+    for (i = 0; keys[i]; i++) {
+        start = virTestNowMicros();
+        if (virHashAddEntry(hash, keys[i], keys[i]) < 0)
+            goto cleanup;
+        end = virTestNowMicros();
+
+        total += end - start;
+        if (end - start > pause)
+            pause = end - start;
+    }
+
+    VIR_TEST_VERBOSE("%.3fus/insert, %lluus longest ",
+                     (double) total / NUM_KEYS, pause);
+    ret = 0;
+
+ cleanup:
+    virHashFree(hash);
+    virStringListFree(keys);
+    return ret;
+}
+
+
+struct testHashParallelData {
+    size_t nthreads;
+    bool atomic;
+};
+
+struct testHashParallelThread {
+    const struct testHashParallelData *data;
+    virMutexPtr lock;
+    virHashTablePtr hash;
+    virHashAtomicPtr atomic;
+    char **keys;
+    unsigned int seed;
+    bool failed;
+};
+
+
+/* Insert this thread's keys, then look up random ones */
+static void
+testHashParallelWorker(void *opaque)
+{
+    struct testHashParallelThread *thr = opaque;
+    size_t nkeys = NUM_KEYS / thr->data->nthreads;
+    size_t i;
+
+    for (i = 0; i < nkeys; i++) {
+        int rc;
+
+        if (thr->atomic) {
+            rc = virHashAtomicUpdate(thr->atomic, thr->keys[i], thr->keys[i]);
+        } else {
+            virMutexLock(thr->lock);
+            rc = virHashAddEntry(thr->hash, thr->keys[i], thr->keys[i]);
+            virMutexUnlock(thr->lock);
+        }
+
+        if (rc < 0) {
+            thr->failed = true;
+            return;
+        }
+    }
+
+    for (i = 0; i < NUM_LOOKUPS / thr->data->nthreads; i++) {
+        const char *key = thr->keys[rand_r(&thr->seed) % nkeys];
+        void *payload;
+
+        if (thr->atomic) {
+            payload = virHashAtomicLookup(thr->atomic, key);
+        } else {
+            virMutexLock(thr->lock);
+            payload = virHashLookup(thr->hash, key);
+            virMutexUnlock(thr->lock);
+        }
+
+        if (payload != key) {
+            thr->failed = true;
+            return;
+        }
+    }
+}
+
+
+static int
+testHashParallel(const void *opaque)
+{
+    const struct testHashParallelData *data = opaque;
+    struct testHashParallelThread *thrs = NULL;
+    virThread *threads = NULL;
+    virMutex lock;
+    virHashTablePtr hash = NULL;
+    virHashAtomicPtr atomic = NULL;
+    unsigned long long start, end;
+    size_t nstarted = 0;
+    size_t i;
+    int ret = -1;
+
+    if (virTestGetExpensive() == 0)
+        return EXIT_AM_SKIP;
+
+    if (virMutexInit(&lock) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(thrs, data->nthreads) < 0 ||
+        VIR_ALLOC_N(threads, data->nthreads) < 0)
+        goto cleanup;
+
+    if (data->atomic ?
+        !(atomic = virHashAtomicNew(0, NULL)) :
+        !(hash = virHashCreate(0, NULL)))
+        goto cleanup;
+
+    for (i = 0; i < data->nthreads; i++) {
+        thrs[i].data = data;
+        thrs[i].lock = &lock;
+        thrs[i].hash = hash;
+        thrs[i].atomic = atomic;
+        thrs[i].seed = i;
+        if (!(thrs[i].keys = testHashGenerateKeys(NUM_KEYS / data->nthreads,
+                                                  i)))
+            goto cleanup;
+    }
+
+    start = virTestNowMicros();
+
+    for (nstarted = 0; nstarted < data->nthreads; nstarted++) {
+        if (virThreadCreate(&threads[nstarted], true,
+                            testHashParallelWorker, &thrs[nstarted]) < 0)
+            goto cleanup;
+    }
+
+    for (i = 0; i < nstarted; i++)
+        virThreadJoin(&threads[i]);
+    nstarted = 0;
+
+    end = virTestNowMicros();
+
+    for (i = 0; i < data->nthreads; i++) {
+        if (thrs[i].failed)
+            goto cleanup;
+    }
+
+    VIR_TEST_VERBOSE("%.2f ops/us ",
+                     (double) (NUM_KEYS + NUM_LOOKUPS) / (end - start));
+    ret = 0;
+
+ cleanup:
+    for (i = 0; i < nstarted; i++)
+        virThreadJoin(&threads[i]);
+    virHashFree(hash);
+    virObjectUnref(atomic);
+    for (i = 0; thrs && i < data->nthreads; i++)
+        virStringListFree(thrs[i].keys);
+    VIR_FREE(thrs);
+    VIR_FREE(threads);
+    virMutexDestroy(&lock);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -635,6 +896,30 @@ mymain(void)
     DO_TEST("Search", Search);
     DO_TEST("GetItems", GetItems);
     DO_TEST("Equal", Equal);
+    DO_TEST("Grow incrementally", GrowIncremental);
+    DO_TEST("Insert pause", InsertPause);
+
+#define DO_TEST_PARALLEL(NTHREADS, ATOMIC)                          \
+    do {                                                            \
+        struct testHashParallelData data = { NTHREADS, ATOMIC };    \
+        char *name = NULL;                                          \
+        if (virAsprintf(&name, "Parallel insert/lookup, "           \
+                        "%zu threads, %s", data.nthreads,           \
+                        data.atomic ? "striped" : "single lock") < 0) \
+            return EXIT_FAILURE;                                    \
+        if (virTestRun(name, testHashParallel, &data) < 0)          \
+            ret = -1;                                               \
+        VIR_FREE(name);                                             \
+    } while (0)
+
+    DO_TEST_PARALLEL(1, false);
+    DO_TEST_PARALLEL(1, true);
+    DO_TEST_PARALLEL(2, false);
+    DO_TEST_PARALLEL(2, true);
+    DO_TEST_PARALLEL(4, false);
+    DO_TEST_PARALLEL(4, true);
+    DO_TEST_PARALLEL(8, false);
+    DO_TEST_PARALLEL(8, true);
 
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,79 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "virmock.h"
+#include "virlease.h"
+#include "virerror.h"
+#include "virstring.h"
+
+/* Once VIR_LEASE_MOCK_FILE is about to be opened, the lease of the
+ * IP address in VIR_LEASE_MOCK_DELETE is deleted and the journal is
+ * folded into the file, as the leases helper could do between a
+ * reader reading the journal and reading the file. It happens only
+ * once, the first variable is unset then. */
+
+static int (*real_open)(const char *path, int flags, ...);
+
+static void
+virLeaseMockInterleave(const char *path)
+{
+    const char *file = getenv("VIR_LEASE_MOCK_FILE");
+    const char *ip = getenv("VIR_LEASE_MOCK_DELETE");
+
+    if (!file || !ip || STRNEQ(path, file))
+        return;
+
+    unsetenv("VIR_LEASE_MOCK_FILE");
+
+    if (virLeaseJournalDelete(file, ip) < 0 ||
+        virLeaseJournalCompact(file, NULL) < 0) {
+        fprintf(stderr, "Cannot compact %s: %s\n",
+                file, virGetLastErrorMessage());
+        abort();
+    }
+}
+
+
+int
+open(const char *path, int flags, ...)
+{
+    int ret;
+
+    VIR_MOCK_REAL_INIT(open);
+
+    virLeaseMockInterleave(path);
+
+    if (flags & O_CREAT) {
+        va_list ap;
+        mode_t mode;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+        ret = real_open(path, flags, mode);
+    } else {
+        ret = real_open(path, flags);
+    }
+
+    return ret;
+}
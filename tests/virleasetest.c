@@ -0,0 +1,340 @@
+/*
+ * virleasetest.c: Test the DHCP lease journal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virlease.h"
+#include "virstring.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+static char *leaseFile;
+
+
+static int
+testLeaseAdd(const char *ip,
+             const char *mac)
+{
+    virJSONValuePtr lease;
+    int ret = -1;
+
+    if (!(lease = virJSONValueNewObject()) ||
+        virJSONValueObjectAppendString(lease, "ip-address", ip) < 0 ||
+        virJSONValueObjectAppendString(lease, "mac-address", mac) < 0 ||
+        virJSONValueObjectAppendNumberLong(lease, "expiry-time", 1000) < 0)
+        goto cleanup;
+
+    ret = virLeaseJournalAdd(leaseFile, lease);
+
+ cleanup:
+    virJSONValueFree(lease);
+    return ret;
+}
+
+
+/* Compare the leases as read by the helper with @expect, and
+ * with those of a lease database */
+static int
+testLeaseCheck(virLeaseDBPtr db,
+               const char *expect)
+{
+    virJSONValuePtr leases = NULL;
+    char *actual = NULL;
+    char *cached = NULL;
+    int ret = -1;
+
+    if (!(leases = virJSONValueNewArray()) ||
+        virLeaseReadCustomLeaseFile(leases, leaseFile, NULL, NULL) < 0 ||
+        !(actual = virJSONValueToString(leases, false)))
+        goto cleanup;
+
+    if (STRNEQ(expect, actual)) {
+        virTestDifference(stderr, expect, actual);
+        goto cleanup;
+    }
+
+    if (db) {
+        if (virLeaseDBRefresh(db) < 0 ||
+            !(cached = virJSONValueToString(virLeaseDBGetLeases(db), false)))
+            goto cleanup;
+
+        if (STRNEQ(expect, cached)) {
+            virTestDifference(stderr, expect, cached);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+ cleanup:
+    virJSONValueFree(leases);
+    VIR_FREE(actual);
+    VIR_FREE(cached);
+    return ret;
+}
+
+
+static int
+testLeaseJournal(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virLeaseDBPtr db = NULL;
+    int ret = -1;
+
+    if (virFileRewriteStr(leaseFile, 0644,
+                          "[{\"ip-address\":\"192.168.122.2\","
+                          "\"mac-address\":\"52:54:00:00:00:02\","
+                          "\"expiry-time\":1000}]") < 0 ||
+        !(db = virLeaseDBNew(leaseFile)))
+        goto cleanup;
+
+    virObjectLock(db);
+
+    if (testLeaseAdd("192.168.122.3", "52:54:00:00:00:03") < 0 ||
+        testLeaseCheck(db,
+                       "[{\"ip-address\":\"192.168.122.2\","
+                       "\"mac-address\":\"52:54:00:00:00:02\","
+                       "\"expiry-time\":1000},"
+                       "{\"ip-address\":\"192.168.122.3\","
+                       "\"mac-address\":\"52:54:00:00:00:03\","
+                       "\"expiry-time\":1000}]") < 0)
+        goto cleanup;
+
+    /* Renewing replaces, deleting removes */
+    if (testLeaseAdd("192.168.122.2", "52:54:00:00:00:04") < 0 ||
+        virLeaseJournalDelete(leaseFile, "192.168.122.3") < 0 ||
+        testLeaseCheck(db,
+                       "[{\"ip-address\":\"192.168.122.2\","
+                       "\"mac-address\":\"52:54:00:00:00:04\","
+                       "\"expiry-time\":1000}]") < 0)
+        goto cleanup;
+
+    ret = 0;
+
+ cleanup:
+    if (db)
+        virObjectUnlock(db);
+    virObjectUnref(db);
+    unlink(leaseFile);
+    virLeaseJournalRemove(leaseFile);
+    return ret;
+}
+
+
+static int
+testLeaseJournalTorn(const void *opaque ATTRIBUTE_UNUSED)
+{
+    char *journal = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&journal, "%s.journal", leaseFile) < 0)
+        return -1;
+
+    /* As left behind by a crash in the middle of a write */
+    if (virFileTouch(leaseFile, 0644) < 0 ||
+        virFileWriteStr(journal, "{\"action\":\"del\",\"ip-addr", 0644) < 0)
+        goto cleanup;
+
+    if (testLeaseCheck(NULL, "[]") < 0 ||
+        testLeaseAdd("192.168.122.5", "52:54:00:00:00:05") < 0 ||
+        testLeaseCheck(NULL,
+                       "[{\"ip-address\":\"192.168.122.5\","
+                       "\"mac-address\":\"52:54:00:00:00:05\","
+                       "\"expiry-time\":1000}]") < 0)
+        goto cleanup;
+
+    ret = 0;
+
+ cleanup:
+    unlink(leaseFile);
+    unlink(journal);
+    VIR_FREE(journal);
+    return ret;
+}
+
+
+static int
+testLeaseJournalCompact(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virLeaseDBPtr db = NULL;
+    char *journal = NULL;
+    char ip[32];
+    struct stat sb;
+    size_t i;
+    int ret = -1;
+
+    if (virAsprintf(&journal, "%s.journal", leaseFile) < 0 ||
+        virFileTouch(leaseFile, 0644) < 0 ||
+        !(db = virLeaseDBNew(leaseFile)))
+        goto cleanup;
+
+    virObjectLock(db);
+
+    /* Enough churn for the journal to be folded in several times */
+    for (i = 0; i < 2000; i++) {
+        snprintf(ip, sizeof(ip), "10.0.%zu.%zu", i / 100, i % 100);
+        if (testLeaseAdd(ip, "52:54:00:00:00:06") < 0 ||
+            (i > 0 && virLeaseJournalDelete(leaseFile, ip) < 0) ||
+            virLeaseJournalCompact(leaseFile, NULL) < 0)
+            goto cleanup;
+
+        if (i % 100 == 0 && virLeaseDBRefresh(db) < 0)
+            goto cleanup;
+    }
+
+    if (stat(journal, &sb) == 0 && sb.st_size >= 64 * 1024) {
+        VIR_TEST_DEBUG("Journal was never compacted\n");
+        goto cleanup;
+    }
+
+    if (testLeaseCheck(db,
+                       "[{\"ip-address\":\"10.0.0.0\","
+                       "\"mac-address\":\"52:54:00:00:00:06\","
+                       "\"expiry-time\":1000}]") < 0)
+        goto cleanup;
+
+    ret = 0;
+
+ cleanup:
+    if (db)
+        virObjectUnlock(db);
+    virObjectUnref(db);
+    unlink(leaseFile);
+    unlink(journal);
+    VIR_FREE(journal);
+    return ret;
+}
+
+
+/* The leases helper folds the journal into the leases file, right
+ * after a reader read the journal and right before it reads the
+ * file. Replaying what it read of the journal on the new file would
+ * bring back the lease deleted meanwhile. */
+static int
+testLeaseJournalInterleave(const void *opaque)
+{
+    const bool *useDB = opaque;
+    virLeaseDBPtr db = NULL;
+    virJSONValuePtr leases = NULL;
+    char *journal = NULL;
+    char *actual = NULL;
+    struct stat sb;
+    int ret = -1;
+
+    if (virAsprintf(&journal, "%s.journal", leaseFile) < 0 ||
+        virFileRewriteStr(leaseFile, 0644, "[]") < 0 ||
+        testLeaseAdd("192.168.122.7", "52:54:00:00:00:07") < 0)
+        goto cleanup;
+
+    /* Enough for the journal to be folded in */
+    do {
+        if (testLeaseAdd("192.168.122.8", "52:54:00:00:00:08") < 0 ||
+            virLeaseJournalDelete(leaseFile, "192.168.122.8") < 0 ||
+            stat(journal, &sb) < 0)
+            goto cleanup;
+    } while (sb.st_size < 64 * 1024);
+
+    if (setenv("VIR_LEASE_MOCK_FILE", leaseFile, 1) < 0 ||
+        setenv("VIR_LEASE_MOCK_DELETE", "192.168.122.7", 1) < 0)
+        goto cleanup;
+
+    if (*useDB) {
+        if (!(db = virLeaseDBNew(leaseFile)))
+            goto cleanup;
+
+        virObjectLock(db);
+        if (virLeaseDBRefresh(db) < 0 ||
+            !(actual = virJSONValueToString(virLeaseDBGetLeases(db), false)))
+            goto cleanup;
+    } else {
+        if (!(leases = virJSONValueNewArray()) ||
+            virLeaseReadCustomLeaseFile(leases, leaseFile, NULL, NULL) < 0 ||
+            !(actual = virJSONValueToString(leases, false)))
+            goto cleanup;
+    }
+
+    if (getenv("VIR_LEASE_MOCK_FILE")) {
+        VIR_TEST_DEBUG("Journal was not folded in while reading\n");
+        goto cleanup;
+    }
+
+    if (STRNEQ(actual, "[]")) {
+        virTestDifference(stderr, "[]", actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+ cleanup:
+    unsetenv("VIR_LEASE_MOCK_FILE");
+    unsetenv("VIR_LEASE_MOCK_DELETE");
+    if (db)
+        virObjectUnlock(db);
+    virObjectUnref(db);
+    virJSONValueFree(leases);
+    unlink(leaseFile);
+    unlink(journal);
+    VIR_FREE(actual);
+    VIR_FREE(journal);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    char *dir = NULL;
+    bool useDB = true;
+    bool noDB = false;
+
+    if (VIR_STRDUP(dir, abs_builddir "/virleasetest-XXXXXX") < 0)
+        return EXIT_FAILURE;
+    if (!mkdtemp(dir) ||
+        virAsprintf(&leaseFile, "%s/virbr0.status", dir) < 0) {
+        VIR_FREE(dir);
+        return EXIT_FAILURE;
+    }
+
+    if (virTestRun("journal replay", testLeaseJournal, NULL) < 0)
+        ret = -1;
+    if (virTestRun("torn journal record", testLeaseJournalTorn, NULL) < 0)
+        ret = -1;
+    if (virTestRun("journal compaction", testLeaseJournalCompact, NULL) < 0)
+        ret = -1;
+    if (virTestRun("journal folded in while read", testLeaseJournalInterleave,
+                   &noDB) < 0)
+        ret = -1;
+    if (virTestRun("journal folded in while cached", testLeaseJournalInterleave,
+                   &useDB) < 0)
+        ret = -1;
+
+    virFileDeleteTree(dir);
+    VIR_FREE(leaseFile);
+    VIR_FREE(dir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN_PRELOAD(mymain, abs_builddir "/.libs/virleasemock.so")
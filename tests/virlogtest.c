@@ -21,7 +21,22 @@
 
 #include "testutils.h"
 
+#include "viralloc.h"
+#include "virfile.h"
 #include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+VIR_LOG_INIT("tests.logtest");
+
+#define ASYNC_THREADS 4
+#define ASYNC_MESSAGES 1000
+#define ASYNC_RECORDS 64
+#define SIGNAL_MESSAGES 10
+#define RECORDER_SIZE 4
+#define RECORDER_MESSAGES 10
 
 struct testLogData {
     const char *str;
@@ -107,6 +122,233 @@ testLogParseFilters(const void *opaque)
     return ret;
 }
 
+/* Replace the outputs with a single one calling @func */
+static int
+testLogDefineOutput(virLogOutputFunc func,
+                    void *data,
+                    virLogPriority priority)
+{
+    virLogOutputPtr *outputs = NULL;
+
+    if (VIR_ALLOC_N(outputs, 1) < 0)
+        return -1;
+
+    if (!(outputs[0] = virLogOutputNew(func, NULL, data, priority,
+                                       VIR_LOG_TO_STDERR, NULL)) ||
+        virLogDefineOutputs(outputs, 1) < 0) {
+        virLogOutputListFree(outputs, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+testLogAsyncOutput(virLogSourcePtr source ATTRIBUTE_UNUSED,
+                   virLogPriority priority ATTRIBUTE_UNUSED,
+                   const char *filename ATTRIBUTE_UNUSED,
+                   int linenr ATTRIBUTE_UNUSED,
+                   const char *funcname ATTRIBUTE_UNUSED,
+                   const char *timestamp ATTRIBUTE_UNUSED,
+                   virLogMetadataPtr metadata ATTRIBUTE_UNUSED,
+                   unsigned int flags ATTRIBUTE_UNUSED,
+                   const char *rawstr,
+                   const char *str ATTRIBUTE_UNUSED,
+                   void *data)
+{
+    size_t *count = data;
+
+    if (STRPREFIX(rawstr, "async message"))
+        (*count)++;
+}
+
+static void
+testLogAsyncThread(void *opaque ATTRIBUTE_UNUSED)
+{
+    size_t i;
+
+    for (i = 0; i < ASYNC_MESSAGES; i++)
+        VIR_DEBUG("async message %zu", i);
+}
+
+/* Every message logged from several threads at once is either
+ * written out or accounted for as dropped, as the queue is too
+ * small to hold them all */
+static int
+testLogAsync(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virThread threads[ASYNC_THREADS];
+    size_t count = 0;
+    unsigned int dropped = virLogGetDropped();
+    size_t i;
+    int ret = -1;
+
+    if (testLogDefineOutput(testLogAsyncOutput, &count, VIR_LOG_DEBUG) < 0 ||
+        virLogSetDefaultPriority(VIR_LOG_DEBUG) < 0 ||
+        virLogSetAsync(ASYNC_RECORDS) < 0)
+        goto cleanup;
+
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        if (virThreadCreate(&threads[i], true, testLogAsyncThread, NULL) < 0)
+            break;
+    }
+    while (i-- > 0)
+        virThreadJoin(&threads[i]);
+
+    if (virLogSetAsync(0) < 0)
+        goto cleanup;
+
+    dropped = virLogGetDropped() - dropped;
+    if (count + dropped != ASYNC_THREADS * ASYNC_MESSAGES) {
+        VIR_TEST_DEBUG("Got %zu messages and %u dropped, expected %d\n",
+                       count, dropped, ASYNC_THREADS * ASYNC_MESSAGES);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    virLogReset();
+    return ret;
+}
+
+/* Queued messages are written to file outputs from a signal handler
+ * while the writer thread cannot get to them */
+static int
+testLogFlushFromSignal(const void *opaque ATTRIBUTE_UNUSED)
+{
+    char path[] = abs_builddir "/virlogtestfile-XXXXXX";
+    char *outputs = NULL;
+    char *content = NULL;
+    const char *p;
+    size_t count = 0;
+    size_t i;
+    int fd;
+    int ret = -1;
+
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    VIR_FORCE_CLOSE(fd);
+
+    if (virAsprintf(&outputs, "1:file:%s", path) < 0 ||
+        virLogSetOutputs(outputs) < 0 ||
+        virLogSetDefaultPriority(VIR_LOG_DEBUG) < 0 ||
+        virLogSetAsync(ASYNC_RECORDS) < 0)
+        goto cleanup;
+
+    /* Let the source pick up the new priority, which takes the lock */
+    VIR_DEBUG("first message");
+
+    virLogLock();
+    for (i = 0; i < SIGNAL_MESSAGES; i++)
+        VIR_DEBUG("signal message %zu", i);
+    virLogFlushFromSignal();
+    virLogUnlock();
+
+    if (virFileReadAll(path, 1024 * 1024, &content) < 0)
+        goto cleanup;
+
+    for (p = content; (p = strstr(p, "signal message")); p++)
+        count++;
+
+    if (count != SIGNAL_MESSAGES) {
+        VIR_TEST_DEBUG("Got %zu messages, expected %d\n",
+                       count, SIGNAL_MESSAGES);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    ignore_value(virLogSetAsync(0));
+    virLogReset();
+    unlink(path);
+    VIR_FREE(outputs);
+    VIR_FREE(content);
+    return ret;
+}
+
+static void
+testLogRecorderOutput(virLogSourcePtr source ATTRIBUTE_UNUSED,
+                      virLogPriority priority ATTRIBUTE_UNUSED,
+                      const char *filename ATTRIBUTE_UNUSED,
+                      int linenr ATTRIBUTE_UNUSED,
+                      const char *funcname ATTRIBUTE_UNUSED,
+                      const char *timestamp ATTRIBUTE_UNUSED,
+                      virLogMetadataPtr metadata ATTRIBUTE_UNUSED,
+                      unsigned int flags ATTRIBUTE_UNUSED,
+                      const char *rawstr,
+                      const char *str ATTRIBUTE_UNUSED,
+                      void *data)
+{
+    size_t *count = data;
+
+    if (strstr(rawstr, "recorded message"))
+        (*count)++;
+}
+
+/* Debug messages are kept by the flight recorder although they
+ * are filtered out, but only the latest ones, and are written to
+ * the outputs only once */
+static int
+testLogRecorder(const void *opaque ATTRIBUTE_UNUSED)
+{
+    char *records = NULL;
+    char *expected = NULL;
+    size_t count = 0;
+    size_t i;
+    int nrecords;
+    int ret = -1;
+
+    if (testLogDefineOutput(testLogRecorderOutput, &count, VIR_LOG_WARN) < 0 ||
+        virLogSetDefaultPriority(VIR_LOG_ERROR) < 0 ||
+        virLogSetRecorder("tests.logtest", RECORDER_SIZE) < 0)
+        goto cleanup;
+
+    for (i = 0; i < RECORDER_MESSAGES; i++)
+        VIR_DEBUG("recorded message %zu", i);
+
+    if (count != 0) {
+        VIR_TEST_DEBUG("Debug messages were not filtered out\n");
+        goto cleanup;
+    }
+
+    if ((nrecords = virLogGetRecorded(&records, 4096)) < 0)
+        goto cleanup;
+
+    if (nrecords != RECORDER_SIZE) {
+        VIR_TEST_DEBUG("Got %d records, expected %d\n",
+                       nrecords, RECORDER_SIZE);
+        goto cleanup;
+    }
+
+    if (virAsprintf(&expected, "recorded message %d\n",
+                    RECORDER_MESSAGES - RECORDER_SIZE - 1) < 0)
+        goto cleanup;
+
+    /* The oldest messages are gone */
+    if (!strstr(records, "recorded message 9\n") ||
+        strstr(records, expected)) {
+        VIR_TEST_DEBUG("Unexpected records:\n%s", records);
+        goto cleanup;
+    }
+
+    virLogFlushRecorder("test");
+    virLogFlushRecorder("test");
+
+    if (count != RECORDER_SIZE) {
+        VIR_TEST_DEBUG("%zu records written out, expected %d\n",
+                       count, RECORDER_SIZE);
+        goto cleanup;
+    }
+
+    ret = 0;
+ cleanup:
+    ignore_value(virLogSetRecorder(NULL, 0));
+    virLogReset();
+    VIR_FREE(records);
+    VIR_FREE(expected);
+    return ret;
+}
+
 static int
 mymain(void)
 {
@@ -151,6 +393,14 @@ mymain(void)
     TEST_PARSE_FILTERS_FAIL(":foo", 1);
     TEST_PARSE_FILTERS_FAIL("1:+", 1);
 
+    if (virTestRun("testLogAsync", testLogAsync, NULL) < 0)
+        ret = -1;
+    if (virTestRun("testLogFlushFromSignal", testLogFlushFromSignal,
+                   NULL) < 0)
+        ret = -1;
+    if (virTestRun("testLogRecorder", testLogRecorder, NULL) < 0)
+        ret = -1;
+
     return ret;
 }
 
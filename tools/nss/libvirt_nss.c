@@ -32,6 +32,7 @@
 #include <netinet/in.h>
 #include <resolv.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <arpa/inet.h>
 
@@ -49,6 +50,9 @@
 #include "configmake.h"
 #include "virmacmap.h"
 #include "virobject.h"
+#include "virhash.h"
+#include "virthread.h"
+#include "stat-time.h"
 
 #if 0
 # define ERROR(...)                                             \
@@ -147,9 +151,9 @@ static int
 findLeaseInJSON(leaseAddress **tmpAddress,
                 size_t *ntmpAddress,
                 virJSONValuePtr leases_array,
+                const size_t *leases,
                 size_t nleases,
                 const char *name,
-                const char **macs,
                 int af,
                 bool *found)
 {
@@ -164,32 +168,14 @@ findLeaseInJSON(leaseAddress **tmpAddress,
     }
 
     for (i = 0; i < nleases; i++) {
-        virJSONValuePtr lease = virJSONValueArrayGet(leases_array, i);
+        virJSONValuePtr lease = virJSONValueArrayGet(leases_array, leases[i]);
 
         if (!lease) {
             /* This should never happen (TM) */
-            ERROR("Unable to get element %zu of %zu", i, nleases);
+            ERROR("Unable to get element %zu", leases[i]);
             goto cleanup;
         }
 
-        if (macs) {
-            const char *macAddr;
-
-            macAddr = virJSONValueObjectGetString(lease, "mac-address");
-            if (!macAddr)
-                continue;
-
-            if (!virStringListHasString(macs, macAddr))
-                continue;
-        } else {
-            const char *lease_name;
-
-            lease_name = virJSONValueObjectGetString(lease, "hostname");
-
-            if (STRNEQ_NULLABLE(name, lease_name))
-                continue;
-        }
-
         if (virJSONValueObjectGetNumberLong(lease, "expiry-time", &expirytime) < 0) {
             /* A lease cannot be present without expiry-time */
             ERROR("expiry-time field missing for %s", name);
@@ -215,6 +201,373 @@ findLeaseInJSON(leaseAddress **tmpAddress,
 }
 
 
+/*
+ * Parsing every lease file on each lookup is what makes resolving
+ * slow, so the parsed leases are kept for the lifetime of the process,
+ * indexed by hostname and MAC address. They are only read again once
+ * a file in the lease directory appears, disappears or changes. The
+ * leases helper replaces the leases files rather than writing them in
+ * place, and only ever appends to their journals, so a change shows as
+ * a new inode or size even within the same mtime.
+ */
+typedef struct {
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} leaseFile;
+
+/* Positions of the leases with a given hostname or MAC address,
+ * in the order they appear in the lease files */
+typedef struct {
+    size_t *leases;
+    size_t nleases;
+} leaseIndexEntry;
+
+static struct {
+    virMutex lock;
+
+    leaseFile *files;
+    size_t nfiles;
+
+    virJSONValuePtr leases;
+    virHashTablePtr byName;
+    virHashTablePtr byMac;
+
+    virMacMapPtr *macmaps;
+    size_t nMacmaps;
+} leaseCache;
+
+
+static int
+leaseCacheOnceInit(void)
+{
+    return virMutexInit(&leaseCache.lock);
+}
+
+VIR_ONCE_GLOBAL_INIT(leaseCache)
+
+
+static void
+leaseFilesFree(leaseFile *files,
+               size_t nfiles)
+{
+    while (nfiles)
+        VIR_FREE(files[--nfiles].name);
+    VIR_FREE(files);
+}
+
+
+static void
+leaseIndexEntryFree(void *payload,
+                    const void *name ATTRIBUTE_UNUSED)
+{
+    leaseIndexEntry *entry = payload;
+
+    if (!entry)
+        return;
+
+    VIR_FREE(entry->leases);
+    VIR_FREE(entry);
+}
+
+
+static int
+leaseIndexAdd(virHashTablePtr index,
+              const char *key,
+              size_t lease)
+{
+    leaseIndexEntry *entry;
+
+    if (!(entry = virHashLookup(index, key))) {
+        if (VIR_ALLOC_QUIET(entry) < 0)
+            return -1;
+
+        if (virHashAddEntry(index, key, entry) < 0) {
+            VIR_FREE(entry);
+            return -1;
+        }
+    }
+
+    return VIR_APPEND_ELEMENT_QUIET(entry->leases, entry->nleases, lease);
+}
+
+
+/* Identify the lease and MAC files currently in @leaseDir */
+static int
+leaseFilesList(const char *leaseDir,
+               leaseFile **files,
+               size_t *nfiles)
+{
+    DIR *dir = NULL;
+    struct dirent *entry;
+    leaseFile file;
+    struct stat sb;
+    char *path = NULL;
+    int ret = -1;
+
+    *files = NULL;
+    *nfiles = 0;
+    memset(&file, 0, sizeof(file));
+
+    if (virDirOpenQuiet(&dir, leaseDir) < 0) {
+        ERROR("Failed to open dir '%s'", leaseDir);
+        goto cleanup;
+    }
+
+    while ((ret = virDirRead(dir, &entry, leaseDir)) > 0) {
+        ret = -1;
+
+        if (!virFileHasSuffix(entry->d_name, ".status") &&
+            !virFileHasSuffix(entry->d_name, ".status.journal") &&
+            !virFileHasSuffix(entry->d_name, ".macs"))
+            continue;
+
+        if (!(path = virFileBuildPath(leaseDir, entry->d_name, NULL)))
+            goto cleanup;
+
+        if (stat(path, &sb) < 0) {
+            ERROR("Unable to stat %s", path);
+            goto cleanup;
+        }
+        VIR_FREE(path);
+
+        if (VIR_STRDUP_QUIET(file.name, entry->d_name) < 0)
+            goto cleanup;
+        file.dev = sb.st_dev;
+        file.ino = sb.st_ino;
+        file.size = sb.st_size;
+        file.mtime = get_stat_mtime(&sb);
+
+        if (VIR_APPEND_ELEMENT_QUIET(*files, *nfiles, file) < 0)
+            goto cleanup;
+    }
+
+ cleanup:
+    if (ret < 0) {
+        leaseFilesFree(*files, *nfiles);
+        *files = NULL;
+        *nfiles = 0;
+    }
+    VIR_FREE(file.name);
+    VIR_FREE(path);
+    VIR_DIR_CLOSE(dir);
+    return ret;
+}
+
+
+static bool
+leaseFilesEqual(const leaseFile *a,
+                size_t na,
+                const leaseFile *b,
+                size_t nb)
+{
+    size_t i;
+
+    if (na != nb)
+        return false;
+
+    for (i = 0; i < na; i++) {
+        if (STRNEQ(a[i].name, b[i].name) ||
+            a[i].dev != b[i].dev ||
+            a[i].ino != b[i].ino ||
+            a[i].size != b[i].size ||
+            a[i].mtime.tv_sec != b[i].mtime.tv_sec ||
+            a[i].mtime.tv_nsec != b[i].mtime.tv_nsec)
+            return false;
+    }
+
+    return true;
+}
+
+
+/* Parse @files and replace the contents of the cache with them.
+ * Called with the cache locked. */
+static int
+leaseCacheLoad(const char *leaseDir,
+               leaseFile *files,
+               size_t nfiles)
+{
+    virJSONValuePtr leases = NULL;
+    virHashTablePtr byName = NULL;
+    virHashTablePtr byMac = NULL;
+    virMacMapPtr *macmaps = NULL;
+    size_t nMacmaps = 0;
+    ssize_t nleases;
+    char *path = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (!(leases = virJSONValueNewArray())) {
+        ERROR("Failed to create json array");
+        goto cleanup;
+    }
+
+    if (!(byName = virHashCreate(0, leaseIndexEntryFree)) ||
+        !(byMac = virHashCreate(0, leaseIndexEntryFree)))
+        goto cleanup;
+
+    for (i = 0; i < nfiles; i++) {
+        if (!(path = virFileBuildPath(leaseDir, files[i].name, NULL)))
+            goto cleanup;
+
+        DEBUG("Processing %s", path);
+        if (virFileHasSuffix(files[i].name, ".status")) {
+            /* Along with its journal */
+            if (virLeaseReadCustomLeaseFile(leases, path, NULL, NULL) < 0) {
+                ERROR("Unable to parse %s", path);
+                goto cleanup;
+            }
+        } else if (virFileHasSuffix(files[i].name, ".macs")) {
+            if (VIR_REALLOC_N_QUIET(macmaps, nMacmaps + 1) < 0)
+                goto cleanup;
+
+            if (!(macmaps[nMacmaps] = virMacMapNew(path))) {
+                ERROR("Unable to parse %s", path);
+                goto cleanup;
+            }
+            nMacmaps++;
+        }
+        VIR_FREE(path);
+    }
+
+    if ((nleases = virJSONValueArraySize(leases)) < 0)
+        goto cleanup;
+    DEBUG("Read %zd leases", nleases);
+
+    for (i = 0; i < nleases; i++) {
+        virJSONValuePtr lease = virJSONValueArrayGet(leases, i);
+        const char *key;
+
+        if ((key = virJSONValueObjectGetString(lease, "hostname")) &&
+            leaseIndexAdd(byName, key, i) < 0)
+            goto cleanup;
+
+        if ((key = virJSONValueObjectGetString(lease, "mac-address")) &&
+            leaseIndexAdd(byMac, key, i) < 0)
+            goto cleanup;
+    }
+
+    virJSONValueFree(leaseCache.leases);
+    virHashFree(leaseCache.byName);
+    virHashFree(leaseCache.byMac);
+    while (leaseCache.nMacmaps)
+        virObjectUnref(leaseCache.macmaps[--leaseCache.nMacmaps]);
+    VIR_FREE(leaseCache.macmaps);
+
+    leaseCache.leases = leases;
+    leaseCache.byName = byName;
+    leaseCache.byMac = byMac;
+    leaseCache.macmaps = macmaps;
+    leaseCache.nMacmaps = nMacmaps;
+    leases = NULL;
+    byName = byMac = NULL;
+    macmaps = NULL;
+    nMacmaps = 0;
+    ret = 0;
+
+ cleanup:
+    VIR_FREE(path);
+    virJSONValueFree(leases);
+    virHashFree(byName);
+    virHashFree(byMac);
+    while (nMacmaps)
+        virObjectUnref(macmaps[--nMacmaps]);
+    VIR_FREE(macmaps);
+    return ret;
+}
+
+
+/* Make the cache reflect the current contents of @leaseDir.
+ * Called with the cache locked. */
+static int
+leaseCacheRefresh(const char *leaseDir)
+{
+    leaseFile *files = NULL;
+    size_t nfiles = 0;
+
+    /* Files are identified before being parsed, so if one changes
+     * in between it is just parsed again on the next lookup */
+    if (leaseFilesList(leaseDir, &files, &nfiles) < 0)
+        return -1;
+
+    if (leaseCache.leases &&
+        leaseFilesEqual(leaseCache.files, leaseCache.nfiles, files, nfiles)) {
+        leaseFilesFree(files, nfiles);
+        return 0;
+    }
+
+    /* Don't keep using stale leases if they can't be parsed */
+    leaseFilesFree(leaseCache.files, leaseCache.nfiles);
+    leaseCache.files = NULL;
+    leaseCache.nfiles = 0;
+
+    if (leaseCacheLoad(leaseDir, files, nfiles) < 0) {
+        leaseFilesFree(files, nfiles);
+        return -1;
+    }
+
+    leaseCache.files = files;
+    leaseCache.nfiles = nfiles;
+    return 0;
+}
+
+
+#if defined(LIBVIRT_NSS_GUEST)
+static int
+compareLeaseIndex(const void *a,
+                  const void *b)
+{
+    size_t ia = *(const size_t *) a;
+    size_t ib = *(const size_t *) b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+
+/* Positions of the leases of any of @macs, in the order of the
+ * lease files and without duplicates */
+static int
+findLeasesByMac(const char **macs,
+                size_t **leases,
+                size_t *nleases)
+{
+    size_t i, j;
+
+    *leases = NULL;
+    *nleases = 0;
+
+    for (i = 0; macs[i]; i++) {
+        leaseIndexEntry *entry = virHashLookup(leaseCache.byMac, macs[i]);
+
+        if (!entry)
+            continue;
+
+        if (VIR_REALLOC_N_QUIET(*leases, *nleases + entry->nleases) < 0)
+            return -1;
+
+        memcpy(*leases + *nleases, entry->leases,
+               entry->nleases * sizeof(**leases));
+        *nleases += entry->nleases;
+    }
+
+    if (*nleases == 0)
+        return 0;
+
+    qsort(*leases, *nleases, sizeof(**leases), compareLeaseIndex);
+
+    for (i = 1, j = 1; i < *nleases; i++) {
+        if ((*leases)[i] != (*leases)[j - 1])
+            (*leases)[j++] = (*leases)[i];
+    }
+    *nleases = j;
+
+    return 0;
+}
+#endif /* defined(LIBVIRT_NSS_GUEST) */
+
+
 /**
  * findLease:
  * @name: domain name to lookup
@@ -243,16 +596,11 @@ findLease(const char *name,
           bool *found,
           int *errnop)
 {
-    DIR *dir = NULL;
     int ret = -1;
     const char *leaseDir = LEASEDIR;
-    struct dirent *entry;
-    virJSONValuePtr leases_array = NULL;
-    ssize_t nleases;
     leaseAddress *tmpAddress = NULL;
     size_t ntmpAddress = 0;
-    virMacMapPtr *macmaps = NULL;
-    size_t nMacmaps = 0;
+    bool locked = false;
 
     *address = NULL;
     *naddress = 0;
@@ -263,74 +611,49 @@ findLease(const char *name,
         goto cleanup;
     }
 
-    if (virDirOpenQuiet(&dir, leaseDir) < 0) {
-        ERROR("Failed to open dir '%s'", leaseDir);
+    if (leaseCacheInitialize() < 0)
         goto cleanup;
-    }
 
-    if (!(leases_array = virJSONValueNewArray())) {
-        ERROR("Failed to create json array");
-        goto cleanup;
-    }
+    virMutexLock(&leaseCache.lock);
+    locked = true;
 
     DEBUG("Dir: %s", leaseDir);
-    while ((ret = virDirRead(dir, &entry, leaseDir)) > 0) {
-        char *path;
-
-        if (virFileHasSuffix(entry->d_name, ".status")) {
-            if (!(path = virFileBuildPath(leaseDir, entry->d_name, NULL)))
-                goto cleanup;
-
-            DEBUG("Processing %s", path);
-            if (virLeaseReadCustomLeaseFile(leases_array, path, NULL, NULL) < 0) {
-                ERROR("Unable to parse %s", path);
-                VIR_FREE(path);
-                goto cleanup;
-            }
-            VIR_FREE(path);
-        } else if (virFileHasSuffix(entry->d_name, ".macs")) {
-            if (!(path = virFileBuildPath(leaseDir, entry->d_name, NULL)))
-                goto cleanup;
-
-            if (VIR_REALLOC_N_QUIET(macmaps, nMacmaps + 1) < 0) {
-                VIR_FREE(path);
-                goto cleanup;
-            }
-
-            DEBUG("Processing %s", path);
-            if (!(macmaps[nMacmaps] = virMacMapNew(path))) {
-                ERROR("Unable to parse %s", path);
-                VIR_FREE(path);
-                goto cleanup;
-            }
-            nMacmaps++;
-            VIR_FREE(path);
-        }
-    }
-    VIR_DIR_CLOSE(dir);
-
-    if ((nleases = virJSONValueArraySize(leases_array)) < 0)
+    if (leaseCacheRefresh(leaseDir) < 0)
         goto cleanup;
-    DEBUG("Read %zd leases", nleases);
 
 #if !defined(LIBVIRT_NSS_GUEST)
-    if (findLeaseInJSON(&tmpAddress, &ntmpAddress,
-                        leases_array, nleases,
-                        name, NULL, af, found) < 0)
+    leaseIndexEntry *entry = NULL;
+
+    if (name)
+        entry = virHashLookup(leaseCache.byName, name);
+
+    if (entry &&
+        findLeaseInJSON(&tmpAddress, &ntmpAddress,
+                        leaseCache.leases, entry->leases, entry->nleases,
+                        name, af, found) < 0)
         goto cleanup;
 
 #else /* defined(LIBVIRT_NSS_GUEST) */
 
     size_t i;
-    for (i = 0; i < nMacmaps; i++) {
-        const char **macs = (const char **) virMacMapLookup(macmaps[i], name);
+    for (i = 0; i < leaseCache.nMacmaps; i++) {
+        const char **macs = (const char **) virMacMapLookup(leaseCache.macmaps[i],
+                                                            name);
+        size_t *leases = NULL;
+        size_t nleases = 0;
+        int rc;
 
         if (!macs)
             continue;
 
-        if (findLeaseInJSON(&tmpAddress, &ntmpAddress,
-                            leases_array, nleases,
-                            name, macs, af, found) < 0)
+        if (findLeasesByMac(macs, &leases, &nleases) < 0)
+            goto cleanup;
+
+        rc = findLeaseInJSON(&tmpAddress, &ntmpAddress,
+                             leaseCache.leases, leases, nleases,
+                             name, af, found);
+        VIR_FREE(leases);
+        if (rc < 0)
             goto cleanup;
     }
 
@@ -345,12 +668,9 @@ findLease(const char *name,
 
  cleanup:
     *errnop = errno;
+    if (locked)
+        virMutexUnlock(&leaseCache.lock);
     VIR_FREE(tmpAddress);
-    virJSONValueFree(leases_array);
-    VIR_DIR_CLOSE(dir);
-    while (nMacmaps)
-        virObjectUnref(macmaps[--nMacmaps]);
-    VIR_FREE(macmaps);
     return ret;
 }
 
@@ -265,6 +265,23 @@ int virshStreamSink(virStreamPtr st ATTRIBUTE_UNUSED,
     return safewrite(*fd, bytes, nbytes);
 }
 
+int virshStreamSkip(virStreamPtr st ATTRIBUTE_UNUSED,
+                    long long offset, void *opaque)
+{
+    int *fd = opaque;
+    off_t cur;
+
+    if ((cur = lseek(*fd, offset, SEEK_CUR)) == (off_t) -1)
+        return -1;
+
+    /* The hole may be the last thing in the stream, in which
+     * case nothing is written after it to extend the file */
+    if (ftruncate(*fd, cur) < 0)
+        return -1;
+
+    return 0;
+}
+
 /* ---------------
  * Command Connect
  * ---------------
@@ -1079,6 +1079,77 @@ cmdDaemonLogOutputs(vshControl *ctl, const vshCmd *cmd)
     return true;
 }
 
+/* -------------------------------
+ * Command daemon-event-loop-stats
+ * -------------------------------
+ */
+static const vshCmdInfo info_daemon_event_loop_stats[] = {
+    {.name = "help",
+     .data = N_("get daemon's event loop statistics")
+    },
+    {.name = "desc",
+     .data = N_("Retrieve activity statistics of each event loop run by "
+                "the daemon.")
+    },
+    {.name = NULL}
+};
+
+static bool
+cmdDaemonEventLoopStats(vshControl *ctl, const vshCmd *cmd ATTRIBUTE_UNUSED)
+{
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    size_t i;
+    vshAdmControlPtr priv = ctl->privData;
+
+    if (virAdmConnectGetEventLoopStats(priv->conn, &params, &nparams, 0) < 0) {
+        vshError(ctl, "%s", _("Unable to get daemon event loop statistics"));
+        return false;
+    }
+
+    for (i = 0; i < nparams; i++) {
+        if (params[i].type == VIR_TYPED_PARAM_ULLONG)
+            vshPrint(ctl, "%-20s: %llu\n", params[i].field, params[i].value.ul);
+        else
+            vshPrint(ctl, "%-20s: %u\n", params[i].field, params[i].value.ui);
+    }
+
+    virTypedParamsFree(params, nparams);
+    return true;
+}
+
+/* ---------------------------
+ * Command daemon-log-recorder
+ * ---------------------------
+ */
+static const vshCmdInfo info_daemon_log_recorder[] = {
+    {.name = "help",
+     .data = N_("dump daemon's flight recorder")
+    },
+    {.name = "desc",
+     .data = N_("Print the latest messages kept in memory by the daemon "
+                "for the sources set up by log_recorder_filters.")
+    },
+    {.name = NULL}
+};
+
+static bool
+cmdDaemonLogRecorder(vshControl *ctl, const vshCmd *cmd ATTRIBUTE_UNUSED)
+{
+    char *records = NULL;
+    vshAdmControlPtr priv = ctl->privData;
+
+    if (virAdmConnectGetLoggingRecords(priv->conn, &records, 0) < 0) {
+        vshError(ctl, "%s", _("Unable to get daemon flight recorder"));
+        return false;
+    }
+
+    vshPrint(ctl, "%s", records);
+
+    VIR_FREE(records);
+    return true;
+}
+
 static void *
 vshAdmConnectionHandler(vshControl *ctl)
 {
@@ -1419,6 +1490,18 @@ static const vshCmdDef monitoringCmds[] = {
      .info = info_srv_clients_info,
      .flags = 0
     },
+    {.name = "daemon-event-loop-stats",
+     .handler = cmdDaemonEventLoopStats,
+     .opts = NULL,
+     .info = info_daemon_event_loop_stats,
+     .flags = 0
+    },
+    {.name = "daemon-log-recorder",
+     .handler = cmdDaemonLogRecorder,
+     .opts = NULL,
+     .info = info_daemon_log_recorder,
+     .flags = 0
+    },
     {.name = NULL}
 };
 